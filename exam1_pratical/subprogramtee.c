@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/uio.h>
 #include <unistd.h>
@@ -7,12 +9,29 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 
 /*--------------- 
   Ochoa, Alan
   80639123
 ----------------*/
 
+/*
+  Usage: subprogramtee <file> [-o <file> ...] <command> [<argument> ...]
+
+  The output of the command goes to standard output and to every file.
+  When standard output is a pipe, the output never gets copied to user
+  space: tee() duplicates what the command wrote into standard output
+  and into a second pipe that gets splice()d into each file but the
+  last one, and splice() moves it into the last file. Otherwise, the
+  output gets read into a buffer that starts at BUFFER_MIN bytes and
+  doubles up to BUFFER_MAX as long as the reads fill it.
+*/
+
+#define BUFFER_MIN  ((size_t) 65536)
+#define BUFFER_MAX  ((size_t) (1 << 20))
+#define PIPE_SIZE   (1 << 20)
+
 /*
   Calls write() until all bytes are written or until an error occurs
   Return 0 on SUCCESS
@@ -21,14 +40,14 @@
 int my_write(int fd, const char *buf, size_t bytes) {
   size_t bytes_to_be_written;
   size_t bytes_already_written;
-  size_t bytes_written_this_time;
+  ssize_t bytes_written_this_time;
   
   bytes_to_be_written = bytes;
   bytes_already_written = (size_t) 0;
   
   while (bytes_to_be_written > ((size_t) 0)) {
     bytes_written_this_time = write(fd, &buf[bytes_already_written], bytes_to_be_written);
-    if (bytes_written_this_time < ((size_t)0)) {
+    if (bytes_written_this_time < ((ssize_t) 0)) {
       return -1;
     }
     bytes_to_be_written -= (size_t) bytes_written_this_time;
@@ -60,14 +79,26 @@ int display_error_message(char *str){
   return 0;
 }
 
+/* Closes the files, and reports if that fails */
+int close_files(int *fds, int nfds) {
+  int res = 0;
+
+  for (int i = 0; i < nfds; i++) {
+    if (close(fds[i]) < 0) {
+      fprintf(stderr, "close() did not work: %s\n", strerror(errno));
+      res = 1;
+    }
+  }
+  return res;
+}
+
 /* child process dup2() error checking */
-int child(int ear, int mouth, int fd, char **argument) {
+int child(int ear, int mouth, int *fds, int nfds, char **command) {
   if (close(mouth) < 0) {
     fprintf(stderr,"close() did not work: %s\n", strerror(errno));
     return 2;
   }
-  if (close(fd) < 0) {
-    fprintf(stderr, "close() did not work: %s\n", strerror(errno));
+  if (close_files(fds, nfds) != 0) {
     return 2;
   }
   
@@ -88,9 +119,9 @@ int child(int ear, int mouth, int fd, char **argument) {
   
   /* 
     Child process replaces itself with new executable
-    name given by the 2nd command line argument argv[2].
+    name given by the command line arguments after the files.
   */
-  if (execvp(argument[2], &argument[2]) < 0) {
+  if (execvp(command[0], command) < 0) {
     fprintf(stderr, "execvp() did not work: %s\n", strerror(errno));
     return 1;
   }
@@ -98,15 +129,177 @@ int child(int ear, int mouth, int fd, char **argument) {
 }
 
 
+/* Reads exactly bytes bytes from fd, returns 0 on SUCCESS */
+int read_all(int fd, char *buf, size_t bytes) {
+  ssize_t read_res;
 
-int main(int argc, char **argv) {
+  while (bytes > (size_t) 0) {
+    read_res = read(fd, buf, bytes);
+    if (read_res <= ((ssize_t) 0)) {
+      if (read_res < ((ssize_t) 0) && errno == EINTR) continue;
+      return -1;
+    }
+    buf += read_res;
+    bytes -= (size_t) read_res;
+  }
+  return 0;
+}
+
+/* Moves bytes bytes from the pipe in to out, returns 0 on SUCCESS */
+int splice_all(int in, int out, size_t bytes) {
+  ssize_t res;
+
+  while (bytes > (size_t) 0) {
+    res = splice(in, NULL, out, NULL, bytes, SPLICE_F_MOVE);
+    if (res <= ((ssize_t) 0)) {
+      if (res < ((ssize_t) 0) && errno == EINTR) continue;
+      return -1;
+    }
+    bytes -= (size_t) res;
+  }
+  return 0;
+}
+
+/*
+  Copies the output of the command without going through user space.
+  Returns 0 at end-of-file, -1 on error and 1 if tee() is not
+  supported for these files, in which case what is left in mouth
+  has not been copied anywhere yet.
+*/
+int copy_spliced(int mouth, int *fds, int nfds) {
   char buffer[4096];
-  char *file;
-  int fd;
-  int ear, mouth;
+  int extra[2] = { -1, -1 };
+  ssize_t teed, dup;
+  size_t len, chunk, off, skip, done_bytes;
+  int size, i, res;
+
+  /* A pipe as large as mouth, so that it takes what tee() gives it in one go */
+  size = fcntl(mouth, F_GETPIPE_SZ);
+  if (size <= 0) return 1;
+  if (nfds > 1) {
+    if (pipe(extra) < 0) return 1;
+    if (fcntl(extra[1], F_SETPIPE_SZ, size) < size) {
+      close(extra[0]);
+      close(extra[1]);
+      return 1;
+    }
+  }
+
+  res = 0;
+  while (1) {
+    /* Duplicate what is in mouth into standard output, waiting for it */
+    teed = tee(mouth, 1, (size_t) size, 0);
+    if (teed < ((ssize_t) 0)) {
+      if (errno == EINTR) continue;
+      res = (errno == EINVAL ? 1 : -1);
+      break;
+    }
+    if (teed == ((ssize_t) 0)) break; /* End-of-file/Finished */
+    res = -1;
+    len = (size_t) teed;
+
+    /* Everything was copied once, anything failing now is an error */
+    for (i = 0; i < nfds - 1; i++) {
+      dup = tee(mouth, extra[1], len, 0);
+      if (dup != (ssize_t) len) break;
+      if (splice_all(extra[0], fds[i], len) < 0) goto done;
+    }
+
+    /* Files tee() could not serve get a copy through user space */
+    if (i < nfds - 1) {
+      skip = (size_t) 0;
+      if (dup > ((ssize_t) 0)) {
+        if (splice_all(extra[0], fds[i], (size_t) dup) < 0) goto done;
+        skip = (size_t) dup;
+      }
+      for (off = (size_t) 0; off < len; off += chunk) {
+        chunk = (len - off < sizeof(buffer) ? len - off : sizeof(buffer));
+        if (read_all(mouth, buffer, chunk) < 0) goto done;
+        if (off + chunk > skip) {
+          done_bytes = (skip > off ? skip - off : (size_t) 0);
+          if (my_write(fds[i], &buffer[done_bytes], chunk - done_bytes) < 0) goto done;
+        }
+        for (int j = i + 1; j < nfds; j++) {
+          if (my_write(fds[j], buffer, chunk) < 0) goto done;
+        }
+      }
+    } else if (splice_all(mouth, fds[nfds - 1], len) < 0) {
+      goto done;
+    }
+    res = 0;
+  }
+
+ done:
+  if (nfds > 1) {
+    close(extra[0]);
+    close(extra[1]);
+  }
+  return res;
+}
+
+/* Copies the output of the command through an adaptive buffer */
+int copy_buffered(int mouth, int *fds, int nfds) {
+  char *buffer, *ptr;
+  size_t size;
   ssize_t read_res;
   size_t read_bytes;
+
+  size = BUFFER_MIN;
+  buffer = (char *) malloc(size);
+  if (buffer == NULL) {
+    fprintf(stderr, "malloc() did not work: %s\n", strerror(errno));
+    return -1;
+  }
+
+  while(1) {
+    /* Read from the mouth end of the pipe */
+    read_res = read(mouth, buffer, size);
+    if (read_res < ((ssize_t) 0)) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "read() did not work: %s\n", strerror(errno));
+      free(buffer);
+      return -1;
+    }
+    if(read_res == ((ssize_t) 0)) break; /* End-of-file/Finished */
+    read_bytes = (size_t) read_res;
+    
+    /* Use the files as writable files */
+    for (int i = 0; i < nfds; i++) {
+      if (my_write(fds[i], buffer, read_bytes) < 0) {
+        free(buffer);
+        return -1;
+      }
+    }
+    
+    /* Write to standard output */
+    if (my_write(1, buffer, read_bytes) < 0) {
+      free(buffer);
+      return -1;
+    }
+
+    /* The command writes faster than we read, read more at once */
+    if (read_bytes == size && size < BUFFER_MAX) {
+      ptr = (char *) realloc(buffer, size * ((size_t) 2));
+      if (ptr != NULL) {
+        buffer = ptr;
+        size *= (size_t) 2;
+      }
+    }
+  }
+
+  free(buffer);
+  return 0;
+}
+
+
+int main(int argc, char **argv) {
+  struct stat st;
+  char **command;
+  int *fds;
+  int nfds;
+  int ear, mouth;
   int pipefd[2];
+  int res;
   pid_t pid;
   
   
@@ -116,23 +309,42 @@ int main(int argc, char **argv) {
     //fprintf(stderr,"Not enough command line arguments. %s \n", strerror(errno));
     return 1;
   }
+
+  /* The first file, then every file given with -o */
+  command = &argv[2];
+  while (command[0] != NULL && strcmp(command[0], "-o") == 0 && command[1] != NULL) {
+    command += 2;
+  }
+  if (command[0] == NULL) {
+    display_error_message("Not enough command line arguments.\n");
+    return 1;
+  }
+  nfds = (int) (((command - &argv[2]) / 2) + 1);
   
-  /* Open file to be used for writing */
-  fd = open(argv[1], O_RDWR|O_CREAT , 0644);
-  file = argv[1];
-  if (fd < 0) {
-    //display_error_message("Cannot open file \"%s\" %s: Permission denied\n");
-    fprintf(stderr,"Cannot open file \"%s\": %s\n", file, strerror(errno));
+  /* Open files to be used for writing */
+  fds = (int *) malloc(((size_t) nfds) * sizeof(int));
+  if (fds == NULL) {
+    fprintf(stderr, "malloc() did not work: %s\n", strerror(errno));
     return 1;
   }
+  for (int i = 0; i < nfds; i++) {
+    char *file = (i == 0 ? argv[1] : argv[2 * i + 1]);
+    fds[i] = open(file, O_RDWR|O_CREAT , 0644);
+    if (fds[i] < 0) {
+      //display_error_message("Cannot open file \"%s\" %s: Permission denied\n");
+      fprintf(stderr,"Cannot open file \"%s\": %s\n", file, strerror(errno));
+      close_files(fds, i);
+      free(fds);
+      return 1;
+    }
+  }
   
   /* Un-named pipe process */
   if (pipe(pipefd) < 0) {
-    if (close(fd) < 0) {
-      fprintf(stderr,"close() did not work %s\n", strerror(errno));
-    }
+    close_files(fds, nfds);
     // display_error_message("Error using pipe()");
     fprintf(stderr,"pipe() did not work %s\n", strerror(errno));
+    free(fds);
     return 1;
   }
   
@@ -150,16 +362,15 @@ int main(int argc, char **argv) {
     if (close(ear) < 0) {
       fprintf(stderr, "close() did not work: %s\n", strerror(errno));
     }
-    if (close(fd) < 0) {
-      fprintf(stderr, "close() did not work: %s\n", strerror(errno));
-    }
+    close_files(fds, nfds);
+    free(fds);
     return 1;
   }
   
   
   /* fork() success | returns 0 to the child process */
   if (pid == (0)) {
-    return child(ear, mouth, fd, argv);	
+    return child(ear, mouth, fds, nfds, command);	
   }
   
   
@@ -167,38 +378,28 @@ int main(int argc, char **argv) {
   if (close(ear) < 0) {
     fprintf(stderr, "close() did not work: %s\n", strerror(errno));
   }
-  
-  /* Fill buffer array w/ NULL terminators '\0' */
-  for (int i = 0; i < sizeof(buffer); i++) {
-    buffer[i] = '\0';
-  }
 
-  while(1) {
-		/* Read from the mouth end of the pipe */
-    read_res = read(mouth, buffer, sizeof(buffer)-1); 
-    read_bytes = (size_t) read_res;
-    
-    if(read_res == ((ssize_t) 0)) break; /* End-of-file/Finished */
-    
-    /* Use argv[1] as writable file */
-    if (my_write(fd, buffer, read_bytes) < 0) {
-      return 1;
-    }
-    
-    /* Write to standard output */
-    if (my_write(1, buffer, read_bytes) < 0) {
-      return 1;
-    }
+  /* Bigger pipes mean fewer system calls, it is fine if this fails */
+  fcntl(mouth, F_SETPIPE_SZ, PIPE_SIZE);
+
+  /* tee() only works when standard output is a pipe too */
+  res = 1;
+  if (fstat(1, &st) == 0 && S_ISFIFO(st.st_mode)) {
+    res = copy_spliced(mouth, fds, nfds);
+  }
+  if (res > 0) {
+    res = copy_buffered(mouth, fds, nfds);
   }
   
   /* Wait on child to die */
   wait(NULL);
   
-  /* Close file */
-  if (close(fd) < 0) {
-    fprintf(stderr, "close() did not work: %s\n", strerror(errno));
+  /* Close files */
+  if (close_files(fds, nfds) != 0) {
+    free(fds);
     return 1;
-	}
+  }
+  free(fds);
   
-  return 0; /* SUCCESS */
+  return (res == 0 ? 0 : 1); /* SUCCESS */
 }
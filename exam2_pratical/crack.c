@@ -5,8 +5,13 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <stdlib.h>
+#include <spawn.h>
+#include <time.h>
 
 #define NAIVELOGINEXECUTABLE "naivelogin"
+#define MAX_PASSWORD_LEN (16)
+
+extern char **environ;
 
 // Ochoa Alan
 // 80639123
@@ -237,6 +242,228 @@ static int try_password(size_t *remainder, const char *str) {
 
 
 
+/* A probe of the parallel mode: a naivelogin process reading its
+   candidate from a pipe. The parent keeps both ends of the pipe, so
+   that it can count what the process did not read once it died.
+*/
+typedef struct probe_t {
+  pid_t  pid;        /* 0 if the slot is empty */
+  int    to_child;   /* write end, -1 once the candidate is sent */
+  int    from_pipe;  /* read end */
+  int    position;   /* position the candidate is for, -1 until it is sent */
+  char   candidate;
+} probe_t;
+
+/* Spawns a naivelogin process into the slot with posix_spawn(),
+   which does not copy the parent's memory.
+
+   Returns 0 on success, -1 on failure.
+*/
+static int spawn_probe(probe_t *probe) {
+  posix_spawn_file_actions_t actions;
+  char *args[] = { NAIVELOGINEXECUTABLE, NULL };
+  int pipes[2];
+  int res;
+
+  if (pipe(pipes) < 0) {
+    fprintf(stderr, "Cannot create a pipe: %s\n", strerror(errno));
+    return -1;
+  }
+  if (posix_spawn_file_actions_init(&actions) != 0) {
+    fprintf(stderr, "Cannot prepare a process\n");
+    close(pipes[0]);
+    close(pipes[1]);
+    return -1;
+  }
+  posix_spawn_file_actions_adddup2(&actions, pipes[0], 0);
+  posix_spawn_file_actions_addclose(&actions, pipes[0]);
+  posix_spawn_file_actions_addclose(&actions, pipes[1]);
+  res = posix_spawnp(&probe->pid, NAIVELOGINEXECUTABLE, &actions, NULL, args, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (res != 0) {
+    fprintf(stderr, "Cannot spawn a process: %s\n", strerror(res));
+    close(pipes[0]);
+    close(pipes[1]);
+    probe->pid = (pid_t) 0;
+    return -1;
+  }
+  probe->to_child = pipes[1];
+  probe->from_pipe = pipes[0];
+  probe->position = -1;
+  return 0;
+}
+
+/* Sends the candidate str to the spawned probe.
+
+   Returns 0 on success, -1 on failure.
+*/
+static int start_probe(probe_t *probe, const char *str, int position, char candidate) {
+  if (write_string(probe->to_child, str) < 0) {
+    fprintf(stderr, "Cannot write to pipe: %s\n", strerror(errno));
+    return -1;
+  }
+  if (close(probe->to_child) < 0) {
+    fprintf(stderr, "Cannot close a pipe end: %s\n", strerror(errno));
+    return -1;
+  }
+  probe->to_child = -1;
+  probe->position = position;
+  probe->candidate = candidate;
+  return 0;
+}
+
+/* Collects the probe whose process died with wstatus. Sets remainder
+   to the number of bytes it did not read and empties the slot.
+
+   Returns the exit code of the process, -1 on failure.
+*/
+static int finish_probe(probe_t *probe, int wstatus, size_t *remainder) {
+  char buf[32];
+  ssize_t read_res;
+
+  *remainder = (size_t) 0;
+  if (probe->to_child >= 0) close(probe->to_child);
+  for (;;) {
+    read_res = read(probe->from_pipe, buf, sizeof(buf));
+    if (read_res < ((ssize_t) 0)) {
+      fprintf(stderr, "Cannot read: %s\n", strerror(errno));
+      close(probe->from_pipe);
+      probe->pid = (pid_t) 0;
+      return -1;
+    }
+    if (read_res == ((ssize_t) 0)) break;
+    *remainder += (size_t) read_res;
+  }
+  if (close(probe->from_pipe) < 0) {
+    fprintf(stderr, "Cannot close a pipe end: %s\n", strerror(errno));
+    probe->pid = (pid_t) 0;
+    return -1;
+  }
+  probe->pid = (pid_t) 0;
+  return (int) ((char) WEXITSTATUS(wstatus));
+}
+
+/* Cracks the password with up to k probes at the same time.
+
+   All the candidates for a position get tried at once, k at a time:
+   whenever a probe dies, the next candidate gets a new one. The
+   candidate c is right for the position
+   p if naivelogin accepts the password or reads further than p + 1
+   characters of 
+
+   <prefix found so far> c ....
+
+   Probes still running for a position already decided get ignored.
+   Counts the probes in *probes.
+
+   Returns 0 and fills password if it got cracked, 1 if it could not
+   be cracked and -1 on failure.
+*/
+static int crack_parallel(char *password, const char *character_set, int k, size_t *probes) {
+  char str[MAX_PASSWORD_LEN + 1];
+  probe_t *pool;
+  size_t remainder, n_chars, next;
+  int position, found, done, res, status, running, i, wstatus;
+  pid_t pid;
+
+  pool = (probe_t *) calloc((size_t) k, sizeof(probe_t));
+  if (pool == NULL) {
+    fprintf(stderr, "Cannot allocate memory: %s\n", strerror(errno));
+    return -1;
+  }
+  n_chars = strlen(character_set);
+  memset(str, '.', (size_t) MAX_PASSWORD_LEN);
+  str[MAX_PASSWORD_LEN] = '\0';
+
+  res = 1;
+  done = 0;
+  for (position = 0; (position < MAX_PASSWORD_LEN) && (!done) && (res != -1); position++) {
+    found = 0;
+    next = (size_t) 0;
+    while (!found && (res != -1)) {
+      /* Start a probe for the next candidate in every empty slot */
+      running = 0;
+      for (i = 0; i < k; i++) {
+        if ((pool[i].pid == ((pid_t) 0)) && (next < n_chars)) {
+          str[position] = character_set[next];
+          if ((spawn_probe(&pool[i]) < 0) ||
+              (start_probe(&pool[i], str, position, character_set[next]) < 0)) {
+            res = -1;
+            break;
+          }
+          next++;
+          (*probes)++;
+        }
+        if ((pool[i].pid != ((pid_t) 0)) && (pool[i].position == position)) running++;
+      }
+      if (res == -1) break;
+      if (running == 0) break; /* every candidate failed */
+
+      /* Collect whichever probe dies first */
+      pid = waitpid(-1, &wstatus, 0);
+      if (pid < ((pid_t) 0)) {
+        fprintf(stderr, "Cannot wait: %s\n", strerror(errno));
+        res = -1;
+        break;
+      }
+      for (i = 0; (i < k) && (pool[i].pid != pid); i++);
+      if (i == k) continue;
+      if (pool[i].position != position) {
+        finish_probe(&pool[i], wstatus, &remainder);
+        continue;
+      }
+      status = finish_probe(&pool[i], wstatus, &remainder);
+      if (status < 0) {
+        res = -1;
+        break;
+      }
+      if ((status == 0) ||
+          (remainder < ((size_t) (MAX_PASSWORD_LEN - position - 1)))) {
+        password[position] = pool[i].candidate;
+        str[position] = pool[i].candidate;
+        found = 1;
+        if (status == 0) {
+          password[position + 1] = '\0';
+          done = 1;
+          res = 0;
+        }
+      }
+    }
+    if (!found) break;
+  }
+
+  /* Let the remaining probes go */
+  for (i = 0; i < k; i++) {
+    if (pool[i].pid == ((pid_t) 0)) continue;
+    if (pool[i].to_child >= 0) {
+      close(pool[i].to_child);
+      pool[i].to_child = -1;
+    }
+    if (waitpid(pool[i].pid, &wstatus, 0) < ((pid_t) 0)) {
+      fprintf(stderr, "Cannot wait: %s\n", strerror(errno));
+    }
+    finish_probe(&pool[i], wstatus, &remainder);
+  }
+  free(pool);
+  return res;
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((double) ts.tv_sec) + ((double) ts.tv_nsec) * 1e-9;
+}
+
+/* Prints how many probes were run and how fast, on stderr */
+static void report_probes(size_t probes, double start) {
+  double elapsed;
+
+  elapsed = now_seconds() - start;
+  fprintf(stderr, "%zu probes in %.3f s (%.0f probes/s)\n", probes, elapsed,
+          (elapsed > 0.0 ? ((double) probes) / elapsed : 0.0));
+}
+
 /* Tries to crack the password compiled into 
 
    naivelogin
@@ -278,6 +505,11 @@ static int try_password(size_t *remainder, const char *str) {
 
    and returns 1.
 
+   With the option -j <k>, runs up to k probes at the same time,
+   using crack_parallel(). Without a number, k is 4 times the number
+   of processors. Either way, prints the number of probes per second
+   on stderr.
+
 */
 
 
@@ -285,15 +517,44 @@ static int try_password(size_t *remainder, const char *str) {
 // return 0 - pass return decrypted password
 // return 1 - fail 
 int main(int argc, char **argv) {
-  char character_set[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!@#$*_-+<>/"; // 75 available
+  char character_set[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!@#$%&*_-+<>/"; // 75 available
   char password[] = "................"; // Since '.' not in character set fill as placeholder in 16 possible spots 
   
   size_t crack_cypher_attempt = ((size_t) 15); // remainder 
   size_t previous_attempt = ((size_t) 15);     // previous remainder 
   short  next_cypher_option = 0; // character_set ref 
   int tp_status; // type_password return value
+  size_t probes = (size_t) 0;
+  double start = now_seconds();
+  long k;
+  char *end;
+
+  // parallel mode
+  if ((argc > 1) && (strcmp(argv[1], "-j") == 0)) {
+    k = 4L * sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 2) {
+      k = strtol(argv[2], &end, 10);
+      if ((*end != '\0') || (k < 1L) || (k > 4096L)) {
+        fprintf(stderr, "Cannot use \"%s\" as a number of probes\n", argv[2]);
+        return 1;
+      }
+    }
+    if (k < 1L) k = 1L;
+    tp_status = crack_parallel(password, character_set, (int) k, &probes);
+    report_probes(probes, start);
+    if (tp_status < 0) {
+      fprintf(stderr, "An error occurred. Cannot crack the password.\n");
+      return 1;
+    }
+    if (tp_status > 0) {
+      printf("Could not crack the password.\n");
+      return 1;
+    }
+    printf("Cracked the password.The password is:%s\n", password);
+    return 0;
+  }
 
-  while ((tp_status = try_password(&crack_cypher_attempt, password)) != 0) {
+  while (probes++, (tp_status = try_password(&crack_cypher_attempt, password)) != 0) {
     // Check try_password() return value 
     if (tp_status == -1) {
       fprintf(stderr,"An error occurred.Cannot crack the password.Error: %s \n", strerror(errno));
@@ -304,13 +565,13 @@ int main(int argc, char **argv) {
       previous_attempt = crack_cypher_attempt;
       next_cypher_option = 0; // reset back to 0 index in char_set 
     }
-    // string comparison exploit  
-    password[16-previous_attempt-1] = character_set[next_cypher_option++];
     // traversed through entire cypher options
-    if (next_cypher_option > (strlen(character_set)-1)) {
+    if (next_cypher_option >= strlen(character_set)) {
       printf("Could not crack the password exhausted options\n");
       return 1;
     }
+    // string comparison exploit  
+    password[16-previous_attempt-1] = character_set[next_cypher_option++];
   }
   // remove unused spaces in geenerated password
   for (char *ptr = password; *ptr != '\0'; ptr++) {
@@ -319,6 +580,7 @@ int main(int argc, char **argv) {
     }
   }
   // success 
+  report_probes(probes, start);
   printf("Cracked the password.The password is:%s\n", password);
   return 0;
 }
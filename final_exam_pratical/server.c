@@ -1,14 +1,24 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/wait.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <time.h>
 
-#define PORT ((short int) 9999) 
+#define DEFAULT_BACKLOG (5)
+#define DEFAULT_MAX_CHILDREN (64)
 
 /* Alan Ochoa 
 *  80639123
@@ -93,7 +103,7 @@ int create_new_argv(char ***new_argv, int argc, char **argv) {
   }
 
   /* Set last element of new array to NULL */
-  temp_new_argv[s] = NULL;
+  temp_new_argv[s - ((size_t) 1)] = NULL;
 
   /* "Return" the new array through the pointer */
   *new_argv = temp_new_argv;
@@ -281,6 +291,1117 @@ int try_convert_unsigned_short(unsigned short int *n, const char *str) {
 }
 
 
+/* Tries to convert the string str to a positive int.
+
+   On success, assigns the converted integer to *n and returns zero.
+
+   On failure, does not touch n and returns a negative value.
+
+*/
+int try_convert_positive_int(int *n, const char *str) {
+  char *end;
+  long long int nn;
+
+  if (str == NULL) return -1;
+  if (*str == '\0') return -1;
+  nn = strtoll(str, &end, 0);
+  if (*end != '\0') return -1;
+  if (nn < ((long long int) 1)) return -1;
+  if (nn > ((long long int) 0x7fffffff)) return -1;
+  *n = (int) nn;
+  return 0;
+}
+
+/* State of a long-running server.
+
+   children counts all live children: the handlers executing the
+   executable for a client and, with a pool, the pre-forked workers.
+   For each child, pids and busy tell its process id and whether it got
+   a client already. A worker that accepts a client tells the server
+   by writing its process id into event_pipe, and so does the SIGCHLD
+   handler with the id 0, so that the server only ever has to wait on
+   the pipe and its listening socket.
+
+*/
+typedef struct server_state_t {
+  int   sockfd;
+  int   argc;
+  char  **argv;
+  int   workers;          /* pre-forked workers kept idle, 0 for none */
+  int   max_children;
+  int   children;
+  int   idle;
+  pid_t *pids;
+  char  *busy;
+} server_state_t;
+
+static int event_pipe[2] = { -1, -1 };
+
+/* Wakes up the server when a child terminates */
+static void handle_sigchld(int sig) {
+  int saved_errno = errno;
+  pid_t zero = (pid_t) 0;
+
+  (void) sig;
+  if (write(event_pipe[1], &zero, sizeof(zero)) < 0) {
+    /* The pipe is full, the server wakes up anyway */
+  }
+  errno = saved_errno;
+}
+
+/* Creates event_pipe and installs the SIGCHLD handler. 
+
+   The SIGCHLD handler does not restart system calls, the children
+   must set the default handler again before doing anything else.
+
+   Returns zero on success and a negative value on failure.
+
+*/
+int setup_events(void) {
+  struct sigaction sa;
+
+  if (pipe(event_pipe) < 0) {
+    fprintf(stderr, "Cannot create a pipe: %s\n", strerror(errno));
+    return -1;
+  }
+  if ((fcntl(event_pipe[0], F_SETFL, O_NONBLOCK) < 0) ||
+      (fcntl(event_pipe[1], F_SETFL, O_NONBLOCK) < 0) ||
+      (fcntl(event_pipe[0], F_SETFD, FD_CLOEXEC) < 0) ||
+      (fcntl(event_pipe[1], F_SETFD, FD_CLOEXEC) < 0)) {
+    fprintf(stderr, "Cannot set up a pipe: %s\n", strerror(errno));
+    return -1;
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_sigchld;
+  sa.sa_flags = SA_NOCLDSTOP;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGCHLD, &sa, NULL) < 0) {
+    fprintf(stderr, "Cannot install a signal handler: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/* Puts the process id of a new child into a free slot */
+static void add_child(server_state_t *state, pid_t pid, int busy) {
+  int i;
+
+  for (i=0;i<state->max_children;i++) {
+    if (state->pids[i] == ((pid_t) 0)) {
+      state->pids[i] = pid;
+      state->busy[i] = (char) busy;
+      break;
+    }
+  }
+  state->children++;
+  if (!busy) state->idle++;
+}
+
+/* Returns the slot of the child pid, or -1 if it is not a child. */
+static int find_child(server_state_t *state, pid_t pid) {
+  int i;
+
+  for (i=0;i<state->max_children;i++) {
+    if (state->pids[i] == pid) return i;
+  }
+  return -1;
+}
+
+/* Handles what is in event_pipe and reaps all terminated children,
+   without ever blocking.
+*/
+void handle_events(server_state_t *state) {
+  pid_t pids[64];
+  ssize_t res;
+  size_t k, n;
+  pid_t pid;
+  int i, wstatus;
+
+  /* Workers that got a client */
+  while ((res = read(event_pipe[0], pids, sizeof(pids))) > ((ssize_t) 0)) {
+    n = ((size_t) res) / sizeof(pid_t);
+    for (k=((size_t) 0);k<n;k++) {
+      if (pids[k] == ((pid_t) 0)) continue;
+      i = find_child(state, pids[k]);
+      if ((i >= 0) && (!state->busy[i])) {
+        state->busy[i] = (char) 1;
+        state->idle--;
+      }
+    }
+  }
+
+  /* Terminated children */
+  while ((pid = waitpid(-1, &wstatus, WNOHANG)) > ((pid_t) 0)) {
+    i = find_child(state, pid);
+    if (i >= 0) {
+      if (!state->busy[i]) state->idle--;
+      state->pids[i] = (pid_t) 0;
+    }
+    state->children--;
+  }
+}
+
+/* Prepares a new child: the server's signal handler and pipe are not
+   for it.
+*/
+static void enter_child(void) {
+  signal(SIGCHLD, SIG_DFL);
+  close(event_pipe[0]);
+}
+
+/* Forks off a child that runs the executable for the client on
+   connfd. The server does not close connfd.
+
+   Returns zero on success and a negative value on failure.
+
+*/
+int spawn_handler(server_state_t *state, int connfd) {
+  pid_t kid;
+
+  kid = fork();
+  if (kid < ((pid_t) 0)) {
+    fprintf(stderr, "Cannot fork off a child process: %s\n", strerror(errno));
+    return -1;
+  }
+  if (kid == ((pid_t) 0)) {
+    enter_child();
+    close(event_pipe[1]);
+    close(state->sockfd);
+    run_child(connfd, state->argc, state->argv);
+    if (close(connfd) < 0) {
+      fprintf(stderr, "Cannot close a socket: %s\n", strerror(errno));
+    }
+    exit(1);
+  }
+  add_child(state, kid, 1);
+  return 0;
+}
+
+/* Forks off a pre-forked worker. The worker waits for a client in
+   accept(), tells the server it got one and becomes the executable
+   for that client, so that no fork() happens between the time the
+   client connects and the time the executable starts.
+
+   Returns zero on success and a negative value on failure.
+
+*/
+int spawn_worker(server_state_t *state) {
+  pid_t kid, self;
+  int connfd;
+
+  kid = fork();
+  if (kid < ((pid_t) 0)) {
+    fprintf(stderr, "Cannot fork off a child process: %s\n", strerror(errno));
+    return -1;
+  }
+  if (kid == ((pid_t) 0)) {
+    enter_child();
+
+    /* Idle workers go away with the server, clients are served to the end */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() == ((pid_t) 1)) exit(1);
+    do {
+      connfd = accept(state->sockfd, NULL, NULL);
+    } while ((connfd < 0) && ((errno == EINTR) || (errno == ECONNABORTED)));
+    if (connfd < 0) {
+      fprintf(stderr, "Cannot accept a connection: %s\n", strerror(errno));
+      exit(1);
+    }
+    prctl(PR_SET_PDEATHSIG, 0);
+    self = getpid();
+    if (write(event_pipe[1], &self, sizeof(self)) < 0) {
+      fprintf(stderr, "Cannot notify the server: %s\n", strerror(errno));
+    }
+    close(event_pipe[1]);
+    close(state->sockfd);
+    run_child(connfd, state->argc, state->argv);
+    if (close(connfd) < 0) {
+      fprintf(stderr, "Cannot close a socket: %s\n", strerror(errno));
+    }
+    exit(1);
+  }
+  add_child(state, kid, 0);
+  return 0;
+}
+
+/* Runs the server until an error occurs.
+
+   Without a pool, the server accepts the clients itself, as long as
+   fewer than max_children children are running, and forks off a
+   child for each. With a pool, the server keeps forking off workers
+   until workers of them are idle, within max_children children, and
+   otherwise only waits for them to get clients or to terminate.
+
+   Returns a negative value on failure, never returns otherwise.
+
+*/
+int serve_forever(server_state_t *state) {
+  struct pollfd fds[2];
+  nfds_t nfds;
+  int connfd;
+
+  if (state->workers == 0) {
+    if (fcntl(state->sockfd, F_SETFL, O_NONBLOCK) < 0) {
+      fprintf(stderr, "Cannot set up a socket: %s\n", strerror(errno));
+      return -1;
+    }
+  }
+
+  while (1) {
+    handle_events(state);
+
+    /* Refill the pool */
+    while ((state->idle < state->workers) &&
+           (state->children < state->max_children)) {
+      if (spawn_worker(state) < 0) break;
+    }
+
+    /* Wait for something to happen, the socket only counts if we may
+       take another client
+    */
+    fds[0].fd = event_pipe[0];
+    fds[0].events = POLLIN;
+    nfds = (nfds_t) 1;
+    if ((state->workers == 0) && (state->children < state->max_children)) {
+      fds[1].fd = state->sockfd;
+      fds[1].events = POLLIN;
+      fds[1].revents = 0;
+      nfds++;
+    }
+    if (poll(fds, nfds, -1) < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Cannot poll: %s\n", strerror(errno));
+      return -1;
+    }
+    if ((nfds < ((nfds_t) 2)) || (!(fds[1].revents & POLLIN))) continue;
+
+    /* Take the client */
+    connfd = accept(state->sockfd, NULL, NULL);
+    if (connfd < 0) {
+      if ((errno == EINTR) || (errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+          (errno == ECONNABORTED)) continue;
+      fprintf(stderr, "Cannot accept a connection: %s\n", strerror(errno));
+      if ((errno == EMFILE) || (errno == ENFILE) ||
+          (errno == ENOBUFS) || (errno == ENOMEM)) continue;
+      return -1;
+    }
+    if (fcntl(connfd, F_SETFL, 0) < 0) {
+      fprintf(stderr, "Cannot set up a connection: %s\n", strerror(errno));
+    }
+    spawn_handler(state, connfd);
+    if (close(connfd) < 0) {
+      fprintf(stderr, "Cannot close a connection: %s\n", strerror(errno));
+    }
+  }
+}
+
+
+/* Event-driven mode.
+
+   With -e <n>, the server runs n worker processes. Each one listens
+   on its own socket bound to the port with SO_REUSEPORT, so that the
+   kernel spreads the clients over the workers, and handles all its
+   clients in a single epoll loop.
+
+   Instead of forking and executing the executable for every client,
+   each worker starts it once, as a long-lived helper that is kept
+   running on a pair of pipes. The helper must be a filter answering
+   every line it reads with one line in the same order, e.g. "cat" or
+   "sed -u ...". Each line a client sends is a request: the worker
+   forwards it to its helper and sends the line the helper answers
+   back to that client. If the helper terminates, the clients waiting
+   for an answer get disconnected and a new helper is started. A
+   helper that keeps terminating without answering anything is
+   restarted after a growing delay, and the worker gives up after
+   HELPER_RESTART_MAX attempts in a row, which stops the server.
+
+   Every worker counts its connections, requests and their latency,
+   from the time a request line is complete to the time its answer
+   has been handed to the client's socket, and samples the length of
+   its accept queue. A worker prints its counters to standard error
+   when the server gets SIGUSR1, and when it stops on an error.
+
+*/
+
+#define EPOLL_EVENTS (64)
+#define EPOLL_READ_LEN (65536)
+#define EPOLL_MAX_LINE ((size_t) 65536)
+#define LATENCY_BUCKETS (32)
+#define HELPER_RESTART_MAX (5)
+#define HELPER_BACKOFF_MS (100)
+
+/* A growable buffer of bytes, data[0..len) is in use */
+typedef struct buffer_t {
+  char   *data;
+  size_t len;
+  size_t size;
+} buffer_t;
+
+/* A client connection of a worker, found by its file descriptor */
+typedef struct client_t {
+  int          open;
+  int          eof;          /* the client is done sending */
+  unsigned int generation;   /* tells connections on the same fd apart */
+  size_t       inflight;     /* requests waiting for the helper */
+  buffer_t     in;           /* beginning of an incomplete request */
+  buffer_t     out;          /* answers the socket did not take yet */
+} client_t;
+
+/* A request given to the helper, the answers come in the same order */
+typedef struct request_t {
+  int             fd;
+  unsigned int    generation;
+  struct timespec start;
+} request_t;
+
+typedef struct epoll_stats_t {
+  size_t   connections;
+  size_t   open_connections;
+  size_t   requests;
+  size_t   answers;
+  size_t   dropped;            /* requests whose client went away */
+  size_t   helper_restarts;
+  double   latency_sum;        /* in microseconds */
+  double   latency_max;
+  size_t   latency[LATENCY_BUCKETS]; /* bucket k: less than 2^k us */
+  unsigned int queue_now;      /* connections waiting in the accept queue */
+  unsigned int queue_max;
+  unsigned int queue_limit;
+} epoll_stats_t;
+
+typedef struct epoll_worker_t {
+  int           epfd;
+  int           sockfd;
+  int           argc;
+  char          **argv;
+  pid_t         helper;
+  int           to_helper;      /* -1 while there is no helper */
+  int           from_helper;
+  int           waiting_out;    /* to_helper is watched for EPOLLOUT */
+  int           failed_restarts; /* restarts in a row without an answer */
+  buffer_t      helper_out;     /* requests the helper did not take yet */
+  buffer_t      helper_in;      /* beginning of an incomplete answer */
+  request_t     *requests;      /* ring of requests given to the helper */
+  size_t        requests_head;
+  size_t        requests_len;
+  size_t        requests_size;
+  client_t      *clients;
+  size_t        clients_size;
+  epoll_stats_t stats;
+} epoll_worker_t;
+
+static volatile sig_atomic_t print_stats_requested = 0;
+
+static void handle_sigusr1(int sig) {
+  (void) sig;
+  print_stats_requested = 1;
+}
+
+/* Appends len bytes to the buffer. Returns a negative value if no
+   memory can be allocated.
+*/
+int buffer_append(buffer_t *buf, const char *data, size_t len) {
+  size_t size;
+  char *ptr;
+
+  if (buf->len + len > buf->size) {
+    size = (buf->size == ((size_t) 0) ? ((size_t) 256) : buf->size);
+    while (size < buf->len + len) size *= (size_t) 2;
+    ptr = (char *) realloc(buf->data, size);
+    if (ptr == NULL) return -1;
+    buf->data = ptr;
+    buf->size = size;
+  }
+  memcpy(&buf->data[buf->len], data, len);
+  buf->len += len;
+  return 0;
+}
+
+/* Removes the first len bytes of the buffer */
+void buffer_consume(buffer_t *buf, size_t len) {
+  memmove(buf->data, &buf->data[len], buf->len - len);
+  buf->len -= len;
+}
+
+void buffer_free(buffer_t *buf) {
+  free(buf->data);
+  buf->data = NULL;
+  buf->len = (size_t) 0;
+  buf->size = (size_t) 0;
+}
+
+/* Writes as much of the buffer as fd takes without blocking.
+   Returns a negative value if fd cannot be written to anymore.
+*/
+int buffer_flush(buffer_t *buf, int fd) {
+  ssize_t res;
+  size_t done;
+
+  done = (size_t) 0;
+  while (done < buf->len) {
+    res = write(fd, &buf->data[done], buf->len - done);
+    if (res < ((ssize_t) 0)) {
+      if (errno == EINTR) continue;
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+      return -1;
+    }
+    done += (size_t) res;
+  }
+  buffer_consume(buf, done);
+  return 0;
+}
+
+/* Prints the counters of the worker to standard error */
+void print_epoll_stats(const epoll_stats_t *stats) {
+  size_t k, seen, p50, p99;
+  char line[512];
+  int len;
+
+  /* Upper bounds of the buckets holding the 50th and 99th percentiles */
+  p50 = (size_t) 0;
+  p99 = (size_t) 0;
+  seen = (size_t) 0;
+  for (k=((size_t) 0);k<((size_t) LATENCY_BUCKETS);k++) {
+    seen += stats->latency[k];
+    if ((p50 == ((size_t) 0)) && (seen * ((size_t) 2) >= stats->answers)) p50 = ((size_t) 1) << k;
+    if ((p99 == ((size_t) 0)) && (seen * ((size_t) 100) >= stats->answers * ((size_t) 99))) p99 = ((size_t) 1) << k;
+  }
+  if (stats->answers == ((size_t) 0)) {
+    p50 = (size_t) 0;
+    p99 = (size_t) 0;
+  }
+
+  len = snprintf(line, sizeof(line),
+                 "worker %ld: connections %zu (%zu open), requests %zu, answers %zu, "
+                 "dropped %zu, helper restarts %zu, latency avg %.1fus max %.1fus "
+                 "p50 <%zuus p99 <%zuus, accept queue %u (max %u) of %u\n",
+                 (long) getpid(), stats->connections, stats->open_connections,
+                 stats->requests, stats->answers, stats->dropped, stats->helper_restarts,
+                 (stats->answers > ((size_t) 0) ? stats->latency_sum / ((double) stats->answers) : 0.0),
+                 stats->latency_max, p50, p99,
+                 stats->queue_now, stats->queue_max, stats->queue_limit);
+  if (len > 0) {
+    if (write(2, line, (size_t) len) < 0) {
+      /* Nothing can be done about it */
+    }
+  }
+}
+
+/* Samples the length of the accept queue of the listening socket */
+void sample_accept_queue(epoll_worker_t *w) {
+  struct tcp_info info;
+  socklen_t len;
+
+  len = sizeof(info);
+  memset(&info, 0, sizeof(info));
+  if (getsockopt(w->sockfd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) return;
+
+  /* For a listening socket, these are the queue length and its limit */
+  w->stats.queue_now = info.tcpi_unacked;
+  w->stats.queue_limit = info.tcpi_sacked;
+  if (info.tcpi_unacked > w->stats.queue_max) w->stats.queue_max = info.tcpi_unacked;
+}
+
+/* Starts the helper with the executable on a pair of pipes.
+   Returns a negative value on failure, also when the executable
+   cannot be executed.
+*/
+int start_helper(epoll_worker_t *w) {
+  int in[2], out[2], status[2], err;
+  struct epoll_event ev;
+  char **new_argv;
+  ssize_t res;
+  pid_t kid;
+
+  if (pipe(in) < 0) {
+    fprintf(stderr, "Cannot create a pipe: %s\n", strerror(errno));
+    return -1;
+  }
+  if (pipe(out) < 0) {
+    fprintf(stderr, "Cannot create a pipe: %s\n", strerror(errno));
+    close(in[0]);
+    close(in[1]);
+    return -1;
+  }
+
+  /* The child writes errno to the status pipe if it does not get to
+     execute the executable, exec closes the pipe otherwise */
+  if (pipe2(status, O_CLOEXEC) < 0) {
+    fprintf(stderr, "Cannot create a pipe: %s\n", strerror(errno));
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    return -1;
+  }
+
+  kid = fork();
+  if (kid < ((pid_t) 0)) {
+    fprintf(stderr, "Cannot fork off a child process: %s\n", strerror(errno));
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    close(status[0]);
+    close(status[1]);
+    return -1;
+  }
+  if (kid == ((pid_t) 0)) {
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGUSR1, SIG_DFL);
+    close(status[0]);
+    if ((dup2(in[0], 0) < 0) || (dup2(out[1], 1) < 0)) {
+      fprintf(stderr, "Cannot duplicate a file descriptor: %s\n", strerror(errno));
+    } else {
+      close(in[0]);
+      close(in[1]);
+      close(out[0]);
+      close(out[1]);
+      if (create_new_argv(&new_argv, w->argc, w->argv) >= 0) {
+        execvp(new_argv[0], new_argv);
+        fprintf(stderr, "Cannot replace executable: %s\n", strerror(errno));
+      }
+    }
+    err = errno;
+    while ((write(status[1], &err, sizeof(err)) < ((ssize_t) 0)) && (errno == EINTR));
+    exit(1);
+  }
+
+  close(in[0]);
+  close(out[1]);
+  close(status[1]);
+  do {
+    res = read(status[0], &err, sizeof(err));
+  } while ((res < ((ssize_t) 0)) && (errno == EINTR));
+  close(status[0]);
+  if (res > ((ssize_t) 0)) {
+    close(in[1]);
+    close(out[0]);
+    waitpid(kid, NULL, 0);
+    errno = err;
+    return -1;
+  }
+
+  w->helper = kid;
+  w->to_helper = in[1];
+  w->from_helper = out[0];
+  w->waiting_out = 0;
+  fcntl(w->to_helper, F_SETFL, O_NONBLOCK);
+  fcntl(w->from_helper, F_SETFL, O_NONBLOCK);
+  fcntl(w->to_helper, F_SETFD, FD_CLOEXEC);
+  fcntl(w->from_helper, F_SETFD, FD_CLOEXEC);
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = w->from_helper;
+  if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->from_helper, &ev) < 0) {
+    fprintf(stderr, "Cannot watch a pipe: %s\n", strerror(errno));
+    close(w->to_helper);
+    close(w->from_helper);
+    w->to_helper = -1;
+    w->from_helper = -1;
+    kill(kid, SIGTERM);
+    waitpid(kid, NULL, 0);
+    return -1;
+  }
+  return 0;
+}
+
+/* Closes the connection of a client. Answers still to come for it
+   get dropped.
+*/
+void close_client(epoll_worker_t *w, int fd) {
+  client_t *c = &w->clients[fd];
+
+  if (!c->open) return;
+  epoll_ctl(w->epfd, EPOLL_CTL_DEL, fd, NULL);
+  if (close(fd) < 0) {
+    fprintf(stderr, "Cannot close a connection: %s\n", strerror(errno));
+  }
+  c->open = 0;
+  c->generation++;
+  w->stats.dropped += c->inflight;
+  c->inflight = (size_t) 0;
+  buffer_free(&c->in);
+  buffer_free(&c->out);
+  w->stats.open_connections--;
+}
+
+/* Closes the client once all its answers are out, after it has sent
+   everything
+*/
+void maybe_close_client(epoll_worker_t *w, int fd) {
+  client_t *c = &w->clients[fd];
+
+  if (c->open && c->eof && (c->inflight == ((size_t) 0)) && (c->out.len == ((size_t) 0))) {
+    close_client(w, fd);
+  }
+}
+
+/* Stops the helper, which terminated or cannot take requests anymore,
+   and starts a new one. The clients waiting for it get disconnected.
+   A restart following another one without an answer in between waits
+   HELPER_BACKOFF_MS first, twice as long every time. After
+   HELPER_RESTART_MAX of them, no new helper is started and to_helper
+   stays -1, as it does when the start fails.
+*/
+void restart_helper(epoll_worker_t *w) {
+  struct timespec delay;
+  request_t *r;
+  long ms;
+  int wstatus;
+
+  if (w->to_helper >= 0) {
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, w->from_helper, NULL);
+    if (w->waiting_out) epoll_ctl(w->epfd, EPOLL_CTL_DEL, w->to_helper, NULL);
+    close(w->to_helper);
+    close(w->from_helper);
+    w->to_helper = -1;
+    w->from_helper = -1;
+    kill(w->helper, SIGTERM);
+    waitpid(w->helper, &wstatus, 0);
+  }
+  buffer_consume(&w->helper_out, w->helper_out.len);
+  buffer_consume(&w->helper_in, w->helper_in.len);
+
+  while (w->requests_len > ((size_t) 0)) {
+    r = &w->requests[w->requests_head];
+    w->requests_head = (w->requests_head + ((size_t) 1)) % w->requests_size;
+    w->requests_len--;
+    if (w->clients[r->fd].open && (w->clients[r->fd].generation == r->generation)) {
+      close_client(w, r->fd);
+    }
+  }
+
+  if (w->failed_restarts >= HELPER_RESTART_MAX) {
+    fprintf(stderr, "The helper keeps terminating without answering, giving up.\n");
+    return;
+  }
+  if (w->failed_restarts > 0) {
+    ms = ((long) HELPER_BACKOFF_MS) << (w->failed_restarts - 1);
+    delay.tv_sec = (time_t) (ms / 1000L);
+    delay.tv_nsec = (ms % 1000L) * 1000000L;
+    while ((nanosleep(&delay, &delay) < 0) && (errno == EINTR));
+  }
+  w->failed_restarts++;
+
+  w->stats.helper_restarts++;
+  if (start_helper(w) < 0) {
+    fprintf(stderr, "Cannot restart the helper.\n");
+  }
+}
+
+/* Makes sure to_helper gets watched for EPOLLOUT while requests are
+   waiting to be written to it, and only then
+*/
+void watch_helper_out(epoll_worker_t *w) {
+  struct epoll_event ev;
+  int want;
+
+  if (w->to_helper < 0) return;
+  want = (w->helper_out.len > ((size_t) 0));
+  if (want == w->waiting_out) return;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLOUT;
+  ev.data.fd = w->to_helper;
+  if (epoll_ctl(w->epfd, (want ? EPOLL_CTL_ADD : EPOLL_CTL_DEL), w->to_helper, &ev) == 0) {
+    w->waiting_out = want;
+  }
+}
+
+/* Watches the socket of the client for EPOLLIN until it is done
+   sending and for EPOLLOUT while it has answers waiting
+*/
+void watch_client(epoll_worker_t *w, int fd) {
+  struct epoll_event ev;
+
+  if (!w->clients[fd].open) return;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = (w->clients[fd].eof ? 0 : EPOLLIN) |
+              (w->clients[fd].out.len > ((size_t) 0) ? EPOLLOUT : 0);
+  ev.data.fd = fd;
+  epoll_ctl(w->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/* Queues a request line of the client for the helper.
+   Returns a negative value if no memory can be allocated.
+*/
+int forward_request(epoll_worker_t *w, int fd, const char *line, size_t len) {
+  request_t *ptr;
+  size_t size, k;
+
+  if (w->to_helper < 0) return -1;
+
+  /* Grow the ring, keeping the requests in order */
+  if (w->requests_len == w->requests_size) {
+    size = (w->requests_size == ((size_t) 0) ? ((size_t) 64) : w->requests_size * ((size_t) 2));
+    ptr = (request_t *) calloc(size, sizeof(request_t));
+    if (ptr == NULL) return -1;
+    for (k=((size_t) 0);k<w->requests_len;k++) {
+      ptr[k] = w->requests[(w->requests_head + k) % w->requests_size];
+    }
+    free(w->requests);
+    w->requests = ptr;
+    w->requests_head = (size_t) 0;
+    w->requests_size = size;
+  }
+
+  if (buffer_append(&w->helper_out, line, len) < 0) return -1;
+  ptr = &w->requests[(w->requests_head + w->requests_len) % w->requests_size];
+  ptr->fd = fd;
+  ptr->generation = w->clients[fd].generation;
+  clock_gettime(CLOCK_MONOTONIC, &ptr->start);
+  w->requests_len++;
+  w->clients[fd].inflight++;
+  w->stats.requests++;
+  return 0;
+}
+
+/* Hands the answer line to the client that is first in line */
+void deliver_answer(epoll_worker_t *w, const char *line, size_t len) {
+  struct timespec now;
+  request_t *r;
+  client_t *c;
+  double us;
+  size_t k;
+
+  if (w->requests_len == ((size_t) 0)) return; /* the helper talks on its own */
+  w->failed_restarts = 0;
+  r = &w->requests[w->requests_head];
+  w->requests_head = (w->requests_head + ((size_t) 1)) % w->requests_size;
+  w->requests_len--;
+
+  c = &w->clients[r->fd];
+  if ((!c->open) || (c->generation != r->generation)) return;
+  c->inflight--;
+  if ((buffer_append(&c->out, line, len) < 0) || (buffer_flush(&c->out, r->fd) < 0)) {
+    close_client(w, r->fd);
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  us = ((double) (now.tv_sec - r->start.tv_sec)) * 1e6 +
+       ((double) (now.tv_nsec - r->start.tv_nsec)) / 1e3;
+  w->stats.answers++;
+  w->stats.latency_sum += us;
+  if (us > w->stats.latency_max) w->stats.latency_max = us;
+  for (k=((size_t) 0);(k<((size_t) (LATENCY_BUCKETS - 1))) && (us >= (double) (((size_t) 1) << k));k++);
+  w->stats.latency[k]++;
+
+  watch_client(w, r->fd);
+  maybe_close_client(w, r->fd);
+}
+
+/* Splits the bytes in buf into lines, handing each complete one to
+   handle(), and keeps an incomplete one in buf. Returns a negative
+   value if handle() fails or if a line is too long.
+*/
+int split_lines(buffer_t *buf, epoll_worker_t *w, int fd,
+                int (*handle)(epoll_worker_t *, int, const char *, size_t)) {
+  char *nl;
+  size_t start, len;
+
+  start = (size_t) 0;
+  while ((nl = memchr(&buf->data[start], '\n', buf->len - start)) != NULL) {
+    len = ((size_t) (nl - &buf->data[start])) + ((size_t) 1);
+    if (handle(w, fd, &buf->data[start], len) < 0) return -1;
+    start += len;
+  }
+  buffer_consume(buf, start);
+  if (buf->len > EPOLL_MAX_LINE) return -1;
+  return 0;
+}
+
+static int handle_answer(epoll_worker_t *w, int fd, const char *line, size_t len) {
+  (void) fd;
+  deliver_answer(w, line, len);
+  return 0;
+}
+
+/* Reads everything fd has into buf. Returns 1 at end-of-file, 0 if
+   fd has nothing more for now and a negative value on error.
+*/
+int read_available(int fd, buffer_t *buf) {
+  char chunk[EPOLL_READ_LEN];
+  ssize_t res;
+
+  while (1) {
+    res = read(fd, chunk, sizeof(chunk));
+    if (res < ((ssize_t) 0)) {
+      if (errno == EINTR) continue;
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return 0;
+      return -1;
+    }
+    if (res == ((ssize_t) 0)) return 1;
+    if (buffer_append(buf, chunk, (size_t) res) < 0) return -1;
+  }
+}
+
+/* Accepts all clients waiting in the accept queue */
+void accept_clients(epoll_worker_t *w) {
+  struct epoll_event ev;
+  client_t *ptr;
+  size_t size;
+  int connfd;
+
+  sample_accept_queue(w);
+  while (1) {
+    connfd = accept4(w->sockfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (connfd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        fprintf(stderr, "Cannot accept a connection: %s\n", strerror(errno));
+      }
+      return;
+    }
+
+    /* The table of clients is indexed by file descriptor */
+    if (((size_t) connfd) >= w->clients_size) {
+      size = (w->clients_size == ((size_t) 0) ? ((size_t) 64) : w->clients_size);
+      while (size <= ((size_t) connfd)) size *= (size_t) 2;
+      ptr = (client_t *) realloc(w->clients, size * sizeof(client_t));
+      if (ptr == NULL) {
+        fprintf(stderr, "Cannot allocate memory for a client.\n");
+        close(connfd);
+        continue;
+      }
+      memset(&ptr[w->clients_size], 0, (size - w->clients_size) * sizeof(client_t));
+      w->clients = ptr;
+      w->clients_size = size;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = connfd;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+      fprintf(stderr, "Cannot watch a connection: %s\n", strerror(errno));
+      close(connfd);
+      continue;
+    }
+    w->clients[connfd].open = 1;
+    w->clients[connfd].eof = 0;
+    w->clients[connfd].inflight = (size_t) 0;
+    w->stats.connections++;
+    w->stats.open_connections++;
+  }
+}
+
+/* Handles what happened on the connection of a client */
+void handle_client(epoll_worker_t *w, int fd, unsigned int events) {
+  client_t *c = &w->clients[fd];
+  int res;
+
+  /* The client went away without waiting for its answers */
+  if (c->eof && (events & (EPOLLHUP | EPOLLERR))) {
+    close_client(w, fd);
+    return;
+  }
+
+  if (events & EPOLLOUT) {
+    if (buffer_flush(&c->out, fd) < 0) {
+      close_client(w, fd);
+      return;
+    }
+    watch_client(w, fd);
+  }
+
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+    res = read_available(fd, &c->in);
+    if ((res < 0) || (split_lines(&c->in, w, fd, forward_request) < 0)) {
+      close_client(w, fd);
+      return;
+    }
+    if (res > 0) {
+      /* A last request without newline still gets an answer */
+      if ((c->in.len > ((size_t) 0)) &&
+          ((buffer_append(&c->in, "\n", (size_t) 1) < 0) ||
+           (split_lines(&c->in, w, fd, forward_request) < 0))) {
+        close_client(w, fd);
+        return;
+      }
+      c->eof = 1;
+      watch_client(w, fd);
+      maybe_close_client(w, fd);
+    }
+  }
+}
+
+/* Runs a worker: one listening socket, one helper and an epoll loop
+   over both and the clients. Never returns unless there is an error.
+*/
+int run_epoll_worker(unsigned short int port, int backlog, int argc, char **argv) {
+  struct epoll_event events[EPOLL_EVENTS], ev;
+  struct sockaddr_in serveraddr;
+  struct sigaction sa;
+  epoll_worker_t w;
+  int n, i, fd, one, res;
+
+  memset(&w, 0, sizeof(w));
+  w.argc = argc;
+  w.argv = argv;
+  w.to_helper = -1;
+  w.from_helper = -1;
+
+  signal(SIGPIPE, SIG_IGN);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_sigusr1;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+
+  /* Every worker has its own socket, the kernel spreads the clients */
+  w.sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (w.sockfd < 0) {
+    fprintf(stderr, "Cannot create a socket: %s\n", strerror(errno));
+    return -1;
+  }
+  one = 1;
+  if (setsockopt(w.sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+    fprintf(stderr, "Cannot share the port: %s\n", strerror(errno));
+    close(w.sockfd);
+    return -1;
+  }
+  memset(&serveraddr, 0, sizeof(serveraddr));
+  serveraddr.sin_family = AF_INET;
+  serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+  serveraddr.sin_port = htons(port);
+  if (bind(w.sockfd, (struct sockaddr *) &serveraddr, sizeof(serveraddr)) < 0) {
+    fprintf(stderr, "Cannot bind: %s\n", strerror(errno));
+    close(w.sockfd);
+    return -1;
+  }
+  if (listen(w.sockfd, backlog) < 0) {
+    fprintf(stderr, "Cannot listen: %s\n", strerror(errno));
+    close(w.sockfd);
+    return -1;
+  }
+
+  w.epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (w.epfd < 0) {
+    fprintf(stderr, "Cannot create an epoll instance: %s\n", strerror(errno));
+    close(w.sockfd);
+    return -1;
+  }
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = w.sockfd;
+  if ((epoll_ctl(w.epfd, EPOLL_CTL_ADD, w.sockfd, &ev) < 0) || (start_helper(&w) < 0)) {
+    fprintf(stderr, "Cannot set up the worker.\n");
+    close(w.epfd);
+    close(w.sockfd);
+    return -1;
+  }
+
+  while (1) {
+    if (print_stats_requested) {
+      print_stats_requested = 0;
+      sample_accept_queue(&w);
+      print_epoll_stats(&w.stats);
+    }
+
+    n = epoll_wait(w.epfd, events, EPOLL_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Cannot wait for events: %s\n", strerror(errno));
+      break;
+    }
+
+    for (i=0;i<n;i++) {
+      fd = events[i].data.fd;
+      if (fd == w.sockfd) {
+        accept_clients(&w);
+      } else if (fd == w.from_helper) {
+        /* Deliver what came before end-of-file too */
+        res = read_available(fd, &w.helper_in);
+        if ((res >= 0) && (split_lines(&w.helper_in, &w, fd, handle_answer) < 0)) res = -1;
+        if (res != 0) restart_helper(&w);
+      } else if (fd == w.to_helper) {
+        if (buffer_flush(&w.helper_out, fd) < 0) restart_helper(&w);
+      } else if ((((size_t) fd) < w.clients_size) && w.clients[fd].open) {
+        handle_client(&w, fd, events[i].events);
+      }
+    }
+
+    /* Give the helper what came in */
+    if ((w.to_helper >= 0) && (buffer_flush(&w.helper_out, w.to_helper) < 0)) restart_helper(&w);
+    watch_helper_out(&w);
+
+    /* Without a helper nothing gets answered, let the server know */
+    if (w.to_helper < 0) break;
+  }
+
+  print_epoll_stats(&w.stats);
+  return -1;
+}
+
+/* Runs n epoll workers and starts a new one whenever one terminates.
+   Forwards SIGUSR1 to the workers. Never returns unless there is an
+   error.
+*/
+int run_epoll_server(unsigned short int port, int backlog, int n, int argc, char **argv) {
+  struct sigaction sa;
+  pid_t *pids;
+  pid_t pid, kid;
+  int i, wstatus;
+
+  pids = (pid_t *) calloc((size_t) n, sizeof(pid_t));
+  if (pids == NULL) {
+    fprintf(stderr, "Cannot allocate memory for the workers.\n");
+    return -1;
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_sigusr1;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+
+  while (1) {
+    /* Start the workers missing */
+    for (i=0;i<n;i++) {
+      if (pids[i] != ((pid_t) 0)) continue;
+      kid = fork();
+      if (kid < ((pid_t) 0)) {
+        fprintf(stderr, "Cannot fork off a child process: %s\n", strerror(errno));
+        free(pids);
+        return -1;
+      }
+      if (kid == ((pid_t) 0)) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        exit(run_epoll_worker(port, backlog, argc, argv) < 0 ? 1 : 0);
+      }
+      pids[i] = kid;
+    }
+
+    pid = waitpid(-1, &wstatus, 0);
+    if (pid < ((pid_t) 0)) {
+      if (errno != EINTR) {
+        fprintf(stderr, "Cannot wait: %s\n", strerror(errno));
+        free(pids);
+        return -1;
+      }
+      if (print_stats_requested) {
+        print_stats_requested = 0;
+        for (i=0;i<n;i++) {
+          if (pids[i] != ((pid_t) 0)) kill(pids[i], SIGUSR1);
+        }
+      }
+      continue;
+    }
+    for (i=0;i<n;i++) {
+      if (pids[i] == pid) pids[i] = (pid_t) 0;
+    }
+
+    /* A worker that cannot even start would be restarted forever */
+    if (WIFEXITED(wstatus) && (WEXITSTATUS(wstatus) != 0)) {
+      fprintf(stderr, "A worker failed, stopping.\n");
+      for (i=0;i<n;i++) {
+        if (pids[i] != ((pid_t) 0)) kill(pids[i], SIGTERM);
+      }
+      free(pids);
+      return -1;
+    }
+  }
+}
+
+
 /* Server program: runs a TCP/IP server on a port and waits for a
    client to connect.  When a client connects, executes the executable
    indicated in the second argument of the server program, with the
@@ -288,9 +1409,21 @@ int try_convert_unsigned_short(unsigned short int *n, const char *str) {
 
    Synopsis:
 
-            arg 1  arg 2        arg 3      arg 4
-   ./server <port> <executable> <argument> <argument> ...
+                       arg 1  arg 2        arg 3      arg 4
+   ./server [options] <port> <executable> <argument> <argument> ...
  
+   Options:
+
+   -l        Keep running and serve one client after another, each
+             one with its own child, instead of a single client.
+   -b <n>    Listen backlog, 5 by default.
+   -c <n>    Maximum number of children running at the same time,
+             64 by default. Clients beyond that wait in the backlog.
+   -w <n>    Keep n pre-forked workers waiting for clients, implies -l.
+   -e <n>    Run n event-driven workers sharing the port, each with a
+             long-lived instance of the executable answering the lines
+             the clients send, see run_epoll_worker().
+
    The first argument indicates a TCP/IP port as an integer 1-65535.
    
    The second argument indicates the executable to be run when a client
@@ -304,6 +1437,48 @@ int main(int argc, char **argv) {
   struct sockaddr_in serveraddr, clientaddr;
   socklen_t clientaddrlen;
   unsigned short int port;
+  server_state_t state;
+  int long_running, backlog, workers, max_children, epoll_workers;
+  int *opt;
+
+  /* Parse the options */
+  long_running = 0;
+  backlog = DEFAULT_BACKLOG;
+  workers = 0;
+  max_children = DEFAULT_MAX_CHILDREN;
+  epoll_workers = 0;
+  while ((argc > 1) && (argv[1][0] == '-')) {
+    if (strcmp(argv[1], "-l") == 0) {
+      long_running = 1;
+      argc--;
+      argv++;
+      continue;
+    }
+    opt = NULL;
+    if (strcmp(argv[1], "-b") == 0) opt = &backlog;
+    if (strcmp(argv[1], "-c") == 0) opt = &max_children;
+    if (strcmp(argv[1], "-w") == 0) opt = &workers;
+    if (strcmp(argv[1], "-e") == 0) opt = &epoll_workers;
+    if (opt == NULL) {
+      fprintf(stderr, "Unknown option \"%s\".\n", argv[1]);
+      return 1;
+    }
+    if ((argc < 3) || (try_convert_positive_int(opt, argv[2]) < 0)) {
+      fprintf(stderr, "Option \"%s\" needs a positive number.\n", argv[1]);
+      return 1;
+    }
+    argc -= 2;
+    argv += 2;
+  }
+  if (workers > 0) long_running = 1;
+  if ((epoll_workers > 0) && long_running) {
+    fprintf(stderr, "Option \"-e\" cannot be used with \"-l\" or \"-w\".\n");
+    return 1;
+  }
+  if (workers > max_children) {
+    fprintf(stderr, "Cannot keep %d workers with at most %d children.\n", workers, max_children);
+    return 1;
+  }
 
   /* Check if enough arguments are given */
   if (argc < 3) {
@@ -316,6 +1491,12 @@ int main(int argc, char **argv) {
     fprintf(stderr, "Cannot convert \"%s\" to a port number.\n", argv[1]);
     return -1;
   }
+
+  /* The event-driven workers have their own sockets */
+  if (epoll_workers > 0) {
+    run_epoll_server(port, backlog, epoll_workers, argc-2, &argv[2]);
+    return 1;
+  }
   
   /* Create a socket: IPv4, TCP */
   sockfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -328,7 +1509,7 @@ int main(int argc, char **argv) {
   memset(&serveraddr, 0, sizeof(serveraddr));
   serveraddr.sin_family = AF_INET;
   serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
-  serveraddr.sin_port = htons(PORT); /* 172.20.40.24 */
+  serveraddr.sin_port = htons(port);
   
   if (bind(sockfd, (struct sockaddr *) &serveraddr, sizeof(serveraddr))) {
     fprintf(stderr, "Cannot bind: %s\n", strerror(errno));
@@ -339,7 +1520,7 @@ int main(int argc, char **argv) {
   }
 
   /* Listen */
-  if (listen(sockfd, 5) < 0) {
+  if (listen(sockfd, backlog) < 0) {
     fprintf(stderr, "Cannot listen: %s\n", strerror(errno));
     if (close(sockfd) < 0) {
       fprintf(stderr, "Cannot close a socket: %s\n", strerror(errno));
@@ -347,6 +1528,30 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  /* Serve clients until something goes wrong */
+  if (long_running) {
+    state.sockfd = sockfd;
+    state.argc = argc-2;
+    state.argv = &argv[2];
+    state.workers = workers;
+    state.max_children = max_children;
+    state.children = 0;
+    state.idle = 0;
+    state.pids = (pid_t *) calloc((size_t) max_children, sizeof(pid_t));
+    state.busy = (char *) calloc((size_t) max_children, sizeof(char));
+    if ((state.pids == NULL) || (state.busy == NULL) || (setup_events() < 0)) {
+      fprintf(stderr, "Cannot set up the server.\n");
+    } else {
+      serve_forever(&state);
+    }
+    free(state.pids);
+    free(state.busy);
+    if (close(sockfd) < 0) {
+      fprintf(stderr, "Cannot close a socket: %s\n", strerror(errno));
+    }
+    return 1;
+  }
+
   /* Accept */
   clientaddrlen = sizeof(clientaddr);
   connfd = accept(sockfd, (struct sockaddr *) &clientaddr, &clientaddrlen);
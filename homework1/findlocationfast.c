@@ -7,13 +7,30 @@
 #include <string.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <errno.h>
 #include "user_methods.h"
+#include "record_map.h"
 /* 
    CS4375 OS Fall22 
    Homework 1 Part 4
    Due: 9/28/22 11:59PM 
 
    Sources: linuxhint.com, stackoverflow.com, geeksforgeeks,com 
+
+   Usage: findlocationfast <filename> <prefix>
+          findlocationfast <filename> -b [<queryfile>] [--no-index]
+
+   With -b, the prefixes are read one per line from the query file, or
+   from standard input, and answered against a single mapping of the
+   registry, one line "<prefix> <location>" or "<prefix> not found"
+   each. Unless --no-index is given, a batch first builds a table
+   indexed directly by the 6 digits of the prefix, so each lookup
+   touches one slot of the table and one entry of the registry instead
+   of about 17 entries of the binary search. With --no-index, the
+   prefixes of each buffer read get sorted and looked up together by
+   record_map_find_batch(), so the searches go through the registry
+   in order.
 */
 
 
@@ -25,6 +42,18 @@ typedef struct entry_t {
   /* 6 + 25 + 1 = 32 character per line */
 } entry_t;
 
+/* The registry mapped in memory */
+typedef struct registry_t {
+  record_map_t map;
+  uint32_t *index;         /* entry + 1 for every 6 digit prefix, or NULL */
+} registry_t;
+
+#define INDEX_SIZE ((size_t) 1000000)
+#define QUERY_BUFFER_LEN (65536)
+#define OUTPUT_BUFFER_LEN (65536)
+#define QUERY_MAX_LEN (64)
+#define QUERY_BATCH (4096)
+
 
 /* Method to close file */
 int closeFile(int fd){
@@ -35,83 +64,250 @@ int closeFile(int fd){
   return 0;
 }
 
-/* Do the actual comparison between given prefix and registry*/
-int compare(const char *prefix_registry, const char *prefix_given){
-  const char *reg;
-  const char *giv;
-  int i;
+/* Open the file and map the entries */
+int openRegistry(const char *fileName, registry_t *reg, int preload){
+  reg->index = NULL;
+  if (record_map_open(&reg->map, fileName, sizeof(entry_t), offsetof(entry_t, prefix),
+                      sizeof(((entry_t *) NULL)->prefix), preload) < 0){
+    if (errno == EINVAL){
+      display_error_message("Error, file is not properly formatted\n");
+    } else {
+      display_error_message("Error opening file\n");
+    }
+    return 1;
+  }
+  return 0;
+}
 
-  for (reg = prefix_registry, giv = prefix_given, i = 0; i <= 5; i++, reg++, giv++){
-    if (*reg < *giv) return -1;
-    if (*reg > *giv) return 1;
+/* Unmap and close the registry */
+int closeRegistry(registry_t *reg){
+  free(reg->index);
+  if (record_map_close(&reg->map) != 0){
+    display_error_message("Error unmapping file.\n");
+    return 1;
   }
-  
   return 0;
 }
 
-/* Lookup search the map for the given prefix */
-char *lookup(entry_t registry[], ssize_t num_entries, const char *prefix){
-  ssize_t l, r, m;
-  int cmp;
-
-  l = (ssize_t) 0;
-  r = num_entries - ((ssize_t) 1);
-
-  /* loop through registry to compare */
-  while (l <= r) {
-    m = ((l+r) / ((ssize_t) 2));
-    cmp = compare(registry[m].prefix, prefix);
-    if (cmp == 0) {
-      return registry[m].location;
-    } else if (cmp < 0) {
-      l = m + ((ssize_t) 1);
-    } else {
-      r = m - ((ssize_t) 1);
+/* Returns the entry i of the registry */
+const entry_t *get_entry(registry_t *reg, size_t i){
+  return (const entry_t *) record_map_record(&reg->map, i);
+}
+
+/* Convert 6 digits to their value, -1 if there is anything else */
+ssize_t prefix_to_key(const char *prefix){
+  ssize_t key;
+  int i;
+
+  key = (ssize_t) 0;
+  for (i = 0; i < 6; i++){
+    if (prefix[i] < '0' || prefix[i] > '9') return (ssize_t) -1;
+    key = key * ((ssize_t) 10) + ((ssize_t) (prefix[i] - '0'));
+  }
+  return key;
+}
+
+/* 
+   Build the direct index of the registry. The registry is kept
+   without index if a prefix is not made of 6 digits. The table is
+   4MB but only the pages of the prefixes in use ever get touched.
+*/
+void build_index(registry_t *reg){
+  uint32_t *index;
+  ssize_t key;
+  size_t i;
+
+  if (reg->map.num_records >= (size_t) UINT32_MAX) return;
+  index = (uint32_t *) calloc(INDEX_SIZE, sizeof(uint32_t));
+  if (index == NULL) return;
+
+  for (i = (size_t) 0; i < reg->map.num_records; i++){
+    key = prefix_to_key(get_entry(reg, i)->prefix);
+    if (key < (ssize_t) 0){
+      free(index);
+      return;
     }
+    if (index[key] == (uint32_t) 0) index[key] = (uint32_t) (i + ((size_t) 1));
   }
-  return NULL;
+  reg->index = index;
 }
 
+/* Look up a prefix of len characters in the registry */
+const char *find_prefix(registry_t *reg, const char *prefix, size_t len){
+  const entry_t *entry;
+  ssize_t key;
+  uint32_t slot;
 
+  if (len != (size_t) 6) return NULL;
+  if (reg->index == NULL){
+    entry = (const entry_t *) record_map_find(&reg->map, prefix);
+    return (entry == NULL ? NULL : entry->location);
+  }
+  key = prefix_to_key(prefix);
+  if (key < (ssize_t) 0) return NULL;
+  slot = reg->index[key];
+  if (slot == (uint32_t) 0) return NULL;
+  return get_entry(reg, (size_t) (slot - ((uint32_t) 1)))->location;
+}
 
-/* open the file and map the entries*/ 
-int mapFile(const char *fileName, const char *prefix){
-  /* Open file */
-  int fd = open(fileName, O_RDONLY);
-  if (fd < 0){
-    display_error_message("Error opening file\n");
-    return 1;
+/* Answer one query with its location into the output buffer, flushing it when full */
+int answer_query(const char *query, size_t len, const char *location,
+                 char *out, size_t *out_len){
+  size_t need;
+
+  /* Echo no more of the query than fits in an empty buffer */
+  need = ((size_t) 1) + ((size_t) 25) + ((size_t) 1);
+  if (len > (size_t) OUTPUT_BUFFER_LEN - need) len = (size_t) OUTPUT_BUFFER_LEN - need;
+  need += len;
+  if (*out_len + need > (size_t) OUTPUT_BUFFER_LEN){
+    if (my_write(1, out, *out_len) < 0) return -1;
+    *out_len = (size_t) 0;
   }
 
-  /* Find the end of the file in bytes */
-  off_t lseek_res = lseek(fd, (off_t) 0, SEEK_END);
-  if (lseek_res == (off_t) -1){
-    display_error_message("Error seeking in file\n");
-    closeFile(fd);
-    return 1;
+  memcpy(&out[*out_len], query, len);
+  *out_len += len;
+  out[(*out_len)++] = ' ';
+  if (location == NULL){
+    memcpy(&out[*out_len], "not found", (size_t) 9);
+    *out_len += (size_t) 9;
+  } else {
+    memcpy(&out[*out_len], location, (size_t) 25);
+    *out_len += (size_t) 25;
   }
+  out[(*out_len)++] = '\n';
+  return 0;
+}
 
-  size_t fileSize = (size_t)lseek_res;
-  if ((fileSize % sizeof(entry_t)) != (size_t) 0){
-    display_error_message("Error, file is not properly formatted\n");
-    closeFile(fd);
-    return 1;
+/* The queries of a buffer, answered together */
+typedef struct query_batch_t {
+  const char *queries[QUERY_BATCH];
+  size_t lengths[QUERY_BATCH];
+  const char *keys[QUERY_BATCH];
+  const char *entries[QUERY_BATCH];
+  size_t num_queries;
+} query_batch_t;
+
+/* Look up all queries of the batch and answer them in their order */
+int answer_batch(registry_t *reg, query_batch_t *batch, char *out, size_t *out_len){
+  const char *location;
+  size_t i, num_keys;
+
+  /* Without index, the 6 character queries get looked up sorted */
+  num_keys = (size_t) 0;
+  if (reg->index == NULL){
+    for (i = (size_t) 0; i < batch->num_queries; i++){
+      if (batch->lengths[i] == (size_t) 6) batch->keys[num_keys++] = batch->queries[i];
+    }
+    if (record_map_find_batch(&reg->map, batch->keys, num_keys, batch->entries) < 0) return -1;
   }
 
-  /* Map the file */
-  char *ptr = NULL;
-  ptr = mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fd, (off_t) 0);
-  
-  
-  if (ptr == MAP_FAILED){
-    display_error_message("Error mapping file\n");
-    closeFile(fd);
+  num_keys = (size_t) 0;
+  for (i = (size_t) 0; i < batch->num_queries; i++){
+    if (reg->index != NULL){
+      location = find_prefix(reg, batch->queries[i], batch->lengths[i]);
+    } else if (batch->lengths[i] == (size_t) 6){
+      location = batch->entries[num_keys++];
+      if (location != NULL) location = ((const entry_t *) location)->location;
+    } else {
+      location = NULL;
+    }
+    if (answer_query(batch->queries[i], batch->lengths[i], location, out, out_len) < 0) return -1;
+  }
+  batch->num_queries = (size_t) 0;
+  return 0;
+}
+
+/* Add a query to the batch, answering the batch when it is full */
+int add_query(registry_t *reg, query_batch_t *batch, const char *query, size_t len,
+              char *out, size_t *out_len){
+  /* Ignore carriage returns and empty lines, cut lines too long to be a prefix */
+  if (len > (size_t) 0 && query[len - ((size_t) 1)] == '\r') len--;
+  if (len == (size_t) 0) return 0;
+  if (len > (size_t) QUERY_MAX_LEN) len = (size_t) QUERY_MAX_LEN;
+
+  batch->queries[batch->num_queries] = query;
+  batch->lengths[batch->num_queries] = len;
+  batch->num_queries++;
+  if (batch->num_queries == (size_t) QUERY_BATCH) return answer_batch(reg, batch, out, out_len);
+  return 0;
+}
+
+/* Read prefixes from fd, one per line, and answer all of them */
+int batchLookup(registry_t *reg, int fd){
+  static query_batch_t batch;
+  char buffer[QUERY_BUFFER_LEN];
+  char out[OUTPUT_BUFFER_LEN];
+  size_t out_len, start, filled, i;
+  ssize_t read_res;
+  int discard;
+
+  out_len = (size_t) 0;
+  filled = (size_t) 0;
+  discard = 0;
+  batch.num_queries = (size_t) 0;
+  while (1){
+    read_res = read(fd, &buffer[filled], sizeof(buffer) - filled);
+    if (read_res < ((ssize_t) 0)){
+      display_error_message("Error reading queries\n");
+      return 1;
+    }
+    if (read_res == ((ssize_t) 0)) break;
+
+    /* Drop what is left of a line that got cut, up to its newline */
+    if (discard){
+      for (i = filled; i < filled + (size_t) read_res && buffer[i] != '\n'; i++);
+      if (i == filled + (size_t) read_res) continue;
+      memmove(&buffer[filled], &buffer[i], filled + (size_t) read_res - i);
+      read_res = (ssize_t) (filled + (size_t) read_res - i);
+      discard = 0;
+    }
+    filled += (size_t) read_res;
+
+    /* Answer every complete line in the buffer */
+    start = (size_t) 0;
+    for (i = (size_t) 0; i < filled; i++){
+      if (buffer[i] != '\n') continue;
+      if (add_query(reg, &batch, &buffer[start], i - start, out, &out_len) < 0){
+        display_error_message("Error writing answers\n");
+        return 1;
+      }
+      start = i + ((size_t) 1);
+    }
+    if (answer_batch(reg, &batch, out, &out_len) < 0){
+      display_error_message("Error writing answers\n");
+      return 1;
+    }
+
+    /* Keep the beginning of the last line, cut lines too long to be a prefix */
+    if (filled - start > (size_t) QUERY_MAX_LEN){
+      memmove(buffer, &buffer[start], (size_t) QUERY_MAX_LEN);
+      filled = (size_t) QUERY_MAX_LEN;
+      discard = 1;
+    } else {
+      memmove(buffer, &buffer[start], filled - start);
+      filled -= start;
+    }
+  }
+
+  /* The last line may have no newline */
+  if (add_query(reg, &batch, buffer, filled, out, &out_len) < 0 ||
+      answer_batch(reg, &batch, out, &out_len) < 0 ||
+      my_write(1, out, out_len) < 0){
+    display_error_message("Error writing answers\n");
     return 1;
   }
+  return 0;
+}
 
-  /* use the pointer to read the file */
-  char *location; 
-  location = lookup((entry_t*) ptr, ((ssize_t)(fileSize / sizeof(entry_t))), prefix);
+/* open the file and map the entries*/ 
+int mapFile(const char *fileName, const char *prefix){
+  registry_t reg;
+
+  if (openRegistry(fileName, &reg, 0) != 0) return 1;
+
+  /* use the pointer to read the file, only the first 6 characters count */
+  const char *location = NULL;
+  if (strlen(prefix) >= (size_t) 6) location = find_prefix(&reg, prefix, (size_t) 6);
   if (location == NULL) {
     display_error_message("That Prefix is not in the Registry\n");
   } else {
@@ -120,16 +316,32 @@ int mapFile(const char *fileName, const char *prefix){
     display_error_message("\nThank you for using the Registry!\n\n");
   }
 
-  /* unmapp */
-  if (munmap(ptr, fileSize) != 0){
-    display_error_message("Error unmapping file\n");
-    closeFile(fd);
-    return 1;
+  return closeRegistry(&reg);
+}
+
+/* open the file, map the entries and answer the queries in queryFile */
+int mapFileBatch(const char *fileName, const char *queryFile, int useIndex){
+  registry_t reg;
+  int fd, res;
+
+  if (openRegistry(fileName, &reg, 1) != 0) return 1;
+
+  fd = 0;
+  if (queryFile != NULL){
+    fd = open(queryFile, O_RDONLY);
+    if (fd < 0){
+      display_error_message("Error opening query file\n");
+      closeRegistry(&reg);
+      return 1;
+    }
   }
 
-  /* close file if everything works */
-  closeFile(fd);
-  return 0; 
+  if (useIndex) build_index(&reg);
+  res = batchLookup(&reg, fd);
+
+  if (queryFile != NULL) closeFile(fd);
+  if (closeRegistry(&reg) != 0) return 1;
+  return res;
 }
 
 
@@ -137,12 +349,30 @@ int main(int argc, char **argv){
   /* check for valid inputs */
   if (argc < 3){
     display_error_message("Error: Lookup <filename> <prefix>\n");
+    display_error_message("       Lookup <filename> -b [<queryfile>] [--no-index]\n");
     return 1;
   }
   
   /* assign the inputs to variables */
   char *fileName = argv[1];
   char *prefix = argv[2];
+
+  /* batch mode answers many prefixes with a single mapping */
+  if (str_comp(prefix, "-b") == 0){
+    char *queryFile = NULL;
+    int useIndex = 1;
+    for (int i = 3; i < argc; i++){
+      if (str_comp(argv[i], "--no-index") == 0){
+        useIndex = 0;
+      } else if (queryFile == NULL){
+        queryFile = argv[i];
+      } else {
+        display_error_message("Error: Lookup <filename> -b [<queryfile>] [--no-index]\n");
+        return 1;
+      }
+    }
+    return mapFileBatch(fileName, queryFile, useIndex);
+  }
   
   /* display_error_message for the user */
   display_error_message("\nWelcome to the North American Prefix Registry\n");
@@ -3,9 +3,13 @@
 #include <fcntl.h>
 #include <stdio.h>  
 #include <errno.h>  
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include "user_methods.h"
 
-#define BUFFER_LEN (4096)
+#define BUFFER_LEN (65536)
 
 /* 
    Allowed systems calls:
@@ -21,21 +25,58 @@
    mem_set()
    mem_cpy()
    mem_move()  
+
+   Each buffer read gets written up to the num-th newline with a
+   single write, find_line_end does the counting. A regular file gets
+   mapped instead of read, and its first num lines are sent with
+   sendfile, so they never get copied through user space.
 */
 
 
+/* Prints the first num lines of a regular file of size bytes */
+int head_mapped(int fd, size_t size, int num) {
+  char *ptr;
+  size_t end, found;
+  off_t offset;
+  ssize_t sent;
+
+  if (size == (size_t) 0) return 0;
+  ptr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, (off_t) 0);
+  if (ptr == MAP_FAILED) return -1;
+  end = find_line_end(ptr, size, (size_t) num, &found);
+
+  offset = (off_t) 0;
+  while ((size_t) offset < end) {
+    sent = sendfile(1, fd, &offset, end - ((size_t) offset));
+    if (sent <= ((ssize_t) 0)) break;
+  }
+
+  /* Not every output can be sent to, write the rest from the mapping */
+  if ((size_t) offset < end) {
+    if (my_write(1, &ptr[offset], end - ((size_t) offset)) < 0) {
+      display_error_message("Error writing! \n");
+      munmap(ptr, size);
+      return 1;
+    }
+  }
+  munmap(ptr, size);
+  return 0;
+}
+
+
 int main(int argc, char **argv) {
   
   char buffer[BUFFER_LEN];
   char *file = NULL;
   int fd;
   int num;
-  int n_lines_printed;
+  int res;
+  struct stat st;
+  size_t n_lines_printed;
 
   ssize_t read_res; /* SIGNED SIZE */
-  size_t remaining_bytes; 
-  size_t bytes_written;
   size_t line_bytes;
+  size_t found;
 
   /* 
     10 Default number of lines read 
@@ -62,10 +103,25 @@ int main(int argc, char **argv) {
 
   fd = (file != NULL ? open(file, O_RDONLY) : 0); /* [statement] ? true : false  */
 
+  if (fd < 0) {
+    display_error_message("head: cannot open file\n");
+    return 1;
+  }
+
+  /* Regular files can be mapped, fall back to reading if that fails */
+  if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) &&
+      (lseek(fd, (off_t) 0, SEEK_CUR) == (off_t) 0)) {
+    res = head_mapped(fd, (size_t) st.st_size, num);
+    if (res >= 0) {
+      if (fd != 0) close(fd);
+      return res;
+    }
+  }
+
   /* Reading until file hits the end-of-file (EOF) condition */
-  n_lines_printed = 0;
+  n_lines_printed = (size_t) 0;
 
-  while (n_lines_printed < num) {
+  while (n_lines_printed < (size_t) num) {
     read_res = read(fd, buffer, sizeof(buffer)); /* Try to read into buffer  */
 
     /* Handle the return values of the read system call */
@@ -79,28 +135,14 @@ int main(int argc, char **argv) {
       return 1;
     }
 
-    /* read_res assummed positive. */
-    remaining_bytes = (size_t) read_res;
-
-    /* If buffer filled but didn't reach end of the line */
-    if ((remaining_bytes == sizeof(buffer)) && (buffer[remaining_bytes-1] != '\n')) {
-      n_lines_printed--;
-    }
-
-    bytes_written = (size_t) 0;
-    while ((remaining_bytes > (size_t) 0) && (n_lines_printed < num)) {
-      line_bytes = get_line_bytes(&buffer[bytes_written], remaining_bytes);
-      
-      /* Need to write the remaining_bytes bytes from buffer to stdout */
-      if (my_write(1, &buffer[bytes_written], line_bytes) < 0) {
-        /* Display the appropriate error message and die */
-        display_error_message("Error writing! \n");
-        return 1;
-      }
-      remaining_bytes -= line_bytes;
-      bytes_written += line_bytes;
-      n_lines_printed++;
+    /* Write everything up to the last line needed at once */
+    line_bytes = find_line_end(buffer, (size_t) read_res, ((size_t) num) - n_lines_printed, &found);
+    if (my_write(1, buffer, line_bytes) < 0) {
+      /* Display the appropriate error message and die */
+      display_error_message("Error writing! \n");
+      return 1;
     }
+    n_lines_printed += found;
   }
   
   if (fd != 0) {
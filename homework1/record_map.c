@@ -0,0 +1,205 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "record_map.h"
+
+
+/* A key of a batch, its place in the batch and the map it is looked
+   up in, as qsort() gives the comparison no other context */
+typedef struct batch_key_t {
+  const char *key;
+  size_t idx;
+  const record_map_t *map;
+} batch_key_t;
+
+
+/* Compares the key of record i with the first len bytes of key */
+static int compare_record(const record_map_t *map, size_t i, const char *key, size_t len) {
+  const char *record_key = map->base + i * map->record_size + map->key_offset;
+
+  if (map->compare != NULL) return map->compare(record_key, key, len);
+  return memcmp(record_key, key, len);
+}
+
+
+/* Returns the first record in [l, r) whose key is not below key */
+static size_t lower_bound(const record_map_t *map, size_t l, size_t r, const char *key, size_t len) {
+  size_t m;
+
+  while (l < r) {
+    m = l + (r - l) / ((size_t) 2);
+    if (compare_record(map, m, key, len) < 0) {
+      l = m + ((size_t) 1);
+    } else {
+      r = m;
+    }
+  }
+  return l;
+}
+
+
+/* Returns the first record in [l, r) whose key is above key */
+static size_t upper_bound(const record_map_t *map, size_t l, size_t r, const char *key, size_t len) {
+  size_t m;
+
+  while (l < r) {
+    m = l + (r - l) / ((size_t) 2);
+    if (compare_record(map, m, key, len) <= 0) {
+      l = m + ((size_t) 1);
+    } else {
+      r = m;
+    }
+  }
+  return l;
+}
+
+
+int record_map_open(record_map_t *map, const char *filename, size_t record_size,
+                    size_t key_offset, size_t key_width, int preload) {
+  struct stat st;
+  void *ptr;
+  int fd;
+
+  if ((record_size == (size_t) 0) || (key_offset + key_width > record_size)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) return -1;
+
+  /* One fstat gives both the type and the size of the file */
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+  if ((!S_ISREG(st.st_mode)) || ((((size_t) st.st_size) % record_size) != (size_t) 0)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  map->fd = fd;
+  map->base = NULL;
+  map->size = (size_t) st.st_size;
+  map->record_size = record_size;
+  map->num_records = map->size / record_size;
+  map->key_offset = key_offset;
+  map->key_width = key_width;
+  map->compare = NULL;
+  if (map->size == (size_t) 0) return 0;
+
+  ptr = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, (off_t) 0);
+  if (ptr == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  map->base = (const char *) ptr;
+
+  /* Binary searches jump around, read-ahead would only waste memory */
+  madvise(ptr, map->size, MADV_RANDOM);
+  if (preload) madvise(ptr, map->size, MADV_WILLNEED);
+  return 0;
+}
+
+
+int record_map_close(record_map_t *map) {
+  int res = 0;
+
+  if ((map->base != NULL) && (munmap((void *) map->base, map->size) < 0)) res = -1;
+  map->base = NULL;
+  if (close(map->fd) < 0) res = -1;
+  return res;
+}
+
+
+const char *record_map_record(const record_map_t *map, size_t i) {
+  return map->base + i * map->record_size;
+}
+
+
+const char *record_map_find(const record_map_t *map, const char *key) {
+  size_t i;
+
+  i = lower_bound(map, (size_t) 0, map->num_records, key, map->key_width);
+  if ((i < map->num_records) && (compare_record(map, i, key, map->key_width) == 0)) {
+    return record_map_record(map, i);
+  }
+  return NULL;
+}
+
+
+size_t record_map_prefix(const record_map_t *map, const char *prefix, size_t len, size_t *first) {
+  size_t l, r;
+
+  if (len > map->key_width) len = map->key_width;
+  l = lower_bound(map, (size_t) 0, map->num_records, prefix, len);
+  r = upper_bound(map, l, map->num_records, prefix, len);
+  *first = l;
+  return r - l;
+}
+
+
+size_t record_map_range(const record_map_t *map, const char *low, const char *high, size_t *first) {
+  size_t l, r;
+
+  l = lower_bound(map, (size_t) 0, map->num_records, low, map->key_width);
+  r = upper_bound(map, l, map->num_records, high, map->key_width);
+  *first = l;
+  return (r > l ? r - l : (size_t) 0);
+}
+
+
+static int compare_batch_keys(const void *a, const void *b) {
+  const batch_key_t *x = (const batch_key_t *) a;
+  const batch_key_t *y = (const batch_key_t *) b;
+
+  if (x->map->compare != NULL) return x->map->compare(x->key, y->key, x->map->key_width);
+  return memcmp(x->key, y->key, x->map->key_width);
+}
+
+
+int record_map_find_batch(const record_map_t *map, const char **keys, size_t n, const char **results) {
+  batch_key_t *sorted;
+  size_t i, l, step, r;
+
+  sorted = (batch_key_t *) malloc(n * sizeof(batch_key_t));
+  if ((sorted == NULL) && (n > (size_t) 0)) return -1;
+  for (i = (size_t) 0; i < n; i++) {
+    sorted[i].key = keys[i];
+    sorted[i].idx = i;
+    sorted[i].map = map;
+  }
+  qsort(sorted, n, sizeof(batch_key_t), compare_batch_keys);
+
+  /*
+     Each key is not below the one before, so its search starts where
+     the last one ended, first doubling steps to bound it, then a
+     binary search within the bound
+  */
+  l = (size_t) 0;
+  for (i = (size_t) 0; i < n; i++) {
+    step = (size_t) 1;
+    r = l;
+    while ((r < map->num_records) && (compare_record(map, r, sorted[i].key, map->key_width) < 0)) {
+      l = r + ((size_t) 1);
+      r = l + step;
+      step *= (size_t) 2;
+    }
+    if (r > map->num_records) r = map->num_records;
+    l = lower_bound(map, l, r, sorted[i].key, map->key_width);
+    if ((l < map->num_records) && (compare_record(map, l, sorted[i].key, map->key_width) == 0)) {
+      results[sorted[i].idx] = record_map_record(map, l);
+    } else {
+      results[sorted[i].idx] = NULL;
+    }
+  }
+
+  free(sorted);
+  return 0;
+}
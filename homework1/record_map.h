@@ -0,0 +1,87 @@
+#ifndef _RECORD_MAP_
+#define _RECORD_MAP_
+
+#include <stddef.h>
+
+/*
+    Lookups in a file of fixed-size records sorted by a key.
+
+    The file gets mapped in memory once. Every record is record_size
+    bytes long and holds its key of key_width bytes at key_offset.
+    Keys compare with memcmp(), unless compare is set, in which case
+    compare(record_key, key, len) must return a negative value, 0 or
+    a positive value like memcmp() does on the first len <= key_width
+    bytes, in the order the file is sorted in. It must not read more
+    than len bytes of either key: keys need not be terminated, and the
+    keys of a batch lie right next to each other.
+*/
+typedef struct record_map_t {
+  int fd;
+  const char *base;
+  size_t size;
+  size_t record_size;
+  size_t num_records;
+  size_t key_offset;
+  size_t key_width;
+  int (*compare)(const char *record_key, const char *key, size_t len);
+} record_map_t;
+
+
+/*
+    Opens and maps the file filename. Checks with fstat() that it
+    is a regular file made of whole records. Advises the kernel that
+    it gets read at random, and, if preload is not zero, that all of
+    it is needed soon.
+    Returns 0 on success
+    Returns -1 on failure, with errno set, to EINVAL if the file is
+    not made of whole records
+*/
+int record_map_open(record_map_t *map, const char *filename, size_t record_size,
+                    size_t key_offset, size_t key_width, int preload);
+
+
+/*
+    Unmaps and closes the file.
+    Returns 0 on success
+    Returns -1 on failure, with errno set
+*/
+int record_map_close(record_map_t *map);
+
+
+/* Returns the i-th record */
+const char *record_map_record(const record_map_t *map, size_t i);
+
+
+/*
+    Returns the first record with the key of key_width bytes given,
+    or NULL if there is none
+*/
+const char *record_map_find(const record_map_t *map, const char *key);
+
+
+/*
+    Returns the number of records whose key starts with the len bytes
+    of prefix. The first of them is number *first.
+*/
+size_t record_map_prefix(const record_map_t *map, const char *prefix, size_t len, size_t *first);
+
+
+/*
+    Returns the number of records whose key is between the keys low
+    and high, of key_width bytes each, both included. The first of
+    them is number *first.
+*/
+size_t record_map_range(const record_map_t *map, const char *low, const char *high, size_t *first);
+
+
+/*
+    Looks up the n keys of key_width bytes, like record_map_find(),
+    and stores the records found in results, in the order of keys.
+    The keys get sorted first, so that the lookups go through the
+    mapping in order and each one starts where the last one ended.
+    Returns 0 on success
+    Returns -1 if no memory can be allocated
+*/
+int record_map_find_batch(const record_map_t *map, const char **keys, size_t n, const char **results);
+
+#endif
@@ -4,324 +4,427 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
 #include "user_methods.h"
 
 #define BUFFER_LEN (4096)
+#define SCAN_BUFFER_LEN (65536)
 #define FIRST_LINE_ALLOC_SIZE ((size_t) 2)
-#define FIRST_ARRAY_SIZE ((size_t) 2)
+#define FOLLOW_POLL_MS (1000)
+#define FOLLOW_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
 
-int main(int argc, char **argv) {
-    char buffer[BUFFER_LEN];
-    ssize_t read_res;  /* SIGNED */
-    size_t read_bytes; /* UNSIGNED */
-
-	char *file = NULL;
-    int fd;
-    int num;
-    int temp;
-    size_t i;
-    char c;
-    
-    char *current_line;
-    size_t current_line_len, current_line_size;
-
-    char *ptr;
-    char **lines;
-    char **lptr;
-    char *llptr;
-    size_t lines_len, lines_size;
-    char *lines_lengths;
-    
-    /* Read until file hits end-of-file condition */
-    current_line_len = (size_t) 0;
-    current_line_size = (size_t) 0;
-    current_line = NULL;
-    
-    lines_len = (size_t) 0;
-    lines_size = (size_t) 0;
-    lines = NULL;
-    lines_lengths = NULL;
-
-	/* 
-    	10 Default number of lines read 
-    	unless -n argument specified in argv[] + filename specified  
-  	*/
-	num = 10;    
-  	for (int i = 1; i < argc; i++) {
-    	if (str_comp(argv[i],"-n") == 0) {   /* Check for -n arg */
-      		if (++i >= argc) {                 /* Determine if invalid input detected */
-				display_error_message("head: option requires an argument -n [num]\n\tUsage: head -n <num> <filename>\n\tUsage: head <filename> -n <num>");
-				return 1;
-      		}
-      
-     		/* Convert input -n [num] to int */
-      		num = string_to_integer(argv[i]);
-      		if (num == 0) {   /* if zero, negative, or string entered */
-        		display_error_message("head: invalid num input\n");
-        		return 1;
-      		}
-    	} else {
-      		file = argv[i];
-    	}
-  	}
-
-  	fd = (file != NULL ? open(file, O_RDONLY) : 0); /* [statement] ? true : false  */
-
-    
-    while(1){
-        /* 
-			Try to read into the buffer 
-	   		sizeof(buffer) bytes 
-		*/
-        read_res = read(fd, buffer, sizeof(buffer));
-        
-        /* Handle the return values of the read system call */
-        
-        /* Return value zero, done, end-of-file reached */
-        if (read_res == ((ssize_t) 0)) break;
-        
-        /* Return value negative, we have an error and we die */
-        if (read_res < ((ssize_t) 0)) {
-	  		/* Display the appropriate error message and die */
-	  		display_error_message( "Error reading!\n");
-	  		/* Deallocate everything that has been allocated */
-	  		for (i=(size_t) 0; i<lines_len; i++){
-	    		free(lines[i]);
-	  		}
-	  		free(lines);
-	  		free(lines_lengths);
-	  		return 1;
-		}
-        
-        /* read_res is positive */
-        read_bytes = (size_t) read_res;
-        
-        /* Handle input and store into memory */
-        for(i=(size_t) 0; i < read_bytes; i++){
-	  /* Get current character */
-	  c = buffer[i];
-            
-	  /* Put the current character into the current line */
-	  if ((current_line_len + ((size_t) 1)) > current_line_size){
-	    /* Allocate Memory */
-	    if ((current_line_len == ((size_t) 0)) ||
-		(current_line == NULL)) {
-	      /* First allocation */
-	      ptr = (char *) malloc(FIRST_LINE_ALLOC_SIZE * sizeof(char)); //Each char is 1 byte
-	      if (ptr == NULL) {
-		display_error_message("Could not allocate any more memory.\n");
-		/* Deallocate everything that has been allocated */
-		for (i=(size_t) 0; i<lines_len; i++){
-		  free(lines[i]);
-		}
-		free(lines);
-		free(lines_lengths);
-		return 1;
-	      }
-	      current_line = ptr;
-	      current_line_size = FIRST_LINE_ALLOC_SIZE;
-	    } else {
-
-	      /* Preform Reallocation */
-	      ptr = (char *) realloc(current_line, current_line_size * ((size_t) 2) * sizeof(char));
-
-	      if (ptr == NULL){
-		display_error_message("Could not allocate any more memory.\n");
-		/* Deallocate everything that has been allocated */
-		for (i = (size_t) 0; i < lines_len; i++) {
-		  free(lines[i]);
-		}
-		free(lines);
-		free(lines_lengths);
-		return 1;
-	      }
-	      current_line = ptr;
-	      current_line_size *= (size_t) 2;
-	    }
-	  }
-            
-	  /*
-	    Here, we are sure to have the right space in memory. 
-	     We put the character in and increment the length
-	  */
-	  current_line[current_line_len] = c;
-	  current_line_len++;
-            
-            
-	  /* If this is a newline character, start a new line */
-	  if (c == '\n'){
-	    if ((lines_len + ((size_t) 1)) > lines_size) {
-	      /* Allocate memory :) */
-	      if ((lines_len == ((size_t) 0)) ||
-		  (lines == NULL)) {
-		/* First allocation */
-		lptr = (char **) malloc(FIRST_ARRAY_SIZE * sizeof(char *));
-		if(lptr == NULL){
-		  display_error_message("Could not allocate any more memory.\n");
-		  /* Deallocate everything that has been allocated */
-		  for (i=(size_t) 0; i<lines_len; i++){
-		    free(lines[i]);
-		  }
-		  free(lines);
-		  free(lines_lengths);
-		  return 1;
-		}
-		lines = lptr;
-		lines_size = FIRST_ARRAY_SIZE;
-		llptr = (char *) malloc(FIRST_ARRAY_SIZE * sizeof(char));
-		if(llptr == NULL){
-		  display_error_message("Could not allocate any more memory.\n");
-		  /* Deallocate everything that has been allocated */
-		  for (i=(size_t) 0; i<lines_len; i++){
-		    free(lines[i]);
-		  }
-		  free(lines);
-		  free(lines_lengths);
-		  return 1;
-		}
-		lines_lengths = llptr;
-	      } else {
-		/* Reallocation */
-		lptr = (char **) realloc(lines, lines_size * ((size_t) 2) * sizeof(char *));
-                
-		if(lptr == NULL){
-		  display_error_message("Could not allocate any more memory.\n");
-		  /* Deallocate everything that has been allocated */
-		  for (i=(size_t) 0; i<lines_len; i++){
-		    free(lines[i]);
-		  }
-		  free(lines);
-		  free(lines_lengths);
-		  return 1;
-		}
-		lines = lptr;
-		lines_size *= (size_t) 2;
-                
-		/* Reallocation */
-		llptr = (char *) realloc(lines_lengths, lines_size * ((size_t) 2) * sizeof(char));
-                
-		if(llptr == NULL){
-		  display_error_message("Could not allocate any more memory.\n");
-		  /* Deallocate everything that has been allocated */
-		  for (i=(size_t) 0; i<lines_len; i++){
-		    free(lines[i]);
-		  }
-		  free(lines);
-		  free(lines_lengths);
-		  return 1;
-		}
-		lines_lengths = llptr;
-	      }
-	    }
-	    lines[lines_len] = current_line;
-	    lines_lengths[lines_len] = current_line_len;
-	    lines_len++;
-	    current_line = NULL;
-	    current_line_len = (size_t) 0;
-	    current_line_size = (size_t) 0;
-	  }
+/*
+   Regular files get read from the end: blocks are read backwards
+   until num lines have been found, and only these blocks and the
+   lines are ever read. Pipes and terminals cannot seek, so their
+   input gets read forwards into a ring of num lines, where a new line
+   takes the place of the oldest one. The memory used is bounded by
+   the size of the lines printed, not by the size of the input.
+
+   With -f, the named files are followed once their last lines have
+   been printed. tail remembers how far each file has been printed and
+   sleeps on inotify until a file changes, or at most FOLLOW_POLL_MS,
+   which also is how often it checks when inotify is not available.
+   Only the bytes appended since get printed. A file that got shorter
+   has been truncated and is printed again from its start, and a file
+   whose name now refers to another file has been rotated: the rest of
+   the old file is printed, then the new one is followed from its
+   start.
+*/
+
+/* A file followed with -f */
+typedef struct follow_t {
+  const char *name;
+  int fd;           /* -1 while the file cannot be opened */
+  off_t offset;     /* bytes printed so far */
+  dev_t dev;
+  ino_t ino;
+  int wd;           /* inotify watch, -1 if none */
+  int active;       /* 0 if the file is not followed */
+} follow_t;
+
+
+/* 
+   Copies the bytes of fd from offset *start to offset end to stdout,
+   in blocks of SCAN_BUFFER_LEN, and advances *start past them
+*/
+int copy_range(int fd, off_t *start, off_t end) {
+  static char buffer[SCAN_BUFFER_LEN];
+  ssize_t read_res;
+  size_t len;
+
+  while (*start < end) {
+    len = sizeof(buffer);
+    if ((off_t) len > end - *start) len = (size_t) (end - *start);
+    read_res = pread(fd, buffer, len, *start);
+    if (read_res < ((ssize_t) 0)) {
+      display_error_message("Error reading!\n");
+      return 1;
+    }
+    if (read_res == ((ssize_t) 0)) break;
+    if (my_write(1, buffer, (size_t) read_res) < 0) {
+      display_error_message("Error writing!\n");
+      return 1;
+    }
+    *start += (off_t) read_res;
+  }
+  return 0;
+}
+
+
+/* Prints the last num lines of a regular file of size bytes */
+int tail_seekable(int fd, off_t size, int num) {
+  static char buffer[SCAN_BUFFER_LEN];
+  ssize_t read_res;
+  off_t pos, end, start;
+  size_t len, i;
+  int newlines;
+
+  /* A newline at the very end terminates the last line, it does not start one */
+  end = size;
+  if (size > (off_t) 0) {
+    if (pread(fd, buffer, (size_t) 1, size - (off_t) 1) != (ssize_t) 1) {
+      display_error_message("Error reading!\n");
+      return 1;
+    }
+    if (buffer[0] == '\n') end--;
+  }
+
+  /* Scan backwards for the newline in front of the num-th last line */
+  start = (off_t) 0;
+  newlines = 0;
+  pos = end;
+  while ((pos > (off_t) 0) && (start == (off_t) 0)) {
+    len = sizeof(buffer);
+    if ((off_t) len > pos) len = (size_t) pos;
+    pos -= (off_t) len;
+    read_res = pread(fd, buffer, len, pos);
+    if (read_res != (ssize_t) len) {
+      display_error_message("Error reading!\n");
+      return 1;
+    }
+    for (i = len; i > (size_t) 0; i--) {
+      if (buffer[i - ((size_t) 1)] == '\n') {
+        newlines++;
+        if (newlines == num) {
+          start = pos + (off_t) i;
+          break;
         }
-        
+      }
+    }
+  }
+
+  return copy_range(fd, &start, size);
+}
+
+
+/* Prints the last num lines of a stream, keeping no more than num + 1 lines */
+int tail_stream(int fd, int num) {
+  char buffer[BUFFER_LEN];
+  ssize_t read_res;
+  char **lines;
+  size_t *lines_lengths;
+  size_t *lines_sizes;
+  size_t current, count, i, pos, len;
+  size_t slots;
+  char *nl, *ptr;
+  int res;
+
+  /* One slot more than num, for the line being read */
+  slots = ((size_t) num) + ((size_t) 1);
+  lines = (char **) calloc(slots, sizeof(char *));
+  lines_lengths = (size_t *) calloc(slots, sizeof(size_t));
+  lines_sizes = (size_t *) calloc(slots, sizeof(size_t));
+  if ((lines == NULL) || (lines_lengths == NULL) || (lines_sizes == NULL)) {
+    display_error_message("Could not allocate any more memory.\n");
+    free(lines);
+    free(lines_lengths);
+    free(lines_sizes);
+    return 1;
+  }
+
+  /* lines[current] is the line being read, count the number of complete lines */
+  current = (size_t) 0;
+  count = (size_t) 0;
+  res = 0;
+  while (1) {
+    read_res = read(fd, buffer, sizeof(buffer));
+    if (read_res == ((ssize_t) 0)) break;
+    if (read_res < ((ssize_t) 0)) {
+      display_error_message("Error reading!\n");
+      res = 1;
+      break;
     }
-    
-    /*
-      In the case when the last line has no new line character at the
-      end we need to put the line into the array of lines nevertheless 
-    */
-    if ( !((current_line == NULL) || (current_line_len == (size_t) 0)) ) {
-      if ((lines_len + ((size_t) 1)) > lines_size) {
-	/* Allocate memory :) */
-	if ((lines_len == ((size_t) 0)) ||
-            (lines == NULL)) {
-	  /* First allocation */
-	  lptr = (char **) malloc(FIRST_ARRAY_SIZE * sizeof(char *));
-	  if(lptr == NULL){
-	    display_error_message("Could not allocate any more memory.\n");
-	    /* Deallocate everything that has been allocated */
-	    for (i=(size_t) 0; i<lines_len; i++){
-	      free(lines[i]);
-	    }
-	    free(lines);
-	    free(lines_lengths);
-	    return 1;
-	  }
-	  lines = lptr;
-	  lines_size = FIRST_ARRAY_SIZE;
-	  llptr = (char *) malloc(FIRST_ARRAY_SIZE * sizeof(char));
-	  if(llptr == NULL){
-	    display_error_message("Could not allocate any more memory.\n");
-	    /* Deallocate everything that has been allocated */
-	    for (i=(size_t) 0; i<lines_len; i++){
-	      free(lines[i]);
-	    }
-	    free(lines);
-	    free(lines_lengths);
-	    return 1;
-	  }
-	  lines_lengths = llptr;
-	} else {
-	  /* Reallocation */
-	  lptr = (char **) realloc(lines, lines_size * ((size_t) 2) * sizeof(char *));
-	  
-	  if(lptr == NULL){
-	    display_error_message("Could not allocate any more memory.\n");
-	    /* Deallocate everything that has been allocated */
-	    for (i=(size_t) 0; i<lines_len; i++){
-	      free(lines[i]);
-	    }
-	    free(lines);
-	    free(lines_lengths);
-	    return 1;
-	  }
-	  lines = lptr;
-	  lines_size *= (size_t) 2;
-	  
-	  /* Reallocation */
-	  llptr = (char *) realloc(lines_lengths, lines_size * ((size_t) 2) * sizeof(char));
-          
-	  if(llptr == NULL){
-	    display_error_message("Could not allocate any more memory.\n");
-	    /* Deallocate everything that has been allocated */
-	    for (i=(size_t) 0; i < lines_len; i++){
-	      free(lines[i]);
-	    }
-	    free(lines);
-	    free(lines_lengths);
-	    return 1;
-	  }
-	  lines_lengths = llptr;
-	}
-        
-	lines[lines_len] = current_line;
-	lines_lengths[lines_len] = current_line_len;
-	lines_len++;
-	current_line = NULL;
-	current_line_len = (size_t) 0;
-	current_line_size = (size_t) 0;
+
+    pos = (size_t) 0;
+    while (pos < (size_t) read_res) {
+      nl = memchr(&buffer[pos], '\n', ((size_t) read_res) - pos);
+      len = (nl == NULL ? ((size_t) read_res) - pos : ((size_t) (nl - &buffer[pos])) + ((size_t) 1));
+
+      /* Grow the slot, which keeps its memory when it gets reused */
+      if (lines_lengths[current] + len > lines_sizes[current]) {
+        size_t new_size = (lines_sizes[current] == (size_t) 0 ? FIRST_LINE_ALLOC_SIZE : lines_sizes[current]);
+        while (new_size < lines_lengths[current] + len) new_size *= (size_t) 2;
+        ptr = (char *) realloc(lines[current], new_size);
+        if (ptr == NULL) {
+          display_error_message("Could not allocate any more memory.\n");
+          res = 1;
+          goto done;
+        }
+        lines[current] = ptr;
+        lines_sizes[current] = new_size;
+      }
+      memcpy(&lines[current][lines_lengths[current]], &buffer[pos], len);
+      lines_lengths[current] += len;
+      pos += len;
+
+      /* A complete line, the next one replaces the oldest */
+      if (nl != NULL) {
+        current = (current + ((size_t) 1)) % slots;
+        lines_lengths[current] = (size_t) 0;
+        if (count < (size_t) num) count++;
       }
     }
-    
-    /*
-      Here, we have an array lines of "strings", i.e. array lines of 
-      pointers to characters. There are lines_len set by [num] valid entries
-    */
-    
-    temp = 0;
-    for (i= lines_len; i > (size_t) 0; i--){
-      if (temp < num) {
-	my_write(1, lines[i - ((size_t)1)], lines_lengths[i - ((size_t) 1)]);
-	temp++;
-      } else {
-		break;
+  }
+
+  /*
+    In the case when the last line has no new line character at the
+    end we need to print it nevertheless, in the place of the oldest
+  */
+  if (lines_lengths[current] > (size_t) 0) {
+    current = (current + ((size_t) 1)) % slots;
+    if (count < (size_t) num) count++;
+  }
+
+  /* The oldest line kept comes count lines before current */
+  for (i = slots - count; i < slots; i++) {
+    size_t idx = (current + i) % slots;
+    if (my_write(1, lines[idx], lines_lengths[idx]) < 0) {
+      display_error_message("Error writing!\n");
+      res = 1;
+      break;
+    }
+  }
+
+done:
+  /* Deallocate everything that has been allocated */
+  for (i = (size_t) 0; i < slots; i++) {
+    free(lines[i]);
+  }
+  free(lines);
+  free(lines_lengths);
+  free(lines_sizes);
+  return res;
+}
+
+
+/* Prints the header in front of the lines of a file when there are several */
+void print_header(const char *name, int first) {
+  if (!first) my_write(1, "\n", (size_t) 1);
+  my_write(1, "==> ", (size_t) 4);
+  my_write(1, name, (size_t) find_length((char *) name));
+  my_write(1, " <==\n", (size_t) 5);
+}
+
+
+/* Prints the last num lines of fd, *end is set to the bytes read */
+int tail_fd(int fd, int num, off_t *end) {
+  struct stat st;
+
+  /* Only regular files can be read from the end */
+  if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) &&
+      (lseek(fd, (off_t) 0, SEEK_CUR) == (off_t) 0)) {
+    *end = st.st_size;
+    return tail_seekable(fd, st.st_size, num);
+  }
+  *end = (off_t) 0;
+  return tail_stream(fd, num);
+}
+
+
+/* Opens the file of f by its name, and watches it */
+void follow_open(follow_t *f, int ifd) {
+  struct stat st;
+
+  f->fd = open(f->name, O_RDONLY);
+  if (f->fd < 0) return;
+  if (fstat(f->fd, &st) < 0) {
+    close(f->fd);
+    f->fd = -1;
+    return;
+  }
+  f->dev = st.st_dev;
+  f->ino = st.st_ino;
+  if (ifd >= 0) f->wd = inotify_add_watch(ifd, f->name, FOLLOW_EVENTS);
+}
+
+
+/* Prints what has been appended to the file of f since the last call */
+int follow_check(follow_t *f, int idx, int ifd, int several, int *last) {
+  struct stat st, name_st;
+  int rotated;
+
+  if (f->fd < 0) {
+    follow_open(f, ifd);
+    if (f->fd < 0) return 0;
+    f->offset = (off_t) 0;
+  }
+
+  /* Has the name been given to another file? Until then, keep the old one */
+  rotated = ((stat(f->name, &name_st) == 0) &&
+             ((name_st.st_dev != f->dev) || (name_st.st_ino != f->ino)));
+
+  if (fstat(f->fd, &st) < 0) return 1;
+  if (st.st_size < f->offset) {
+    /* On stderr, so that the notice does not end up in the output */
+    my_write(2, "tail: ", (size_t) 6);
+    my_write(2, f->name, (size_t) find_length((char *) f->name));
+    my_write(2, ": file truncated\n", (size_t) 17);
+    f->offset = (off_t) 0;
+  }
+  if (st.st_size > f->offset) {
+    if (several && (*last != idx)) print_header(f->name, 0);
+    *last = idx;
+    if (copy_range(f->fd, &f->offset, st.st_size) != 0) return 1;
+  }
+
+  /* The rest of the old file has been printed, follow the new one */
+  if (rotated) {
+    if ((ifd >= 0) && (f->wd >= 0)) inotify_rm_watch(ifd, f->wd);
+    f->wd = -1;
+    close(f->fd);
+    f->fd = -1;
+    follow_open(f, ifd);
+    f->offset = (off_t) 0;
+    if (f->fd >= 0) return follow_check(f, idx, ifd, several, last);
+  }
+  return 0;
+}
+
+
+/* Follows the files, last is the one printed last, never returns unless there is an error */
+int follow(follow_t *files, int n, int last) {
+  char events[4096];
+  struct pollfd pfd;
+  int ifd, i;
+
+  ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  for (i = 0; i < n; i++) {
+    files[i].wd = -1;
+    if ((ifd >= 0) && (files[i].fd >= 0)) {
+      files[i].wd = inotify_add_watch(ifd, files[i].name, FOLLOW_EVENTS);
+    }
+  }
+
+  while (1) {
+    for (i = 0; i < n; i++) {
+      if (!files[i].active) continue;
+      if (follow_check(&files[i], i, ifd, n > 1, &last) != 0) {
+        display_error_message("Error reading!\n");
+        if (ifd >= 0) close(ifd);
+        return 1;
       }
     }
-    
-    /* Deallocate everything that has been allocated */
-    for (i=(size_t) 0; i<lines_len; i++){
-      free(lines[i]);
+
+    /* Sleep until a file changes, rotations are caught by the timeout */
+    if (ifd >= 0) {
+      pfd.fd = ifd;
+      pfd.events = POLLIN;
+      if (poll(&pfd, 1, FOLLOW_POLL_MS) > 0) {
+        while (read(ifd, events, sizeof(events)) > (ssize_t) 0);
+      }
+    } else {
+      poll(NULL, 0, FOLLOW_POLL_MS);
     }
-    free(lines);
-    free(lines_lengths);
-    
-    return 0; /* Signal success */
+  }
+}
+
+
+int main(int argc, char **argv) {
+  follow_t *files;
+  struct stat st;
+  int n_files;
+  int follow_mode;
+  int fd;
+  int num;
+  int res;
+  int last;
+
+  files = (follow_t *) calloc((size_t) argc, sizeof(follow_t));
+  if (files == NULL) {
+    display_error_message("Could not allocate any more memory.\n");
+    return 1;
+  }
+
+  /*
+    10 Default number of lines read
+    unless -n argument specified in argv[] + filename specified
+  */
+  num = 10;
+  n_files = 0;
+  follow_mode = 0;
+  for (int i = 1; i < argc; i++) {
+    if (str_comp(argv[i],"-n") == 0) {   /* Check for -n arg */
+      if (++i >= argc) {                 /* Determine if invalid input detected */
+        display_error_message("tail: option requires an argument -n [num]\n\tUsage: tail [-f] -n <num> <filename> ...\n\tUsage: tail [-f] <filename> ... -n <num>\n");
+        free(files);
+        return 1;
+      }
+
+      /* Convert input -n [num] to int */
+      num = string_to_integer(argv[i]);
+      if (num == 0) {   /* if zero, negative, or string entered */
+        display_error_message("tail: invalid num input\n");
+        free(files);
+        return 1;
+      }
+    } else if (str_comp(argv[i],"-f") == 0) {
+      follow_mode = 1;
+    } else {
+      files[n_files++].name = argv[i];
+    }
+  }
+
+  /* Without file, read standard input, which cannot be followed */
+  if (n_files == 0) {
+    res = tail_fd(0, num, &files[0].offset);
+    free(files);
+    return res;
+  }
+
+  res = 0;
+  last = -1;
+  for (int i = 0; i < n_files; i++) {
+    files[i].fd = -1;
+    files[i].active = follow_mode;
+    fd = open(files[i].name, O_RDONLY);
+    if (fd < 0) {
+      display_error_message("tail: cannot open ");
+      display_error_message((char *) files[i].name);
+      display_error_message("\n");
+      res = 1;
+      continue;
+    }
+    if (n_files > 1) print_header(files[i].name, last == -1);
+    if (tail_fd(fd, num, &files[i].offset) != 0) res = 1;
+    last = i;
+
+    /* Keep the file open to follow it */
+    if (follow_mode && (fstat(fd, &st) == 0) && S_ISREG(st.st_mode)) {
+      files[i].fd = fd;
+      files[i].dev = st.st_dev;
+      files[i].ino = st.st_ino;
+    } else {
+      files[i].active = 0;
+      close(fd);
+    }
+  }
+
+  if (follow_mode) res = follow(files, n_files, last);
+
+  free(files);
+  return res;
 }
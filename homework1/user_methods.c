@@ -41,6 +41,91 @@ size_t get_line_bytes(char *buf, size_t num_bytes_remaining) {
 }
 
 
+/* Vectorized newline search, selected once at run time */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* 
+   Counts the newlines of blocks of w bytes with popcount and only
+   looks for the one that ends the lines in the block that has it.
+*/
+#define FIND_LINE_END_BODY(vec_t, w, load, set1, cmpeq, movemask)          \
+  size_t pos = (size_t) 0, count = (size_t) 0, c;                          \
+  unsigned int mask;                                                       \
+  vec_t nl = set1('\n');                                                   \
+  while (pos + ((size_t) w) <= num_bytes) {                                \
+    mask = (unsigned int) movemask(cmpeq(load((const vec_t *) &buf[pos]), nl)); \
+    c = (size_t) __builtin_popcount(mask);                                 \
+    if (count + c >= lines) {                                              \
+      while (count + ((size_t) 1) < lines) {                               \
+        mask &= mask - 1u;                                                 \
+        count++;                                                           \
+      }                                                                    \
+      *found = lines;                                                      \
+      return pos + ((size_t) __builtin_ctz(mask)) + ((size_t) 1);          \
+    }                                                                      \
+    count += c;                                                            \
+    pos += (size_t) w;                                                     \
+  }                                                                        \
+  for (; pos < num_bytes; pos++) {                                         \
+    if (buf[pos] == '\n' && ++count == lines) {                            \
+      *found = count;                                                      \
+      return pos + ((size_t) 1);                                           \
+    }                                                                      \
+  }                                                                        \
+  *found = count;                                                          \
+  return num_bytes;
+
+__attribute__((target("avx2")))
+static size_t find_line_end_avx2(const char *buf, size_t num_bytes, size_t lines, size_t *found) {
+  FIND_LINE_END_BODY(__m256i, 32, _mm256_loadu_si256, _mm256_set1_epi8,
+                     _mm256_cmpeq_epi8, _mm256_movemask_epi8)
+}
+
+__attribute__((target("sse2")))
+static size_t find_line_end_sse2(const char *buf, size_t num_bytes, size_t lines, size_t *found) {
+  FIND_LINE_END_BODY(__m128i, 16, _mm_loadu_si128, _mm_set1_epi8,
+                     _mm_cmpeq_epi8, _mm_movemask_epi8)
+}
+#endif
+
+/* Portable version, one memchr per line */
+static size_t find_line_end_memchr(const char *buf, size_t num_bytes, size_t lines, size_t *found) {
+  size_t pos = (size_t) 0, count = (size_t) 0;
+  const char *nl;
+
+  while (count < lines && pos < num_bytes) {
+    nl = memchr(&buf[pos], '\n', num_bytes - pos);
+    if (nl == NULL) break;
+    count++;
+    pos = ((size_t) (nl - buf)) + ((size_t) 1);
+  }
+  *found = count;
+  return (count == lines ? pos : num_bytes);
+}
+
+size_t find_line_end(const char *buf, size_t num_bytes, size_t lines, size_t *found) {
+  static size_t (*impl)(const char *, size_t, size_t, size_t *) = NULL;
+
+  if (lines == (size_t) 0) {
+    *found = (size_t) 0;
+    return (size_t) 0;
+  }
+  if (impl == NULL) {
+    impl = find_line_end_memchr;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      impl = find_line_end_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+      impl = find_line_end_sse2;
+    }
+#endif
+  }
+  return impl(buf, num_bytes, lines, found);
+}
+
+
 /* Find string length */
 int find_length(char *thatString){
   int length = 0;
@@ -13,6 +13,15 @@ int my_write(int fd, const char *buf, size_t bytes);
 size_t get_line_bytes(char *buf, size_t num_bytes_remaining);
 
 
+/* 
+    Returns the number of bytes of buf up to and including the
+    <lines>-th newline, or <num_bytes> if there are fewer newlines.
+    The newlines found, at most <lines>, are stored in *found.
+    Uses AVX2 or SSE2 when the processor has them.
+*/
+size_t find_line_end(const char *buf, size_t num_bytes, size_t lines, size_t *found);
+
+
 /* Return the length of a given string */
 size_t str_length(char *str);
 
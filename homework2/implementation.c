@@ -55,38 +55,191 @@
     
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stddef.h>
 #include <sys/mman.h>
 
 /* Predefined helper functions */
 
-static void *__memset(void *s, int c, size_t n) {
+/* __memset and __memcpy work on machine words, or on 16 and 32 byte
+   vectors when the processor supports SSE2 and AVX2. The kernel to
+   use gets chosen on the first call. Stores are aligned on the width
+   of the kernel; loads are not. */
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define MEMORY_HAVE_SIMD 1
+#include <immintrin.h>
+#endif
+
+typedef size_t __attribute__((__may_alias__)) memory_word_t;
+
+static void *__memset_words(void *s, int c, size_t n) {
   unsigned char *p;
-  size_t i;
+  memory_word_t w;
 
-  if (n == ((size_t) 0)) return s;
-  for (i=(size_t) 0,p=(unsigned char *)s;
-       i<=(n-((size_t) 1));
-       i++,p++) {
-    *p = (unsigned char) c;
+  p = (unsigned char *) s;
+  while ((n > ((size_t) 0)) && ((((size_t) p) & (sizeof(memory_word_t) - ((size_t) 1))) != ((size_t) 0))) {
+    *p++ = (unsigned char) c;
+    n--;
+  }
+  w = ((memory_word_t) -1) / ((memory_word_t) 255) * ((memory_word_t) (unsigned char) c);
+  for (; n >= sizeof(memory_word_t); n -= sizeof(memory_word_t), p += sizeof(memory_word_t)) {
+    *((memory_word_t *) p) = w;
+  }
+  for (; n > ((size_t) 0); n--) {
+    *p++ = (unsigned char) c;
   }
   return s;
 }
 
-static void *__memcpy(void *dest, const void *src, size_t n) {
+static void *__memcpy_words(void *dest, const void *src, size_t n) {
   unsigned char *pd;
   const unsigned char *ps;
-  size_t i;
 
-  if (n == ((size_t) 0)) return dest;
-  for (i=(size_t) 0,pd=(unsigned char *)dest,ps=(const unsigned char *)src;
-       i<=(n-((size_t) 1));
-       i++,pd++,ps++) {
-    *pd = *ps;
+  pd = (unsigned char *) dest;
+  ps = (const unsigned char *) src;
+  while ((n > ((size_t) 0)) && ((((size_t) pd) & (sizeof(memory_word_t) - ((size_t) 1))) != ((size_t) 0))) {
+    *pd++ = *ps++;
+    n--;
+  }
+  for (; n >= sizeof(memory_word_t); n -= sizeof(memory_word_t), pd += sizeof(memory_word_t), ps += sizeof(memory_word_t)) {
+    *((memory_word_t *) pd) = *((const memory_word_t *) ps);
+  }
+  for (; n > ((size_t) 0); n--) {
+    *pd++ = *ps++;
+  }
+  return dest;
+}
+
+#ifdef MEMORY_HAVE_SIMD
+static void *__memset_sse2(void *s, int c, size_t n) {
+  unsigned char *p;
+  __m128i v;
+
+  p = (unsigned char *) s;
+  while ((n > ((size_t) 0)) && ((((size_t) p) & ((size_t) 15)) != ((size_t) 0))) {
+    *p++ = (unsigned char) c;
+    n--;
+  }
+  v = _mm_set1_epi8((char) c);
+  for (; n >= ((size_t) 64); n -= (size_t) 64, p += 64) {
+    _mm_store_si128((__m128i *) p, v);
+    _mm_store_si128((__m128i *) (p + 16), v);
+    _mm_store_si128((__m128i *) (p + 32), v);
+    _mm_store_si128((__m128i *) (p + 48), v);
+  }
+  for (; n >= ((size_t) 16); n -= (size_t) 16, p += 16) {
+    _mm_store_si128((__m128i *) p, v);
+  }
+  __memset_words(p, c, n);
+  return s;
+}
+
+static void *__memcpy_sse2(void *dest, const void *src, size_t n) {
+  unsigned char *pd;
+  const unsigned char *ps;
+
+  pd = (unsigned char *) dest;
+  ps = (const unsigned char *) src;
+  while ((n > ((size_t) 0)) && ((((size_t) pd) & ((size_t) 15)) != ((size_t) 0))) {
+    *pd++ = *ps++;
+    n--;
+  }
+  for (; n >= ((size_t) 64); n -= (size_t) 64, pd += 64, ps += 64) {
+    _mm_store_si128((__m128i *) pd, _mm_loadu_si128((const __m128i *) ps));
+    _mm_store_si128((__m128i *) (pd + 16), _mm_loadu_si128((const __m128i *) (ps + 16)));
+    _mm_store_si128((__m128i *) (pd + 32), _mm_loadu_si128((const __m128i *) (ps + 32)));
+    _mm_store_si128((__m128i *) (pd + 48), _mm_loadu_si128((const __m128i *) (ps + 48)));
+  }
+  for (; n >= ((size_t) 16); n -= (size_t) 16, pd += 16, ps += 16) {
+    _mm_store_si128((__m128i *) pd, _mm_loadu_si128((const __m128i *) ps));
   }
+  __memcpy_words(pd, ps, n);
   return dest;
 }
 
+__attribute__((__target__("avx2")))
+static void *__memset_avx2(void *s, int c, size_t n) {
+  unsigned char *p;
+  __m256i v;
+
+  p = (unsigned char *) s;
+  while ((n > ((size_t) 0)) && ((((size_t) p) & ((size_t) 31)) != ((size_t) 0))) {
+    *p++ = (unsigned char) c;
+    n--;
+  }
+  v = _mm256_set1_epi8((char) c);
+  for (; n >= ((size_t) 128); n -= (size_t) 128, p += 128) {
+    _mm256_store_si256((__m256i *) p, v);
+    _mm256_store_si256((__m256i *) (p + 32), v);
+    _mm256_store_si256((__m256i *) (p + 64), v);
+    _mm256_store_si256((__m256i *) (p + 96), v);
+  }
+  for (; n >= ((size_t) 32); n -= (size_t) 32, p += 32) {
+    _mm256_store_si256((__m256i *) p, v);
+  }
+  __memset_words(p, c, n);
+  return s;
+}
+
+__attribute__((__target__("avx2")))
+static void *__memcpy_avx2(void *dest, const void *src, size_t n) {
+  unsigned char *pd;
+  const unsigned char *ps;
+
+  pd = (unsigned char *) dest;
+  ps = (const unsigned char *) src;
+  while ((n > ((size_t) 0)) && ((((size_t) pd) & ((size_t) 31)) != ((size_t) 0))) {
+    *pd++ = *ps++;
+    n--;
+  }
+  for (; n >= ((size_t) 128); n -= (size_t) 128, pd += 128, ps += 128) {
+    _mm256_store_si256((__m256i *) pd, _mm256_loadu_si256((const __m256i *) ps));
+    _mm256_store_si256((__m256i *) (pd + 32), _mm256_loadu_si256((const __m256i *) (ps + 32)));
+    _mm256_store_si256((__m256i *) (pd + 64), _mm256_loadu_si256((const __m256i *) (ps + 64)));
+    _mm256_store_si256((__m256i *) (pd + 96), _mm256_loadu_si256((const __m256i *) (ps + 96)));
+  }
+  for (; n >= ((size_t) 32); n -= (size_t) 32, pd += 32, ps += 32) {
+    _mm256_store_si256((__m256i *) pd, _mm256_loadu_si256((const __m256i *) ps));
+  }
+  __memcpy_words(pd, ps, n);
+  return dest;
+}
+#endif
+
+static void *(*__memset_kernel)(void *, int, size_t) = NULL;
+static void *(*__memcpy_kernel)(void *, const void *, size_t) = NULL;
+
+static void __select_kernels() {
+  __memset_kernel = __memset_words;
+  __memcpy_kernel = __memcpy_words;
+#ifdef MEMORY_HAVE_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    __memset_kernel = __memset_avx2;
+    __memcpy_kernel = __memcpy_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    __memset_kernel = __memset_sse2;
+    __memcpy_kernel = __memcpy_sse2;
+  }
+#endif
+}
+
+static void *__memset(void *s, int c, size_t n) {
+  if (n == ((size_t) 0)) return s;
+  if (__memset_kernel == NULL) __select_kernels();
+  return __memset_kernel(s, c, n);
+}
+
+static void *__memcpy(void *dest, const void *src, size_t n) {
+  if (n == ((size_t) 0)) return dest;
+  if (__memcpy_kernel == NULL) __select_kernels();
+  return __memcpy_kernel(dest, src, n);
+}
+
 /* Tries to multiply the two size_t arguments a and b.
 
    If the product holds on a size_t variable, sets the 
@@ -160,170 +313,574 @@ static int __try_size_t_multiply(size_t *c, size_t a, size_t b) {
 // Define Min Size 
 #define MEMORY_MAP_MIN_SIZE (4194304)
 
-/* Structure */ 
+// Requests of at least that size get a memory map of their own
+#define MEMORY_DIRECT_MAP_THRESHOLD (1048576)
+
+#define PAGE_SIZE (4096)
+#define HUGE_PAGE_SIZE (2097152)
+
+/* Huge page modes, see __set_huge_pages_impl */
+#define HUGE_PAGES_NONE (0)
+#define HUGE_PAGES_MADVISE (1)
+#define HUGE_PAGES_HUGETLB (2)
+
+static int __huge_pages = HUGE_PAGES_NONE;
+
+/* Statistics, see __stats_impl */
+static size_t __bytes_mapped = (size_t) 0;
+static size_t __bytes_unmapped = (size_t) 0;
+
+/* Rounds the variable pointed to by size up to a multiple of 
+   alignment, which must be a power of two. Returns zero on overflow. */
+static int __round_up(size_t *size, size_t alignment){
+	size_t s;
+	
+	s = *size + (alignment - (size_t) 1);
+	if (s < *size) return 0;
+	*size = s & ~(alignment - (size_t) 1);
+	return 1;
+}
+
+/* Map Memory 
+
+   Maps at least the number of bytes held by the variable pointed to 
+   by size and sets that variable to the size of the mapping. Maps of
+   at least one huge page get backed by huge pages if requested: with
+   MAP_HUGETLB, falling back to normal pages if none are available, or
+   by aligning the map on the size of a huge page and advising the 
+   kernel to use transparent huge pages.
+
+   Returns NULL if the memory cannot be mapped.
+*/
+static void *__map_memory(size_t *size){
+	size_t s, head;
+	void *ptr, *aligned;
+	
+	s = *size;
+	if ((__huge_pages != HUGE_PAGES_NONE) && (s >= (size_t) HUGE_PAGE_SIZE)){
+		if (!__round_up(&s, (size_t) HUGE_PAGE_SIZE)) return NULL;
+#ifdef MAP_HUGETLB
+		if (__huge_pages == HUGE_PAGES_HUGETLB){
+			ptr = mmap(NULL, s, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (ptr != MAP_FAILED){
+				__bytes_mapped += s;
+				*size = s;
+				return ptr;
+			}
+		}
+#endif
+#ifdef MADV_HUGEPAGE
+		if ((__huge_pages == HUGE_PAGES_MADVISE) && (s + (size_t) HUGE_PAGE_SIZE > s)){
+			ptr = mmap(NULL, s + (size_t) HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (ptr == MAP_FAILED) return NULL;
+			aligned = (void *) ((((size_t) ptr) + ((size_t) (HUGE_PAGE_SIZE - 1))) & ~((size_t) (HUGE_PAGE_SIZE - 1)));
+			head = (size_t) (aligned - ptr);
+			if (head > (size_t) 0) munmap(ptr, head);
+			if (head < (size_t) HUGE_PAGE_SIZE) munmap(aligned + s, ((size_t) HUGE_PAGE_SIZE) - head);
+			madvise(aligned, s, MADV_HUGEPAGE);
+			__bytes_mapped += s;
+			*size = s;
+			return aligned;
+		}
+#endif
+	}else{
+		if (!__round_up(&s, (size_t) PAGE_SIZE)) return NULL;
+	}
+	
+	ptr = mmap(NULL, s, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED) return NULL;
+	__bytes_mapped += s;
+	*size = s;
+	return ptr;
+}
+
+/* Blocks
+
+   Memory gets mapped in arenas of at least MEMORY_MAP_MIN_SIZE bytes.
+   An arena starts with a memory_map_t, ends with the header of a block
+   of size zero that is never free and gets cut into blocks in between.
+   Each block starts with a memory_block_t. A free block also ends with
+   a copy of its size, its footer, so that the block following it can
+   find it. The low bits of the size say whether the block and the one
+   before it are free, which makes merging a freed block with its free
+   neighbours take constant time. No two free blocks are adjacent.
+
+   Free blocks are kept in doubly linked lists binned by the binary
+   logarithm of their size, with a bitmap of the bins that are not
+   empty. A request gets the first block large enough in its own bin,
+   or any block of the next bin that is not empty.
+
+   Each arena counts its blocks in use. An arena in which that count
+   drops to zero consists of a single free block and gets unmapped,
+   unless it is the only empty arena, which is kept so that a program
+   allocating and freeing one block at a time does not map and unmap
+   an arena each time.
+
+   The next field of memory_block_t must stay its last one: while a 
+   block is in use, it is set to NULL, which tells the block apart 
+   from the objects of a slab (see below).
+*/
+#define BLOCK_FREE ((size_t) 1)
+#define BLOCK_PREV_FREE ((size_t) 2)
+#define BLOCK_DIRECT ((size_t) 4)
+#define BLOCK_FLAGS ((size_t) 31)
+#define BLOCK_BINS (64)
+
+struct __memory_map_struct_t{
+	size_t size;
+	size_t used;
+	size_t padding[2];
+};
+typedef struct __memory_map_struct_t memory_map_t;
+
 struct __memory_block_struct_t{
 	size_t size;
-	void *mmap_start;
-	size_t mmap_size;
+	memory_map_t *map;
+	struct __memory_block_struct_t *prev;
 	struct __memory_block_struct_t *next;
 };
 typedef struct __memory_block_struct_t memory_block_t;
 
+#define BLOCK_SIZE(block) ((block)->size & ~BLOCK_FLAGS)
+#define BLOCK_MIN_SIZE (2 * sizeof(memory_block_t))
+
 /* Free Memory Blocks */ 
-static memory_block_t *__free_memory_blocks = NULL; 
-
-/* Get Memory Block */ 
-static memory_block_t *__get_memory_block(size_t rawsize){
-	size_t nmemb, size;
-	memory_block_t *curr, *prev, *new;
-	
-	if (rawsize == (size_t) 0) return NULL; 
-	
-	size = rawsize - (size_t) 1;
-	nmemb = size + sizeof(memory_block_t);
-	
-	if (nmemb < size) return NULL;
-	
-	nmemb /= sizeof(memory_block_t);
-	
-	if (!__try_size_t_multiply(&size, nmemb, sizeof(memory_block_t))) return NULL; 
-	
-	for (curr=__free_memory_blocks, prev=NULL; curr!=NULL; curr = (prev = curr)->next){
-		if (curr->size >= size){
-			if ((curr->size - size) < sizeof(memory_block_t)){
-				if (prev==NULL){
-					__free_memory_blocks = curr->next;
-				}else{ 
-					prev->next = curr->next;
-				}
-				return curr;
-			}else{
-				new = (memory_block_t*)((void*)curr+size);
-				new->size = curr->size - size;
-				new->mmap_start = curr->mmap_start;
-				new->mmap_size = curr->mmap_size;
-				new->next = curr->next;
-				
-				if (prev == NULL){
-					__free_memory_blocks = new;
-				}else{ 
-					prev->next = new;
-				}
-				
-				curr->size = size;
-				return curr; 
-			}
-		}
+static memory_block_t *__free_memory_blocks[BLOCK_BINS];
+static unsigned long __free_memory_bins = 0UL;
+static memory_map_t *__empty_memory_map = NULL;
+
+static int __memory_bin(size_t size){
+	return ((int) (8 * sizeof(unsigned long))) - 1 - __builtin_clzl((unsigned long) size);
+}
+
+static memory_block_t *__next_memory_block(memory_block_t *block){
+	return (memory_block_t *) (((void *) block) + BLOCK_SIZE(block));
+}
+
+/* Returns the free block preceding block, which is only valid if 
+   block has the BLOCK_PREV_FREE flag. */
+static memory_block_t *__prev_memory_block(memory_block_t *block){
+	return (memory_block_t *) (((void *) block) - *((size_t *) (((void *) block) - sizeof(size_t))));
+}
+
+/* Marks the block, whose neighbours are in use, free and puts it 
+   into its bin. */
+static void __insert_free_memory_block(memory_block_t *block){
+	size_t size;
+	int bin;
+	
+	size = BLOCK_SIZE(block);
+	block->size = size | BLOCK_FREE;
+	*((size_t *) (((void *) block) + size - sizeof(size_t))) = size;
+	__next_memory_block(block)->size |= BLOCK_PREV_FREE;
+	
+	bin = __memory_bin(size);
+	block->prev = NULL;
+	block->next = __free_memory_blocks[bin];
+	if (block->next != NULL) block->next->prev = block;
+	__free_memory_blocks[bin] = block;
+	__free_memory_bins |= 1UL << bin;
+}
+
+/* Takes the free block out of its bin. The block stays marked free. */
+static void __remove_free_memory_block(memory_block_t *block){
+	int bin;
+	
+	bin = __memory_bin(BLOCK_SIZE(block));
+	if (block->prev == NULL){
+		__free_memory_blocks[bin] = block->next;
+		if (block->next == NULL) __free_memory_bins &= ~(1UL << bin);
+	}else{
+		block->prev->next = block->next;
 	}
-	return NULL; 
-}
-
-/* Prune Memory Maps */ 
-static void __prune_memory_maps() {
-	memory_block_t *curr, *prev, *next;
-	
-	for (curr = __free_memory_blocks, prev = NULL; curr != NULL; curr = (prev = curr)-> next) {
-        	if ((curr->size == curr->mmap_size) && (curr->mmap_start == ((void *) curr))) {
-            		next = curr->next;
-            		if (munmap(curr->mmap_start, curr->mmap_size)==0) {
-                		if (prev == NULL) {
-                    			__free_memory_blocks = next;
-				} else {
-					prev->next = next;
-				}
+	if (block->next != NULL) block->next->prev = block->prev;
+}
+
+/* Returns the size of a block holding size bytes of content, or zero
+   on overflow. */
+static size_t __memory_block_size(size_t size){
+	size_t s;
+	
+	s = size + sizeof(memory_block_t);
+	if (s < size) return (size_t) 0;
+	if (!__round_up(&s, sizeof(memory_block_t))) return (size_t) 0;
+	if (s < BLOCK_MIN_SIZE) s = BLOCK_MIN_SIZE;
+	return s;
+}
+
+/* Cuts the block in use down to size bytes, a multiple of 
+   sizeof(memory_block_t), if what is left makes a block, and frees 
+   the rest. */
+static void __release_memory_block(memory_block_t *block);
+
+static void __split_memory_block(memory_block_t *block, size_t size){
+	memory_block_t *rest;
+	
+	if ((BLOCK_SIZE(block) - size) < BLOCK_MIN_SIZE) return;
+	
+	rest = (memory_block_t *) (((void *) block) + size);
+	rest->size = BLOCK_SIZE(block) - size;
+	rest->map = block->map;
+	block->size = size | (block->size & BLOCK_PREV_FREE);
+	block->map->used++;
+	__release_memory_block(rest);
+}
+
+/* Get Memory Block 
+
+   Returns a block of at least size bytes, a value returned by
+   __memory_block_size, in use, or NULL if no free block is large 
+   enough. */
+static memory_block_t *__get_memory_block(size_t size){
+	memory_block_t *curr;
+	unsigned long bins;
+	int bin;
+	
+	bin = __memory_bin(size);
+	for (curr=__free_memory_blocks[bin]; curr!=NULL; curr=curr->next){
+		if (BLOCK_SIZE(curr) >= size) break;
+	}
+	if (curr == NULL){
+		if (bin + 1 >= BLOCK_BINS) return NULL;
+		bins = __free_memory_bins & (~0UL << (bin + 1));
+		if (bins == 0UL) return NULL;
+		curr = __free_memory_blocks[__builtin_ctzl(bins)];
+	}
+	
+	__remove_free_memory_block(curr);
+	curr->size &= ~BLOCK_FREE;
+	__next_memory_block(curr)->size &= ~BLOCK_PREV_FREE;
+	if (curr->map == __empty_memory_map) __empty_memory_map = NULL;
+	curr->map->used++;
+	curr->next = NULL;
+	__split_memory_block(curr, size);
+	return curr;
+}
+
+/* Frees the block in use, merging it with its free neighbours, and 
+   unmaps its arena if it was the last block in use there. */
+static void __release_memory_block(memory_block_t *block){
+	memory_block_t *next, *prev;
+	memory_map_t *map;
+	size_t size;
+	
+	map = block->map;
+	size = BLOCK_SIZE(block);
+	next = __next_memory_block(block);
+	if (next->size & BLOCK_FREE){
+		__remove_free_memory_block(next);
+		size += BLOCK_SIZE(next);
+	}
+	if (block->size & BLOCK_PREV_FREE){
+		prev = __prev_memory_block(block);
+		__remove_free_memory_block(prev);
+		size += BLOCK_SIZE(prev);
+		block = prev;
+	}
+	block->size = size;
+	
+	map->used--;
+	if (map->used == (size_t) 0){
+		if (__empty_memory_map == NULL){
+			__empty_memory_map = map;
+		}else{
+			size = map->size;
+			if (munmap((void *) map, size) == 0){
+				__bytes_unmapped += size;
 				return;
 			}
 		}
 	}
+	__insert_free_memory_block(block);
 }
 
-/* Coalesce Memory Blocks */ 
-static void __coalesce_memory_blocks(memory_block_t *ptr, int prune){
-	memory_block_t *clobbered;
-	int did_coalesce;
+/* New Memory Map 
+
+   Maps an arena with a free block of at least size bytes.
+*/
+static void __new_memory_map(size_t size){
+	size_t s;
+	memory_map_t *map;
+	memory_block_t *block, *end;
 	
-	if (ptr == NULL || ptr->next == NULL){ 
-		if (prune) __prune_memory_maps();
-		return;
+	s = size + sizeof(memory_map_t) + sizeof(memory_block_t);
+	if (s < size) return;
+	if (s < (size_t) MEMORY_MAP_MIN_SIZE) s = (size_t) MEMORY_MAP_MIN_SIZE;
+	
+	map = (memory_map_t *) __map_memory(&s);
+	if (map == NULL) return;
+	map->size = s;
+	map->used = (size_t) 0;
+	
+	block = (memory_block_t *) (((void *) map) + sizeof(memory_map_t));
+	block->size = s - sizeof(memory_map_t) - sizeof(memory_block_t);
+	block->map = map;
+	end = __next_memory_block(block);
+	end->size = (size_t) 0;
+	end->map = map;
+	end->next = NULL;
+	__insert_free_memory_block(block);
+}
+
+/* Slabs
+
+   Requests of up to SLAB_MAX_SIZE bytes are served from slabs: blocks
+   of SLAB_SIZE bytes taken from the free memory blocks and cut into
+   objects of one size class each, the classes being SLAB_GRANULE 
+   bytes apart. Every class has a doubly linked list of the slabs that
+   still have free objects, which makes allocating and freeing an 
+   object take constant time. Objects are handed out from the slab's 
+   free list first, then from the part of the slab that has never 
+   been used.
+
+   Each object is preceded by a header of the size of two pointers,
+   the second of which points to its slab and thus overlays the next
+   field of the header of a block in use, which is NULL.
+
+   A slab that becomes empty is given back to the free memory blocks,
+   unless it is the only slab of its class with free objects.
+*/
+#define SLAB_SIZE (65536)
+#define SLAB_GRANULE (16)
+#define SLAB_MAX_SIZE (512)
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_GRANULE)
+
+struct __slab_object_struct_t{
+	struct __slab_object_struct_t *next;
+	struct __slab_struct_t *slab;
+};
+typedef struct __slab_object_struct_t slab_object_t;
+
+struct __slab_struct_t{
+	size_t class;
+	size_t used;
+	size_t capacity;
+	size_t unused;
+	slab_object_t *free_objects;
+	struct __slab_struct_t *prev;
+	struct __slab_struct_t *next;
+	size_t padding;
+};
+typedef struct __slab_struct_t slab_t;
+
+#define SLAB_OBJECT_SIZE(class) (((class) + (size_t) 1) * ((size_t) SLAB_GRANULE) + sizeof(slab_object_t))
+
+/* Slabs with free objects, by class */
+static slab_t *__partial_slabs[SLAB_CLASSES];
+
+/* Allocates a block of at least size bytes, size being non-zero, 
+   from the free memory blocks and returns a pointer to its content. */
+static void *__allocate_memory_block(size_t size){
+	size_t s;
+	memory_block_t *block;
+	
+	s = __memory_block_size(size);
+	if (s == (size_t) 0) return NULL;
+	
+	block = __get_memory_block(s);
+	if (block == NULL){
+		__new_memory_map(s);
+		block = __get_memory_block(s);
+		if (block == NULL) return NULL;
 	}
-		
-	did_coalesce = 0;
-	
-	if ((ptr->mmap_start == ptr->next->mmap_start) && ((void*) ptr) + ptr->size == (void*)(ptr->next)){
-		clobbered = ptr->next;
-		ptr->next = clobbered->next;
-		ptr->size += clobbered->size;
-		did_coalesce = 1;
+	return ((void *) block) + sizeof(memory_block_t);
+}
+
+/* Direct Memory Map 
+
+   Allocates a block of at least size bytes, size being non-zero, in
+   a memory map of its own and returns a pointer to its content. Such
+   a block is the only one to span a whole map while in use and gets
+   unmapped as soon as it is freed.
+*/
+static void *__allocate_direct_memory_map(size_t size){
+	size_t s;
+	memory_block_t *block;
+	
+	s = size + sizeof(memory_block_t);
+	if (s < size) return NULL;
+	
+	block = (memory_block_t *) __map_memory(&s);
+	if (block == NULL) return NULL;
+	
+	block->size = s | BLOCK_DIRECT;
+	block->map = NULL;
+	block->next = NULL;
+	return ((void *) block) + sizeof(memory_block_t);
+}
+
+static void __unlink_slab(slab_t *slab){
+	if (slab->prev == NULL){
+		__partial_slabs[slab->class] = slab->next;
+	}else{
+		slab->prev->next = slab->next;
 	}
+	if (slab->next != NULL) slab->next->prev = slab->prev;
+	slab->prev = NULL;
+	slab->next = NULL;
+}
+
+static void __link_slab(slab_t *slab){
+	slab->prev = NULL;
+	slab->next = __partial_slabs[slab->class];
+	if (slab->next != NULL) slab->next->prev = slab;
+	__partial_slabs[slab->class] = slab;
+}
+
+/* Returns an object of at least size bytes, size being non-zero and 
+   at most SLAB_MAX_SIZE. */
+static void *__slab_allocate(size_t size){
+	size_t class;
+	slab_t *slab;
+	slab_object_t *object;
 	
-	if (ptr->next == NULL){
-		if (did_coalesce && prune) __prune_memory_maps();
-		return;
+	class = (size - (size_t) 1) / ((size_t) SLAB_GRANULE);
+	slab = __partial_slabs[class];
+	if (slab == NULL){
+		slab = (slab_t *) __allocate_memory_block((size_t) SLAB_SIZE);
+		if (slab == NULL) return NULL;
+		slab->class = class;
+		slab->used = (size_t) 0;
+		slab->capacity = (((size_t) SLAB_SIZE) - sizeof(slab_t)) / SLAB_OBJECT_SIZE(class);
+		slab->unused = (size_t) 0;
+		slab->free_objects = NULL;
+		__link_slab(slab);
 	}
-		
-	if(ptr->next->next == NULL){
-		if (did_coalesce && prune) __prune_memory_maps();
-		return;
+	
+	if (slab->free_objects != NULL){
+		object = slab->free_objects;
+		slab->free_objects = object->next;
+	}else{
+		object = (slab_object_t *) (((void *) slab) + sizeof(slab_t) + slab->unused * SLAB_OBJECT_SIZE(class));
+		object->slab = slab;
+		slab->unused++;
 	}
-		
-	if ((ptr->next->mmap_start == ptr->next->next->mmap_start) && ((void*)(ptr->next) + ptr->next->size == (void*)(ptr->next->next))){
-		clobbered = ptr->next->next;
-		ptr->next->next= clobbered->next;
-		ptr->next->size += clobbered->size;
-		did_coalesce = 1;
+	slab->used++;
+	if (slab->used == slab->capacity) __unlink_slab(slab);
+	return ((void *) object) + sizeof(slab_object_t);
+}
+
+static void __free_memory_block(void *ptr);
+
+static void __slab_free(slab_object_t *object){
+	slab_t *slab;
+	
+	slab = object->slab;
+	if (slab->used == slab->capacity) __link_slab(slab);
+	object->next = slab->free_objects;
+	slab->free_objects = object;
+	slab->used--;
+	if ((slab->used == (size_t) 0) && 
+	    ((slab->prev != NULL) || (slab->next != NULL))){
+		__unlink_slab(slab);
+		__free_memory_block((void *) slab);
 	}
+}
+
+/* Returns the header of the slab object pointed to by ptr, or NULL if
+   ptr points to the content of a block. */
+static slab_object_t *__get_slab_object(void *ptr){
+	slab_object_t *object;
 	
-	if (did_coalesce && prune) __prune_memory_maps();
+	object = (slab_object_t *) (ptr - sizeof(slab_object_t));
+	if (object->slab == NULL) return NULL;
+	return object;
 }
 
-/* Add Free Memory Block */ 
-static void __add_free_memory_block(memory_block_t *ptr, int prune){
-	memory_block_t *curr, *prev;
+static void __free_memory_block(void *ptr){
+	memory_block_t *block;
+	size_t size;
 	
-	if (ptr == NULL) return;
-	for(curr = __free_memory_blocks, prev=NULL; curr!=NULL; curr=(prev=curr)->next){
-		if ((void *) ptr < (void *) curr) break;
-	}
-	if (prev == NULL) {
-		ptr -> next = __free_memory_blocks;
-		__free_memory_blocks = ptr;
-		__coalesce_memory_blocks(ptr, prune);
-	}else{
-		ptr -> next = curr;
-		prev -> next = ptr;
-		__coalesce_memory_blocks(ptr,prune);
+	block = (memory_block_t *) (ptr - sizeof(memory_block_t));
+	if (block->size & BLOCK_DIRECT){
+		size = BLOCK_SIZE(block);
+		if (munmap((void *) block, size) == 0) __bytes_unmapped += size;
+		return;
 	}
+	__release_memory_block(block);
 }
 
-/* New Memory Map */ 
-static void __new_memory_map(size_t rawsize){
-	size_t size, minnmemb, nmemb;
-	void *ptr;
-	memory_block_t *new;
+/* Grows the block in use to size bytes, a value returned by 
+   __memory_block_size, by taking memory from the block following it
+   if that one is free. Returns zero if it is not or too small. */
+static int __grow_memory_block(memory_block_t *block, size_t size){
+	memory_block_t *next;
+	size_t total;
 	
-	if (rawsize == ((size_t) 0)) return; 
+	next = __next_memory_block(block);
+	if (!(next->size & BLOCK_FREE)) return 0;
+	total = BLOCK_SIZE(block) + BLOCK_SIZE(next);
+	if (total < size) return 0;
 	
-	size = rawsize = ((size_t) 1);
-	nmemb = size + sizeof(memory_block_t);
+	__remove_free_memory_block(next);
+	block->size = total | (block->size & BLOCK_PREV_FREE);
+	__next_memory_block(block)->size &= ~BLOCK_PREV_FREE;
+	__split_memory_block(block, size);
+	return 1;
+}
+
+/* Resizes the block pointed to by ptr, which spans a whole map of its
+   own, with mremap, to hold size bytes of content. Returns a pointer
+   to the content of the block, which may have moved, or NULL if the
+   map cannot be resized, in which case the block is left alone. */
+static void *__remap_direct_memory_map(void *ptr, size_t size){
+	memory_block_t *block;
+	size_t s, old;
+	void *new;
 	
-	if (nmemb < size) return;
+	block = (memory_block_t *) (ptr - sizeof(memory_block_t));
+	s = size + sizeof(memory_block_t);
+	if (s < size) return NULL;
+	if ((__huge_pages != HUGE_PAGES_NONE) && (s >= (size_t) HUGE_PAGE_SIZE)){
+		if (!__round_up(&s, (size_t) HUGE_PAGE_SIZE)) return NULL;
+	}else{
+		if (!__round_up(&s, (size_t) PAGE_SIZE)) return NULL;
+	}
+	old = BLOCK_SIZE(block);
+	if (s == old) return ptr;
+	
+	new = mremap((void *) block, old, s, MREMAP_MAYMOVE);
+	if (new == MAP_FAILED) return NULL;
 	
-	nmemb /= sizeof(memory_block_t);
-	minnmemb = (MEMORY_MAP_MIN_SIZE / sizeof(memory_block_t));
+	if (s > old){
+		__bytes_mapped += s - old;
+	}else{
+		__bytes_unmapped += old - s;
+	}
+	block = (memory_block_t *) new;
+	block->size = s | BLOCK_DIRECT;
+	return new + sizeof(memory_block_t);
+}
+
+/* Tries to resize the allocation pointed to by ptr to size bytes, 
+   size being non-zero, without copying its content. Returns a 
+   pointer to the allocation on success and NULL otherwise. */
+static void *__resize_in_place(void *ptr, size_t size){
+	slab_object_t *object;
+	memory_block_t *block;
+	size_t s;
 	
-	if (nmemb < minnmemb) nmemb = minnmemb;
-	if (!__try_size_t_multiply(&size, nmemb, sizeof(memory_block_t))) return;
+	object = __get_slab_object(ptr);
+	if (object != NULL){
+		if (size <= (object->slab->class + (size_t) 1) * ((size_t) SLAB_GRANULE)) return ptr;
+		return NULL;
+	}
 	
-	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE| MAP_ANONYMOUS, -1, 0);
-	if (ptr == MAP_FAILED) return;
+	if (size <= (size_t) SLAB_MAX_SIZE) return NULL;
 	
-	new = (memory_block_t *) ptr;
-	new->size = size;
-	new->mmap_start = ptr;
-	new->mmap_size = size;
-	new->next = NULL; 
+	block = (memory_block_t *) (ptr - sizeof(memory_block_t));
+	if (block->size & BLOCK_DIRECT){
+		return __remap_direct_memory_map(ptr, size);
+	}
 	
-	__add_free_memory_block(new, 0);
+	s = __memory_block_size(size);
+	if (s == (size_t) 0) return NULL;
+	if (s <= BLOCK_SIZE(block)){
+		__split_memory_block(block, s);
+		return ptr;
+	}
+	if (__grow_memory_block(block, s)) return ptr;
+	return NULL;
 }
 
 /* End of your helper functions */
@@ -331,35 +888,20 @@ static void __new_memory_map(size_t rawsize){
 /* Start of the actual malloc/calloc/realloc/free functions */
 
 void __free_impl(void *);
+size_t __usable_size_impl(void *);
 
 /*The malloc() function allocates size bytes and returns a pointer
   to the allocated memory.  The memory is not initialized.  If size
   is 0, then malloc() returns either NULL, or a unique pointer
   value that can later be successfully passed to free().*/
 void *__malloc_impl(size_t size) {
-	size_t s;
-	void *ptr;
-	
 	if (size == (size_t) 0) return NULL; 
 	
-	s = size + sizeof(memory_block_t);
-	
-	if (s < size) return NULL; 
-	
-	ptr = (void*) __get_memory_block(s);
-	
-	if (ptr != NULL){
-		return (ptr + sizeof(memory_block_t));
-	}
+	if (size <= (size_t) SLAB_MAX_SIZE) return __slab_allocate(size);
 	
-	__new_memory_map(s);
-	ptr = (void*) __get_memory_block(s);
+	if (size >= (size_t) MEMORY_DIRECT_MAP_THRESHOLD) return __allocate_direct_memory_map(size);
 	
-	if (ptr != NULL){
-		return (ptr + sizeof(memory_block_t));
-	}
-		
-	return NULL;
+	return __allocate_memory_block(size);
 }
 
 /*The calloc() function allocates memory for an array of nmemb
@@ -375,6 +917,9 @@ void *__calloc_impl(size_t nmemb, size_t size) {
 	
 	if (!__try_size_t_multiply(&s, nmemb, size)) return NULL;
 	
+	/* A map of its own comes zero-filled from the kernel. */
+	if (s >= (size_t) MEMORY_DIRECT_MAP_THRESHOLD) return __allocate_direct_memory_map(s);
+	
 	ptr = __malloc_impl(s);
 	
 	if (ptr != NULL){
@@ -396,7 +941,6 @@ void *__calloc_impl(size_t nmemb, size_t size) {
   pointed to was moved, a free(ptr) is done.*/
 void *__realloc_impl(void *ptr, size_t size) {
   	void *new_ptr;
-	memory_block_t *old_mem_block;
 	size_t s;
 	
 	if (ptr == NULL) return __malloc_impl(size);
@@ -406,11 +950,15 @@ void *__realloc_impl(void *ptr, size_t size) {
 		return NULL;
 	}
 	
+	/* Shrink or grow in place or remap when possible, copy as a 
+	   last resort. */
+	new_ptr = __resize_in_place(ptr, size);
+	if (new_ptr != NULL) return new_ptr;
+	
 	new_ptr = __malloc_impl(size);
 	if (new_ptr == NULL) return NULL;
 	
-	old_mem_block = (memory_block_t*) (ptr - sizeof(memory_block_t));
-	s = old_mem_block->size;
+	s = __usable_size_impl(ptr);
 	
 	if (size < s) s = size;
 	
@@ -425,8 +973,64 @@ void *__realloc_impl(void *ptr, size_t size) {
   been called before, undefined behavior occurs.  If ptr is NULL,
   no operation is performed.*/
 void __free_impl(void *ptr) {
+	slab_object_t *object;
+	
 	if (ptr == NULL) return;
-	__add_free_memory_block((ptr-sizeof(memory_block_t)), 1);
+	
+	object = __get_slab_object(ptr);
+	if (object != NULL){
+		__slab_free(object);
+		return;
+	}
+	__free_memory_block(ptr);
+}
+
+/* Sets how memory maps of at least HUGE_PAGE_SIZE bytes get backed:
+   HUGE_PAGES_NONE (0) for normal pages, HUGE_PAGES_MADVISE (1) for 
+   transparent huge pages and HUGE_PAGES_HUGETLB (2) for pages of the
+   huge page pool. Applies to the maps created after the call. */
+void __set_huge_pages_impl(int mode) {
+	if ((mode < HUGE_PAGES_NONE) || (mode > HUGE_PAGES_HUGETLB)) return;
+	__huge_pages = mode;
+}
+
+/* Sets the variables pointed to by the arguments to the number of 
+   bytes mapped and unmapped so far, the number of free memory blocks,
+   the number of bytes they hold and the size of the largest one. */
+void __stats_impl(size_t *bytes_mapped, size_t *bytes_unmapped, size_t *free_blocks, size_t *free_bytes, size_t *largest_free_block) {
+	memory_block_t *curr;
+	int bin;
+	
+	*bytes_mapped = __bytes_mapped;
+	*bytes_unmapped = __bytes_unmapped;
+	*free_blocks = (size_t) 0;
+	*free_bytes = (size_t) 0;
+	*largest_free_block = (size_t) 0;
+	for (bin=0; bin<BLOCK_BINS; bin++){
+		for (curr=__free_memory_blocks[bin]; curr!=NULL; curr=curr->next){
+			(*free_blocks)++;
+			*free_bytes += BLOCK_SIZE(curr);
+			if (BLOCK_SIZE(curr) > *largest_free_block) *largest_free_block = BLOCK_SIZE(curr);
+		}
+	}
+}
+
+/* Returns the number of bytes usable in the block pointed to by
+   ptr, which must have been returned by __malloc_impl, __calloc_impl
+   or __realloc_impl and not been freed since. Only reads the block's
+   header or the size class of the object's slab, which do not change
+   while the block is in use, so this may be called without holding
+   the lock. */
+size_t __usable_size_impl(void *ptr) {
+	slab_object_t *object;
+	
+	if (ptr == NULL) return (size_t) 0;
+	
+	object = __get_slab_object(ptr);
+	if (object != NULL){
+		return (object->slab->class + (size_t) 1) * ((size_t) SLAB_GRANULE);
+	}
+	return BLOCK_SIZE((memory_block_t *) (ptr - sizeof(memory_block_t))) - sizeof(memory_block_t);
 }
 
 /* End of the actual malloc/calloc/realloc/free functions */
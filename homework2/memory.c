@@ -35,6 +35,9 @@
     but you don't need the debug messages, set MEMORY_DEBUG to no
     before starting the process.
 
+    Set MEMORY_HUGEPAGES to madvise or hugetlb to have large memory 
+    maps backed by huge pages.
+
     You do not need to change anything in this file. You don't need to
     understand this file but it may be a good learning exercise to
     understand it. Your actual implementation goes into the file
@@ -84,12 +87,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "memory_stats.h"
 
 
 void *__malloc_impl(size_t);
 void *__calloc_impl(size_t, size_t);
 void *__realloc_impl(void *, size_t);
 void __free_impl(void *);
+size_t __usable_size_impl(void *);
+void __set_huge_pages_impl(int);
+void __stats_impl(size_t *, size_t *, size_t *, size_t *, size_t *);
 
 static int __memory_print_debug_running = 0;
 static int __memory_print_debug_init_running = 0;
@@ -99,6 +108,116 @@ static int __memory_print_debug_do_it = 0;
 static pthread_mutex_t memory_management_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* MEMORY_HUGEPAGES=madvise backs large memory maps with transparent
+   huge pages, MEMORY_HUGEPAGES=hugetlb with pages of the huge page
+   pool, see __set_huge_pages_impl in implementation.c. */
+static pthread_once_t __memory_options_once = PTHREAD_ONCE_INIT;
+
+/* Statistics, see memory_stats.h */
+static int __memory_stats_at_exit_do_it = 0;
+static long __memory_stats_interval = 0L;
+static long __memory_stats_last_print = 0L;
+static size_t __memory_trace_interval = (size_t) 0;
+
+static void __memory_options_init() {
+  struct timespec now;
+  char *env_var;
+
+  env_var = getenv("MEMORY_HUGEPAGES");
+  if (env_var != NULL) {
+    if (!strcmp(env_var, "madvise")) {
+      __set_huge_pages_impl(1);
+    } else if (!strcmp(env_var, "hugetlb")) {
+      __set_huge_pages_impl(2);
+    }
+  }
+  env_var = getenv("MEMORY_STATS");
+  if ((env_var != NULL) && (!strcmp(env_var, "yes"))) {
+    __memory_stats_at_exit_do_it = 1;
+  }
+  env_var = getenv("MEMORY_STATS_INTERVAL");
+  if (env_var != NULL) {
+    __memory_stats_interval = strtol(env_var, NULL, 10);
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    __memory_stats_last_print = (long) now.tv_sec;
+  }
+  env_var = getenv("MEMORY_TRACE");
+  if (env_var != NULL) {
+    __memory_trace_interval = (size_t) strtoul(env_var, NULL, 10);
+  }
+}
+
+/* Per-thread caches
+
+   Each thread keeps the small blocks it frees on one list per size
+   class and hands them out again on malloc without taking
+   memory_management_lock. A class holds the blocks whose usable size
+   is at least its size, so any of them fits any request rounded up
+   to that size. An empty list gets refilled with a batch of blocks
+   under a single acquisition of the lock; a list that grows past its
+   limit gives half of its blocks back the same way. When a thread
+   exits, all its cached blocks are freed.
+
+   The link of a cached block is stored in the block itself.
+
+   The classes are the ones of the slabs of implementation.c. The 
+   lists are kept short on purpose: a slab cannot be given back while
+   one of its objects sits in a cache.
+
+*/
+#define MEMORY_CACHE_GRANULE     ((size_t) 16)
+#define MEMORY_CACHE_CLASSES     32
+#define MEMORY_CACHE_MAX_SIZE    (MEMORY_CACHE_GRANULE * ((size_t) MEMORY_CACHE_CLASSES))
+#define MEMORY_CACHE_BATCH       4
+#define MEMORY_CACHE_LIMIT       16
+
+struct __memory_cached_block_struct_t {
+  struct __memory_cached_block_struct_t *next;
+};
+typedef struct __memory_cached_block_struct_t memory_cached_block_t;
+
+/* Counters of a thread, only ever written by that thread. The stats
+   of all threads are linked together so that they can be summed up;
+   those of the threads that have exited get added to
+   __memory_stats_retired. */
+struct __memory_thread_stats_struct_t {
+  size_t                                calls[MEMORY_STATS_OPERATIONS][MEMORY_STATS_CLASSES];
+  size_t                                cache_hits;
+  size_t                                lock_acquisitions;
+  size_t                                lock_contentions;
+  size_t                                lock_wait_ns;
+  struct __memory_thread_stats_struct_t *prev;
+  struct __memory_thread_stats_struct_t *next;
+};
+typedef struct __memory_thread_stats_struct_t memory_thread_stats_t;
+
+struct __memory_thread_cache_struct_t {
+  int                   state;
+  int                   count[MEMORY_CACHE_CLASSES];
+  memory_cached_block_t *blocks[MEMORY_CACHE_CLASSES];
+  size_t                trace_countdown;
+  memory_thread_stats_t stats;
+};
+typedef struct __memory_thread_cache_struct_t memory_thread_cache_t;
+
+#define MEMORY_CACHE_UNUSED      0
+#define MEMORY_CACHE_ACTIVE      1
+#define MEMORY_CACHE_FLUSHED     2
+
+static __thread memory_thread_cache_t __memory_thread_cache;
+static pthread_key_t __memory_thread_cache_key;
+static pthread_once_t __memory_thread_cache_once = PTHREAD_ONCE_INIT;
+static int __memory_thread_cache_key_created = 0;
+
+static pthread_mutex_t __memory_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static memory_thread_stats_t *__memory_stats_threads = NULL;
+static memory_thread_stats_t __memory_stats_retired;
+
+#define MEMORY_TRACE_SITES       1024
+#define MEMORY_TRACE_PRINTED     16
+
+static memory_trace_site_t __memory_trace_sites[MEMORY_TRACE_SITES];
+
 static void __memory_print_debug_init() {
   char *env_var;
   
@@ -136,40 +255,429 @@ static void __memory_print_debug(const char *fmt, ...) {
   pthread_mutex_unlock(&print_lock);
 }
 
-void *malloc(size_t size) {
-  void *ptr;
+static inline void __memory_stats_add(size_t *counter, size_t n) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static int __memory_stats_class(size_t size) {
+  int class;
+
+  if (size == ((size_t) 0)) return 0;
+  class = ((int) (8 * sizeof(unsigned long))) - __builtin_clzl((unsigned long) size);
+  if (class >= MEMORY_STATS_CLASSES) class = MEMORY_STATS_CLASSES - 1;
+  return class;
+}
+
+static void __memory_stats_count(memory_thread_cache_t *cache, int operation, size_t size) {
+  if (cache == NULL) return;
+  __memory_stats_add(&(cache->stats.calls[operation][__memory_stats_class(size)]), (size_t) 1);
+}
+
+/* Takes memory_management_lock, measuring the time spent waiting for
+   it if it is held by another thread. */
+static void __memory_lock(memory_thread_cache_t *cache) {
+  struct timespec start, end;
+
+  if (pthread_mutex_trylock(&memory_management_lock) == 0) {
+    if (cache != NULL) __memory_stats_add(&(cache->stats.lock_acquisitions), (size_t) 1);
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_mutex_lock(&memory_management_lock);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (cache == NULL) return;
+  __memory_stats_add(&(cache->stats.lock_acquisitions), (size_t) 1);
+  __memory_stats_add(&(cache->stats.lock_contentions), (size_t) 1);
+  __memory_stats_add(&(cache->stats.lock_wait_ns),
+                     (size_t) ((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec)));
+}
+
+static void __memory_unlock() {
+  pthread_mutex_unlock(&memory_management_lock);
+}
+
+/* Records a sample of a call from site for size bytes in the table of
+   allocation sites, which is shared by all threads. Samples of new 
+   sites are dropped once the table is full. */
+static void __memory_trace_record(void *site, size_t size) {
+  size_t i, j;
+  void *expected;
+
+  i = (((size_t) site) >> 4) % MEMORY_TRACE_SITES;
+  for (j=0;j<MEMORY_TRACE_SITES;j++,i=(i+1)%MEMORY_TRACE_SITES) {
+    expected = __atomic_load_n(&(__memory_trace_sites[i].site), __ATOMIC_ACQUIRE);
+    if (expected == NULL) {
+      if (!__atomic_compare_exchange_n(&(__memory_trace_sites[i].site), &expected, site, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        if (expected != site) continue;
+      }
+    } else if (expected != site) {
+      continue;
+    }
+    __atomic_fetch_add(&(__memory_trace_sites[i].samples), (size_t) 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(__memory_trace_sites[i].bytes), size, __ATOMIC_RELAXED);
+    return;
+  }
+}
+
+static void __memory_trace(memory_thread_cache_t *cache, void *site, size_t size) {
+  if ((__memory_trace_interval == ((size_t) 0)) || (cache == NULL)) return;
+  if (cache->trace_countdown > ((size_t) 1)) {
+    cache->trace_countdown--;
+    return;
+  }
+  cache->trace_countdown = __memory_trace_interval;
+  __memory_trace_record(site, size);
+}
+
+static void __memory_stats_sum(memory_thread_stats_t *sum, memory_thread_stats_t *stats) {
+  int o, c;
+
+  for (o=0;o<MEMORY_STATS_OPERATIONS;o++) {
+    for (c=0;c<MEMORY_STATS_CLASSES;c++) {
+      sum->calls[o][c] += __atomic_load_n(&(stats->calls[o][c]), __ATOMIC_RELAXED);
+    }
+  }
+  sum->cache_hits += __atomic_load_n(&(stats->cache_hits), __ATOMIC_RELAXED);
+  sum->lock_acquisitions += __atomic_load_n(&(stats->lock_acquisitions), __ATOMIC_RELAXED);
+  sum->lock_contentions += __atomic_load_n(&(stats->lock_contentions), __ATOMIC_RELAXED);
+  sum->lock_wait_ns += __atomic_load_n(&(stats->lock_wait_ns), __ATOMIC_RELAXED);
+}
+
+static void __memory_stats_register(memory_thread_cache_t *cache) {
+  pthread_mutex_lock(&__memory_stats_lock);
+  cache->stats.prev = NULL;
+  cache->stats.next = __memory_stats_threads;
+  if (cache->stats.next != NULL) cache->stats.next->prev = &(cache->stats);
+  __memory_stats_threads = &(cache->stats);
+  pthread_mutex_unlock(&__memory_stats_lock);
+}
+
+static void __memory_stats_retire(memory_thread_cache_t *cache) {
+  pthread_mutex_lock(&__memory_stats_lock);
+  __memory_stats_sum(&__memory_stats_retired, &(cache->stats));
+  if (cache->stats.prev == NULL) {
+    __memory_stats_threads = cache->stats.next;
+  } else {
+    cache->stats.prev->next = cache->stats.next;
+  }
+  if (cache->stats.next != NULL) cache->stats.next->prev = cache->stats.prev;
+  pthread_mutex_unlock(&__memory_stats_lock);
+}
+
+static void __memory_thread_cache_flush(memory_thread_cache_t *cache, int class, int keep) {
+  memory_cached_block_t *curr, *next;
+
+  __memory_lock(cache);
+  for (curr=cache->blocks[class]; cache->count[class] > keep; curr=next) {
+    next = curr->next;
+    __free_impl((void *) curr);
+    cache->count[class]--;
+  }
+  __memory_unlock();
+  cache->blocks[class] = curr;
+}
+
+static void __memory_thread_cache_destroy(void *data) {
+  memory_thread_cache_t *cache;
+  int class;
+
+  cache = (memory_thread_cache_t *) data;
+  for (class=0;class<MEMORY_CACHE_CLASSES;class++) {
+    if (cache->count[class] > 0) {
+      __memory_thread_cache_flush(cache, class, 0);
+    }
+  }
+  cache->state = MEMORY_CACHE_FLUSHED;
+  __memory_stats_retire(cache);
+}
+
+static void __memory_thread_cache_init_key() {
+  if (pthread_key_create(&__memory_thread_cache_key, __memory_thread_cache_destroy) == 0) {
+    __memory_thread_cache_key_created = 1;
+  }
+}
+
+/* Returns the cache of the calling thread or NULL if it cannot be
+   used, which is the case while the thread is exiting. The calls of
+   a thread without a cache do not get counted. */
+static memory_thread_cache_t *__memory_thread_cache_get() {
+  memory_thread_cache_t *cache;
+
+  cache = &__memory_thread_cache;
+  if (cache->state == MEMORY_CACHE_ACTIVE) return cache;
+  if (cache->state == MEMORY_CACHE_FLUSHED) return NULL;
+  pthread_once(&__memory_thread_cache_once, __memory_thread_cache_init_key);
+  if (!__memory_thread_cache_key_created) return NULL;
+  if (pthread_setspecific(__memory_thread_cache_key, cache) != 0) return NULL;
+  __memory_stats_register(cache);
+  cache->state = MEMORY_CACHE_ACTIVE;
+  return cache;
+}
+
+/* Returns a block of at least size bytes, size being at most
+   MEMORY_CACHE_MAX_SIZE, from the cache. */
+static void *__memory_thread_cache_malloc(memory_thread_cache_t *cache, size_t size) {
+  memory_cached_block_t *block;
+  void *ptrs[MEMORY_CACHE_BATCH];
+  int class, i, n;
+
+  if (cache == NULL) return NULL;
+  class = (int) ((size + (MEMORY_CACHE_GRANULE - ((size_t) 1))) / MEMORY_CACHE_GRANULE) - 1;
+  if (cache->blocks[class] == NULL) {
+    __memory_lock(cache);
+    for (n=0;n<MEMORY_CACHE_BATCH;n++) {
+      ptrs[n] = __malloc_impl(((size_t) (class + 1)) * MEMORY_CACHE_GRANULE);
+      if (ptrs[n] == NULL) break;
+    }
+    __memory_unlock();
+    if (n == 0) return NULL;
+    for (i=n-1;i>=0;i--) {
+      block = (memory_cached_block_t *) ptrs[i];
+      block->next = cache->blocks[class];
+      cache->blocks[class] = block;
+    }
+    cache->count[class] = n;
+  } else {
+    __memory_stats_add(&(cache->stats.cache_hits), (size_t) 1);
+  }
+  block = cache->blocks[class];
+  cache->blocks[class] = block->next;
+  cache->count[class]--;
+  return (void *) block;
+}
+
+/* Puts the block pointed to by ptr, of size usable bytes, into the
+   cache. Returns zero if the block is too large to be cached. */
+static int __memory_thread_cache_free(memory_thread_cache_t *cache, void *ptr, size_t size) {
+  memory_cached_block_t *block;
+  int class;
+
+  if ((size < MEMORY_CACHE_GRANULE) || (size > MEMORY_CACHE_MAX_SIZE)) return 0;
+  if (cache == NULL) return 0;
+  class = (int) (size / MEMORY_CACHE_GRANULE) - 1;
+  block = (memory_cached_block_t *) ptr;
+  block->next = cache->blocks[class];
+  cache->blocks[class] = block;
+  cache->count[class]++;
+  if (cache->count[class] > MEMORY_CACHE_LIMIT) {
+    __memory_thread_cache_flush(cache, class, MEMORY_CACHE_LIMIT / 2);
+  } else {
+    __memory_stats_add(&(cache->stats.cache_hits), (size_t) 1);
+  }
+  return 1;
+}
+
+void memory_get_stats(memory_stats_t *stats) {
+  memory_thread_stats_t sum;
+  memory_thread_stats_t *curr;
+  int o, c;
+
+  memset(&sum, 0, sizeof(sum));
+  pthread_mutex_lock(&__memory_stats_lock);
+  __memory_stats_sum(&sum, &__memory_stats_retired);
+  for (curr=__memory_stats_threads; curr!=NULL; curr=curr->next) {
+    __memory_stats_sum(&sum, curr);
+  }
+  pthread_mutex_unlock(&__memory_stats_lock);
+
+  memset(stats, 0, sizeof(memory_stats_t));
+  for (o=0;o<MEMORY_STATS_OPERATIONS;o++) {
+    for (c=0;c<MEMORY_STATS_CLASSES;c++) {
+      stats->calls[o][c] = sum.calls[o][c];
+    }
+  }
+  stats->cache_hits = sum.cache_hits;
+  stats->lock_acquisitions = sum.lock_acquisitions;
+  stats->lock_contentions = sum.lock_contentions;
+  stats->lock_wait_ns = sum.lock_wait_ns;
 
   pthread_mutex_lock(&memory_management_lock);
-  ptr = __malloc_impl(size);
+  __stats_impl(&(stats->bytes_mapped), &(stats->bytes_unmapped), &(stats->free_blocks),
+               &(stats->free_bytes), &(stats->largest_free_block));
   pthread_mutex_unlock(&memory_management_lock);
+}
+
+size_t memory_get_trace(memory_trace_site_t *sites, size_t n) {
+  size_t i, j, k, best;
+  memory_trace_site_t site;
+
+  /* Selects the most sampled sites one at a time, as the table must
+     not be sorted in place while other threads update it. */
+  for (k=0;k<n;k++) {
+    best = (size_t) 0;
+    site.site = NULL;
+    for (i=0;i<MEMORY_TRACE_SITES;i++) {
+      if (__atomic_load_n(&(__memory_trace_sites[i].site), __ATOMIC_ACQUIRE) == NULL) continue;
+      for (j=0;j<k;j++) {
+        if (sites[j].site == __memory_trace_sites[i].site) break;
+      }
+      if (j < k) continue;
+      if (__atomic_load_n(&(__memory_trace_sites[i].samples), __ATOMIC_RELAXED) > best) {
+        site.site = __memory_trace_sites[i].site;
+        site.samples = __atomic_load_n(&(__memory_trace_sites[i].samples), __ATOMIC_RELAXED);
+        site.bytes = __atomic_load_n(&(__memory_trace_sites[i].bytes), __ATOMIC_RELAXED);
+        best = site.samples;
+      }
+    }
+    if (site.site == NULL) break;
+    sites[k] = site;
+  }
+  return k;
+}
+
+/* Writes the formatted text to fd, without allocating any memory. */
+static void __memory_stats_printf(int fd, const char *fmt, ...) {
+  char buf[256];
+  va_list valist;
+  int len;
+
+  va_start(valist, fmt);
+  len = vsnprintf(buf, sizeof(buf), fmt, valist);
+  va_end(valist);
+  if (len <= 0) return;
+  if (len >= ((int) sizeof(buf))) len = ((int) sizeof(buf)) - 1;
+  if (write(fd, buf, (size_t) len) < 0) return;
+}
+
+void memory_print_stats(int fd) {
+  memory_stats_t stats;
+  memory_trace_site_t sites[MEMORY_TRACE_PRINTED];
+  size_t i, n;
+  int c;
+
+  memory_get_stats(&stats);
+  __memory_stats_printf(fd, "memory.so statistics of process %d\n", (int) getpid());
+  __memory_stats_printf(fd, "  %-12s %14s %14s %14s %14s\n", "size", "malloc", "calloc", "realloc", "free");
+  for (c=0;c<MEMORY_STATS_CLASSES;c++) {
+    if ((stats.calls[MEMORY_STATS_MALLOC][c] | stats.calls[MEMORY_STATS_CALLOC][c] |
+         stats.calls[MEMORY_STATS_REALLOC][c] | stats.calls[MEMORY_STATS_FREE][c]) == ((size_t) 0)) continue;
+    if (c == 0) {
+      __memory_stats_printf(fd, "  %-12s", "0");
+    } else if (c == MEMORY_STATS_CLASSES - 1) {
+      __memory_stats_printf(fd, "  >= 2^%-6d", c - 1);
+    } else {
+      __memory_stats_printf(fd, "  < 2^%-7d", c);
+    }
+    __memory_stats_printf(fd, " %14zu %14zu %14zu %14zu\n",
+                          stats.calls[MEMORY_STATS_MALLOC][c], stats.calls[MEMORY_STATS_CALLOC][c],
+                          stats.calls[MEMORY_STATS_REALLOC][c], stats.calls[MEMORY_STATS_FREE][c]);
+  }
+  __memory_stats_printf(fd, "  thread cache hits %zu\n", stats.cache_hits);
+  __memory_stats_printf(fd, "  lock acquisitions %zu, contended %zu, waited %.3f ms\n",
+                        stats.lock_acquisitions, stats.lock_contentions, ((double) stats.lock_wait_ns) / 1e6);
+  __memory_stats_printf(fd, "  bytes mapped %zu, unmapped %zu, in use %zu\n",
+                        stats.bytes_mapped, stats.bytes_unmapped, stats.bytes_mapped - stats.bytes_unmapped);
+  __memory_stats_printf(fd, "  free blocks %zu, %zu bytes, largest %zu, fragmentation %.3f\n",
+                        stats.free_blocks, stats.free_bytes, stats.largest_free_block,
+                        (stats.free_bytes == ((size_t) 0)) ? 0.0 :
+                        1.0 - ((double) stats.largest_free_block) / ((double) stats.free_bytes));
+  n = memory_get_trace(sites, MEMORY_TRACE_PRINTED);
+  for (i=0;i<n;i++) {
+    __memory_stats_printf(fd, "  site %p: %zu samples, %zu bytes\n", sites[i].site, sites[i].samples, sites[i].bytes);
+  }
+}
+
+/* Prints the statistics if MEMORY_STATS_INTERVAL seconds have passed
+   since they were last printed. Only gets called after the lock has
+   been taken, so that threads served by their caches never get here. */
+static void __memory_stats_tick() {
+  struct timespec now;
+  long last;
+
+  if (__memory_stats_interval <= 0L) return;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  last = __atomic_load_n(&__memory_stats_last_print, __ATOMIC_RELAXED);
+  if (((long) now.tv_sec) - last < __memory_stats_interval) return;
+  if (!__atomic_compare_exchange_n(&__memory_stats_last_print, &last, (long) now.tv_sec, 0,
+                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return;
+  memory_print_stats(2);
+}
+
+__attribute__((destructor))
+static void __memory_stats_at_exit() {
+  if (__memory_stats_at_exit_do_it) memory_print_stats(2);
+}
+
+void *malloc(size_t size) {
+  memory_thread_cache_t *cache;
+  void *ptr;
+
+  pthread_once(&__memory_options_once, __memory_options_init);
+  cache = __memory_thread_cache_get();
+  __memory_stats_count(cache, MEMORY_STATS_MALLOC, size);
+  __memory_trace(cache, __builtin_return_address(0), size);
+  ptr = NULL;
+  if ((size > ((size_t) 0)) && (size <= MEMORY_CACHE_MAX_SIZE)) {
+    ptr = __memory_thread_cache_malloc(cache, size);
+  }
+  if (ptr == NULL) {
+    __memory_lock(cache);
+    ptr = __malloc_impl(size);
+    __memory_unlock();
+    __memory_stats_tick();
+  }
   __memory_print_debug("malloc(0x%zx) = %p\n", size, ptr);
   return ptr;
 }
 
 void *calloc(size_t nmemb, size_t size) {
+  memory_thread_cache_t *cache;
   void *ptr;
 
-  pthread_mutex_lock(&memory_management_lock);
-  ptr = __calloc_impl(nmemb, size);
-  pthread_mutex_unlock(&memory_management_lock);
+  pthread_once(&__memory_options_once, __memory_options_init);
+  cache = __memory_thread_cache_get();
+  __memory_stats_count(cache, MEMORY_STATS_CALLOC,
+                       ((nmemb == ((size_t) 0)) || (size <= ((size_t) -1) / nmemb)) ? nmemb * size : ((size_t) -1));
+  __memory_trace(cache, __builtin_return_address(0),
+                 ((nmemb == ((size_t) 0)) || (size <= ((size_t) -1) / nmemb)) ? nmemb * size : ((size_t) 0));
+  ptr = NULL;
+  if ((nmemb > ((size_t) 0)) && (size > ((size_t) 0)) &&
+      (size <= MEMORY_CACHE_MAX_SIZE / nmemb)) {
+    ptr = __memory_thread_cache_malloc(cache, nmemb * size);
+    if (ptr != NULL) {
+      memset(ptr, 0, nmemb * size);
+    }
+  }
+  if (ptr == NULL) {
+    __memory_lock(cache);
+    ptr = __calloc_impl(nmemb, size);
+    __memory_unlock();
+    __memory_stats_tick();
+  }
   __memory_print_debug("calloc(0x%zx, 0x%zx) = %p\n", nmemb, size, ptr);
   return ptr;
 }
 
 void *realloc(void *old_ptr, size_t size) {
+  memory_thread_cache_t *cache;
   void *ptr;
 
-  pthread_mutex_lock(&memory_management_lock);
+  pthread_once(&__memory_options_once, __memory_options_init);
+  cache = __memory_thread_cache_get();
+  __memory_stats_count(cache, MEMORY_STATS_REALLOC, size);
+  __memory_trace(cache, __builtin_return_address(0), size);
+  __memory_lock(cache);
   ptr = __realloc_impl(old_ptr, size);
-  pthread_mutex_unlock(&memory_management_lock);
+  __memory_unlock();
+  __memory_stats_tick();
   __memory_print_debug("realloc(%p, 0x%zx) = %p\n", old_ptr, size, ptr);
   return ptr;
 }
 
 void free(void *ptr) {
-  pthread_mutex_lock(&memory_management_lock);
+  memory_thread_cache_t *cache;
+  size_t size;
+
+  cache = __memory_thread_cache_get();
+  size = __usable_size_impl(ptr);
+  __memory_stats_count(cache, MEMORY_STATS_FREE, size);
+  if ((ptr != NULL) && __memory_thread_cache_free(cache, ptr, size)) {
+    __memory_print_debug("free(%p)\n", ptr);
+    return;
+  }
+  __memory_lock(cache);
   __free_impl(ptr);
-  pthread_mutex_unlock(&memory_management_lock);
+  __memory_unlock();
   __memory_print_debug("free(%p)\n", ptr);
 }
-
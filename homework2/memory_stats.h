@@ -0,0 +1,70 @@
+/*
+
+    Statistics of the memory management functions of memory.so
+
+    Every thread counts its own calls, without any synchronization, so
+    keeping the statistics costs a few stores per call. memory_get_stats
+    sums up the counters of all threads, including the ones that have
+    exited, and adds the state of the free memory blocks.
+
+    The statistics can also be printed to stderr, by setting these
+    environment variables before starting the process:
+
+    MEMORY_STATS=yes           at exit
+    MEMORY_STATS_INTERVAL=n    every n seconds, at most, while the
+                               process allocates memory
+    MEMORY_TRACE=n             samples one in n calls to malloc, calloc
+                               and realloc of each thread and records
+                               the address they are called from
+
+*/
+
+#ifndef MEMORY_STATS_H
+#define MEMORY_STATS_H
+
+#include <stddef.h>
+
+#define MEMORY_STATS_MALLOC      0
+#define MEMORY_STATS_CALLOC      1
+#define MEMORY_STATS_REALLOC     2
+#define MEMORY_STATS_FREE        3
+#define MEMORY_STATS_OPERATIONS  4
+
+/* Calls get counted by the size requested, or the size of the block
+   freed: class 0 holds the size 0, class k > 0 the sizes from
+   2^(k-1) to 2^k - 1 and the last class everything bigger. */
+#define MEMORY_STATS_CLASSES     32
+
+struct memory_stats_struct_t {
+  size_t calls[MEMORY_STATS_OPERATIONS][MEMORY_STATS_CLASSES];
+  size_t cache_hits;          /* calls served by a thread cache */
+  size_t lock_acquisitions;
+  size_t lock_contentions;    /* acquisitions that had to wait */
+  size_t lock_wait_ns;
+  size_t bytes_mapped;
+  size_t bytes_unmapped;
+  size_t free_blocks;         /* number of free blocks */
+  size_t free_bytes;
+  size_t largest_free_block;
+};
+typedef struct memory_stats_struct_t memory_stats_t;
+
+struct memory_trace_site_struct_t {
+  void   *site;
+  size_t samples;
+  size_t bytes;
+};
+typedef struct memory_trace_site_struct_t memory_trace_site_t;
+
+/* Fills in the structure pointed to by stats. */
+void memory_get_stats(memory_stats_t *stats);
+
+/* Prints the statistics and the most sampled allocation sites to the
+   file descriptor fd. */
+void memory_print_stats(int fd);
+
+/* Copies up to n of the sampled allocation sites, the most sampled
+   first, to the array pointed to by sites and returns their number. */
+size_t memory_get_trace(memory_trace_site_t *sites, size_t n);
+
+#endif
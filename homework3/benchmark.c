@@ -0,0 +1,611 @@
+/*
+
+  Benchmark of the MyFS implementations
+
+  Runs the __myfs_*_implem functions directly on an anonymous memory
+  map, without FUSE, so that every implementation of the interface
+  can be measured on the same workloads. Build it once per
+  implementation:
+
+  gcc -O2 -Wall benchmark.c implementation.c -o benchmark
+  gcc -O2 -Wall benchmark.c ../rob/OS_HW3-main/implementation.c -o benchmark-rob
+
+  and run
+
+  ./benchmark [--size=<s>] [--scale=<n>] [--seed=<n>] [--timeout=<s>]
+              [workload ...]
+
+  Every workload runs in a child process on a fresh filesystem, so a
+  crash or a hang (longer than timeout seconds, 120 by default) of one
+  workload is reported and the others still run. The random choices
+  only depend on the seed, so two runs with the same seed do the same
+  operations on any implementation.
+
+  For every kind of operation, the number of operations, the
+  operations per second and the 50th, 90th, 99th percentile and
+  maximum latency in microseconds get printed, together with the
+  number of operations that failed or read back something else than
+  what had been written. Once a workload is done, the space the files
+  take (live), the space statfs reports as used and free and the
+  largest file that can still be created show how much memory the
+  implementation wastes and how fragmented the free memory is.
+
+*/
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Declaration for the implementations of the operations */
+
+int __myfs_getattr_implem(void *, size_t, int *, uid_t, gid_t, const char *, struct stat *);
+int __myfs_readdir_implem(void *, size_t, int *, const char *, char ***);
+int __myfs_mknod_implem(void *, size_t, int *, const char *);
+int __myfs_unlink_implem(void *, size_t, int *, const char *);
+int __myfs_mkdir_implem(void *, size_t, int *, const char *);
+int __myfs_truncate_implem(void *, size_t, int *, const char *, off_t);
+int __myfs_read_implem(void *, size_t, int *, const char *, char *, size_t, off_t);
+int __myfs_write_implem(void *, size_t, int *, const char *, const char *, size_t, off_t);
+int __myfs_statfs_implem(void *, size_t, int *, struct statvfs *);
+
+/* End of declarations */
+
+#define BENCH_DEFAULT_SIZE     ((size_t) (64 << 20)) /* 64MB */
+#define BENCH_MIN_SIZE         ((size_t) (1 << 20))  /* 1MB */
+#define BENCH_DEFAULT_TIMEOUT  (120)
+#define BENCH_CHUNK            ((size_t) 4096)
+#define BENCH_DEPTH            (64)
+#define BENCH_TRUNCATE_FILES   (64)
+#define BENCH_TRUNCATE_MAX     ((size_t) (64 << 10)) /* 64kB */
+#define BENCH_PROBE_STEP       ((size_t) (64 << 10)) /* 64kB */
+
+struct __bench_struct_t {
+  void     *memory;
+  size_t   size;
+  size_t   scale;
+  uint64_t rng;
+  size_t   live;    /* bytes the files of the workload hold */
+};
+typedef struct __bench_struct_t bench_t;
+
+struct __bench_stats_struct_t {
+  const char *name;
+  size_t     ops;
+  size_t     capacity;
+  size_t     errors;
+  uint64_t   *latencies;
+};
+typedef struct __bench_stats_struct_t bench_stats_t;
+
+struct __bench_workload_struct_t {
+  const char *name;
+  void       (*run)(bench_t *);
+};
+typedef struct __bench_workload_struct_t bench_workload_t;
+
+/* xorshift64*, so that the workloads only depend on the seed */
+static uint64_t __bench_random(bench_t *b) {
+  b->rng ^= b->rng >> 12;
+  b->rng ^= b->rng << 25;
+  b->rng ^= b->rng >> 27;
+  return b->rng * ((uint64_t) 2685821657736338717ull);
+}
+
+static uint64_t __bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec) * ((uint64_t) 1000000000) + ((uint64_t) ts.tv_nsec);
+}
+
+static int __bench_parse_size(size_t *size, const char *str) {
+  unsigned long long int tmp;
+  char *end;
+
+  if (*str == '\0') return 0;
+  tmp = strtoull(str, &end, 0);
+  if (*end != '\0') return 0;
+  if (((unsigned long long int) ((size_t) tmp)) != tmp) return 0;
+  *size = (size_t) tmp;
+  return 1;
+}
+
+static void __bench_stats_init(bench_stats_t *stats, const char *name, size_t capacity) {
+  stats->name = name;
+  stats->ops = (size_t) 0;
+  stats->capacity = capacity;
+  stats->errors = (size_t) 0;
+  stats->latencies = (uint64_t *) malloc(capacity * sizeof(uint64_t));
+  if (stats->latencies == NULL) {
+    perror("Cannot allocate latencies");
+    exit(1);
+  }
+}
+
+/* Records an operation that started at start */
+static void __bench_record(bench_stats_t *stats, uint64_t start, int failed) {
+  uint64_t end;
+
+  end = __bench_now();
+  if (stats->ops < stats->capacity) {
+    stats->latencies[stats->ops++] = end - start;
+  }
+  if (failed) stats->errors++;
+}
+
+static int __bench_compare(const void *a, const void *b) {
+  uint64_t x = *((const uint64_t *) a);
+  uint64_t y = *((const uint64_t *) b);
+
+  return (x > y) - (x < y);
+}
+
+static double __bench_percentile(const bench_stats_t *stats, double p) {
+  size_t i;
+
+  i = (size_t) (p * ((double) (stats->ops - ((size_t) 1))));
+  return ((double) stats->latencies[i]) / 1000.0;
+}
+
+/* Prints a line of the table and frees the latencies */
+static void __bench_stats_print(bench_stats_t *stats) {
+  uint64_t total;
+  size_t i;
+
+  if (stats->ops == (size_t) 0) {
+    printf("  %-14s %9s\n", stats->name, "0");
+  } else {
+    total = (uint64_t) 0;
+    for (i = 0; i < stats->ops; i++) total += stats->latencies[i];
+    qsort(stats->latencies, stats->ops, sizeof(uint64_t), __bench_compare);
+    printf("  %-14s %9zu %12.0f %9.2f %9.2f %9.2f %10.2f %7zu\n",
+           stats->name, stats->ops,
+           ((double) stats->ops) * 1e9 / ((double) (total ? total : 1)),
+           __bench_percentile(stats, 0.5),
+           __bench_percentile(stats, 0.9),
+           __bench_percentile(stats, 0.99),
+           ((double) stats->latencies[stats->ops - ((size_t) 1)]) / 1000.0,
+           stats->errors);
+  }
+  free(stats->latencies);
+}
+
+/* Fills buf with bytes that are never 0 */
+static void __bench_fill(bench_t *b, char *buf, size_t size) {
+  size_t i;
+
+  for (i = 0; i < size; i++) {
+    buf[i] = (char) ('a' + (__bench_random(b) % ((uint64_t) 26)));
+  }
+}
+
+/* Puts the free bytes statfs reports into *free_bytes. Returns 0, or
+   the error of statfs. */
+static int __bench_free_bytes(bench_t *b, size_t *free_bytes) {
+  struct statvfs st;
+  int e;
+
+  *free_bytes = (size_t) 0;
+  memset(&st, 0, sizeof(st));
+  if (__myfs_statfs_implem(b->memory, b->size, &e, &st) < 0) return e;
+  *free_bytes = ((size_t) st.f_bfree) * ((size_t) st.f_bsize);
+  return 0;
+}
+
+/* Tells if extending /probe with truncate leaves a hole, which takes
+   no memory: then statfs reports about as much free memory with a file
+   of half the free memory as without it. Only statfs figures that fit
+   into the filesystem are trusted; otherwise truncate is taken to 
+   allocate, so that nothing gets written into the file. */
+static int __bench_truncate_sparse(bench_t *b, size_t free_bytes) {
+  size_t len, after;
+  int e, sparse;
+
+  len = free_bytes / ((size_t) 2);
+  if ((free_bytes > b->size) || (len < BENCH_PROBE_STEP)) return 0;
+  if (__myfs_truncate_implem(b->memory, b->size, &e, "/probe", (off_t) len) < 0) return 0;
+  sparse = ((__bench_free_bytes(b, &after) == 0) && (after <= b->size) &&
+            (after + len / ((size_t) 2) > free_bytes));
+  __myfs_truncate_implem(b->memory, b->size, &e, "/probe", (off_t) 0);
+  return sparse;
+}
+
+/* Prints how the filesystem uses its memory */
+static void __bench_space(bench_t *b) {
+  struct stat sb;
+  size_t raw_free, free_bytes, lo, hi, mid;
+  char *zeros;
+  int e, fits;
+
+  e = __bench_free_bytes(b, &raw_free);
+  if (e != 0) {
+    printf("  space: statfs failed: %s\n", strerror(e));
+    return;
+  }
+  free_bytes = (raw_free > b->size) ? b->size : raw_free;
+
+  /* Find the largest file that can be created, up to BENCH_PROBE_STEP,
+     by extending it with truncate. Where that leaves a hole, the file
+     gets written with zeros instead. */
+  lo = (size_t) 0;
+  hi = free_bytes + BENCH_PROBE_STEP;
+  zeros = NULL;
+  if ((__myfs_getattr_implem(b->memory, b->size, &e, 0, 0, "/probe", &sb) == 0) ||
+      (__myfs_mknod_implem(b->memory, b->size, &e, "/probe") == 0)) {
+    if (__bench_truncate_sparse(b, raw_free)) {
+      zeros = (char *) calloc(hi, (size_t) 1);
+      if (zeros == NULL) hi = lo;
+    }
+    while (hi - lo > BENCH_PROBE_STEP) {
+      mid = lo + (hi - lo) / ((size_t) 2);
+      if (zeros != NULL) {
+        fits = (__myfs_write_implem(b->memory, b->size, &e, "/probe", zeros, mid, (off_t) 0) == (int) mid);
+      } else {
+        fits = (__myfs_truncate_implem(b->memory, b->size, &e, "/probe", (off_t) mid) == 0);
+      }
+      if (fits) {
+        lo = mid;
+        __myfs_truncate_implem(b->memory, b->size, &e, "/probe", (off_t) 0);
+      } else {
+        hi = mid;
+        if (zeros != NULL) __myfs_truncate_implem(b->memory, b->size, &e, "/probe", (off_t) 0);
+      }
+    }
+    __myfs_unlink_implem(b->memory, b->size, &e, "/probe");
+  }
+  free(zeros);
+
+  printf("  space: live %zu kB, used %zu kB, free %zu kB, largest new file %zu kB\n",
+         b->live >> 10, (b->size - free_bytes) >> 10, free_bytes >> 10, lo >> 10);
+}
+
+/* Creates, stats and removes a lot of files in one directory */
+static void __bench_create(bench_t *b) {
+  bench_stats_t mknod, getattr, unlink;
+  struct stat st;
+  char path[64];
+  size_t n, i;
+  uint64_t t;
+  int e;
+
+  n = ((size_t) 2000) * b->scale;
+  __myfs_mkdir_implem(b->memory, b->size, &e, "/create");
+
+  __bench_stats_init(&mknod, "mknod", n);
+  for (i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "/create/file%zu", i);
+    t = __bench_now();
+    __bench_record(&mknod, t, __myfs_mknod_implem(b->memory, b->size, &e, path) < 0);
+  }
+  __bench_stats_print(&mknod);
+
+  __bench_stats_init(&getattr, "getattr", n);
+  for (i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "/create/file%zu",
+             (size_t) (__bench_random(b) % ((uint64_t) n)));
+    t = __bench_now();
+    __bench_record(&getattr, t,
+                   __myfs_getattr_implem(b->memory, b->size, &e, 0, 0, path, &st) < 0);
+  }
+  __bench_stats_print(&getattr);
+
+  __bench_stats_init(&unlink, "unlink", n);
+  for (i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "/create/file%zu", n - i - ((size_t) 1));
+    t = __bench_now();
+    __bench_record(&unlink, t, __myfs_unlink_implem(b->memory, b->size, &e, path) < 0);
+  }
+  __bench_stats_print(&unlink);
+}
+
+/* Looks up files at the end of a long path */
+static void __bench_deep(bench_t *b) {
+  bench_stats_t mkdir, getattr;
+  struct stat st;
+  char path[BENCH_DEPTH * 4 + 16];
+  size_t len, n, i;
+  uint64_t t;
+  int e;
+
+  __bench_stats_init(&mkdir, "mkdir", BENCH_DEPTH);
+  len = (size_t) 0;
+  for (i = 0; i < BENCH_DEPTH; i++) {
+    len += (size_t) snprintf(path + len, sizeof(path) - len, "/d%02zu", i);
+    t = __bench_now();
+    __bench_record(&mkdir, t, __myfs_mkdir_implem(b->memory, b->size, &e, path) < 0);
+  }
+  __bench_stats_print(&mkdir);
+  snprintf(path + len, sizeof(path) - len, "/file");
+  __myfs_mknod_implem(b->memory, b->size, &e, path);
+
+  n = ((size_t) 20000) * b->scale;
+  __bench_stats_init(&getattr, "getattr", n);
+  for (i = 0; i < n; i++) {
+    t = __bench_now();
+    __bench_record(&getattr, t,
+                   __myfs_getattr_implem(b->memory, b->size, &e, 0, 0, path, &st) < 0);
+  }
+  __bench_stats_print(&getattr);
+}
+
+/* Writes a file in order and reads it back, then overwrites and reads
+   random chunks of it */
+static void __bench_readwrite(bench_t *b) {
+  bench_stats_t seqwrite, seqread, randwrite, randread;
+  char *model, buf[BENCH_CHUNK];
+  size_t size, chunks, n, i, off;
+  uint64_t t;
+  int e, res;
+
+  size = ((size_t) (4 << 20)) * b->scale;
+  if (size > b->size / ((size_t) 4)) size = b->size / ((size_t) 4);
+  chunks = size / BENCH_CHUNK;
+  size = chunks * BENCH_CHUNK;
+  model = (char *) malloc(size);
+  if (model == NULL) {
+    perror("Cannot allocate model");
+    exit(1);
+  }
+  __bench_fill(b, model, size);
+  __myfs_mknod_implem(b->memory, b->size, &e, "/data");
+
+  __bench_stats_init(&seqwrite, "seq-write", chunks);
+  for (i = 0; i < chunks; i++) {
+    t = __bench_now();
+    res = __myfs_write_implem(b->memory, b->size, &e, "/data", model + i * BENCH_CHUNK,
+                              BENCH_CHUNK, (off_t) (i * BENCH_CHUNK));
+    __bench_record(&seqwrite, t, res != (int) BENCH_CHUNK);
+  }
+  __bench_stats_print(&seqwrite);
+  b->live = size;
+
+  __bench_stats_init(&seqread, "seq-read", chunks);
+  for (i = 0; i < chunks; i++) {
+    t = __bench_now();
+    res = __myfs_read_implem(b->memory, b->size, &e, "/data", buf, BENCH_CHUNK,
+                             (off_t) (i * BENCH_CHUNK));
+    __bench_record(&seqread, t, (res != (int) BENCH_CHUNK) ||
+                                (memcmp(buf, model + i * BENCH_CHUNK, BENCH_CHUNK) != 0));
+  }
+  __bench_stats_print(&seqread);
+
+  n = ((size_t) 2000) * b->scale;
+  __bench_stats_init(&randwrite, "rand-write", n);
+  for (i = 0; i < n; i++) {
+    off = ((size_t) (__bench_random(b) % ((uint64_t) chunks))) * BENCH_CHUNK;
+    __bench_fill(b, model + off, BENCH_CHUNK);
+    t = __bench_now();
+    res = __myfs_write_implem(b->memory, b->size, &e, "/data", model + off,
+                              BENCH_CHUNK, (off_t) off);
+    __bench_record(&randwrite, t, res != (int) BENCH_CHUNK);
+  }
+  __bench_stats_print(&randwrite);
+
+  __bench_stats_init(&randread, "rand-read", n);
+  for (i = 0; i < n; i++) {
+    off = ((size_t) (__bench_random(b) % ((uint64_t) chunks))) * BENCH_CHUNK;
+    t = __bench_now();
+    res = __myfs_read_implem(b->memory, b->size, &e, "/data", buf, BENCH_CHUNK, (off_t) off);
+    __bench_record(&randread, t, (res != (int) BENCH_CHUNK) ||
+                                 (memcmp(buf, model + off, BENCH_CHUNK) != 0));
+  }
+  __bench_stats_print(&randread);
+
+  free(model);
+}
+
+/* Grows and shrinks a set of files to random sizes */
+static void __bench_truncate(bench_t *b) {
+  bench_stats_t truncate;
+  size_t sizes[BENCH_TRUNCATE_FILES];
+  char path[64];
+  size_t n, i, f, size;
+  uint64_t t;
+  int e, res;
+
+  __myfs_mkdir_implem(b->memory, b->size, &e, "/truncate");
+  for (f = 0; f < BENCH_TRUNCATE_FILES; f++) {
+    snprintf(path, sizeof(path), "/truncate/file%zu", f);
+    __myfs_mknod_implem(b->memory, b->size, &e, path);
+    sizes[f] = (size_t) 0;
+  }
+
+  n = ((size_t) 5000) * b->scale;
+  __bench_stats_init(&truncate, "truncate", n);
+  for (i = 0; i < n; i++) {
+    f = (size_t) (__bench_random(b) % ((uint64_t) BENCH_TRUNCATE_FILES));
+    size = (size_t) (__bench_random(b) % ((uint64_t) (BENCH_TRUNCATE_MAX + 1)));
+    snprintf(path, sizeof(path), "/truncate/file%zu", f);
+    t = __bench_now();
+    res = __myfs_truncate_implem(b->memory, b->size, &e, path, (off_t) size);
+    __bench_record(&truncate, t, res < 0);
+    if (res == 0) {
+      b->live += size;
+      b->live -= sizes[f];
+      sizes[f] = size;
+    }
+  }
+  __bench_stats_print(&truncate);
+}
+
+/* Lists a directory with a lot of entries */
+static void __bench_readdir(bench_t *b) {
+  bench_stats_t readdir;
+  char path[64];
+  char **names;
+  size_t n, i, j;
+  uint64_t t;
+  int e, res;
+
+  n = ((size_t) 5000) * b->scale;
+  __myfs_mkdir_implem(b->memory, b->size, &e, "/huge");
+  for (i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "/huge/entry%zu", i);
+    __myfs_mknod_implem(b->memory, b->size, &e, path);
+  }
+
+  __bench_stats_init(&readdir, "readdir", (size_t) 50);
+  for (i = 0; i < (size_t) 50; i++) {
+    names = NULL;
+    t = __bench_now();
+    res = __myfs_readdir_implem(b->memory, b->size, &e, "/huge", &names);
+    __bench_record(&readdir, t, res != (int) n);
+    if (res > 0) {
+      for (j = 0; j < (size_t) res; j++) free(names[j]);
+      free(names);
+    }
+  }
+  __bench_stats_print(&readdir);
+}
+
+static const bench_workload_t __bench_workloads[] = {
+  { "create",    __bench_create },
+  { "deep",      __bench_deep },
+  { "readwrite", __bench_readwrite },
+  { "truncate",  __bench_truncate },
+  { "readdir",   __bench_readdir },
+  { NULL,        NULL }
+};
+
+/* Runs the workload on a fresh filesystem in a child process */
+static void __bench_run(const bench_workload_t *workload, size_t size, size_t scale,
+                        uint64_t seed, unsigned int timeout) {
+  bench_t b;
+  pid_t pid;
+  int status;
+
+  printf("%s\n", workload->name);
+  fflush(stdout);
+
+  pid = fork();
+  if (pid < ((pid_t) 0)) {
+    perror("Cannot fork");
+    return;
+  }
+  if (pid == ((pid_t) 0)) {
+    b.memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b.memory == MAP_FAILED) {
+      perror("Cannot map in memory");
+      exit(1);
+    }
+    b.size = size;
+    b.scale = scale;
+    b.rng = seed ? seed : ((uint64_t) 1);
+    b.live = (size_t) 0;
+
+    alarm(timeout);
+    workload->run(&b);
+    __bench_space(&b);
+    exit(0);
+  }
+
+  if (waitpid(pid, &status, 0) < ((pid_t) 0)) {
+    perror("Cannot wait for workload");
+    return;
+  }
+  if (WIFSIGNALED(status)) {
+    if (WTERMSIG(status) == SIGALRM) {
+      printf("  timed out after %u seconds\n", timeout);
+    } else {
+      printf("  crashed: %s\n", strsignal(WTERMSIG(status)));
+    }
+  }
+}
+
+static void __bench_show_help(const char *name) {
+  const bench_workload_t *w;
+
+  printf("usage: %s [options] [workload ...]\n\n", name);
+  printf("Options:\n"
+         "  --size=<s>     Size of the file system\n"
+         "                 Default: 64MB, at least 1MB\n"
+         "  --scale=<n>    Multiplies the number of operations\n"
+         "                 Default: 1\n"
+         "  --seed=<n>     Seed of the random choices\n"
+         "                 Default: 1\n"
+         "  --timeout=<s>  Seconds a workload may run\n"
+         "                 Default: 120\n"
+         "\n"
+         "Workloads (default: all):");
+  for (w = __bench_workloads; w->name != NULL; w++) printf(" %s", w->name);
+  printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  const bench_workload_t *w;
+  size_t size, scale, seed, timeout;
+  int i, selected;
+
+  size = BENCH_DEFAULT_SIZE;
+  scale = (size_t) 1;
+  seed = (size_t) 1;
+  timeout = (size_t) BENCH_DEFAULT_TIMEOUT;
+  selected = 0;
+
+  /* Parse options */
+  for (i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--size=", 7) == 0) {
+      if (!__bench_parse_size(&size, argv[i] + 7)) {
+        fprintf(stderr, "Cannot parse size indication\n");
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--scale=", 8) == 0) {
+      if ((!__bench_parse_size(&scale, argv[i] + 8)) || (scale == (size_t) 0)) {
+        fprintf(stderr, "Cannot parse scale indication\n");
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+      if (!__bench_parse_size(&seed, argv[i] + 7)) {
+        fprintf(stderr, "Cannot parse seed indication\n");
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--timeout=", 10) == 0) {
+      if ((!__bench_parse_size(&timeout, argv[i] + 10)) || (timeout == (size_t) 0)) {
+        fprintf(stderr, "Cannot parse timeout indication\n");
+        return 1;
+      }
+    } else if ((strcmp(argv[i], "-h") == 0) || (strcmp(argv[i], "--help") == 0)) {
+      __bench_show_help(argv[0]);
+      return 0;
+    } else {
+      for (w = __bench_workloads; w->name != NULL; w++) {
+        if (strcmp(argv[i], w->name) == 0) break;
+      }
+      if (w->name == NULL) {
+        fprintf(stderr, "Unknown workload %s\n", argv[i]);
+        return 1;
+      }
+      selected = 1;
+    }
+  }
+  if (size < BENCH_MIN_SIZE) {
+    size = BENCH_MIN_SIZE;
+  }
+
+  printf("%s: size %zu kB, scale %zu, seed %zu\n", argv[0], size >> 10, scale, seed);
+  printf("  %-14s %9s %12s %9s %9s %9s %10s %7s\n",
+         "", "ops", "ops/s", "p50us", "p90us", "p99us", "maxus", "errors");
+
+  /* Run the workloads asked for in the order of the table */
+  for (w = __bench_workloads; w->name != NULL; w++) {
+    if (selected) {
+      for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], w->name) == 0) break;
+      }
+      if (i == argc) continue;
+    }
+    __bench_run(w, size, scale, (uint64_t) seed, (unsigned int) timeout);
+  }
+
+  return 0;
+}
@@ -257,7 +257,30 @@
 //#define MYFS_size ((size_t) (4096))
 #define MYFS_STATIC_PATH_BUF_SIZE (8192)
 #define MYFS_TRUNCATE_SMALL_ALLOCATE ((size_t) 512)
-#define MYFS_MAGIC ((uint32_t) (UINT32_C(0xcafebabe)))
+#define MYFS_EXTENTS_MIN_NUMBER ((size_t) 4)
+#define MYFS_EXTENT_PREALLOCATE_MAX ((size_t) (64 << 10))
+#define MYFS_MAGIC ((uint32_t) (UINT32_C(0xcafebabf)))
+#define MYFS_MAGIC_RETIRED ((uint32_t) (UINT32_C(0xcafebabe)))
+#define MYFS_VERSION ((uint32_t) 1)
+#define MYFS_INLINE_NAME_LENGTH ((size_t) 24)
+#define MYFS_DIRTY_CHUNK_SIZE ((size_t) 4096)
+#define MYFS_JOURNAL_ALIGN ((size_t) (64 << 10))
+#define MYFS_JOURNAL_MIN_SIZE ((size_t) (256 << 10))
+#define MYFS_JOURNAL_MAX_SIZE ((size_t) (16 << 20))
+#define MYFS_JOURNAL_PENDING ((size_t) 64)
+#define MYFS_JOURNAL_DATA ((uint32_t) 1)
+#define MYFS_JOURNAL_COMMIT ((uint32_t) 2)
+#define MYFS_JOURNAL_REVOKE ((uint32_t) 3)
+#define MYFS_JOURNAL_FRESH ((size_t) 32)
+#define MYFS_JOURNAL_IN_PLACE_MIN ((size_t) 4096)
+#define MYFS_MEMORY_BINS ((size_t) 64)
+#define MYFS_BIN_SCAN_LIMIT ((size_t) 8)
+#define MYFS_BLOCK_USED ((size_t) 1)
+#define MYFS_BLOCK_MARK ((size_t) 2)
+#define MYFS_BLOCK_MIN_SIZE ((size_t) sizeof(__myfs_free_block_t))
+#define MYFS_DIR_INDEX_MIN_SIZE ((size_t) 16)
+#define MYFS_FNV_OFFSET_BASIS ((uint32_t) (UINT32_C(0x811c9dc5)))
+#define MYFS_FNV_PRIME ((uint32_t) (UINT32_C(0x01000193)))
 
 
 typedef size_t __myfs_offset_t; 
@@ -266,33 +289,78 @@ typedef unsigned long u_long;
 
 /* Structs Declarations -------------------- */
 
-/*  Handler structure "Super-block" */ 
+/*  Handler structure "Super-block" 
+
+    version is the layout of the inodes: 1 for compact inodes, 0 on 
+    images made before there was a version, which hold the inodes with
+    embedded names (__myfs_inode_v0_t) and get migrated when they are
+    mounted.
+
+    Free memory is kept in MYFS_MEMORY_BINS segregated lists, bin i 
+    holding the free blocks whose size falls into size class i (see 
+    __myfs_bin_index). bin_map has bit i set iff bin i is non-empty. 
+    free_size is the sum of the sizes of all free blocks and 
+    largest_free the size of the largest one, 0 meaning it needs to be
+    recomputed. 
+
+    dirty_map is a bitmap of dirty_words words with one bit per
+    MYFS_DIRTY_CHUNK_SIZE bytes of the filesystem, set when the chunk 
+    got changed since it was last written back. 
+
+    journal is the offset of the write-ahead journal, 0 if there is
+    none, and generation the number of the current journal generation
+    (see the journal helpers). */ 
 typedef struct __myfs_handle_struct_t __myfs_handle_t;
 struct __myfs_handle_struct_t {
   uint32_t magic;
-  __myfs_offset_t free_memory;
+  uint32_t version;
   __myfs_offset_t root_directory;
   size_t size;
+  size_t free_size;
+  size_t largest_free;
+  uint64_t bin_map;
+  __myfs_offset_t bins[MYFS_MEMORY_BINS];
+  __myfs_offset_t dirty_map;
+  size_t dirty_words;
+  __myfs_offset_t journal;
+  size_t journal_size;
+  uint64_t generation;
 };
 
 
-/* Memory block structure */
+/* Memory block structure 
+
+   Every block, free or allocated, starts with this header. size is 
+   the size of the whole block, header included, with MYFS_BLOCK_USED 
+   set while the block is allocated (and MYFS_BLOCK_MARK while the 
+   garbage collection runs). prev_size is the size of the block 
+   physically right before, 0 for the first block, so that a freed 
+   block can be coalesced with both of its neighbors in O(1). */
 typedef struct __myfs_memory_block_struct_t __myfs_mem_block_t;
 struct __myfs_memory_block_struct_t {
   size_t size;
-  size_t user_size;
-  __myfs_offset_t next; 
+  size_t prev_size;
 };
 
 
+/* A free block additionally links into the list of its bin */
+typedef struct __myfs_free_block_struct_t __myfs_free_block_t;
+struct __myfs_free_block_struct_t {
+  __myfs_mem_block_t header;
+  __myfs_offset_t next;
+  __myfs_offset_t prev;
+};
 
-/* File Block Structure */ 
-typedef struct __myfs_file_block_struct_t {
-  size_t size;
+
+/* File extent: a run of file bytes stored contiguously at data.
+   Only the bytes [0, length) of the run are file contents, the
+   remaining allocated - length bytes are room for appends. */
+typedef struct __myfs_extent_struct_t {
+  size_t file_offset;
+  size_t length;
   size_t allocated;
-  __myfs_offset_t next;
   __myfs_offset_t data;
-} __myfs_file_block_t;
+} __myfs_extent_t;
 
 
 
@@ -301,21 +369,59 @@ typedef enum __myfs_inode_enum_type {
   REG_FILE
 } __myfs_inode_type_t;
 
+/* Extent map of a file: extents is an array, sorted by file_offset, 
+   of number_extents extents with room for extents_size of them. */
 typedef struct __myfs_inode_struct_file_t {
   size_t size; 
-  __myfs_offset_t first_block;
+  __myfs_offset_t extents;
+  size_t number_extents;
+  size_t extents_size;
 } __myfs_inode_file_t;
 
 
+/* Directory index slot: open addressing with linear probing.
+   child holds the index into the children array plus one, so that
+   a zero-filled slot reads as empty. */
+typedef struct __myfs_dir_index_entry_struct_t {
+  uint32_t hash;
+  uint32_t child;
+} __myfs_dir_index_entry_t;
+
+
 typedef struct __myfs_inode_struct_directory_t{
   size_t number_children;
   __myfs_offset_t children;  
+  __myfs_offset_t index;      /* array of index_size slots, 0 if not built */
+  size_t index_size;          /* power of two */
 } __myfs_inode_directory_t;
 
 
-/* inode struct */
+/* inode struct 
+
+   Inodes are kept small, as directories store them contiguously: a 
+   name of name_length characters is stored inline, zero-terminated,
+   when it is shorter than MYFS_INLINE_NAME_LENGTH, otherwise in a 
+   block of its own at name.offset (see __myfs_inode_name). */
 typedef struct __myfs_inode_struct_t __myfs_inode_t;
 struct __myfs_inode_struct_t {
+  struct timespec accessed_time;
+  struct timespec modified_time;
+  __myfs_inode_type_t type;
+  uint32_t name_length;
+  union {
+      char inline_name[MYFS_INLINE_NAME_LENGTH];
+      __myfs_offset_t offset;
+    } name;
+  union {
+      __myfs_inode_file_t file;  
+      __myfs_inode_directory_t directory;
+    } value;
+};
+
+
+/* inode struct of version 0 images, only read by the migration */
+typedef struct __myfs_inode_v0_struct_t __myfs_inode_v0_t;
+struct __myfs_inode_v0_struct_t {
   char name[MYFS_MAXIMUM_NAME_LENGTH];
   struct timespec accessed_time;
   struct timespec modified_time;
@@ -340,30 +446,504 @@ static inline void *offset_to_ptr(void *ptr, __myfs_offset_t offset){
 
 
 
-__myfs_handle_t *__myfs_get_handle(void *fsptr, size_t size){
+/* Records that the len bytes at ptr have been changed, without 
+   journaling them. Used directly for file contents. Must be called
+   after the change, as the bits may be taken concurrently by 
+   __myfs_dirty_range_implem when writes run under a shared lock. */
+static void __myfs_mark_dirty_data(__myfs_handle_t *handle, const void *ptr, size_t len) {
+  uint64_t *map, mask;
+  size_t first, last, word;
+
+  if ((len == (size_t) 0) || (handle->dirty_map == (__myfs_offset_t) 0)) return;
+  map = (uint64_t *) offset_to_ptr(handle, handle->dirty_map);
+  first = ((size_t) (ptr - ((void *) handle))) / MYFS_DIRTY_CHUNK_SIZE;
+  last = (((size_t) (ptr - ((void *) handle))) + len - ((size_t) 1)) / MYFS_DIRTY_CHUNK_SIZE;
+  for (word = first >> 6; word <= (last >> 6); word++) {
+    mask = ~((uint64_t) 0);
+    if (word == (first >> 6)) mask &= mask << (first & ((size_t) 63));
+    if (word == (last >> 6)) mask &= (~((uint64_t) 0)) >> (((size_t) 63) - (last & ((size_t) 63)));
+    if ((__atomic_load_n(&map[word], __ATOMIC_SEQ_CST) & mask) != mask) {
+      __atomic_fetch_or(&map[word], mask, __ATOMIC_SEQ_CST);
+    }
+  }
+}
+
+
+/* Write-ahead journal
+
+   The journal is a region of handle->journal_size bytes at offset
+   handle->journal, aligned on MYFS_JOURNAL_ALIGN bytes so that no page
+   of it is shared with the rest of the filesystem. It starts with a
+   __myfs_journal_t header, followed by records.
+
+   While journaling is enabled, every metadata change reported through
+   __myfs_mark_dirty is noted in the pending table of the header.
+   __myfs_journal_commit_implem turns the pending ranges into redo
+   records (offset, length and the current bytes), follows them by a
+   commit record holding a checksum, and hands out the appended bytes,
+   which the caller makes durable with a single sequential write.
+   File contents are not journaled; see __myfs_mark_dirty_data.
+
+   Blocks of at least MYFS_JOURNAL_IN_PLACE_MIN bytes that the running
+   transaction allocates are not journaled either (see the fresh
+   table): the commit has the caller write their changed bytes in
+   place, ahead of the commit record. Nothing committed lives there,
+   as the block was free before the transaction and blocks freed
+   meanwhile only go back to the free lists when the transaction
+   commits (see the deferred list). The first MYFS_BLOCK_MIN_SIZE
+   bytes are left to the journal, since they may still hold the header
+   and links of the free block the new one was cut from.
+
+   Such blocks also get a revoke record. On replay, the records of 
+   earlier commits are not applied to revoked bytes, so that what a 
+   block held before it got freed does not overwrite what got written
+   in place.
+
+   Records carry the generation of the handle. A checkpoint writes back
+   the whole filesystem and starts a new generation, invalidating all
+   records at once. On mount, __myfs_journal_open_implem replays the
+   committed records of the current generation.
+
+   A checkpoint is only crash-safe when the memory holds nothing but
+   committed changes: until the new generation reaches the image, a
+   crash replays the old records over whatever pages were already
+   written. Commits therefore ask for a checkpoint once the journal is
+   half full, and no transaction is allowed to get near the other
+   half: large blocks go in place, writes stop early once the journal
+   gets tight (see __myfs_journal_tight) and freed blocks are given
+   back a few at a time, over as many commits as it takes. Blocks not
+   given back yet when the system crashes are allocated without
+   anything referring to them; the mount collects them (see
+   __myfs_collect_garbage).
+
+   The header only describes the journal during a mount. It is rebuilt
+   from the records by __myfs_journal_open_implem and never trusted
+   otherwise.
+*/
+typedef struct __myfs_journal_range_struct_t {
+  size_t start;
+  size_t end;
+} __myfs_journal_range_t;
+
+/* A block allocated by the running transaction: block is the part
+   written in place, written the part of it that changed */
+typedef struct __myfs_journal_fresh_struct_t {
+  __myfs_journal_range_t block;
+  __myfs_journal_range_t written;
+} __myfs_journal_fresh_t;
+
+typedef struct __myfs_journal_struct_t {
+  int enabled;
+  int overflow;
+  size_t head;                 /* end of the records, from the start of the region */
+  size_t batch;                /* start of the records not yet committed */
+  size_t revoke;               /* the last record if it is a revoke of this batch, 0 otherwise */
+  __myfs_offset_t deferred;    /* freed blocks not yet in the free lists */
+  size_t pending_number;
+  __myfs_journal_range_t pending[MYFS_JOURNAL_PENDING];
+  size_t fresh_number;
+  __myfs_journal_fresh_t fresh[MYFS_JOURNAL_FRESH];
+} __myfs_journal_t;
+
+typedef struct __myfs_journal_record_struct_t {
+  uint64_t generation;
+  uint32_t type;
+  uint32_t checksum;           /* commit records only */
+  size_t offset;
+  size_t length;               /* of the bytes following data records, of the range of revokes */
+} __myfs_journal_record_t;
+
+
+static inline __myfs_journal_t *__myfs_journal(__myfs_handle_t *handle) {
+  return (__myfs_journal_t *) offset_to_ptr(handle, handle->journal);
+}
+
+
+/* Returns the journal if journaling is on, NULL otherwise */
+static inline __myfs_journal_t *__myfs_journal_enabled(__myfs_handle_t *handle) {
+  __myfs_journal_t *journal;
+
+  if (handle->journal == (__myfs_offset_t) 0) return NULL;
+  journal = __myfs_journal(handle);
+  if (!journal->enabled) return NULL;
+  return journal;
+}
+
+
+static inline size_t __myfs_journal_records_start(void) {
+  return (sizeof(__myfs_journal_t) + (sizeof(size_t) - ((size_t) 1))) & ~(sizeof(size_t) - ((size_t) 1));
+}
+
+
+static inline size_t __myfs_journal_record_size(size_t length) {
+  return sizeof(__myfs_journal_record_t) +
+    ((length + (sizeof(size_t) - ((size_t) 1))) & ~(sizeof(size_t) - ((size_t) 1)));
+}
+
+
+/* Size of record, with the bytes following it */
+static inline size_t __myfs_journal_record_span(const __myfs_journal_record_t *record) {
+  if (record->type != MYFS_JOURNAL_DATA) return sizeof(__myfs_journal_record_t);
+  return __myfs_journal_record_size(record->length);
+}
+
+
+static uint32_t __myfs_journal_checksum(uint32_t hash, const void *ptr, size_t len) {
+  const unsigned char *c;
+  size_t i;
+
+  for (c = (const unsigned char *) ptr, i = (size_t) 0; i < len; i++) {
+    hash ^= (uint32_t) c[i];
+    hash *= MYFS_FNV_PRIME;
+  }
+  return hash;
+}
+
+
+/* Number of bytes left in the journal once the pending ranges and a
+   commit record are in */
+static size_t __myfs_journal_room(__myfs_handle_t *handle, __myfs_journal_t *journal) {
+  size_t used, i;
+
+  used = journal->head + sizeof(__myfs_journal_record_t);
+  for (i = (size_t) 0; i < journal->pending_number; i++) {
+    used += __myfs_journal_record_size(journal->pending[i].end - journal->pending[i].start);
+  }
+  if (used >= handle->journal_size) return (size_t) 0;
+  return handle->journal_size - used;
+}
+
+
+/* Returns 1 if the running transaction takes so much of the journal
+   that the operation should stop taking memory and leave the rest of
+   its work to another call, 0 otherwise */
+static int __myfs_journal_tight(__myfs_handle_t *handle) {
+  __myfs_journal_t *journal;
+
+  journal = __myfs_journal_enabled(handle);
+  if (journal == NULL) return 0;
+  return (__myfs_journal_room(handle, journal) < (handle->journal_size >> 2));
+}
+
+
+/* Appends a record of the given type for the length bytes at offset,
+   followed by these bytes for data records. Sets the overflow flag
+   when the journal is full. */
+static void __myfs_journal_append(__myfs_handle_t *handle, __myfs_journal_t *journal, uint32_t type,
+                                  uint32_t checksum, size_t offset, size_t length) {
+  __myfs_journal_record_t *record;
+  size_t size;
+
+  size = __myfs_journal_record_size((type == MYFS_JOURNAL_DATA) ? length : ((size_t) 0));
+  if ((journal->head > handle->journal_size) || (handle->journal_size - journal->head < size)) {
+    journal->overflow = 1;
+    return;
+  }
+  record = (__myfs_journal_record_t *) (((void *) journal) + journal->head);
+  record->generation = handle->generation;
+  record->type = type;
+  record->checksum = checksum;
+  record->offset = offset;
+  record->length = length;
+  if ((type == MYFS_JOURNAL_DATA) && (length > (size_t) 0)) {
+    memcpy(((void *) record) + sizeof(__myfs_journal_record_t), ((void *) handle) + offset, length);
+  }
+  journal->revoke = (type == MYFS_JOURNAL_REVOKE) ? journal->head : ((size_t) 0);
+  journal->head += size;
+}
+
+
+/* Revokes the bytes [start, end), extending the last record if it is
+   a revoke ending right at start */
+static void __myfs_journal_revoke(__myfs_handle_t *handle, __myfs_journal_t *journal, size_t start, size_t end) {
+  __myfs_journal_record_t *record;
+
+  if (journal->revoke != (size_t) 0) {
+    record = (__myfs_journal_record_t *) (((void *) journal) + journal->revoke);
+    if (record->offset + record->length == start) {
+      record->length += end - start;
+      return;
+    }
+  }
+  __myfs_journal_append(handle, journal, MYFS_JOURNAL_REVOKE, (uint32_t) 0, start, end - start);
+}
+
+
+/* Turns the pending ranges into records of their current contents */
+static void __myfs_journal_spill(__myfs_handle_t *handle, __myfs_journal_t *journal) {
+  size_t i;
+
+  for (i = (size_t) 0; (i < journal->pending_number) && (!journal->overflow); i++) {
+    __myfs_journal_append(handle, journal, MYFS_JOURNAL_DATA, (uint32_t) 0,
+                          journal->pending[i].start, journal->pending[i].end - journal->pending[i].start);
+  }
+  journal->pending_number = (size_t) 0;
+}
+
+
+/* Notes that the bytes [start, end) changed */
+static void __myfs_journal_note(__myfs_handle_t *handle, __myfs_journal_t *journal, size_t start, size_t end) {
+  __myfs_journal_range_t *block, *written;
+  size_t i, s, e;
+
+  if (journal->overflow) return;
+
+  /* Bytes of new blocks only widen what gets written in place */
+  for (i = (size_t) 0; i < journal->fresh_number; i++) {
+    block = &(journal->fresh[i].block);
+    if ((start >= block->end) || (end <= block->start)) continue;
+    s = (start > block->start) ? start : block->start;
+    e = (end < block->end) ? end : block->end;
+    written = &(journal->fresh[i].written);
+    if (written->start == written->end) {
+      written->start = s;
+      written->end = e;
+    } else {
+      if (s < written->start) written->start = s;
+      if (e > written->end) written->end = e;
+    }
+    if (start < s) __myfs_journal_note(handle, journal, start, s);
+    if (e < end) __myfs_journal_note(handle, journal, e, end);
+    return;
+  }
+
+  for (i = (size_t) 0; i < journal->pending_number; i++) {
+    if ((start <= journal->pending[i].end) && (end >= journal->pending[i].start)) {
+      if (start < journal->pending[i].start) journal->pending[i].start = start;
+      if (end > journal->pending[i].end) journal->pending[i].end = end;
+      return;
+    }
+  }
+  if (journal->pending_number == MYFS_JOURNAL_PENDING) {
+    __myfs_journal_spill(handle, journal);
+  }
+  journal->pending[journal->pending_number].start = start;
+  journal->pending[journal->pending_number].end = end;
+  journal->pending_number++;
+}
+
+
+/* Registers the block of size bytes at block, which the running
+   transaction just took from free memory, to be written in place if
+   it is large. Also used for free memory an allocation grows into. */
+static void __myfs_journal_fresh(__myfs_handle_t *handle, void *block, size_t size) {
+  __myfs_journal_t *journal;
+  __myfs_journal_fresh_t *fresh;
+  size_t start, i;
+
+  if (size < MYFS_BLOCK_MIN_SIZE + MYFS_JOURNAL_IN_PLACE_MIN) return;
+  journal = __myfs_journal_enabled(handle);
+  if (journal == NULL) return;
+  start = (size_t) (block - ((void *) handle));
+
+  if (journal->fresh_number == MYFS_JOURNAL_FRESH) {
+    /* Make room by forgetting a block nothing got written to, which
+       is most likely file contents */
+    for (i = (size_t) 0; i < journal->fresh_number; i++) {
+      if (journal->fresh[i].written.start == journal->fresh[i].written.end) break;
+    }
+    if (i == journal->fresh_number) return;
+    journal->fresh_number--;
+    journal->fresh[i] = journal->fresh[journal->fresh_number];
+  }
+  fresh = &(journal->fresh[journal->fresh_number]);
+  fresh->block.start = start + MYFS_BLOCK_MIN_SIZE;
+  fresh->block.end = start + size;
+  fresh->written.start = (size_t) 0;
+  fresh->written.end = (size_t) 0;
+  journal->fresh_number++;
+  __myfs_journal_revoke(handle, journal, fresh->block.start, fresh->block.end);
+}
+
+
+/* Returns 0 if changing the len bytes at ptr would put a large record
+   into the journal, 1 if the range is small, lies in a block written 
+   in place or there is no journaling */
+static int __myfs_journal_in_place(__myfs_handle_t *handle, const void *ptr, size_t len) {
+  __myfs_journal_t *journal;
+  size_t start, i;
+
+  journal = __myfs_journal_enabled(handle);
+  if (journal == NULL) return 1;
+  if (len < MYFS_JOURNAL_IN_PLACE_MIN) return 1;
+  start = (size_t) (ptr - ((void *) handle));
+  for (i = (size_t) 0; i < journal->fresh_number; i++) {
+    if ((start >= journal->fresh[i].block.start) && (start + len <= journal->fresh[i].block.end)) return 1;
+  }
+  return 0;
+}
+
+
+/* Records that the len bytes at ptr have been changed. Must be called
+   after the change. Metadata changes also go into the journal. */
+static void __myfs_mark_dirty(__myfs_handle_t *handle, const void *ptr, size_t len) {
+  __myfs_journal_t *journal;
+  size_t start;
+
+  __myfs_mark_dirty_data(handle, ptr, len);
+  if (len == (size_t) 0) return;
+  journal = __myfs_journal_enabled(handle);
+  if (journal == NULL) return;
+  start = (size_t) (ptr - ((void *) handle));
+  __myfs_journal_note(handle, journal, start, start + len);
+}
+
+
+/* Size class of a block of size bytes: two classes per power of two, 
+   [2^k, 1.5 * 2^k) and [1.5 * 2^k, 2^(k+1)), starting at 
+   MYFS_BLOCK_MIN_SIZE. Everything too large lands in the last bin. */
+static inline size_t __myfs_bin_index(size_t size) {
+  size_t log, bin;
+
+  log = ((size_t) 63) - ((size_t) __builtin_clzll((unsigned long long) size));
+  if (log < (size_t) 5) return (size_t) 0;
+  bin = ((log - ((size_t) 5)) << 1) | ((size >> (log - ((size_t) 1))) & ((size_t) 1));
+  if (bin >= MYFS_MEMORY_BINS) bin = MYFS_MEMORY_BINS - ((size_t) 1);
+  return bin;
+}
+
+
+/* Returns the block physically following block or NULL if block is 
+   the last one */
+static inline __myfs_mem_block_t *__myfs_next_block(__myfs_handle_t *handle, __myfs_mem_block_t *block) {
+  void *next;
+
+  next = ((void *) block) + (block->size & ~MYFS_BLOCK_USED);
+  if (next >= ((void *) handle) + sizeof(struct __myfs_handle_struct_t) + handle->size) return NULL;
+  return (__myfs_mem_block_t *) next;
+}
+
+
+static void __myfs_bin_insert(__myfs_handle_t *handle, __myfs_free_block_t *block) {
+  __myfs_free_block_t *head;
+  size_t bin;
+
+  bin = __myfs_bin_index(block->header.size);
+  head = (__myfs_free_block_t *) offset_to_ptr(handle, handle->bins[bin]);
+  block->next = handle->bins[bin];
+  block->prev = (__myfs_offset_t) 0;
+  if (head != NULL) head->prev = ptr_to_offset(block, handle);
+  handle->bins[bin] = ptr_to_offset(block, handle);
+  handle->bin_map |= ((uint64_t) 1) << bin;
+
+  handle->free_size += block->header.size;
+  if ((handle->largest_free != (size_t) 0) && (block->header.size > handle->largest_free)) {
+    handle->largest_free = block->header.size;
+  }
+
+  __myfs_mark_dirty(handle, block, sizeof(__myfs_free_block_t));
+  if (head != NULL) __myfs_mark_dirty(handle, &(head->prev), sizeof(head->prev));
+  __myfs_mark_dirty(handle, handle, sizeof(__myfs_handle_t));
+}
+
+
+static void __myfs_bin_remove(__myfs_handle_t *handle, __myfs_free_block_t *block) {
+  __myfs_free_block_t *neighbor;
+  size_t bin;
+
+  bin = __myfs_bin_index(block->header.size);
+  neighbor = (__myfs_free_block_t *) offset_to_ptr(handle, block->next);
+  if (neighbor != NULL) {
+    neighbor->prev = block->prev;
+    __myfs_mark_dirty(handle, &(neighbor->prev), sizeof(neighbor->prev));
+  }
+  neighbor = (__myfs_free_block_t *) offset_to_ptr(handle, block->prev);
+  if (neighbor != NULL) {
+    neighbor->next = block->next;
+    __myfs_mark_dirty(handle, &(neighbor->next), sizeof(neighbor->next));
+  } else {
+    handle->bins[bin] = block->next;
+    if (block->next == (__myfs_offset_t) 0) {
+      handle->bin_map &= ~(((uint64_t) 1) << bin);
+    }
+  }
+
+  handle->free_size -= block->header.size;
+  if (block->header.size == handle->largest_free) {
+    handle->largest_free = (size_t) 0;
+  }
+  __myfs_mark_dirty(handle, handle, sizeof(__myfs_handle_t));
+}
+
+
+__myfs_offset_t __myfs_allocate_memory(__myfs_handle_t *handle, size_t size);
+
+/* Formats the filesystem if needed and returns its handle, in 
+   whatever version it is. NULL if the image has the layout from 
+   before the directory index, which is neither used nor formatted 
+   over. */
+__myfs_handle_t *__myfs_open_handle(void *fsptr, size_t size){
   __myfs_handle_t *handle = (__myfs_handle_t *) fsptr;
-  __myfs_mem_block_t *block;
-  size_t s;
+  __myfs_free_block_t *block;
+  __myfs_offset_t map;
+  size_t s, i, words;
+  int wiped;
   if (size < sizeof(struct __myfs_handle_struct_t)) return NULL;
+  if (handle->magic == MYFS_MAGIC_RETIRED) return NULL;
 
   if (handle->magic != MYFS_MAGIC) {
     s = (size - (sizeof(struct __myfs_handle_struct_t)));  
+    wiped = 0;
     if (handle->magic != ((uint32_t) 0)) {
       memset((fsptr + sizeof(struct __myfs_handle_struct_t)), 0, s);
+      wiped = 1;
     }
+    /* Keep every block size_t aligned */
+    s &= ~(sizeof(size_t) - ((size_t) 1));
     handle->magic = MYFS_MAGIC; 
+    handle->version = MYFS_VERSION;
     handle->size = s;
+    handle->free_size = (size_t) 0;
+    handle->largest_free = (size_t) 0;
+    handle->bin_map = (uint64_t) 0;
+    for (i = (size_t) 0; i < MYFS_MEMORY_BINS; i++) {
+      handle->bins[i] = (__myfs_offset_t) 0;
+    }
 	
-    if (s == ((size_t) 0)) {
-      handle->free_memory = ((__myfs_offset_t) 0);
-	  
-    } else {
-      block = (__myfs_mem_block_t *) offset_to_ptr(fsptr, sizeof(handle));
-      block->size = s;
-      block->next = (__myfs_offset_t) 0;
-      handle->free_memory = ptr_to_offset(fsptr,block);
+    handle->dirty_map = (__myfs_offset_t) 0;
+    handle->dirty_words = (size_t) 0;
+    handle->journal = (__myfs_offset_t) 0;
+    handle->journal_size = (size_t) 0;
+    handle->generation = (uint64_t) 1;
+	
+    if (s >= MYFS_BLOCK_MIN_SIZE) {
+      block = (__myfs_free_block_t *) offset_to_ptr(fsptr, sizeof(struct __myfs_handle_struct_t));
+      block->header.size = s;
+      block->header.prev_size = (size_t) 0;
+      __myfs_bin_insert(handle, block);
     }           
     handle->root_directory = (__myfs_offset_t) 0;
+
+    /* Without a dirty map, everything counts as dirty all the time */
+    words = (((size + MYFS_DIRTY_CHUNK_SIZE - ((size_t) 1)) / MYFS_DIRTY_CHUNK_SIZE) + ((size_t) 63)) >> 6;
+    map = __myfs_allocate_memory(handle, words * sizeof(uint64_t));
+    if (map != (__myfs_offset_t) 0) {
+      memset(offset_to_ptr(fsptr, map), 0, words * sizeof(uint64_t));
+      handle->dirty_map = map;
+      handle->dirty_words = words;
+      if (wiped) {
+        __myfs_mark_dirty(handle, fsptr, size);
+      } else {
+        __myfs_mark_dirty(handle, fsptr, ((size_t) map) + words * sizeof(uint64_t));
+      }
+    }
+
+    /* The journal takes 1/64 of the filesystem, within bounds, and is
+       left out on small ones */
+    s = (size / ((size_t) 64)) & ~(MYFS_JOURNAL_ALIGN - ((size_t) 1));
+    if (s > MYFS_JOURNAL_MAX_SIZE) s = MYFS_JOURNAL_MAX_SIZE;
+    if (s >= MYFS_JOURNAL_MIN_SIZE) {
+      map = __myfs_allocate_memory(handle, s + MYFS_JOURNAL_ALIGN);
+      if (map != (__myfs_offset_t) 0) {
+        map = (map + (MYFS_JOURNAL_ALIGN - ((size_t) 1))) & ~(MYFS_JOURNAL_ALIGN - ((size_t) 1));
+        memset(offset_to_ptr(fsptr, map), 0, s);
+        handle->journal = map;
+        handle->journal_size = s;
+        /* Stale records must not survive in the backup-file */
+        __myfs_mark_dirty_data(handle, offset_to_ptr(fsptr, map), s);
+        __myfs_mark_dirty(handle, handle, sizeof(__myfs_handle_t));
+      }
+    }
   }
   
   return handle;
@@ -372,104 +952,178 @@ __myfs_handle_t *__myfs_get_handle(void *fsptr, size_t size){
 
 
 size_t free_memory_size(__myfs_handle_t *handle) {
-  size_t total_free_size;
-  __myfs_mem_block_t *block;
-  
-  total_free_size = (size_t) 0;
-  for (block = (__myfs_mem_block_t *) offset_to_ptr(handle, handle->free_memory);
-       block != NULL; block = (__myfs_mem_block_t *) (offset_to_ptr(handle,block->next))) {
-      total_free_size += block->size; 
-    }
-    return total_free_size;
+  return handle->free_size;
 }
 
 
 
 __myfs_mem_block_t *get_memory_block(__myfs_handle_t *handle, size_t size){
-  __myfs_mem_block_t *curr, *prev, *next;
-  for (curr = (__myfs_mem_block_t *) offset_to_ptr(handle, handle->free_memory),
-	 prev = NULL; curr != NULL && curr->next != (__myfs_offset_t) 0; prev = curr,
-	 curr = (__myfs_mem_block_t *) offset_to_ptr(handle, curr->next)) { 
-    if (curr->size > size) {
-      break;
+  __myfs_free_block_t *curr, *rest;
+  __myfs_mem_block_t *next;
+  size_t bin, scanned;
+  uint64_t higher;
+
+  if (size < MYFS_BLOCK_MIN_SIZE) size = MYFS_BLOCK_MIN_SIZE;
+  bin = __myfs_bin_index(size);
+
+  /* First fit among the first few blocks of the request's own bin.
+     Any block in a higher bin fits, so the own bin only gets scanned
+     completely when there is nothing bigger. The last bin has no 
+     upper bound and is always scanned. */
+  for (curr = (__myfs_free_block_t *) offset_to_ptr(handle, handle->bins[bin]), scanned = (size_t) 0;
+       (curr != NULL) && ((scanned < MYFS_BIN_SCAN_LIMIT) || (bin == MYFS_MEMORY_BINS - ((size_t) 1)));
+       curr = (__myfs_free_block_t *) offset_to_ptr(handle, curr->next), scanned++) {
+    if (curr->header.size >= size) break;
+  }
+  if ((curr == NULL) || (curr->header.size < size)) {
+    higher = (bin + ((size_t) 1) < MYFS_MEMORY_BINS) ? (handle->bin_map & ((~((uint64_t) 0)) << (bin + ((size_t) 1)))) : ((uint64_t) 0);
+    if (higher != (uint64_t) 0) {
+      curr = (__myfs_free_block_t *) offset_to_ptr(handle, handle->bins[__builtin_ctzll(higher)]);
+    } else {
+      for (; curr != NULL; curr = (__myfs_free_block_t *) offset_to_ptr(handle, curr->next)) {
+        if (curr->header.size >= size) break;
+      }
     }
   }
     
-  if (curr->size < size) {
+  if (curr == NULL) {
     return NULL;
   }
+  __myfs_bin_remove(handle, curr);
     
-  if (curr->size - size > (size_t) 0) { 
-      next = (__myfs_mem_block_t *) offset_to_ptr(curr, size);
-      next->size = curr->size - size;
-      next->next = curr->next;
-  } else { 
-    next = (__myfs_mem_block_t *) offset_to_ptr(handle, curr->next);
-  }
-  
-  // curr first available memory block
-  if (curr == (__myfs_mem_block_t *) offset_to_ptr(handle, handle->free_memory)) {
-    handle->free_memory = ptr_to_offset(next, handle);
-  } else {
-    prev->next = ptr_to_offset(next, handle);
+  /* Only split when the remainder can still be a free block */
+  if (curr->header.size - size >= MYFS_BLOCK_MIN_SIZE) { 
+    rest = (__myfs_free_block_t *) (((void *) curr) + size);
+    rest->header.size = curr->header.size - size;
+    rest->header.prev_size = size;
+    next = __myfs_next_block(handle, &(rest->header));
+    if (next != NULL) {
+      next->prev_size = rest->header.size;
+      __myfs_mark_dirty(handle, next, sizeof(__myfs_mem_block_t));
+    }
+    curr->header.size = size;
+    __myfs_bin_insert(handle, rest);
   }
-  curr->size = size; 
-  curr->next = (__myfs_offset_t) 0;
   
-  return curr;
+  curr->header.size |= MYFS_BLOCK_USED;
+  __myfs_mark_dirty(handle, curr, sizeof(__myfs_mem_block_t));
+  return &(curr->header);
 }
 
 
 
-// add block back to free memory linked list
+// add block back to free memory, coalescing it with its free neighbors
 void add_to_free_memory(__myfs_handle_t *handle, __myfs_offset_t offset) {
-  __myfs_mem_block_t *mem_block, *curr, *prev;
-  mem_block = (__myfs_mem_block_t *) offset_to_ptr(handle, offset);
-  for (curr = (__myfs_mem_block_t *) offset_to_ptr(handle, handle->free_memory), 
-         prev = NULL; curr != NULL; prev = curr,
-         curr = (__myfs_mem_block_t *) offset_to_ptr(handle, curr->next)) {
-    
-    if ((void *) mem_block < (void *) curr) {
-      break;
-    }
-  }
+  __myfs_mem_block_t *mem_block, *neighbor;
+  size_t size;
 
-  // place block in between prev and curr block
-  if (curr != NULL) {
-    mem_block->next = ptr_to_offset(curr, handle);
-  } else {
-    mem_block->next = (__myfs_offset_t) 0;
-  }
-  
+  mem_block = (__myfs_mem_block_t *) offset_to_ptr(handle, offset);
+  size = mem_block->size & ~MYFS_BLOCK_USED;
   
-  if (prev == NULL){
-    handle->free_memory = offset;      
-  } else {
-    prev->next = offset;
+  neighbor = __myfs_next_block(handle, mem_block);
+  if ((neighbor != NULL) && !(neighbor->size & MYFS_BLOCK_USED)) {
+    __myfs_bin_remove(handle, (__myfs_free_block_t *) neighbor);
+    size += neighbor->size;
   }
   
-  if (curr != NULL && ((void *) ((void *) mem_block + mem_block->size)) == ((void *) curr)) {
-    mem_block->size += curr->size;
-    mem_block->next = curr->next;
+  if (mem_block->prev_size != (size_t) 0) {
+    neighbor = (__myfs_mem_block_t *) (((void *) mem_block) - mem_block->prev_size);
+    if (!(neighbor->size & MYFS_BLOCK_USED)) {
+      __myfs_bin_remove(handle, (__myfs_free_block_t *) neighbor);
+      size += neighbor->size;
+      mem_block = neighbor;
+    }
   }
-  
-  if (prev != NULL && ((void *) ((void *) prev + prev->size)) == ((void *) mem_block)) {
-      prev->size += mem_block->size;
-      prev->next = mem_block->next;
+
+  mem_block->size = size;
+  neighbor = __myfs_next_block(handle, mem_block);
+  if (neighbor != NULL) {
+    neighbor->prev_size = size;
+    __myfs_mark_dirty(handle, neighbor, sizeof(__myfs_mem_block_t));
   }
-  
-    return;
+  __myfs_bin_insert(handle, (__myfs_free_block_t *) mem_block);
 }
 
 
+/* Frees the allocation at offset. While journaling, the block stays
+   allocated until __myfs_journal_release gives it back, linked into 
+   the deferred list through its first bytes. */
 void __myfs_free_impl(__myfs_handle_t *handle, __myfs_offset_t offset) {
+  __myfs_journal_t *journal;
   void *ptr;
+
+  journal = __myfs_journal_enabled(handle);
+  if (journal != NULL) {
+    *((__myfs_offset_t *) offset_to_ptr(handle, offset)) = journal->deferred;
+    journal->deferred = offset;
+    return;
+  }
   ptr = (((void *) offset_to_ptr(handle, offset)) - ((size_t) sizeof(__myfs_mem_block_t))); 
   __myfs_offset_t new_offset = ptr_to_offset(ptr, handle);
   add_to_free_memory(handle, new_offset);
 }
 
 
+/* Gives the blocks on the deferred list back to free memory, as many
+   as fit into the journal without making it tight (see 
+   __myfs_journal_tight), or all of them if all is non-zero. 
+   The blocks must not be referred to by any committed metadata 
+   anymore, as their free links get written over them. */
+static void __myfs_journal_release(__myfs_handle_t *handle, __myfs_journal_t *journal, int all) {
+  __myfs_offset_t offset;
+  size_t cost;
+
+  /* Coalescing touches the block, up to two neighbors and their list
+     neighbors, and the handle */
+  cost = ((size_t) 8) * __myfs_journal_record_size(sizeof(__myfs_free_block_t)) + 
+    __myfs_journal_record_size(sizeof(__myfs_handle_t));
+  while (journal->deferred != (__myfs_offset_t) 0) {
+    if ((!all) && (__myfs_journal_room(handle, journal) < cost + (handle->journal_size >> 2))) break;
+    offset = journal->deferred;
+    journal->deferred = *((__myfs_offset_t *) offset_to_ptr(handle, offset));
+    add_to_free_memory(handle, offset - ((size_t) sizeof(__myfs_mem_block_t)));
+  }
+}
+
+
+
+/* Size of the block needed to hold size bytes, 0 on overflow */
+static inline size_t __myfs_block_size(size_t size) {
+  size_t s;
+
+  s = (size + (size_t) sizeof(__myfs_mem_block_t));
+  if (s < size) return (size_t) 0;
+  /* Keep every block (and hence every struct stored in it) size_t aligned */
+  s = (s + (sizeof(size_t) - ((size_t) 1))) & ~(sizeof(size_t) - ((size_t) 1));
+  if (s < size) return (size_t) 0;
+  if (s < MYFS_BLOCK_MIN_SIZE) s = MYFS_BLOCK_MIN_SIZE;
+  return s;
+}
+
+
+/* Cuts the allocated block down to size bytes (a block size as 
+   returned by __myfs_block_size) if the cut-off tail is large enough
+   to be a block of its own, and frees the tail. */
+static void __myfs_split_block(__myfs_handle_t *handle, __myfs_mem_block_t *block, size_t size) {
+  __myfs_mem_block_t *tail, *next;
+  size_t block_size;
+
+  block_size = block->size & ~MYFS_BLOCK_USED;
+  if (block_size - size < MYFS_BLOCK_MIN_SIZE) return;
+  tail = (__myfs_mem_block_t *) (((void *) block) + size);
+  tail->size = (block_size - size) | MYFS_BLOCK_USED;
+  tail->prev_size = size;
+  __myfs_mark_dirty(handle, tail, sizeof(__myfs_mem_block_t));
+  next = __myfs_next_block(handle, tail);
+  if (next != NULL) {
+    next->prev_size = block_size - size;
+    __myfs_mark_dirty(handle, next, sizeof(__myfs_mem_block_t));
+  }
+  block->size = size | MYFS_BLOCK_USED;
+  __myfs_mark_dirty(handle, block, sizeof(__myfs_mem_block_t));
+  __myfs_free_impl(handle, ptr_to_offset(tail, handle) + ((size_t) sizeof(__myfs_mem_block_t)));
+}
+
 
 __myfs_offset_t __myfs_allocate_memory(__myfs_handle_t *handle, size_t size) {
   size_t s;
@@ -478,131 +1132,1171 @@ __myfs_offset_t __myfs_allocate_memory(__myfs_handle_t *handle, size_t size) {
   if (size == ((size_t) 0)) { 
     return (__myfs_offset_t) 0;
   }
-  
-  s = (size + (size_t) sizeof(__myfs_mem_block_t));
-  if (s < size) return (__myfs_offset_t) 0;
-  
-  ptr = ((void *) get_memory_block(handle, s));
-  if (ptr != NULL) {
-    return  ptr_to_offset((ptr + (size_t) sizeof(__myfs_mem_block_t)), handle);
+  
+  s = __myfs_block_size(size);
+  if (s == (size_t) 0) return (__myfs_offset_t) 0;
+  
+  ptr = ((void *) get_memory_block(handle, s));
+  if (ptr != NULL) {
+    __myfs_journal_fresh(handle, ptr, ((__myfs_mem_block_t *) ptr)->size & ~MYFS_BLOCK_USED);
+    return  ptr_to_offset((ptr + (size_t) sizeof(__myfs_mem_block_t)), handle);
+  }
+  return (__myfs_offset_t) 0;
+}
+
+
+/* Returns the number of bytes usable at offset, which must have been 
+   returned by __myfs_allocate_memory. This may exceed the requested
+   size when a block could not be split. */
+size_t __myfs_memory_size(__myfs_handle_t *handle, __myfs_offset_t offset) {
+  __myfs_mem_block_t *mem_block;
+
+  mem_block = (__myfs_mem_block_t *) (offset_to_ptr(handle, offset) - ((size_t) sizeof(__myfs_mem_block_t)));
+  return (mem_block->size & ~MYFS_BLOCK_USED) - ((size_t) sizeof(__myfs_mem_block_t));
+}
+
+
+/* Fuses the allocation at second into the one at first if second 
+   starts right where first ends. Returns 1 if they got merged, in
+   which case second must not be freed anymore. */
+int __myfs_merge_memory(__myfs_handle_t *handle, __myfs_offset_t first, __myfs_offset_t second) {
+  __myfs_mem_block_t *first_block, *second_block, *next;
+
+  first_block = (__myfs_mem_block_t *) (offset_to_ptr(handle, first) - ((size_t) sizeof(__myfs_mem_block_t)));
+  second_block = (__myfs_mem_block_t *) (offset_to_ptr(handle, second) - ((size_t) sizeof(__myfs_mem_block_t)));
+  if (__myfs_next_block(handle, first_block) != second_block) {
+    return 0;
+  }
+  first_block->size += second_block->size & ~MYFS_BLOCK_USED;
+  __myfs_mark_dirty(handle, first_block, sizeof(__myfs_mem_block_t));
+  next = __myfs_next_block(handle, first_block);
+  if (next != NULL) {
+    next->prev_size = first_block->size & ~MYFS_BLOCK_USED;
+    __myfs_mark_dirty(handle, next, sizeof(__myfs_mem_block_t));
+  }
+  return 1;
+}
+
+
+/* Resizes the allocation at offset to size bytes. Shrinking and 
+   growing into a free block right behind are done in place; only 
+   otherwise the contents get moved to a new block. On failure, 0 is 
+   returned and the old allocation stays untouched. */
+__myfs_offset_t __myfs_reallocate_memory(__myfs_handle_t *handle, __myfs_offset_t offset, size_t size) {
+    __myfs_mem_block_t *block, *next;
+    __myfs_offset_t new_offset;
+    void *old_ptr, *new_mem_block;
+    size_t s, block_size;
+    
+    if (handle == NULL) return (__myfs_offset_t) 0;
+    if (offset == (__myfs_offset_t) 0) return (__myfs_offset_t) 0;
+    if (size == (size_t) 0) {
+        __myfs_free_impl(handle, offset);
+        return (__myfs_offset_t) 0;
+    }
+
+    s = __myfs_block_size(size);
+    if (s == (size_t) 0) return (__myfs_offset_t) 0;
+    block = (__myfs_mem_block_t *) (offset_to_ptr(handle, offset) - ((size_t) sizeof(__myfs_mem_block_t)));
+    block_size = block->size & ~MYFS_BLOCK_USED;
+
+    if (s > block_size) {
+        next = __myfs_next_block(handle, block);
+        if ((next != NULL) && !(next->size & MYFS_BLOCK_USED) && (block_size + next->size >= s)) {
+            __myfs_journal_fresh(handle, next, next->size);
+            __myfs_bin_remove(handle, (__myfs_free_block_t *) next);
+            block_size += next->size;
+            block->size = block_size | MYFS_BLOCK_USED;
+            __myfs_mark_dirty(handle, block, sizeof(__myfs_mem_block_t));
+            next = __myfs_next_block(handle, block);
+            if (next != NULL) {
+                next->prev_size = block_size;
+                __myfs_mark_dirty(handle, next, sizeof(__myfs_mem_block_t));
+            }
+        }
+    }
+    if (s <= block_size) {
+        __myfs_split_block(handle, block, s);
+        return offset;
+    }
+
+    new_offset = __myfs_allocate_memory(handle, size);
+    if (new_offset == (__myfs_offset_t) 0) return (__myfs_offset_t) 0;  
+
+    old_ptr = offset_to_ptr(handle, offset);
+    s = __myfs_memory_size(handle, offset);
+    if (size < s) {
+        s = size;
+    }
+
+    new_mem_block = offset_to_ptr(handle, new_offset);
+    memcpy(new_mem_block, old_ptr, s);
+    __myfs_mark_dirty(handle, new_mem_block, s);
+    __myfs_free_impl(handle, offset);
+
+    return new_offset;
+}
+
+/* Directory hash index helpers
+
+   Every directory keeps, next to its contiguous children array, a 
+   hash table of child indices stored inside the filesystem memory.
+   It lives at an offset like everything else and hence survives in 
+   the backup-file. The table is only an accelerator: when it cannot be
+   allocated (filesystem full), lookups fall back to a linear scan.
+*/
+static inline uint32_t __myfs_name_hash(const char *name, size_t len) {
+  uint32_t hash;
+  size_t i;
+
+  hash = MYFS_FNV_OFFSET_BASIS;
+  for (i = (size_t) 0; i < len; i++) {
+    hash ^= (uint32_t) ((unsigned char) name[i]);
+    hash *= MYFS_FNV_PRIME;
+  }
+  return hash;
+}
+
+
+static inline __myfs_inode_t *__myfs_dir_child(__myfs_handle_t *handle, __myfs_inode_t *dir, size_t i) {
+  return (__myfs_inode_t *) offset_to_ptr(handle, (dir->value.directory.children + i * ((size_t) sizeof(__myfs_inode_t))));
+}
+
+
+static inline const char *__myfs_inode_name(__myfs_handle_t *handle, const __myfs_inode_t *node) {
+  if (((size_t) node->name_length) < MYFS_INLINE_NAME_LENGTH) return node->name.inline_name;
+  return (const char *) offset_to_ptr(handle, node->name.offset);
+}
+
+
+static inline int __myfs_name_equal(__myfs_handle_t *handle, const __myfs_inode_t *node, const char *name, size_t len) {
+  return ((((size_t) node->name_length) == len) && (memcmp(__myfs_inode_name(handle, node), name, len) == 0));
+}
+
+
+/* Gives node the name of len characters at name, which must be 
+   shorter than MYFS_MAXIMUM_NAME_LENGTH. The previous name is 
+   overwritten, not released. node may live outside the filesystem; 
+   the caller marks it dirty. Returns 0 on success, -1 if there is no
+   memory left for a long name. */
+static int __myfs_inode_set_name(__myfs_handle_t *handle, __myfs_inode_t *node, const char *name, size_t len) {
+  __myfs_offset_t offset;
+  char *stored;
+
+  if (len < MYFS_INLINE_NAME_LENGTH) {
+    memset(node->name.inline_name, 0, MYFS_INLINE_NAME_LENGTH);
+    memcpy(node->name.inline_name, name, len);
+  } else {
+    offset = __myfs_allocate_memory(handle, len + ((size_t) 1));
+    if (offset == (__myfs_offset_t) 0) return -1;
+    stored = (char *) offset_to_ptr(handle, offset);
+    memcpy(stored, name, len);
+    stored[len] = '\0';
+    __myfs_mark_dirty(handle, stored, len + ((size_t) 1));
+    node->name.offset = offset;
+  }
+  node->name_length = (uint32_t) len;
+  return 0;
+}
+
+
+/* Releases the storage of the name of node */
+static void __myfs_inode_drop_name(__myfs_handle_t *handle, __myfs_inode_t *node) {
+  if (((size_t) node->name_length) >= MYFS_INLINE_NAME_LENGTH) {
+    __myfs_free_impl(handle, node->name.offset);
+  }
+}
+
+
+/* Drops the index of a directory; lookups go linear until it is rebuilt */
+static void __myfs_dir_index_drop(__myfs_handle_t *handle, __myfs_inode_t *dir) {
+  if (dir->value.directory.index != (__myfs_offset_t) 0) {
+    __myfs_free_impl(handle, dir->value.directory.index);
+  }
+  dir->value.directory.index = (__myfs_offset_t) 0;
+  dir->value.directory.index_size = (size_t) 0;
+  __myfs_mark_dirty(handle, &(dir->value.directory), sizeof(__myfs_inode_directory_t));
+}
+
+
+static size_t __myfs_dir_index_place(__myfs_dir_index_entry_t *table, size_t table_size, uint32_t hash, uint32_t child) {
+  size_t mask, slot;
+
+  mask = table_size - ((size_t) 1);
+  for (slot = ((size_t) hash) & mask; table[slot].child != (uint32_t) 0; slot = (slot + ((size_t) 1)) & mask);
+  table[slot].hash = hash;
+  table[slot].child = child;
+  return slot;
+}
+
+
+/* (Re)builds the index of dir with room for at least number_children 
+   entries at a load factor of at most one half. Returns 0 on success. */
+static int __myfs_dir_index_build(__myfs_handle_t *handle, __myfs_inode_t *dir, size_t number_children) {
+  __myfs_dir_index_entry_t *table;
+  __myfs_offset_t table_offset;
+  __myfs_inode_t *child;
+  size_t table_size, i;
+
+  if (number_children >= (size_t) UINT32_MAX) return -1;
+  for (table_size = MYFS_DIR_INDEX_MIN_SIZE; table_size < ((size_t) 2) * number_children; table_size <<= 1);
+
+  table_offset = __myfs_allocate_memory(handle, table_size * ((size_t) sizeof(__myfs_dir_index_entry_t)));
+  if (table_offset == (__myfs_offset_t) 0) {
+    __myfs_dir_index_drop(handle, dir);
+    return -1;
+  }
+  table = (__myfs_dir_index_entry_t *) offset_to_ptr(handle, table_offset);
+  memset(table, 0, table_size * ((size_t) sizeof(__myfs_dir_index_entry_t)));
+
+  for (i = (size_t) 0; i < dir->value.directory.number_children; i++) {
+    child = __myfs_dir_child(handle, dir, i);
+    __myfs_dir_index_place(table, table_size, __myfs_name_hash(__myfs_inode_name(handle, child), (size_t) child->name_length),
+                           (uint32_t) (i + ((size_t) 1)));
+  }
+
+  __myfs_mark_dirty(handle, table, table_size * ((size_t) sizeof(__myfs_dir_index_entry_t)));
+
+  __myfs_dir_index_drop(handle, dir);
+  dir->value.directory.index = table_offset;
+  dir->value.directory.index_size = table_size;
+  __myfs_mark_dirty(handle, &(dir->value.directory), sizeof(__myfs_inode_directory_t));
+  return 0;
+}
+
+
+/* Finds the slot of the index of dir that refers to child i */
+static size_t __myfs_dir_index_slot(__myfs_handle_t *handle, __myfs_inode_t *dir, size_t i) {
+  __myfs_dir_index_entry_t *table;
+  __myfs_inode_t *child;
+  size_t mask, slot;
+  uint32_t hash;
+
+  table = (__myfs_dir_index_entry_t *) offset_to_ptr(handle, dir->value.directory.index);
+  mask = dir->value.directory.index_size - ((size_t) 1);
+  child = __myfs_dir_child(handle, dir, i);
+  hash = __myfs_name_hash(__myfs_inode_name(handle, child), (size_t) child->name_length);
+  for (slot = ((size_t) hash) & mask; table[slot].child != (uint32_t) 0; slot = (slot + ((size_t) 1)) & mask) {
+    if (table[slot].child == (uint32_t) (i + ((size_t) 1))) {
+      return slot;
+    }
+  }
+  return dir->value.directory.index_size;
+}
+
+
+/* Registers child i, which must already carry its name, in the index of dir */
+static void __myfs_dir_index_insert(__myfs_handle_t *handle, __myfs_inode_t *dir, size_t i) {
+  __myfs_dir_index_entry_t *table;
+  __myfs_inode_t *child;
+  size_t n, slot;
+
+  n = dir->value.directory.number_children;
+  if ((dir->value.directory.index == (__myfs_offset_t) 0) ||
+      (((size_t) 2) * n > dir->value.directory.index_size)) {
+    /* Rebuilding also picks up child i */
+    __myfs_dir_index_build(handle, dir, n);
+    return;
+  }
+  child = __myfs_dir_child(handle, dir, i);
+  table = (__myfs_dir_index_entry_t *) offset_to_ptr(handle, dir->value.directory.index);
+  slot = __myfs_dir_index_place(table, dir->value.directory.index_size,
+                                __myfs_name_hash(__myfs_inode_name(handle, child), (size_t) child->name_length),
+                                (uint32_t) (i + ((size_t) 1)));
+  __myfs_mark_dirty(handle, &table[slot], sizeof(__myfs_dir_index_entry_t));
+}
+
+
+/* Unregisters child i from the index of dir. Uses backward-shift deletion 
+   so that no tombstones accumulate in long-lived directories. */
+static void __myfs_dir_index_remove(__myfs_handle_t *handle, __myfs_inode_t *dir, size_t i) {
+  __myfs_dir_index_entry_t *table;
+  size_t mask, slot, next, home;
+
+  if (dir->value.directory.index == (__myfs_offset_t) 0) return;
+  slot = __myfs_dir_index_slot(handle, dir, i);
+  if (slot == dir->value.directory.index_size) {
+    __myfs_dir_index_drop(handle, dir);
+    return;
+  }
+  table = (__myfs_dir_index_entry_t *) offset_to_ptr(handle, dir->value.directory.index);
+  mask = dir->value.directory.index_size - ((size_t) 1);
+  for (next = (slot + ((size_t) 1)) & mask; table[next].child != (uint32_t) 0; next = (next + ((size_t) 1)) & mask) {
+    home = ((size_t) table[next].hash) & mask;
+    /* Move the entry back if its home slot does not lie in (slot, next] */
+    if (((next - home) & mask) >= ((next - slot) & mask)) {
+      table[slot] = table[next];
+      __myfs_mark_dirty(handle, &table[slot], sizeof(__myfs_dir_index_entry_t));
+      slot = next;
+    }
+  }
+  table[slot].hash = (uint32_t) 0;
+  table[slot].child = (uint32_t) 0;
+  __myfs_mark_dirty(handle, &table[slot], sizeof(__myfs_dir_index_entry_t));
+}
+
+
+/* Tells the index of dir that child i is about to be moved to position j */
+static void __myfs_dir_index_move(__myfs_handle_t *handle, __myfs_inode_t *dir, size_t i, size_t j) {
+  __myfs_dir_index_entry_t *table;
+  size_t slot;
+
+  if (dir->value.directory.index == (__myfs_offset_t) 0) return;
+  slot = __myfs_dir_index_slot(handle, dir, i);
+  if (slot == dir->value.directory.index_size) {
+    __myfs_dir_index_drop(handle, dir);
+    return;
+  }
+  table = (__myfs_dir_index_entry_t *) offset_to_ptr(handle, dir->value.directory.index);
+  table[slot].child = (uint32_t) (j + ((size_t) 1));
+  __myfs_mark_dirty(handle, &table[slot], sizeof(__myfs_dir_index_entry_t));
+}
+
+
+/* Looks up the child called name (len characters, not necessarily 
+   zero-terminated) in dir. On success the child's position in the 
+   children array is put into *position if position is not NULL. */
+__myfs_inode_t *__myfs_dir_lookup(__myfs_handle_t *handle, __myfs_inode_t *dir,
+                                  const char *name, size_t len, size_t *position) {
+  __myfs_dir_index_entry_t *table;
+  __myfs_inode_t *child;
+  size_t mask, slot, i;
+  uint32_t hash;
+
+  if (dir->type != DIRECTORY) return NULL;
+  if (dir->value.directory.number_children == (size_t) 0) return NULL;
+  if (len >= MYFS_MAXIMUM_NAME_LENGTH) return NULL;
+
+  if (dir->value.directory.index == (__myfs_offset_t) 0) {
+    for (i = (size_t) 0; i < dir->value.directory.number_children; i++) {
+      child = __myfs_dir_child(handle, dir, i);
+      if (__myfs_name_equal(handle, child, name, len)) {
+        if (position != NULL) *position = i;
+        return child;
+      }
+    }
+    return NULL;
+  }
+
+  table = (__myfs_dir_index_entry_t *) offset_to_ptr(handle, dir->value.directory.index);
+  mask = dir->value.directory.index_size - ((size_t) 1);
+  hash = __myfs_name_hash(name, len);
+  for (slot = ((size_t) hash) & mask; table[slot].child != (uint32_t) 0; slot = (slot + ((size_t) 1)) & mask) {
+    if (table[slot].hash != hash) continue;
+    i = ((size_t) table[slot].child) - ((size_t) 1);
+    child = __myfs_dir_child(handle, dir, i);
+    if (__myfs_name_equal(handle, child, name, len)) {
+      if (position != NULL) *position = i;
+      return child;
+    }
+  }
+  return NULL;
+}
+
+
+/* Resolves the first path_len characters of path. Components are 
+   looked up in place, without copying the path. */
+__myfs_inode_t *__myfs_path_resolve_len(__myfs_handle_t *handle, const char *path, size_t path_len) {
+  const char *name, *end, *index;
+  __myfs_inode_t *node;
+  
+  if (handle->root_directory == (__myfs_offset_t) 0) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    handle->root_directory = __myfs_allocate_memory(handle, ((size_t) sizeof(__myfs_inode_t)));
+    if (handle->root_directory == (__myfs_offset_t) 0) {
+      return NULL;
+    }
+    __myfs_inode_t *root = (__myfs_inode_t *) offset_to_ptr(handle, handle->root_directory);
+    
+    memset(root, 0, sizeof(__myfs_inode_t));
+    __myfs_inode_set_name(handle, root, "/", (size_t) 1);
+    root->type = DIRECTORY;
+    root->modified_time = ts;
+    root->accessed_time = ts;
+    root->value.directory.number_children = (size_t) 0;
+    root->value.directory.children = (__myfs_offset_t) 0;
+    root->value.directory.index = (__myfs_offset_t) 0;
+    root->value.directory.index_size = (size_t) 0;
+    __myfs_mark_dirty(handle, root, sizeof(__myfs_inode_t));
+    __myfs_mark_dirty(handle, handle, sizeof(__myfs_handle_t));
+  }
+  
+  node = (__myfs_inode_t *) offset_to_ptr(handle, handle->root_directory);
+  end = path + path_len;
+  for (name = path; name < end; name = index + 1) {
+    for (index = name; (index < end) && (*index != '/'); index++);
+    if (index == name) {
+      continue;
+    }
+    node = __myfs_dir_lookup(handle, node, name, (size_t) (index - name), NULL);
+    if (node == NULL) {
+      return NULL;
+    }
+  }
+  return node;
+}
+
+
+__myfs_inode_t *__myfs_path_resolve(__myfs_handle_t *handle, const char *path) {
+  return __myfs_path_resolve_len(handle, path, strlen(path));
+}
+
+
+/* Appends a copy of inode, whose name must be set, to the children of
+   dir and registers it in the index. Returns the new child or NULL if
+   there is no memory left. */
+__myfs_inode_t *__myfs_dir_append_child(__myfs_handle_t *handle, __myfs_inode_t *dir, const __myfs_inode_t *inode) {
+  __myfs_offset_t children;
+  __myfs_inode_t *child;
+  size_t num_children;
+
+  num_children = dir->value.directory.number_children + ((size_t) 1);
+  if (num_children >= (size_t) UINT32_MAX) return NULL;
+
+  if (dir->value.directory.children == (__myfs_offset_t) 0) {
+    children = __myfs_allocate_memory(handle, ((size_t) sizeof(__myfs_inode_t)));
+  } else {
+    children = __myfs_reallocate_memory(handle, dir->value.directory.children,
+                                        num_children * ((size_t) sizeof(__myfs_inode_t)));
+  }
+  if (children == (__myfs_offset_t) 0) return NULL;
+
+  dir->value.directory.children = children;
+  dir->value.directory.number_children = num_children;
+  __myfs_mark_dirty(handle, &(dir->value.directory), sizeof(__myfs_inode_directory_t));
+  child = __myfs_dir_child(handle, dir, num_children - ((size_t) 1));
+  memcpy(child, inode, sizeof(__myfs_inode_t));
+  __myfs_mark_dirty(handle, child, sizeof(__myfs_inode_t));
+  __myfs_dir_index_insert(handle, dir, num_children - ((size_t) 1));
+  return child;
+}
+
+
+/* Removes child i of dir by moving the last child into its place. 
+   The name of the child gets released once the child is out of the 
+   index, which hashes it; the other storage hanging off the child must
+   have been released already. */
+void __myfs_dir_remove_child(__myfs_handle_t *handle, __myfs_inode_t *dir, size_t i) {
+  __myfs_offset_t children;
+  size_t last;
+
+  last = dir->value.directory.number_children - ((size_t) 1);
+  __myfs_dir_index_remove(handle, dir, i);
+  __myfs_inode_drop_name(handle, __myfs_dir_child(handle, dir, i));
+  if (i != last) {
+    __myfs_dir_index_move(handle, dir, last, i);
+    memcpy(__myfs_dir_child(handle, dir, i), __myfs_dir_child(handle, dir, last), sizeof(__myfs_inode_t));
+    __myfs_mark_dirty(handle, __myfs_dir_child(handle, dir, i), sizeof(__myfs_inode_t));
+  }
+  dir->value.directory.number_children = last;
+  __myfs_mark_dirty(handle, &(dir->value.directory), sizeof(__myfs_inode_directory_t));
+
+  if (last == (size_t) 0) {
+    __myfs_free_impl(handle, dir->value.directory.children);
+    dir->value.directory.children = (__myfs_offset_t) 0;
+    __myfs_dir_index_drop(handle, dir);
+    return;
+  }
+  /* A failing shrink leaves the (larger) old array in place */
+  children = __myfs_reallocate_memory(handle, dir->value.directory.children,
+                                      last * ((size_t) sizeof(__myfs_inode_t)));
+  if (children != (__myfs_offset_t) 0) {
+    dir->value.directory.children = children;
+    __myfs_mark_dirty(handle, &(dir->value.directory), sizeof(__myfs_inode_directory_t));
+  }
+}
+
+
+
+/* Size of the largest free block. The cached value only ever gets 
+   lost when that block is handed out; then the highest non-empty bin
+   holds the new largest block. */
+size_t __myfs_total_size(__myfs_handle_t *handle) {
+  __myfs_free_block_t *block;
+  size_t max_free_size;
+  
+  if ((handle->largest_free != (size_t) 0) || (handle->bin_map == (uint64_t) 0)) {
+    return handle->largest_free;
+  }
+  max_free_size = (size_t) 0;
+  for (block = (__myfs_free_block_t *) offset_to_ptr(handle, handle->bins[((size_t) 63) - ((size_t) __builtin_clzll(handle->bin_map))]);
+       block != NULL; 
+       block = (__myfs_free_block_t *) offset_to_ptr(handle, block->next)) {
+    if (block->header.size > max_free_size) {
+      max_free_size = block->header.size;
+    }
+  }
+  handle->largest_free = max_free_size;
+  __myfs_mark_dirty(handle, &(handle->largest_free), sizeof(handle->largest_free));
+  return max_free_size;
+}
+
+
+/* File extent map helpers
+
+   The data of a file is described by a sorted array of extents.
+   Seeking to an offset is a binary search over that array, writes
+   inside the file overwrite the extent data in place and appends 
+   first fill the room left in the last extent. New extents are 
+   allocated with some room to spare (growing with the file, up to
+   MYFS_EXTENT_PREALLOCATE_MAX) and get fused into the last extent 
+   whenever the allocator hands out memory right behind it. Bytes not
+   covered by any extent are a hole: they read as zeros and take no 
+   memory. Extending a file, with truncate or by writing past its end,
+   leaves a hole, and writing into a hole only allocates the bytes 
+   written.
+*/
+static inline __myfs_extent_t *__myfs_file_extents(__myfs_handle_t *handle, __myfs_inode_file_t *file) {
+  return (__myfs_extent_t *) offset_to_ptr(handle, file->extents);
+}
+
+
+/* Returns the index of the first extent of file that ends after 
+   offset, or number_extents if there is no such extent. */
+size_t __myfs_file_find_extent(__myfs_handle_t *handle, __myfs_inode_file_t *file, size_t offset) {
+  __myfs_extent_t *extents;
+  size_t low, high, middle;
+
+  extents = __myfs_file_extents(handle, file);
+  low = (size_t) 0;
+  high = file->number_extents;
+  while (low < high) {
+    middle = low + ((high - low) >> 1);
+    if (extents[middle].file_offset + extents[middle].length <= offset) {
+      low = middle + ((size_t) 1);
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+
+/* Makes sure the extent array of file has room for n extents */
+static int __myfs_file_reserve_extents(__myfs_handle_t *handle, __myfs_inode_file_t *file, size_t n) {
+  __myfs_offset_t extents;
+  size_t size;
+
+  if (n <= file->extents_size) return 0;
+  for (size = ((file->extents_size < MYFS_EXTENTS_MIN_NUMBER) ? MYFS_EXTENTS_MIN_NUMBER : file->extents_size);
+       size < n; size <<= 1);
+
+  if (file->extents == (__myfs_offset_t) 0) {
+    extents = __myfs_allocate_memory(handle, size * ((size_t) sizeof(__myfs_extent_t)));
+  } else {
+    extents = __myfs_reallocate_memory(handle, file->extents, size * ((size_t) sizeof(__myfs_extent_t)));
+  }
+  if (extents == (__myfs_offset_t) 0) return -1;
+  file->extents = extents;
+  file->extents_size = size;
+  __myfs_mark_dirty(handle, file, sizeof(__myfs_inode_file_t));
+  return 0;
+}
+
+
+/* Moves the extent array of file to a new block, which can be written
+   in place rather than journaled. Nothing happens if there is no 
+   memory for it. */
+static void __myfs_file_move_extents(__myfs_handle_t *handle, __myfs_inode_file_t *file) {
+  __myfs_offset_t extents;
+
+  extents = __myfs_allocate_memory(handle, file->extents_size * ((size_t) sizeof(__myfs_extent_t)));
+  if (extents == (__myfs_offset_t) 0) return;
+  memcpy(offset_to_ptr(handle, extents), __myfs_file_extents(handle, file), 
+         file->number_extents * ((size_t) sizeof(__myfs_extent_t)));
+  __myfs_mark_dirty(handle, offset_to_ptr(handle, extents), file->number_extents * ((size_t) sizeof(__myfs_extent_t)));
+  __myfs_free_impl(handle, file->extents);
+  file->extents = extents;
+  __myfs_mark_dirty(handle, file, sizeof(__myfs_inode_file_t));
+}
+
+
+/* Cuts file down to size bytes, releasing the extents past it */
+void __myfs_file_shrink(__myfs_handle_t *handle, __myfs_inode_file_t *file, size_t size) {
+  __myfs_extent_t *extents;
+  __myfs_offset_t data;
+  size_t i, keep, extents_size;
+
+  extents = __myfs_file_extents(handle, file);
+  keep = __myfs_file_find_extent(handle, file, size);
+  if ((keep < file->number_extents) && (extents[keep].file_offset < size)) {
+    extents[keep].length = size - extents[keep].file_offset;
+    data = __myfs_reallocate_memory(handle, extents[keep].data, extents[keep].length);
+    if (data != (__myfs_offset_t) 0) {
+      extents[keep].data = data;
+      extents[keep].allocated = __myfs_memory_size(handle, data);
+    }
+    __myfs_mark_dirty(handle, &extents[keep], sizeof(__myfs_extent_t));
+    keep++;
+  }
+  for (i = keep; i < file->number_extents; i++) {
+    __myfs_free_impl(handle, extents[i].data);
+  }
+  file->number_extents = keep;
+  file->size = size;
+  __myfs_mark_dirty(handle, file, sizeof(__myfs_inode_file_t));
+
+  if (keep == (size_t) 0) {
+    if (file->extents != (__myfs_offset_t) 0) {
+      __myfs_free_impl(handle, file->extents);
+    }
+    file->extents = (__myfs_offset_t) 0;
+    file->extents_size = (size_t) 0;
+    return;
+  }
+  for (extents_size = file->extents_size;
+       (extents_size > MYFS_EXTENTS_MIN_NUMBER) && (((size_t) 4) * keep <= extents_size);
+       extents_size >>= 1);
+  if (extents_size != file->extents_size) {
+    data = __myfs_reallocate_memory(handle, file->extents, extents_size * ((size_t) sizeof(__myfs_extent_t)));
+    if (data != (__myfs_offset_t) 0) {
+      file->extents = data;
+      file->extents_size = extents_size;
+      __myfs_mark_dirty(handle, file, sizeof(__myfs_inode_file_t));
+    }
+  }
+}
+
+
+/* Appends len bytes from buf, or len zeros if buf is NULL, to file.
+   Returns the number of bytes appended, which is less than len only
+   if the filesystem ran out of memory or the journal got too tight 
+   for another allocation. */
+size_t __myfs_file_append(__myfs_handle_t *handle, __myfs_inode_file_t *file, const char *buf, size_t len) {
+  __myfs_extent_t *extents, *last;
+  __myfs_offset_t data;
+  size_t done, chunk, want, remaining;
+
+  done = (size_t) 0;
+  while (done < len) {
+    remaining = len - done;
+    extents = __myfs_file_extents(handle, file);
+    last = NULL;
+    if ((file->number_extents > (size_t) 0) &&
+        (extents[file->number_extents - ((size_t) 1)].file_offset + 
+         extents[file->number_extents - ((size_t) 1)].length == file->size)) {
+      last = &extents[file->number_extents - ((size_t) 1)];
+    }
+
+    if ((last == NULL) || (last->length == last->allocated)) {
+      if ((done > (size_t) 0) && __myfs_journal_tight(handle)) break;
+
+      /* Get a new run, preallocating in proportion to the file size */
+      want = (file->size < MYFS_EXTENT_PREALLOCATE_MAX) ? file->size : MYFS_EXTENT_PREALLOCATE_MAX;
+      if (want < remaining) want = remaining;
+      data = __myfs_allocate_memory(handle, want);
+      if ((data == (__myfs_offset_t) 0) && (want > remaining)) {
+        data = __myfs_allocate_memory(handle, remaining);
+      }
+      if (data == (__myfs_offset_t) 0) {
+        want = __myfs_total_size(handle);
+        if (want <= (size_t) sizeof(__myfs_mem_block_t)) break;
+        data = __myfs_allocate_memory(handle, want - ((size_t) sizeof(__myfs_mem_block_t)));
+        if (data == (__myfs_offset_t) 0) break;
+      }
+
+      if ((last != NULL) && __myfs_merge_memory(handle, last->data, data)) {
+        last->allocated = __myfs_memory_size(handle, last->data);
+      } else {
+        if (__myfs_file_reserve_extents(handle, file, file->number_extents + ((size_t) 1)) != 0) {
+          __myfs_free_impl(handle, data);
+          break;
+        }
+        extents = __myfs_file_extents(handle, file);
+        last = &extents[file->number_extents];
+        last->file_offset = file->size;
+        last->length = (size_t) 0;
+        last->allocated = __myfs_memory_size(handle, data);
+        last->data = data;
+        file->number_extents++;
+      }
+    }
+
+    chunk = last->allocated - last->length;
+    if (chunk > remaining) chunk = remaining;
+    if (buf != NULL) {
+      memcpy(offset_to_ptr(handle, last->data + last->length), buf + done, chunk);
+    } else {
+      memset(offset_to_ptr(handle, last->data + last->length), 0, chunk);
+    }
+    __myfs_mark_dirty_data(handle, offset_to_ptr(handle, last->data + last->length), chunk);
+    last->length += chunk;
+    file->size += chunk;
+    __myfs_mark_dirty(handle, last, sizeof(__myfs_extent_t));
+    done += chunk;
+  }
+  __myfs_mark_dirty(handle, file, sizeof(__myfs_inode_file_t));
+  return done;
+}
+
+
+/* Copies len bytes of file starting at offset into buf. The range must
+   lie inside the file. */
+void __myfs_file_read(__myfs_handle_t *handle, __myfs_inode_file_t *file, char *buf, size_t len, size_t offset) {
+  __myfs_extent_t *extents;
+  size_t i, done, chunk, in, hole_end;
+
+  extents = __myfs_file_extents(handle, file);
+  i = __myfs_file_find_extent(handle, file, offset);
+  for (done = (size_t) 0; done < len; done += chunk, offset += chunk) {
+    if ((i < file->number_extents) && (extents[i].file_offset <= offset)) {
+      in = offset - extents[i].file_offset;
+      chunk = extents[i].length - in;
+      if (chunk > len - done) chunk = len - done;
+      memcpy(buf + done, offset_to_ptr(handle, extents[i].data + in), chunk);
+      i++;
+    } else {
+      hole_end = (i < file->number_extents) ? extents[i].file_offset : file->size;
+      chunk = hole_end - offset;
+      if (chunk > len - done) chunk = len - done;
+      memset(buf + done, 0, chunk);
+    }
+  }
+}
+
+
+/* Returns 1 if the len bytes of file starting at offset are all backed
+   by extents, 0 if some of them lie in a hole. The range must lie 
+   inside the file. */
+static int __myfs_file_backed(__myfs_handle_t *handle, __myfs_inode_file_t *file, size_t len, size_t offset) {
+  __myfs_extent_t *extents;
+  size_t i, end;
+
+  extents = __myfs_file_extents(handle, file);
+  end = offset + len;
+  for (i = __myfs_file_find_extent(handle, file, offset); offset < end; i++) {
+    if ((i >= file->number_extents) || (extents[i].file_offset > offset)) return 0;
+    offset = extents[i].file_offset + extents[i].length;
+  }
+  return 1;
+}
+
+
+/* Returns the number of bytes of memory the extents of file take */
+static size_t __myfs_file_allocated(__myfs_handle_t *handle, __myfs_inode_file_t *file) {
+  __myfs_extent_t *extents;
+  size_t i, allocated;
+
+  extents = __myfs_file_extents(handle, file);
+  allocated = (size_t) 0;
+  for (i = (size_t) 0; i < file->number_extents; i++) {
+    allocated += extents[i].allocated;
+  }
+  return allocated;
+}
+
+
+/* Writes len bytes from buf into file starting at offset. The range must
+   lie inside the file. Bytes backed by extents get overwritten in place,
+   the parts of holes in the range get filled by growing the extent 
+   right before them, into its spare room or into memory right behind
+   it, or else by a new extent of just the bytes written. Returns the 
+   number of bytes written, which is less than len only if the 
+   filesystem ran out of memory while filling a hole, or the journal
+   got too tight for another allocation. */
+size_t __myfs_file_overwrite(__myfs_handle_t *handle, __myfs_inode_file_t *file, const char *buf, size_t len, size_t offset) {
+  __myfs_extent_t *extents, *prev;
+  __myfs_offset_t data;
+  size_t i, done, chunk, in, hole_end, want;
+
+  extents = __myfs_file_extents(handle, file);
+  i = __myfs_file_find_extent(handle, file, offset);
+  done = (size_t) 0;
+  while (done < len) {
+    if ((i < file->number_extents) && (extents[i].file_offset <= offset)) {
+      in = offset - extents[i].file_offset;
+      chunk = extents[i].length - in;
+      if (chunk > len - done) chunk = len - done;
+      memcpy(offset_to_ptr(handle, extents[i].data + in), buf + done, chunk);
+      __myfs_mark_dirty_data(handle, offset_to_ptr(handle, extents[i].data + in), chunk);
+      i++;
+      done += chunk;
+      offset += chunk;
+      continue;
+    }
+
+    hole_end = (i < file->number_extents) ? extents[i].file_offset : file->size;
+    chunk = hole_end - offset;
+    if (chunk > len - done) chunk = len - done;
+    prev = NULL;
+    if ((i > (size_t) 0) && 
+        (extents[i - ((size_t) 1)].file_offset + extents[i - ((size_t) 1)].length == offset)) {
+      prev = &extents[i - ((size_t) 1)];
+    }
+
+    if ((prev != NULL) && (prev->length < prev->allocated)) {
+      /* Grow the extent before the hole into its spare room */
+      if (chunk > prev->allocated - prev->length) chunk = prev->allocated - prev->length;
+      memcpy(offset_to_ptr(handle, prev->data + prev->length), buf + done, chunk);
+      __myfs_mark_dirty_data(handle, offset_to_ptr(handle, prev->data + prev->length), chunk);
+      prev->length += chunk;
+      __myfs_mark_dirty(handle, prev, sizeof(__myfs_extent_t));
+      done += chunk;
+      offset += chunk;
+      continue;
+    }
+
+    if ((done > (size_t) 0) && __myfs_journal_tight(handle)) break;
+    data = __myfs_allocate_memory(handle, chunk);
+    if (data == (__myfs_offset_t) 0) {
+      want = __myfs_total_size(handle);
+      if ((want <= (size_t) sizeof(__myfs_mem_block_t)) || 
+          (want - ((size_t) sizeof(__myfs_mem_block_t)) >= chunk)) break;
+      chunk = want - ((size_t) sizeof(__myfs_mem_block_t));
+      data = __myfs_allocate_memory(handle, chunk);
+      if (data == (__myfs_offset_t) 0) break;
+    }
+
+    /* The spare room gained by a merge gets filled on the next round */
+    if ((prev != NULL) && __myfs_merge_memory(handle, prev->data, data)) {
+      prev->allocated = __myfs_memory_size(handle, prev->data);
+      __myfs_mark_dirty(handle, prev, sizeof(__myfs_extent_t));
+      continue;
+    }
+
+    if (__myfs_file_reserve_extents(handle, file, file->number_extents + ((size_t) 1)) != 0) {
+      __myfs_free_impl(handle, data);
+      break;
+    }
+    extents = __myfs_file_extents(handle, file);
+    if (!__myfs_journal_in_place(handle, &extents[i], (file->number_extents - i) * ((size_t) sizeof(__myfs_extent_t)))) {
+      __myfs_file_move_extents(handle, file);
+      extents = __myfs_file_extents(handle, file);
+    }
+    memmove(&extents[i + ((size_t) 1)], &extents[i], 
+            (file->number_extents - i) * ((size_t) sizeof(__myfs_extent_t)));
+    extents[i].file_offset = offset;
+    extents[i].length = chunk;
+    extents[i].allocated = __myfs_memory_size(handle, data);
+    extents[i].data = data;
+    file->number_extents++;
+    memcpy(offset_to_ptr(handle, data), buf + done, chunk);
+    __myfs_mark_dirty_data(handle, offset_to_ptr(handle, data), chunk);
+    __myfs_mark_dirty(handle, &extents[i], 
+                      (file->number_extents - i) * ((size_t) sizeof(__myfs_extent_t)));
+    __myfs_mark_dirty(handle, file, sizeof(__myfs_inode_file_t));
+    i++;
+    done += chunk;
+    offset += chunk;
+  }
+  return done;
+}
+
+/* Fills stbuf with the attributes of node, as documented for 
+   __myfs_getattr_implem */
+static void __myfs_inode_stat(__myfs_handle_t *handle, __myfs_inode_t *node, 
+                              uid_t uid, gid_t gid, struct stat *stbuf) {
+  size_t i, counter;
+
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_uid = uid;
+  stbuf->st_gid = gid;
+  stbuf->st_atim = node->accessed_time;
+  stbuf->st_mtim = node->modified_time;
+  if (node->type == DIRECTORY) {
+    stbuf->st_mode = S_IFDIR | 0755;
+    counter = (size_t) 0;
+    for (i = (size_t) 0; i < node->value.directory.number_children; i++) {
+      if (__myfs_dir_child(handle, node, i)->type == DIRECTORY) {
+        counter++;
+      }
+    }
+    stbuf->st_nlink = (nlink_t) counter;
+  } else if (node->type == REG_FILE) {
+    stbuf->st_mode = S_IFREG | 0755;
+    stbuf->st_size = (off_t) node->value.file.size;
+    stbuf->st_nlink = 1;
+    /* Holes take no memory, so this can be much less than st_size */
+    stbuf->st_blocks = (blkcnt_t) ((__myfs_file_allocated(handle, &node->value.file) + ((size_t) 511)) / ((size_t) 512));
+  }
+}
+
+/* Migration of version 0 images
+
+   The compact inode is smaller than the old one and has the fields 
+   other than the name in the same layout, so every children array 
+   gets converted in place, front to back, and then shrunk, which 
+   cannot fail. Only the long names need memory. They are moved into
+   blocks of their own first, for the whole tree, before anything 
+   else changes: the old name then gets replaced by a '\0' (no real 
+   name is empty) followed by the offset of the block, and running out
+   of memory undoes all of it. */
+static void __myfs_migrate_unstash(__myfs_handle_t *handle, __myfs_inode_v0_t *dir) {
+  __myfs_inode_v0_t *children;
+  __myfs_offset_t offset;
+  size_t i;
+
+  children = (__myfs_inode_v0_t *) offset_to_ptr(handle, dir->value.directory.children);
+  for (i = (size_t) 0; i < dir->value.directory.number_children; i++) {
+    if (children[i].name[0] == '\0') {
+      memcpy(&offset, &(children[i].name[sizeof(__myfs_offset_t)]), sizeof(__myfs_offset_t));
+      strcpy(children[i].name, (const char *) offset_to_ptr(handle, offset));
+      __myfs_free_impl(handle, offset);
+    }
+    if (children[i].type == DIRECTORY) {
+      __myfs_migrate_unstash(handle, &children[i]);
+    }
+  }
+}
+
+static int __myfs_migrate_stash(__myfs_handle_t *handle, __myfs_inode_v0_t *dir) {
+  __myfs_inode_v0_t *children;
+  __myfs_offset_t offset;
+  size_t i, len;
+
+  children = (__myfs_inode_v0_t *) offset_to_ptr(handle, dir->value.directory.children);
+  for (i = (size_t) 0; i < dir->value.directory.number_children; i++) {
+    len = strlen(children[i].name);
+    if (len >= MYFS_INLINE_NAME_LENGTH) {
+      offset = __myfs_allocate_memory(handle, len + ((size_t) 1));
+      if (offset == (__myfs_offset_t) 0) return -1;
+      memcpy(offset_to_ptr(handle, offset), children[i].name, len + ((size_t) 1));
+      __myfs_mark_dirty(handle, offset_to_ptr(handle, offset), len + ((size_t) 1));
+      children[i].name[0] = '\0';
+      memcpy(&(children[i].name[sizeof(__myfs_offset_t)]), &offset, sizeof(__myfs_offset_t));
+    }
+    if ((children[i].type == DIRECTORY) && (__myfs_migrate_stash(handle, &children[i]) != 0)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Converts old into node, both possibly overlapping */
+static void __myfs_migrate_inode(__myfs_handle_t *handle, __myfs_inode_t *node, const __myfs_inode_v0_t *old) {
+  __myfs_inode_v0_t copy;
+  __myfs_offset_t offset;
+
+  memcpy(&copy, old, sizeof(__myfs_inode_v0_t));
+  memset(node, 0, sizeof(__myfs_inode_t));
+  node->accessed_time = copy.accessed_time;
+  node->modified_time = copy.modified_time;
+  node->type = copy.type;
+  memcpy(&(node->value), &(copy.value), sizeof(node->value));
+  if (copy.name[0] == '\0') {
+    memcpy(&offset, &(copy.name[sizeof(__myfs_offset_t)]), sizeof(__myfs_offset_t));
+    node->name.offset = offset;
+    node->name_length = (uint32_t) strlen((const char *) offset_to_ptr(handle, offset));
+  } else {
+    __myfs_inode_set_name(handle, node, copy.name, strlen(copy.name));
+  }
+}
+
+static void __myfs_migrate_children(__myfs_handle_t *handle, __myfs_inode_t *dir) {
+  __myfs_inode_v0_t *old;
+  size_t i, n;
+
+  n = dir->value.directory.number_children;
+  if (n == (size_t) 0) return;
+  old = (__myfs_inode_v0_t *) offset_to_ptr(handle, dir->value.directory.children);
+  for (i = (size_t) 0; i < n; i++) {
+    __myfs_migrate_inode(handle, __myfs_dir_child(handle, dir, i), &old[i]);
+  }
+  dir->value.directory.children = __myfs_reallocate_memory(handle, dir->value.directory.children,
+                                                           n * sizeof(__myfs_inode_t));
+  __myfs_mark_dirty(handle, __myfs_dir_child(handle, dir, (size_t) 0), n * sizeof(__myfs_inode_t));
+  for (i = (size_t) 0; i < n; i++) {
+    if (__myfs_dir_child(handle, dir, i)->type == DIRECTORY) {
+      __myfs_migrate_children(handle, __myfs_dir_child(handle, dir, i));
+    }
+  }
+}
+
+/* Converts a version 0 image to the current version. Returns 0 on 
+   success, -1 if there is not enough memory, leaving it unchanged. */
+static int __myfs_migrate(__myfs_handle_t *handle) {
+  __myfs_inode_t *root;
+
+  if (handle->root_directory != (__myfs_offset_t) 0) {
+    if (__myfs_migrate_stash(handle, (__myfs_inode_v0_t *) offset_to_ptr(handle, handle->root_directory)) != 0) {
+      __myfs_migrate_unstash(handle, (__myfs_inode_v0_t *) offset_to_ptr(handle, handle->root_directory));
+      return -1;
+    }
+    root = (__myfs_inode_t *) offset_to_ptr(handle, handle->root_directory);
+    __myfs_migrate_inode(handle, root, (__myfs_inode_v0_t *) root);
+    handle->root_directory = __myfs_reallocate_memory(handle, handle->root_directory, sizeof(__myfs_inode_t));
+    __myfs_mark_dirty(handle, root, sizeof(__myfs_inode_t));
+    __myfs_migrate_children(handle, root);
+  }
+  handle->version = MYFS_VERSION;
+  __myfs_mark_dirty(handle, handle, sizeof(__myfs_handle_t));
+  return 0;
+}
+
+
+/* Returns the handle of the filesystem of size size at fsptr, 
+   formatting or migrating it first if needed. NULL if that fails or 
+   the image comes from a newer version. */
+__myfs_handle_t *__myfs_get_handle(void *fsptr, size_t size) {
+  __myfs_handle_t *handle;
+
+  handle = __myfs_open_handle(fsptr, size);
+  if (handle == NULL) return NULL;
+  if (handle->version != MYFS_VERSION) {
+    if (handle->version > MYFS_VERSION) return NULL;
+    if (__myfs_migrate(handle) != 0) return NULL;
+  }
+  return handle;
+}
+
+/* Garbage collection
+
+   Blocks freed while journaling only go back to free memory a few at
+   a time (see __myfs_journal_release), so a crash can leave blocks 
+   allocated that nothing refers to anymore. When the journal gets 
+   opened, the blocks reachable from the handle are marked with 
+   MYFS_BLOCK_MARK and all other allocated blocks are freed.
+*/
+static void __myfs_gc_mark(__myfs_handle_t *handle, __myfs_offset_t offset) {
+  __myfs_mem_block_t *block;
+
+  if (offset == (__myfs_offset_t) 0) return;
+  block = (__myfs_mem_block_t *) (offset_to_ptr(handle, offset) - ((size_t) sizeof(__myfs_mem_block_t)));
+  block->size |= MYFS_BLOCK_MARK;
+}
+
+
+/* Marks the blocks node refers to, and those of its descendants */
+static void __myfs_gc_mark_inode(__myfs_handle_t *handle, __myfs_inode_t *node) {
+  __myfs_extent_t *extents;
+  size_t i;
+
+  if (((size_t) node->name_length) >= MYFS_INLINE_NAME_LENGTH) {
+    __myfs_gc_mark(handle, node->name.offset);
+  }
+  if (node->type == DIRECTORY) {
+    __myfs_gc_mark(handle, node->value.directory.children);
+    __myfs_gc_mark(handle, node->value.directory.index);
+    for (i = (size_t) 0; i < node->value.directory.number_children; i++) {
+      __myfs_gc_mark_inode(handle, __myfs_dir_child(handle, node, i));
+    }
+    return;
+  }
+  __myfs_gc_mark(handle, node->value.file.extents);
+  extents = __myfs_file_extents(handle, &(node->value.file));
+  for (i = (size_t) 0; i < node->value.file.number_extents; i++) {
+    __myfs_gc_mark(handle, extents[i].data);
+  }
+}
+
+
+/* Frees the allocated blocks the filesystem does not refer to. The
+   handle must have the current version. */
+static void __myfs_collect_garbage(__myfs_handle_t *handle, __myfs_journal_t *journal) {
+  __myfs_mem_block_t *block;
+  size_t size;
+  int keep;
+
+  if (handle->root_directory != (__myfs_offset_t) 0) {
+    __myfs_gc_mark(handle, handle->root_directory);
+    __myfs_gc_mark_inode(handle, (__myfs_inode_t *) offset_to_ptr(handle, handle->root_directory));
+  }
+  __myfs_gc_mark(handle, handle->dirty_map);
+
+  /* The garbage goes onto the deferred list first, as freeing right 
+     away would coalesce blocks under the walk */
+  for (block = (__myfs_mem_block_t *) offset_to_ptr(handle, sizeof(__myfs_handle_t));
+       block != NULL; block = __myfs_next_block(handle, block)) {
+    keep = ((block->size & MYFS_BLOCK_MARK) != (size_t) 0);
+    block->size &= ~MYFS_BLOCK_MARK;
+    if (!(block->size & MYFS_BLOCK_USED) || keep) continue;
+    size = block->size & ~MYFS_BLOCK_USED;
+    if ((handle->journal >= ptr_to_offset(block, handle)) &&
+        (handle->journal < ptr_to_offset(block, handle) + size)) continue;
+    *((__myfs_offset_t *) (((void *) block) + sizeof(__myfs_mem_block_t))) = journal->deferred;
+    journal->deferred = ptr_to_offset(block, handle) + ((size_t) sizeof(__myfs_mem_block_t));
   }
-  return (__myfs_offset_t) 0;
+  if (!journal->enabled) __myfs_journal_release(handle, journal, 1);
 }
 
 
-__myfs_offset_t __myfs_reallocate_memory(__myfs_handle_t *handle, __myfs_offset_t offset, size_t size) {
-    __myfs_mem_block_t *old_mem_block;
-    __myfs_offset_t new_offset;
-    void *old_ptr, *new_mem_block;
-    size_t s;
-    
-    if (handle == NULL) return (__myfs_offset_t) 0;
-    if (offset == (__myfs_offset_t) 0) return (__myfs_offset_t) 0;
-    if (size == (size_t) 0) {
-        __myfs_free_impl(handle, offset);
-        return (__myfs_offset_t) 0;
-    }
+/* A revoke record of the journal, see __myfs_journal_open_implem */
+typedef struct __myfs_journal_revoked_struct_t {
+  size_t start;
+  size_t end;
+  size_t reach;                /* largest end of this and all entries before */
+  size_t position;             /* of the record in the journal */
+} __myfs_journal_revoked_t;
 
-    new_offset = __myfs_allocate_memory(handle, size);
-    if (new_offset == (__myfs_offset_t) 0) return (__myfs_offset_t) 0;  
 
-    old_ptr = offset_to_ptr(handle, offset);
-    old_mem_block = (__myfs_mem_block_t *) (old_ptr - (size_t) sizeof(__myfs_mem_block_t));
-    s = old_mem_block->size;
-    if (size < s) {
-        s = size;
-    }
+static int __myfs_journal_revoked_compare(const void *a, const void *b) {
+  const __myfs_journal_revoked_t *x, *y;
 
-    new_mem_block = offset_to_ptr(handle, new_offset);
-    memcpy(new_mem_block, old_ptr, s);
-    __myfs_free_impl(handle, offset);
+  x = (const __myfs_journal_revoked_t *) a;
+  y = (const __myfs_journal_revoked_t *) b;
+  if (x->start < y->start) return -1;
+  if (x->start > y->start) return 1;
+  return 0;
+}
 
-    return new_offset;
+
+/* Copies the bytes [start, end) of the data record back into place */
+static void __myfs_journal_restore(__myfs_handle_t *handle, __myfs_journal_record_t *record, size_t start, size_t end) {
+  if (start >= end) return;
+  memcpy(((void *) handle) + start, ((void *) record) + sizeof(__myfs_journal_record_t) + (start - record->offset), end - start);
+  __myfs_mark_dirty_data(handle, ((void *) handle) + start, end - start);
 }
 
-__myfs_inode_t *__myfs_path_resolve(__myfs_handle_t *handle, const char *path) {
-  char *index, *__path, *name, file_name[MYFS_MAXIMUM_NAME_LENGTH];
-  __myfs_inode_t *node, *child;
-  size_t size, i;
-  
-  if (handle->root_directory == (__myfs_offset_t) 0) {
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    handle->root_directory = __myfs_allocate_memory(handle, ((size_t) sizeof(__myfs_inode_t)));
-    __myfs_inode_t *root = (__myfs_inode_t *) offset_to_ptr(handle, handle->root_directory);
-    
-    root->name[0] = '/';
-    root->name[1] = '\0';
-    root->type = DIRECTORY;
-    root->modified_time = ts;
-    root->accessed_time = ts;
-    root->value.directory.number_children = (size_t) 0;
-    root->value.directory.children = (__myfs_offset_t) 0;
-  }
-  
-  node = (__myfs_inode_t *) offset_to_ptr(handle, handle->root_directory);
-  if (strcmp("/\0", path) == 0) { 
-    return node;
-  }
-    
-  __path = (char *) malloc((strlen(path) + 1) * sizeof(char));
-  if (__path == NULL) {
-    return NULL;
-  }
-  strcpy(__path, path);
-  name = __path + 1;
-  index = strchr(name, '/');
-  
-  while (strlen(name) != 0) {
-    child = NULL; 
-    if (index != NULL) {
-      size = (size_t) (((void *) index) - ((void *) name));
+
+/* Applies the data record, of the batch whose commit record is at 
+   commit, except for the bytes revoked by a later batch. revoked 
+   holds number revokes sorted by start. */
+static void __myfs_journal_replay(__myfs_handle_t *handle, __myfs_journal_record_t *record, size_t commit,
+                                  const __myfs_journal_revoked_t *revoked, size_t number) {
+  size_t cursor, stop, low, high, middle, i;
+
+  cursor = record->offset;
+  stop = record->offset + record->length;
+
+  /* Skip the revokes ending before the record */
+  low = (size_t) 0;
+  high = number;
+  while (low < high) {
+    middle = low + ((high - low) >> 1);
+    if (revoked[middle].reach <= cursor) {
+      low = middle + ((size_t) 1);
     } else {
-      size = (size_t) strlen(name);
-    }
-    strncpy(file_name, name, size);
-    file_name[size] = '\0';
-    for (i = 0; i < node->value.directory.number_children; i++) {
-      child = (__myfs_inode_t *) offset_to_ptr(handle,(node->value.directory.children + i * ((size_t) sizeof(__myfs_inode_t))));
-      if (strcmp(child->name, file_name) == 0) {
-	node = child;
-	break;
-      }
-    }
-    
-    memset(file_name, 0, size);
-    
-    if (node != child) { 
-      free(__path);
-      return NULL;
-    }
-    if (index == NULL) {
-      break;
+      high = middle;
     }
-    name = index + 1;
-    index = strchr(name, '/');
   }
-  free(__path);
-  return node;
+  for (i = low; (i < number) && (revoked[i].start < stop) && (cursor < stop); i++) {
+    if ((revoked[i].position < commit) || (revoked[i].end <= cursor)) continue;
+    __myfs_journal_restore(handle, record, cursor, revoked[i].start);
+    cursor = revoked[i].end;
+  }
+  if (cursor < stop) __myfs_journal_restore(handle, record, cursor, stop);
 }
+/* End of helper functions */
 
 
 
-size_t __myfs_total_size(__myfs_handle_t *handle) {
-  __myfs_mem_block_t *mem_block;
-  size_t max_free_size;
-  
-  max_free_size = (size_t) 0;
-  for (mem_block = (__myfs_mem_block_t *) offset_to_ptr(handle, handle->free_memory);
-       mem_block != NULL; 
-       mem_block = (__myfs_mem_block_t *) (offset_to_ptr(handle,mem_block->next))) {
-        if (mem_block->size > max_free_size) {
-          max_free_size = mem_block->size;
-        }
+/* Checks that the filesystem of size fssize pointed to by fsptr can be
+   used, before anything else touches it.
+
+   Returns 0 if the memory is still to be formatted, or holds an image
+   of the current version or of one that gets migrated. Otherwise, 
+   nothing is changed, -1 is returned and *errnoptr is set to EPROTO if
+   the image has the layout from before the directory index, which 
+   cannot be migrated, or to ENOTSUP if it comes from a newer version.
+*/
+int __myfs_check_implem(void *fsptr, size_t fssize, int *errnoptr) {
+  __myfs_handle_t *handle = (__myfs_handle_t *) fsptr;
+
+  if (fssize < sizeof(struct __myfs_handle_struct_t)) {
+    *errnoptr = EFAULT;
+    return -1;
   }
-  return max_free_size;
+  if (handle->magic == MYFS_MAGIC_RETIRED) {
+    *errnoptr = EPROTO;
+    return -1;
+  }
+  if ((handle->magic == MYFS_MAGIC) && (handle->version > MYFS_VERSION)) {
+    *errnoptr = ENOTSUP;
+    return -1;
+  }
+  return 0;
 }
-/* End of helper functions */
 
 
 
@@ -625,6 +2319,8 @@ size_t __myfs_total_size(__myfs_handle_t *handle) {
                 (including . and ..),
                 1 for files)
    st_size     (supported only for files, where it is the real file size)
+   st_blocks   (for files, the number of 512 byte blocks of memory taken
+                by the data, which does not count holes)
    st_atim
    st_mtim
 */
@@ -634,8 +2330,6 @@ int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
     __myfs_handle_t *handle; 
     __myfs_inode_t *node;
     char *file_name;
-    int counter;
-    size_t i;
 
     handle = __myfs_get_handle(fsptr, fssize);
 
@@ -657,29 +2351,8 @@ int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
         return -1;
     }
 
-    memset(stbuf, 0, sizeof(struct stat));
-
-    stbuf->st_uid = uid;
-    stbuf->st_gid = gid;
-    stbuf->st_atim = node->accessed_time;
-    stbuf->st_mtim = node->modified_time;
-
-    if (node->type == DIRECTORY) {
-    stbuf->st_mode = S_IFDIR | 0755;
-     __myfs_inode_t *children = (__myfs_inode_t *) offset_to_ptr(handle, node->value.directory.children);
-        counter = 0;
-        for (i = (size_t) 0; i < node->value.directory.number_children; i++) {
-            if(children[i].type == DIRECTORY) {
-                counter++;
-            }
-        }
-        stbuf->st_nlink = counter;
-  } else if (node->type == REG_FILE) {
-        stbuf->st_mode = S_IFREG | 0755;
-        stbuf->st_size = node->value.file.size;
-        stbuf->st_nlink = 1;
-  }
-  return 0;
+    __myfs_inode_stat(handle, node, uid, gid, stbuf);
+    return 0;
 }
 
 /* Implements an emulation of the readdir system call on the filesystem 
@@ -756,14 +2429,86 @@ int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
     
     for (size_t i = 0; i < size; i++) {
         child = ((__myfs_inode_t *) offset_to_ptr(handle,(node->value.directory.children + i * ((size_t) sizeof(__myfs_inode_t)))));
-        names[i] = (char *) calloc(strlen(child->name), sizeof(char));
-        strcpy(names[i], child->name);
+        names[i] = (char *) calloc(((size_t) child->name_length) + 1, sizeof(char));
+        strcpy(names[i], __myfs_inode_name(handle, child));
     }
     *namesptr = names;
     return size;
 }
 
 
+/* Implements a streaming variant of readdir on the filesystem of size
+   fssize pointed to by fsptr, which allocates nothing.
+
+   If path can be followed and describes a directory, callback is 
+   called for its children (without . and ..) as 
+
+   callback(data, name, stbuf, next)
+
+   where stbuf only holds the type bits of the child in st_mode, 
+   everything else, st_ino included, being 0, as that is all a 
+   directory listing uses, and next is the cursor to continue the 
+   listing after that child. Listing starts at cursor 
+   offset, 0 being the beginning, and stops when all children have 
+   been reported or when callback returns something else than 0. The 
+   child for which that happens counts as not reported.
+
+   Children are listed from the last one to the first one. A child 
+   gets removed by moving the last child into its place, which has 
+   then been reported already; so a listing interrupted by removals
+   of reported children, as in rm -r, still reports every remaining 
+   child exactly once.
+
+   On success, 0 is returned. On failure, -1 is returned and 
+   *errnoptr is set as for __myfs_readdir_implem.
+*/
+int __myfs_readdir_cursor_implem(void *fsptr, size_t fssize, int *errnoptr,
+                                 const char *path, off_t offset,
+                                 int (*callback)(void *, const char *, const struct stat *, off_t),
+                                 void *data) {
+  __myfs_handle_t *handle;
+  __myfs_inode_t *node, *child;
+  struct stat st;
+  size_t i;
+
+  handle = __myfs_get_handle(fsptr, fssize);
+  if (handle == NULL) {
+    *errnoptr = EFAULT;
+    return -1;
+  }
+
+  node = __myfs_path_resolve(handle, path);
+  if (node == NULL) {
+    *errnoptr = ENOENT;
+    return -1;
+  }
+  if (node->type != DIRECTORY) {
+    *errnoptr = ENOTDIR;
+    return -1;
+  }
+  if (offset < (off_t) 0) {
+    *errnoptr = EINVAL;
+    return -1;
+  }
+
+  /* Cursor i + 1 means that children 0 to i - 1 are left */
+  i = node->value.directory.number_children;
+  if ((offset > (off_t) 0) && (((size_t) (offset - ((off_t) 1))) < i)) {
+    i = (size_t) (offset - ((off_t) 1));
+  }
+  /* No full stat here: the link count of a directory would cost a
+     pass over its own children */
+  memset(&st, 0, sizeof(struct stat));
+  while (i > (size_t) 0) {
+    i--;
+    child = __myfs_dir_child(handle, node, i);
+    st.st_mode = (child->type == DIRECTORY) ? S_IFDIR : S_IFREG;
+    if (callback(data, __myfs_inode_name(handle, child), &st, ((off_t) i) + ((off_t) 1)) != 0) break;
+  }
+  return 0;
+}
+
+
 
 /* Implements an emulation of the mknod system call for regular files
    on the filesystem of size fssize pointed to by fsptr.
@@ -785,9 +2530,9 @@ int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
 int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr,
                         const char *path) {
     __myfs_handle_t *handle;
-    __myfs_inode_t *node, *child;
-    char *file_name, *directory_path;
-    size_t directory_length, num_children;
+    __myfs_inode_t *node, child;
+    char *file_name;
+    size_t directory_length, name_length;
     struct timespec ts;
     clock_gettime(CLOCK_REALTIME, &ts);
 
@@ -804,56 +2549,47 @@ int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr,
     }
 
     file_name = strrchr(path, '/') + 1;
-    directory_length = strlen(path) - strlen(file_name);
-    if (strlen(file_name) >= MYFS_MAXIMUM_NAME_LENGTH) {
+    name_length = strlen(file_name);
+    directory_length = strlen(path) - name_length;
+    if (name_length >= MYFS_MAXIMUM_NAME_LENGTH) {
         *errnoptr = ENAMETOOLONG;
         return -1;
     }
     
-    directory_path = (char *) malloc((directory_length+1) * sizeof(char));
-    if (directory_path == NULL) {
-        *errnoptr = ENOMEM;
-        return -1;
-    }
-
-    strncpy(directory_path, path, directory_length);
-    directory_path[directory_length] = '\0';
-    
-    node = __myfs_path_resolve(handle, directory_path);
+    node = __myfs_path_resolve_len(handle, path, directory_length);
     if (node == NULL) {
-        free(directory_path);
         *errnoptr = ENOENT;
         return -1;
     }
 
-    node->value.directory.number_children++;
-    num_children = node->value.directory.number_children;
-
-    if (num_children == 1) {
-       node->value.directory.children = __myfs_allocate_memory(handle, ((size_t) sizeof(__myfs_inode_t)));
-        if (node->value.directory.children == (__myfs_offset_t) 0) {
-            *errnoptr = ENOMEM;
-            return -1;
-        }
-    } else {
-       node->value.directory.children = __myfs_reallocate_memory(handle,
-                node->value.directory.children, num_children * ((size_t) sizeof(__myfs_inode_t)));
-        if (node->value.directory.children == (__myfs_offset_t) 0) {
-            *errnoptr = ENOMEM;
-            return -1;
-        }
+    if (node->type != DIRECTORY) {
+        *errnoptr = ENOTDIR;
+        return -1;
     }
 
-    child = (__myfs_inode_t *) offset_to_ptr(handle, (node->value.directory.children + (num_children - 1) * ((size_t) sizeof(__myfs_inode_t)))); 
-
-    strcpy(child->name, file_name);
-    child->type = REG_FILE;
-    child->modified_time = ts;
-    child->accessed_time = ts;
-    child->value.file.size = (size_t) 0;
-    child->value.file.first_block = (__myfs_offset_t) 0;
+    if (__myfs_dir_lookup(handle, node, file_name, name_length, NULL) != NULL) {
+        *errnoptr = EEXIST;
+        return -1;
+    }
 
-    free(directory_path);
+    memset(&child, 0, sizeof(__myfs_inode_t));
+    if (__myfs_inode_set_name(handle, &child, file_name, name_length) != 0) {
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+    child.type = REG_FILE;
+    child.modified_time = ts;
+    child.accessed_time = ts;
+    child.value.file.size = (size_t) 0;
+    child.value.file.extents = (__myfs_offset_t) 0;
+    child.value.file.number_extents = (size_t) 0;
+    child.value.file.extents_size = (size_t) 0;
+
+    if (__myfs_dir_append_child(handle, node, &child) == NULL) {
+        __myfs_inode_drop_name(handle, &child);
+        *errnoptr = ENOMEM;
+        return -1;
+    }
     return 0;
 }
 
@@ -880,10 +2616,9 @@ int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr,
                         const char *path) {
 
   __myfs_handle_t *handle;
-  __myfs_inode_t *file_node, *dir_node, *node;
-  char *file_name, *dir_path;
-  size_t dir_len;
-  __myfs_file_block_t *prev, *file_block;
+  __myfs_inode_t *dir_node, *node;
+  char *file_name;
+  size_t dir_len, position;
   
   handle = __myfs_get_handle(fsptr, fssize);
   if (handle == NULL) {
@@ -891,67 +2626,28 @@ int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr,
     return -1;
   }
   
-  
-  file_node = __myfs_path_resolve(handle, path);
-  if (file_node == NULL) {
-    *errnoptr = ENOENT;
-    return -1;
-  }
-  
-  if (file_node->type == DIRECTORY) {
-    *errnoptr = EISDIR;
-    return -1;
-  }
-  
   file_name = strrchr(path, '/') + 1;
   dir_len = strlen(path) - strlen(file_name);
   
-  dir_path = (char *) malloc((dir_len+1) * sizeof(char));
-  if (dir_path == NULL) {
-    *errnoptr = ENOMEM;
-    return -1;
-  }
-  strncpy(dir_path, path, dir_len);
-  dir_path[dir_len] = '\0';
-  
-  dir_node = __myfs_path_resolve(handle, dir_path);
+  dir_node = __myfs_path_resolve_len(handle, path, dir_len);
   if (dir_node == NULL) {
-    free(dir_path);
     *errnoptr = ENOENT;
     return -1;
   }
   
-  for (size_t i = 0; i < dir_node->value.directory.number_children; i++) {
-    node = (__myfs_inode_t *) offset_to_ptr(handle,dir_node->value.directory.children + i * ((size_t) sizeof(__myfs_inode_t)));
-    if (strcmp(node->name, file_name) == 0) {
-      break;
-    }
-  }
-  
-  for (file_block = (__myfs_file_block_t *) offset_to_ptr(handle,node->value.file.first_block),
-       prev = NULL; file_block != NULL;
-       prev = file_block, file_block = (__myfs_file_block_t *) offset_to_ptr(handle,file_block->next)) {
-    
-    if (file_block->data != (__myfs_offset_t) 0) file_block->data = __myfs_reallocate_memory(handle,file_block->data, (size_t) 0);
-    if (prev != NULL) {
-      prev = (__myfs_file_block_t *) __myfs_reallocate_memory(handle, ptr_to_offset((void *) prev, handle), (size_t) 0);
-    } 
-  }
-  
-  if (prev != NULL) {
-    prev = (__myfs_file_block_t *) __myfs_reallocate_memory(handle, ptr_to_offset((void *) prev, handle), (size_t) 0);
+  node = __myfs_dir_lookup(handle, dir_node, file_name, strlen(file_name), &position);
+  if (node == NULL) {
+    *errnoptr = ENOENT;
+    return -1;
   }
 
-  node->value.file.size = (size_t) 0;
-  
-  if (dir_node->value.directory.number_children > 1) {
-    memcpy((void *) node, offset_to_ptr(handle, (dir_node->value.directory.children + (dir_node->value.directory.number_children - 1) * ((size_t) sizeof(__myfs_inode_t)))), ((size_t) sizeof(__myfs_inode_t)));
+  if (node->type == DIRECTORY) {
+    *errnoptr = EISDIR;
+    return -1;
   }
-
-  dir_node->value.directory.number_children--;
-  dir_node->value.directory.children = __myfs_reallocate_memory(handle,dir_node->value.directory.children, (dir_node->value.directory.number_children * ((size_t) sizeof(__myfs_inode_t))));
   
-  free(dir_path);
+  __myfs_file_shrink(handle, &node->value.file, (size_t) 0);
+  __myfs_dir_remove_child(handle, dir_node, position);
   return 0;
 }
 
@@ -977,9 +2673,9 @@ int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr,
                         const char *path) {
 
     __myfs_handle_t *handle;
-    __myfs_inode_t *file_node, *dir_node, *node;
-    char *dir_name, *dir_path;
-    size_t dir_len;
+    __myfs_inode_t *dir_node, *node;
+    char *dir_name;
+    size_t dir_len, position;
 
     handle = __myfs_get_handle(fsptr, fssize);
     if (handle == NULL){
@@ -987,59 +2683,33 @@ int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr,
         return -1;
     }
 
-   // printf("RMDIR %s\n", path);
-
-    file_node = __myfs_path_resolve(handle, path);
-    if (file_node == NULL){
-        *errnoptr = ENOENT;
-        return -1;
-    }
-
-    if (file_node->value.directory.number_children != 0){
-        *errnoptr = ENOTEMPTY;
-        return -1;
-    }
-
     dir_name = strrchr(path, '/') + 1;
     dir_len = strlen(path) - strlen(dir_name);
 
-    dir_path = (char *) malloc((dir_len+1) * sizeof(char));
-    if (dir_path == NULL){
-        *errnoptr = ENOMEM;
-        return -1;
-    }
-    strncpy(dir_path, path, dir_len);
-    dir_path[dir_len] = '\0';
-    
-    dir_node = __myfs_path_resolve(handle, dir_path);
+    dir_node = __myfs_path_resolve_len(handle, path, dir_len);
     if (dir_node == NULL){
-        free(dir_path);
         *errnoptr = ENOENT;
         return -1;
     }
 
-
-    for (size_t i = 0; i < dir_node->value.directory.number_children; i++){
-        node = (__myfs_inode_t *) offset_to_ptr(handle,
-               dir_node->value.directory.children + i * ((size_t) sizeof(__myfs_inode_t)));
-
-        if (strcmp(node->name, dir_name) == 0){
-            break;
-        }
+    node = __myfs_dir_lookup(handle, dir_node, dir_name, strlen(dir_name), &position);
+    if (node == NULL){
+        *errnoptr = (strlen(dir_name) == (size_t) 0) ? EBUSY : ENOENT;
+        return -1;
     }
 
-    if (dir_node->value.directory.number_children > 1) {
-        memcpy((void *) node, offset_to_ptr(handle, (dir_node->value.directory.children 
-                + (dir_node->value.directory.number_children - 1) * ((size_t) sizeof(__myfs_inode_t)))),
-            ((size_t) sizeof(__myfs_inode_t)));
+    if (node->type != DIRECTORY){
+        *errnoptr = ENOTDIR;
+        return -1;
     }
 
-    dir_node->value.directory.number_children--;
-    dir_node->value.directory.children = __myfs_reallocate_memory(handle,
-            dir_node->value.directory.children, (dir_node->value.directory.number_children
-                * ((size_t) sizeof(__myfs_inode_t))));
+    if (node->value.directory.number_children != 0){
+        *errnoptr = ENOTEMPTY;
+        return -1;
+    }
 
-    free(dir_path);
+    __myfs_dir_index_drop(handle, node);
+    __myfs_dir_remove_child(handle, dir_node, position);
     return 0;
 }
 
@@ -1058,9 +2728,9 @@ int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr,
 int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr,
                         const char *path) {
     __myfs_handle_t *handle;
-    __myfs_inode_t *node, *child, *dir_node;
-    char *dir_name, *dir_path;
-    size_t dir_len, num_children;
+    __myfs_inode_t *node, child;
+    char *dir_name;
+    size_t dir_len, name_len;
     struct timespec ts;
     clock_gettime(CLOCK_REALTIME, &ts);
 
@@ -1075,61 +2745,48 @@ int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr,
         return -1;
     }
 
-    dir_node = __myfs_path_resolve(fsptr, path);
-    if (dir_node != NULL){
-        *errnoptr = EEXIST;
-        return -1;
-    }
-
     dir_name = strrchr(path, '/') + 1;
-    dir_len = strlen(path) - strlen(dir_name);
-    if (strlen(dir_name) >= MYFS_MAXIMUM_NAME_LENGTH){
+    name_len = strlen(dir_name);
+    dir_len = strlen(path) - name_len;
+    if (name_len >= MYFS_MAXIMUM_NAME_LENGTH){
         *errnoptr = ENAMETOOLONG;
         return -1;
     }
 
-    dir_path = malloc((dir_len+1) * sizeof(char));
-    if (dir_path == NULL){
-        *errnoptr = ENOMEM;
-        return -1;
-    }
-    strncpy(dir_path, path, dir_len);
-    dir_path[dir_len] = '\0';
-    
-    node = __myfs_path_resolve(handle, dir_path);
+    node = __myfs_path_resolve_len(handle, path, dir_len);
     if (node == NULL) {
-        free(dir_path);
         *errnoptr = ENOENT;
         return -1;
     }
 
-    node->value.directory.number_children++;
-    num_children = node->value.directory.number_children;
-
-    if (num_children == 1) {
-       node->value.directory.children = __myfs_allocate_memory(handle, ((size_t) sizeof(__myfs_inode_t)));
-        if (node->value.directory.children == (__myfs_offset_t) 0) {
-            *errnoptr = ENOMEM;
-            return -1;
-        }
-    } else {
-       node->value.directory.children = __myfs_reallocate_memory(handle, node->value.directory.children, num_children * ((size_t) sizeof(__myfs_inode_t)));
-        if (node->value.directory.children == (__myfs_offset_t) 0) {
-            *errnoptr = ENOMEM;
-            return -1;
-        }
+    if (node->type != DIRECTORY) {
+        *errnoptr = ENOTDIR;
+        return -1;
     }
 
-    child = (__myfs_inode_t *) offset_to_ptr(handle, (node->value.directory.children  + (num_children-1) * ((size_t) sizeof(__myfs_inode_t)))); 
-
-    strcpy(child->name, dir_name);
-    child->type = DIRECTORY;
-    child->modified_time = ts;
-    child->accessed_time = ts;
-    child->value.directory.number_children = (size_t) 0;
-    child->value.directory.children = (__myfs_offset_t) 0;
+    if (__myfs_dir_lookup(handle, node, dir_name, name_len, NULL) != NULL){
+        *errnoptr = EEXIST;
+        return -1;
+    }
 
-    free(dir_path);
+    memset(&child, 0, sizeof(__myfs_inode_t));
+    if (__myfs_inode_set_name(handle, &child, dir_name, name_len) != 0) {
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+    child.type = DIRECTORY;
+    child.modified_time = ts;
+    child.accessed_time = ts;
+    child.value.directory.number_children = (size_t) 0;
+    child.value.directory.children = (__myfs_offset_t) 0;
+    child.value.directory.index = (__myfs_offset_t) 0;
+    child.value.directory.index_size = (size_t) 0;
+
+    if (__myfs_dir_append_child(handle, node, &child) == NULL) {
+        __myfs_inode_drop_name(handle, &child);
+        *errnoptr = ENOMEM;
+        return -1;
+    }
     return 0;
 }
 
@@ -1147,9 +2804,9 @@ int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
                          const char *from, const char *to) {
 
   __myfs_handle_t *handle;
-  __myfs_inode_t *from_file, *from_dir, *to_dir;
-  char *from_file_name, *to_file_name, *from_dir_name, *to_dir_name;
-  size_t from_dir_len, to_dir_len;
+  __myfs_inode_t *from_file, *from_dir, *to_dir, *to_file, moved;
+  char *from_file_name, *to_file_name;
+  size_t from_dir_len, to_dir_len, from_name_len, to_name_len, from_len, position;
   
   if (strcmp(from , to) == 0)
     return 0;
@@ -1160,77 +2817,100 @@ int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
     return -1;
   }
   
-  from_file = __myfs_path_resolve(handle, from);
-  if (from_file == NULL) {
-    *errnoptr = ENOENT;
-    return -1;
-  }
-  
   to_file_name = strrchr(to, '/') + 1;
-  to_dir_len = strlen(to) - strlen(to_file_name);
+  to_name_len = strlen(to_file_name);
+  to_dir_len = strlen(to) - to_name_len;
   from_file_name = strrchr(from, '/') + 1;
-  from_dir_len = strlen(from) - strlen(from_file_name);
+  from_name_len = strlen(from_file_name);
+  from_dir_len = strlen(from) - from_name_len;
   
-  if (strlen(to_file_name) >= MYFS_MAXIMUM_NAME_LENGTH) {
+  if (to_name_len >= MYFS_MAXIMUM_NAME_LENGTH) {
     *errnoptr = ENAMETOOLONG;
     return -1;
   }
   
-  to_dir_name = (char *) malloc((to_dir_len + 1) * sizeof(char));
-  from_dir_name = (char *) malloc((from_dir_len+1) * sizeof(char));
-  if (from_dir_name == NULL || to_dir_name == NULL) {
-    *errnoptr = ENOMEM;
+  from_dir = __myfs_path_resolve_len(handle, from, from_dir_len);
+  if (from_dir == NULL){
+    *errnoptr = ENOENT;
+    return -1;
+  }
+
+  from_file = __myfs_dir_lookup(handle, from_dir, from_file_name, from_name_len, &position);
+  if (from_file == NULL) {
+    *errnoptr = ENOENT;
     return -1;
   }
   
-  strncpy(from_dir_name, from, from_dir_len);
-  from_dir_name[from_dir_len] = '\0';
-  
-  strncpy(to_dir_name, to, to_dir_len);
-  to_dir_name[to_dir_len] = '\0';
-  
-  from_dir = __myfs_path_resolve(handle, from_dir_name);
-  if (from_dir == NULL){
-    free(from_dir_name);
-    free(to_dir_name);
+  to_dir = __myfs_path_resolve_len(handle, to, to_dir_len);
+  if (to_dir == NULL) {
     *errnoptr = ENOENT;
     return -1;
   }
+
+  if (to_dir->type != DIRECTORY) {
+    *errnoptr = ENOTDIR;
+    return -1;
+  }
+
+  /* A directory cannot be moved into its own subtree */
+  from_len = strlen(from);
+  if ((from_file->type == DIRECTORY) && (strncmp(from, to, from_len) == 0) && (to[from_len] == '/')) {
+    *errnoptr = EINVAL;
+    return -1;
+  }
+
+  /* An existing target gets replaced. Removing it may move inodes 
+     around, so everything is resolved again afterwards. */
+  to_file = __myfs_dir_lookup(handle, to_dir, to_file_name, to_name_len, NULL);
+  if (to_file != NULL) {
+    if (to_file->type == DIRECTORY) {
+      if (from_file->type != DIRECTORY) {
+        *errnoptr = EISDIR;
+        return -1;
+      }
+      if (__myfs_rmdir_implem(fsptr, fssize, errnoptr, to) != 0) {
+        return -1;
+      }
+    } else {
+      if (from_file->type == DIRECTORY) {
+        *errnoptr = ENOTDIR;
+        return -1;
+      }
+      if (__myfs_unlink_implem(fsptr, fssize, errnoptr, to) != 0) {
+        return -1;
+      }
+    }
+    from_dir = __myfs_path_resolve_len(handle, from, from_dir_len);
+    from_file = __myfs_dir_lookup(handle, from_dir, from_file_name, from_name_len, &position);
+    to_dir = __myfs_path_resolve_len(handle, to, to_dir_len);
+  }
   
-  to_dir = __myfs_path_resolve(handle, to_dir_name);
-  if (to_dir == NULL) {
-    free(from_dir_name);
-    free(to_dir_name);
-    *errnoptr = ENOENT;
+  /* moved gets the new name, from_file keeps the old one until it is
+     out of the index */
+  memcpy(&moved, from_file, sizeof(__myfs_inode_t));
+  if (__myfs_inode_set_name(handle, &moved, to_file_name, to_name_len) != 0) {
+    *errnoptr = ENOSPC;
     return -1;
   }
-  
-  strcpy(from_file->name, to_file_name);
-  
-  if (strcmp(from_dir_name, to_dir_name) == 0) {
-    free(from_dir_name);
-    free(to_dir_name);
+
+  if (from_dir == to_dir) {
+    __myfs_dir_index_remove(handle, from_dir, position);
+    __myfs_inode_drop_name(handle, from_file);
+    memcpy(from_file, &moved, sizeof(__myfs_inode_t));
+    __myfs_mark_dirty(handle, from_file, sizeof(__myfs_inode_t));
+    __myfs_dir_index_insert(handle, from_dir, position);
     return 0;
   }
-  
-  to_dir->value.directory.number_children++;
-  if (to_dir->value.directory.children == (__myfs_offset_t) 0) {
-    to_dir->value.directory.children = __myfs_allocate_memory(handle,(to_dir->value.directory.number_children * ((size_t) sizeof(__myfs_inode_t))));
-  } else {
-    to_dir->value.directory.children = __myfs_reallocate_memory(handle,to_dir->value.directory.children, (to_dir->value.directory.number_children * ((size_t) sizeof(__myfs_inode_t))));
-  }
-  
-  memmove(offset_to_ptr(handle, (to_dir->value.directory.children + (to_dir->value.directory.number_children - 1) * ((size_t) sizeof(__myfs_inode_t)))), (void *) from_file, ((size_t) sizeof(__myfs_inode_t)));
-  
-  from_file->value.file.size = (size_t) 0;
-  if (from_dir->value.directory.number_children > 1) {
-    memmove((void *) from_file, offset_to_ptr(handle,(from_dir->value.directory.children + (from_dir->value.directory.number_children - 1) * ((size_t) sizeof(__myfs_inode_t)))), ((size_t) sizeof(__myfs_inode_t)));
+
+  if (__myfs_dir_append_child(handle, to_dir, &moved) == NULL) {
+    __myfs_inode_drop_name(handle, &moved);
+    *errnoptr = ENOMEM;
+    return -1;
   }
-  from_dir->value.directory.number_children--;
-  from_dir->value.directory.children = __myfs_reallocate_memory(handle,from_dir->value.directory.children, (from_dir->value.directory.number_children * ((size_t) sizeof(__myfs_inode_t))));
   
-  free(from_dir_name);
-  free(to_dir_name);
+  /* Growing to_dir may have moved from_dir when it is one of its children */
+  from_dir = __myfs_path_resolve_len(handle, from, from_dir_len);
+  __myfs_dir_remove_child(handle, from_dir, position);
   return 0;
 }
 
@@ -1263,8 +2943,7 @@ int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
   
   __myfs_handle_t *handle; 
   __myfs_inode_t *node;
-  __myfs_file_block_t *file_block, *prev;
-  off_t new_offset;
+  size_t old_size;
   
   handle = __myfs_get_handle(fsptr, fssize);
   if (handle == NULL){
@@ -1272,6 +2951,11 @@ int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
     return -1;
   }
   
+  if (offset < (off_t) 0) {
+    *errnoptr = EINVAL;
+    return -1;
+  }
+
   node = __myfs_path_resolve(handle, path);
   if (node == NULL){
     *errnoptr = ENOENT;
@@ -1283,80 +2967,17 @@ int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
     return -1;
   }
   
-  if (node->value.file.size == (size_t) 0) {
-    if ((offset + ((size_t) sizeof(__myfs_file_block_t))) > (off_t) __myfs_total_size(handle)) {
-      *errnoptr = ENOMEM;
-      return -1;
-    }
-    
-    node->value.file.first_block = __myfs_allocate_memory(handle, ((size_t) sizeof(__myfs_file_block_t)));
-    
-    if (node->value.file.first_block == (__myfs_offset_t) 0) {
-      *errnoptr = ENOMEM;
-      return -1;
-    }
-    
-    file_block = (__myfs_file_block_t *) offset_to_ptr(handle,node->value.file.first_block);
-    node->value.file.size = offset;
-    
-  } else if (offset > node->value.file.size) {
-    if ((offset + ((size_t) sizeof(__myfs_file_block_t))) > (off_t) __myfs_total_size(handle)) {
-      *errnoptr = ENOMEM;
-      return -1;
-    }
-    for (file_block = (__myfs_file_block_t *) offset_to_ptr(handle,node->value.file.first_block), prev = NULL; 
-	 file_block != NULL;
-	 prev = file_block, file_block = (__myfs_file_block_t *) offset_to_ptr(handle,file_block->next));
-    
-    prev->next = __myfs_allocate_memory(handle, ((size_t) sizeof(__myfs_file_block_t)));
-    if (prev->next == (__myfs_offset_t) 0) {
-      *errnoptr = ENOMEM;
-      return -1;
-    }
-    
-    file_block = (__myfs_file_block_t *) offset_to_ptr(handle, prev->next);
-    node->value.file.size = offset;
-  } else {
-    node->value.file.size = offset;
-    new_offset = offset; 
-    for (file_block = (__myfs_file_block_t *) offset_to_ptr(handle,node->value.file.first_block); file_block != NULL;
-	  file_block = (__myfs_file_block_t *) offset_to_ptr(handle,file_block->next)) {
-      
-      if (new_offset > file_block->size) {
-        new_offset -= file_block->size;
-      } else {
-	      break;
-      }
-    }
-    
-    file_block->data = __myfs_reallocate_memory(handle, file_block->data, new_offset);
-    file_block->size = new_offset;
-    prev = NULL;
-    file_block = (__myfs_file_block_t *) offset_to_ptr(handle, file_block->next);
-    while (file_block != NULL) {
-      if (prev != NULL) {
-	      prev = (__myfs_file_block_t *) __myfs_reallocate_memory(handle, ptr_to_offset((void *)prev, handle), (size_t) 0);
-      }
-      
-      __myfs_free_impl(handle, file_block->data);
-      prev = file_block;
-      file_block = (__myfs_file_block_t *) offset_to_ptr(handle,file_block->next);
-    }
-    if (prev != NULL) {
-      __myfs_free_impl(handle, ptr_to_offset((void *) prev, handle));
+  old_size = node->value.file.size;
+  if ((size_t) offset <= old_size) {
+    if ((size_t) offset < old_size) {
+      __myfs_file_shrink(handle, &node->value.file, (size_t) offset);
     }
     return 0;
   }
-    
-  file_block->next = (__myfs_offset_t) 0;
-  file_block->data = __myfs_allocate_memory(handle, offset);
-  if (file_block->data == (__myfs_offset_t) 0) {
-    *errnoptr = ENOMEM;
-    return -1;
-  }
-  file_block->size = offset;
-  memset(offset_to_ptr(handle, file_block->data), '\0', offset);
-  
+
+  /* Extending only moves the end, the new bytes are a hole */
+  node->value.file.size = (size_t) offset;
+  __myfs_mark_dirty(handle, &node->value.file, sizeof(__myfs_inode_file_t));
   return 0;
 }
 
@@ -1429,10 +3050,7 @@ int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
                        const char *path, char *buf, size_t size, off_t offset) {
   __myfs_handle_t *handle; 
   __myfs_inode_t *node;
-  __myfs_file_block_t *file_block;
-  size_t new_size;
-  off_t new_offset;
-  int num_bytes = 0;
+  size_t num_bytes;
   
   handle = __myfs_get_handle(fsptr, fssize);
   if (handle == NULL){
@@ -1440,6 +3058,11 @@ int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
     return -1;
   }
   
+  if (offset < (off_t) 0) {
+    *errnoptr = EINVAL;
+    return -1;
+  }
+
   node = __myfs_path_resolve(handle, path);
   if (node == NULL) {
     *errnoptr = ENOENT;
@@ -1451,39 +3074,16 @@ int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
     return -1;
   }
   
-  if ((size_t) offset > node->value.file.size) {
+  if ((size_t) offset >= node->value.file.size) {
     return 0;
   }
   
-  new_size = size;
-  new_offset = offset;
-  for (file_block = (__myfs_file_block_t *) offset_to_ptr(handle,node->value.file.first_block);
-       file_block != NULL;
-       file_block = (__myfs_file_block_t *) offset_to_ptr(handle,file_block->next)) {
-    if (new_offset > file_block->size) {
-      new_offset -= file_block->size;
-    } else {
-      break;
-    }
-  }
-  while (file_block != NULL) {
-    if (((size_t) new_offset + new_size) < file_block->size) {
-      memcpy(buf+num_bytes, offset_to_ptr(handle, ((size_t) new_offset + file_block->data)), new_size);
-      num_bytes += (int) new_size;
-      break;
-    } else {
-      new_size -= (file_block->size - new_offset);     
-      memcpy(buf + num_bytes, offset_to_ptr(handle, ((size_t) new_offset + file_block->data)), (file_block->size - new_offset));
-      num_bytes += (int) (file_block->size - new_offset);
-    }
-    
-    if (new_offset != (off_t) 0) {
-      new_offset = 0;
-    }
-    
-    file_block = (__myfs_file_block_t *) offset_to_ptr(handle, file_block->next);
+  num_bytes = node->value.file.size - ((size_t) offset);
+  if (num_bytes > size) {
+    num_bytes = size;
   }
-  return num_bytes;
+  __myfs_file_read(handle, &node->value.file, buf, num_bytes, (size_t) offset);
+  return (int) num_bytes;
 }
 
 /* Implements an emulation of the write system call on the filesystem 
@@ -1513,8 +3113,8 @@ int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
                         const char *path, const char *buf, size_t size, off_t offset) {
   __myfs_handle_t *handle; 
   __myfs_inode_t *node;
-  __myfs_file_block_t *file_block;
-  int num_bytes;
+  __myfs_inode_file_t *file;
+  size_t old_size, overwrite, num_bytes;
   
   handle = __myfs_get_handle(fsptr, fssize);
   if (handle == NULL) {
@@ -1522,6 +3122,11 @@ int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
     return -1;
   }
   
+  if (offset < (off_t) 0) {
+    *errnoptr = EINVAL;
+    return -1;
+  }
+
   node = __myfs_path_resolve(handle, path);
   if (node == NULL) {
     *errnoptr = ENOENT;
@@ -1533,61 +3138,192 @@ int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
     return -1;
   }
   
-  if (node->value.file.size == (size_t) 0) {
-    node->value.file.first_block = __myfs_allocate_memory(handle, ((size_t) sizeof(__myfs_file_block_t)));
-    
-    if (node->value.file.first_block == (size_t) 0) {
-      *errnoptr = ENOMEM;
-      return -1;
-    }
+  file = &node->value.file;
+  
+  /* Writing past the end leaves a hole up to offset */
+  old_size = file->size;
+  if ((size != (size_t) 0) && ((size_t) offset > file->size)) {
+    file->size = (size_t) offset;
+    __myfs_mark_dirty(handle, file, sizeof(__myfs_inode_file_t));
   }
   
-  if (offset > node->value.file.size) {
-    return 0;
+  /* Write what is inside the file in place, append the rest */
+  overwrite = (file->size > (size_t) offset) ? (file->size - ((size_t) offset)) : ((size_t) 0);
+  if (overwrite > size) {
+    overwrite = size;
+  }
+  num_bytes = __myfs_file_overwrite(handle, file, buf, overwrite, (size_t) offset);
+  if ((num_bytes == overwrite) && (overwrite < size)) {
+    num_bytes += __myfs_file_append(handle, file, buf + overwrite, size - overwrite);
+  }
+
+  if ((num_bytes == (size_t) 0) && (size != (size_t) 0)) {
+    file->size = old_size;
+    __myfs_mark_dirty(handle, file, sizeof(__myfs_inode_file_t));
+    *errnoptr = ENOMEM;
+    return -1;
   }
+  return (int) num_bytes;
+}
+
+
+/* Implements the part of the write system call that can be done 
+   without changing the layout of the filesystem: overwriting bytes
+   that are already inside the file indicated by path.
+
+   Nothing but file contents gets written, so the caller only needs
+   to keep other readers and writers of the same file out, not the 
+   whole filesystem.
+
+   On success, size is returned.
+
+   If the write would need to allocate memory (it reaches beyond the
+   end of the file or into a hole), nothing is written, -1 is returned and *errnoptr
+   is set to EAGAIN; the caller must retry with __myfs_write_implem.
+
+   On other failures, -1 is returned and *errnoptr is set as for 
+   __myfs_write_implem.
+*/
+int __myfs_overwrite_implem(void *fsptr, size_t fssize, int *errnoptr,
+                            const char *path, const char *buf, size_t size, off_t offset) {
+  __myfs_handle_t *handle; 
+  __myfs_inode_t *node;
   
-  file_block = (__myfs_file_block_t *) offset_to_ptr(handle, node->value.file.first_block);
+  handle = __myfs_get_handle(fsptr, fssize);
+  if (handle == NULL) {
+    *errnoptr = EFAULT;  
+    return -1;
+  }
   
-  if (node->value.file.size == (size_t) 0) {
-    file_block->data = __myfs_allocate_memory(handle, size);
-    
-    if (file_block->data == (size_t) 0) {
-      *errnoptr = ENOMEM;
-      return -1;
-    }
-    
-    file_block->size = size;
-    file_block->next = (__myfs_offset_t) 0;
-    node->value.file.size = size;
+  if (offset < (off_t) 0) {
+    *errnoptr = EINVAL;
+    return -1;
   }
-    
-  else if (((size_t) offset + size) > node->value.file.size) {
-    for (file_block = (__myfs_file_block_t*) offset_to_ptr(handle,node->value.file.first_block);
-	 file_block->next != (__myfs_offset_t) 0;
-	 file_block = (__myfs_file_block_t *) offset_to_ptr(handle,file_block->next));
-    
-    file_block->next = __myfs_allocate_memory(handle, ((size_t) sizeof(__myfs_file_block_t)));
-    
-    if (file_block->next == (size_t) 0){
-      *errnoptr = ENOMEM;
-      return -1;
-    }
-    
-    file_block = (__myfs_file_block_t *) offset_to_ptr(handle,file_block->next);
-    file_block->data = __myfs_allocate_memory(handle, size);
-    
-    if (file_block->data == (size_t) 0) {
-      *errnoptr = ENOMEM;
-      return -1;
-    }
-    file_block->next = (__myfs_offset_t) 0;
-    file_block->size = size;
-    node->value.file.size += size;
+
+  node = __myfs_path_resolve(handle, path);
+  if (node == NULL) {
+    *errnoptr = ENOENT;
+    return -1;
   }
-  num_bytes = (size_t) size;
-  memcpy(offset_to_ptr(handle, file_block->data), buf, size);
   
-  return num_bytes;
+  if (node->type == DIRECTORY) {
+    *errnoptr = EISDIR;
+    return -1;
+  }
+
+  if ((size > node->value.file.size) || 
+      (((size_t) offset) > node->value.file.size - size) ||
+      (!__myfs_file_backed(handle, &node->value.file, size, (size_t) offset))) {
+    *errnoptr = EAGAIN;
+    return -1;
+  }
+
+  __myfs_file_overwrite(handle, &node->value.file, buf, size, (size_t) offset);
+  return (int) size;
+}
+
+
+/* Maps the bytes of the file indicated by path starting at offset
+   onto the filesystem of size fssize pointed to by fsptr, so that 
+   the caller can move them without an intermediate copy. 
+
+   For every run of bytes stored contiguously, callback is called as
+   callback(data, start, len), start being the offset of the run in the
+   filesystem, or 0 for a run of a hole, which reads as zeros. 
+
+   Without write, up to size bytes are mapped, stopping at the end of
+   the file. The bytes only stay where they are while the caller keeps
+   the file from changing. 
+
+   With write, the callback is expected to fill the runs and they get
+   marked dirty afterwards. The size bytes must lie inside the file 
+   and must not touch a hole; otherwise nothing is mapped, -1 is 
+   returned and *errnoptr is set to EAGAIN, as for 
+   __myfs_overwrite_implem. This needs the same locking as that.
+
+   Returns the number of bytes mapped. If callback returns something 
+   else than 0, mapping stops, -1 is returned and *errnoptr is set to
+   EIO. Other errors are reported as for __myfs_read_implem.
+*/
+int __myfs_map_implem(void *fsptr, size_t fssize, int *errnoptr,
+                      const char *path, size_t size, off_t offset, int write,
+                      int (*callback)(void *, size_t, size_t), void *data) {
+  __myfs_handle_t *handle;
+  __myfs_inode_t *node;
+  __myfs_inode_file_t *file;
+  __myfs_extent_t *extents;
+  size_t i, pos, end, in, chunk, hole_end, start;
+  int res;
+
+  handle = __myfs_get_handle(fsptr, fssize);
+  if (handle == NULL) {
+    *errnoptr = EFAULT;
+    return -1;
+  }
+
+  if (offset < (off_t) 0) {
+    *errnoptr = EINVAL;
+    return -1;
+  }
+
+  node = __myfs_path_resolve(handle, path);
+  if (node == NULL) {
+    *errnoptr = ENOENT;
+    return -1;
+  }
+
+  if (node->type == DIRECTORY) {
+    *errnoptr = EISDIR;
+    return -1;
+  }
+  file = &node->value.file;
+
+  pos = (size_t) offset;
+  if (pos >= file->size) {
+    if (!write) return 0;
+    *errnoptr = EAGAIN;
+    return -1;
+  }
+  end = (size > file->size - pos) ? file->size : (pos + size);
+  if (write && (end - pos != size)) {
+    *errnoptr = EAGAIN;
+    return -1;
+  }
+
+  /* A hole in the way needs memory first */
+  if (write && (!__myfs_file_backed(handle, file, size, pos))) {
+    *errnoptr = EAGAIN;
+    return -1;
+  }
+
+  extents = __myfs_file_extents(handle, file);
+  i = __myfs_file_find_extent(handle, file, pos);
+
+  for (start = pos; pos < end; pos += chunk) {
+    if ((i < file->number_extents) && (extents[i].file_offset <= pos)) {
+      in = pos - extents[i].file_offset;
+      chunk = extents[i].length - in;
+      if (chunk > end - pos) chunk = end - pos;
+      res = callback(data, (size_t) (extents[i].data + in), chunk);
+      if (write) {
+        __myfs_mark_dirty_data(handle, offset_to_ptr(handle, extents[i].data + in), chunk);
+      }
+      if (res != 0) {
+        *errnoptr = EIO;
+        return -1;
+      }
+      i++;
+    } else {
+      hole_end = (i < file->number_extents) ? extents[i].file_offset : file->size;
+      chunk = hole_end - pos;
+      if (chunk > end - pos) chunk = end - pos;
+      if (callback(data, (size_t) 0, chunk) != 0) {
+        *errnoptr = EIO;
+        return -1;
+      }
+    }
+  }
+  return (int) (end - start);
 }
 
 
@@ -1621,6 +3357,7 @@ int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr,
   
   node->accessed_time = ts[0];
   node->modified_time = ts[1];
+  __myfs_mark_dirty(handle, node, sizeof(__myfs_inode_t));
   
   return 0;
 }
@@ -1643,6 +3380,8 @@ int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr,
    f_bsize   fill with what you call a block (typically 1024 bytes)
    f_blocks  fill with the total number of blocks in the filesystem
    f_bfree   fill with the free number of blocks in the filesystem
+             (holes in files take none, so the sizes of the files
+             can add up to more than f_blocks)
    f_bavail  fill with same value as f_bfree
    f_namemax fill with your maximum file/directory name, if your
    filesystem has such a maximum
@@ -1680,3 +3419,316 @@ int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr,
   stbuf->f_namemax = (u_long) MYFS_MAXIMUM_NAME_LENGTH; // 256 characters 
   return 0;
 }
+
+/* Hands out the parts of the filesystem of size fssize pointed to by
+   fsptr that changed since they were last handed out, so that they 
+   can be written back.
+
+   Searches for the first run of dirty bytes at or after byte offset
+   from, marks it clean and puts its offset into *start and its length
+   into *len. Runs start on multiples of MYFS_DIRTY_CHUNK_SIZE and end
+   on one as well, or at fssize. Passing the end of one run as from
+   for the next call walks over all dirty runs in order.
+
+   When no dirty map could be allocated, the whole filesystem is 
+   handed out as a single run.
+
+   Returns 1 if a run was found, 0 if there is nothing dirty at or 
+   after from. On failure, -1 is returned and *errnoptr is set.
+*/
+int __myfs_dirty_range_implem(void *fsptr, size_t fssize, int *errnoptr,
+                              size_t from, size_t *start, size_t *len) {
+  __myfs_handle_t *handle;
+  uint64_t *map, bits, mask;
+  size_t word, first, end, stop;
+
+  handle = __myfs_get_handle(fsptr, fssize);
+  if (handle == NULL) {
+    *errnoptr = EFAULT;
+    return -1;
+  }
+
+  if (handle->dirty_map == (__myfs_offset_t) 0) {
+    if (from != (size_t) 0) return 0;
+    *start = (size_t) 0;
+    *len = fssize;
+    return 1;
+  }
+
+  map = (uint64_t *) offset_to_ptr(handle, handle->dirty_map);
+  first = from / MYFS_DIRTY_CHUNK_SIZE;
+  word = first >> 6;
+  if (word >= handle->dirty_words) return 0;
+
+  /* Find the first dirty chunk ... */
+  bits = __atomic_load_n(&map[word], __ATOMIC_SEQ_CST) & ((~((uint64_t) 0)) << (first & ((size_t) 63)));
+  while (bits == (uint64_t) 0) {
+    word++;
+    if (word >= handle->dirty_words) return 0;
+    bits = __atomic_load_n(&map[word], __ATOMIC_SEQ_CST);
+  }
+  first = (word << 6) + ((size_t) __builtin_ctzll(bits));
+
+  /* ... and the first clean one after it */
+  bits = (~__atomic_load_n(&map[word], __ATOMIC_SEQ_CST)) & ((~((uint64_t) 0)) << (first & ((size_t) 63)));
+  while (bits == (uint64_t) 0) {
+    word++;
+    if (word >= handle->dirty_words) break;
+    bits = ~__atomic_load_n(&map[word], __ATOMIC_SEQ_CST);
+  }
+  end = (word >= handle->dirty_words) ? (handle->dirty_words << 6) : ((word << 6) + ((size_t) __builtin_ctzll(bits)));
+
+  /* Clear the run before it gets written back, so that changes made 
+     in the meantime mark it again */
+  for (word = first >> 6; (word << 6) < end; word++) {
+    mask = ~((uint64_t) 0);
+    if (word == (first >> 6)) mask &= mask << (first & ((size_t) 63));
+    stop = end - (word << 6);
+    if (stop < (size_t) 64) mask &= ~((~((uint64_t) 0)) << stop);
+    __atomic_fetch_and(&map[word], ~mask, __ATOMIC_SEQ_CST);
+  }
+
+  *start = first * MYFS_DIRTY_CHUNK_SIZE;
+  if (*start >= fssize) return 0;
+  end *= MYFS_DIRTY_CHUNK_SIZE;
+  if (end > fssize) end = fssize;
+  *len = end - *start;
+  return 1;
+}
+
+/* Opens the journal of the filesystem of size fssize pointed to by 
+   fsptr when it gets mounted. Must be called before any other 
+   operation on the mounted filesystem.
+
+   Replays all committed records of the current generation, dropping
+   whatever follows the last valid commit record, and then enables 
+   journaling if enable is non-zero. With journaling disabled, the 
+   replayed records are invalidated right away. Blocks that a crash 
+   left allocated without use are freed.
+
+   Returns the number of replayed commits. On failure, -1 is returned
+   and *errnoptr is set; ENOSPC means that the filesystem has no 
+   journal, because it is too small for one, and ENOMEM that there is
+   not enough memory to replay it, in which case nothing got changed.
+*/
+int __myfs_journal_open_implem(void *fsptr, size_t fssize, int *errnoptr, int enable) {
+  __myfs_handle_t *handle;
+  __myfs_journal_t *journal;
+  __myfs_journal_record_t *record;
+  __myfs_journal_revoked_t *revoked;
+  size_t pos, end, commit, size, number, committed, i;
+  uint32_t checksum;
+  int commits;
+
+  handle = __myfs_open_handle(fsptr, fssize);
+  if (handle == NULL) {
+    *errnoptr = EFAULT;
+    return -1;
+  }
+  if (handle->journal == (__myfs_offset_t) 0) {
+    if (!enable) return 0;
+    *errnoptr = ENOSPC;
+    return -1;
+  }
+
+  journal = __myfs_journal(handle);
+  journal->enabled = 0;
+  journal->overflow = 0;
+  journal->revoke = (size_t) 0;
+  journal->deferred = (__myfs_offset_t) 0;
+  journal->pending_number = (size_t) 0;
+  journal->fresh_number = (size_t) 0;
+
+  /* Find the end of the last complete batch, counting the revokes 
+     up to there */
+  commits = 0;
+  number = committed = (size_t) 0;
+  checksum = MYFS_FNV_OFFSET_BASIS;
+  for (pos = end = __myfs_journal_records_start();
+       handle->journal_size - pos >= sizeof(__myfs_journal_record_t);) {
+    record = (__myfs_journal_record_t *) (((void *) journal) + pos);
+    if (record->generation != handle->generation) break;
+    if (record->type == MYFS_JOURNAL_COMMIT) {
+      if (record->checksum != checksum) break;
+      pos += sizeof(__myfs_journal_record_t);
+      end = pos;
+      committed = number;
+      checksum = MYFS_FNV_OFFSET_BASIS;
+      commits++;
+      continue;
+    }
+    if ((record->type != MYFS_JOURNAL_DATA) && (record->type != MYFS_JOURNAL_REVOKE)) break;
+    if ((record->type == MYFS_JOURNAL_DATA) && (record->length > handle->journal_size)) break;
+    size = __myfs_journal_record_span(record);
+    if (handle->journal_size - pos < size) break;
+    if ((record->offset > fssize) || (fssize - record->offset < record->length)) break;
+    if ((record->type == MYFS_JOURNAL_DATA) &&
+        (record->offset < handle->journal + handle->journal_size) &&
+        (record->offset + record->length > handle->journal)) break;
+    if (record->type == MYFS_JOURNAL_REVOKE) number++;
+    checksum = __myfs_journal_checksum(checksum, record, size);
+    pos += size;
+  }
+
+  /* Sort the revokes, so that every data record can find those
+     covering it */
+  revoked = NULL;
+  if (committed > (size_t) 0) {
+    revoked = (__myfs_journal_revoked_t *) malloc(committed * sizeof(__myfs_journal_revoked_t));
+    if (revoked == NULL) {
+      *errnoptr = ENOMEM;
+      return -1;
+    }
+    for (pos = __myfs_journal_records_start(), i = (size_t) 0; pos < end; pos += __myfs_journal_record_span(record)) {
+      record = (__myfs_journal_record_t *) (((void *) journal) + pos);
+      if (record->type != MYFS_JOURNAL_REVOKE) continue;
+      revoked[i].start = record->offset;
+      revoked[i].end = record->offset + record->length;
+      revoked[i].position = pos;
+      i++;
+    }
+    qsort(revoked, committed, sizeof(__myfs_journal_revoked_t), __myfs_journal_revoked_compare);
+    for (i = (size_t) 0; i < committed; i++) {
+      revoked[i].reach = revoked[i].end;
+      if ((i > (size_t) 0) && (revoked[i - ((size_t) 1)].reach > revoked[i].reach)) {
+        revoked[i].reach = revoked[i - ((size_t) 1)].reach;
+      }
+    }
+  }
+
+  /* Apply the batches in order */
+  for (pos = __myfs_journal_records_start(); pos < end; pos = commit + sizeof(__myfs_journal_record_t)) {
+    for (commit = pos; ((__myfs_journal_record_t *) (((void *) journal) + commit))->type != MYFS_JOURNAL_COMMIT;
+         commit += __myfs_journal_record_span((__myfs_journal_record_t *) (((void *) journal) + commit)));
+    for (i = pos; i < commit; i += __myfs_journal_record_span(record)) {
+      record = (__myfs_journal_record_t *) (((void *) journal) + i);
+      if (record->type == MYFS_JOURNAL_DATA) {
+        __myfs_journal_replay(handle, record, commit, revoked, committed);
+      }
+    }
+  }
+  free(revoked);
+  journal->head = end;
+  journal->batch = end;
+
+  if ((!enable) && (commits > 0)) {
+    handle->generation++;
+    __myfs_mark_dirty_data(handle, &(handle->generation), sizeof(handle->generation));
+  }
+  journal->enabled = enable;
+  if (handle->version == MYFS_VERSION) {
+    __myfs_collect_garbage(handle, journal);
+  }
+  return commits;
+}
+
+
+/* Commits the metadata changes made on the filesystem of size fssize
+   pointed to by fsptr since the last commit. 
+
+   First, the changed parts of the blocks written in place are handed
+   to persist, along with data, as the byte range of the filesystem 
+   starting at start of len bytes; persist must make them durable and
+   return 0, or return -1 on failure. 
+
+   Returns 1 and puts into *start and *len the byte range of the 
+   filesystem holding the new records, which the caller then needs to 
+   make durable, 0 if there is nothing to commit (or no journaling),
+   and -1 on failure. ENOSPC means the journal ran full; the changes 
+   are then only safe after a checkpoint. EIO means persist failed; 
+   the commit can be retried. A return value of 2 is a 1 telling in 
+   addition that the journal is half full and the caller should 
+   checkpoint once the records are durable.
+
+   Freed blocks are given back to free memory by the commits, as many 
+   at a time as fit into the journal, so the caller should commit 
+   again until 0 is returned.
+*/
+int __myfs_journal_commit_implem(void *fsptr, size_t fssize, int *errnoptr,
+                                 int (*persist)(void *, size_t, size_t), void *data,
+                                 size_t *start, size_t *len) {
+  __myfs_handle_t *handle;
+  __myfs_journal_t *journal;
+  __myfs_journal_range_t *written;
+  uint32_t checksum;
+  size_t i;
+  int in_place;
+
+  handle = __myfs_get_handle(fsptr, fssize);
+  if (handle == NULL) {
+    *errnoptr = EFAULT;
+    return -1;
+  }
+  journal = __myfs_journal_enabled(handle);
+  if (journal == NULL) return 0;
+
+  __myfs_journal_release(handle, journal, 0);
+  __myfs_journal_spill(handle, journal);
+  if (handle->journal_size - journal->head < sizeof(__myfs_journal_record_t)) {
+    journal->overflow = 1;
+  }
+  if (journal->overflow) {
+    *errnoptr = ENOSPC;
+    return -1;
+  }
+
+  in_place = 0;
+  for (i = (size_t) 0; i < journal->fresh_number; i++) {
+    if (journal->fresh[i].written.start != journal->fresh[i].written.end) in_place = 1;
+  }
+  if ((!in_place) && (journal->head == journal->batch)) {
+    journal->fresh_number = (size_t) 0;
+    return 0;
+  }
+  for (i = (size_t) 0; i < journal->fresh_number; i++) {
+    written = &(journal->fresh[i].written);
+    if (written->start == written->end) continue;
+    if (persist(data, written->start, written->end - written->start) != 0) {
+      *errnoptr = EIO;
+      return -1;
+    }
+  }
+  journal->fresh_number = (size_t) 0;
+
+  checksum = __myfs_journal_checksum(MYFS_FNV_OFFSET_BASIS, ((void *) journal) + journal->batch,
+                                     journal->head - journal->batch);
+  __myfs_journal_append(handle, journal, MYFS_JOURNAL_COMMIT, checksum, (size_t) 0, (size_t) 0);
+  *start = handle->journal + journal->batch;
+  *len = journal->head - journal->batch;
+  journal->batch = journal->head;
+  if (journal->head > (handle->journal_size >> 1)) return 2;
+  return 1;
+}
+
+
+/* Starts a new journal generation on the filesystem of size fssize 
+   pointed to by fsptr, emptying the journal. 
+
+   The caller must afterwards write back all of the filesystem, the 
+   range holding the handle last: the records of the old generation 
+   stop counting exactly when the new generation number gets there.
+
+   Returns 0 on success. On failure, -1 is returned and *errnoptr 
+   is set.
+*/
+int __myfs_journal_checkpoint_implem(void *fsptr, size_t fssize, int *errnoptr) {
+  __myfs_handle_t *handle;
+  __myfs_journal_t *journal;
+
+  handle = __myfs_get_handle(fsptr, fssize);
+  if (handle == NULL) {
+    *errnoptr = EFAULT;
+    return -1;
+  }
+  if (handle->journal == (__myfs_offset_t) 0) return 0;
+  journal = __myfs_journal(handle);
+  journal->head = __myfs_journal_records_start();
+  journal->batch = journal->head;
+  journal->revoke = (size_t) 0;
+  journal->pending_number = (size_t) 0;
+  journal->fresh_number = (size_t) 0;
+  journal->overflow = 0;
+  handle->generation++;
+  __myfs_mark_dirty_data(handle, &(handle->generation), sizeof(handle->generation));
+  return 0;
+}
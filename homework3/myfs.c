@@ -54,11 +54,17 @@
 #include <sys/mman.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <time.h>
 
 
 struct __myfs_options_struct_t {
         const char *filename;
         const char *size;
+        const char *locking;
+        const char *flushinterval;
+        int syncstats;
+        int journal;
+        int zerocopy;
         int show_help;
 };
 
@@ -67,6 +73,11 @@ struct __myfs_options_struct_t {
 static const struct fuse_opt __myfs_option_spec[] = {
         OPTION("--backupfile=%s", filename),
         OPTION("--size=%s", size),
+        OPTION("--locking=%s", locking),
+        OPTION("--flushinterval=%s", flushinterval),
+        OPTION("--syncstats", syncstats),
+        OPTION("--journal", journal),
+        OPTION("--zerocopy", zerocopy),
         OPTION("-h", show_help),
         OPTION("--help", show_help),
         FUSE_OPT_END
@@ -78,14 +89,39 @@ struct __memory_block_struct_t {
 };
 typedef struct __memory_block_struct_t memory_block_t;
 
+#define MYFS_LOCKING_GLOBAL      (0)
+#define MYFS_LOCKING_RWLOCK      (1)
+#define MYFS_INODE_LOCK_STRIPES  (64)
+
 struct __myfs_environment_struct_t {
-  pthread_mutex_t env_lock;
+  pthread_mutex_t  env_lock;
+  int              locking;
+  pthread_rwlock_t meta_lock;
+  pthread_rwlock_t inode_locks[MYFS_INODE_LOCK_STRIPES];
   uid_t           uid;
   gid_t           gid;
   void            *memory;
   size_t          size;
   int             using_backup;
   int             backup_fd;
+  int             journaling;
+  int             private_mapping;
+  int             zero_copy;
+  size_t          page_size;
+  int             sync_all;
+  int             sync_stats;
+  size_t          synced_bytes;
+  unsigned int    flush_interval;
+  int             flusher_running;
+  int             flusher_stop;
+  pthread_t       flusher;
+  pthread_mutex_t flusher_lock;
+  pthread_cond_t  flusher_cond;
+};
+
+struct __myfs_range_struct_t {
+  size_t start;
+  size_t len;
 };
 
 #define MYFS_DEFAULT_SIZE  ((size_t) (128 << 20))   /* 128MB */
@@ -106,6 +142,116 @@ static int __myfs_parse_size(size_t *size, const char *str) {
   return 1;
 }
 
+/* Locking
+
+   In the default (global) locking mode, every operation runs under
+   env_lock, one at a time.
+
+   In rwlock mode, operations that only look at the filesystem take
+   meta_lock shared, operations that change its structure (the tree,
+   the allocator, the layout of a file, the times of an inode) take it 
+   exclusively. Operations on the contents of a single file or 
+   directory additionally take the inode lock of their path, out of a 
+   table of striped locks; there are no hard links, so a path names 
+   exactly one inode. 
+
+   Lock ordering: meta_lock first, then at most one inode lock. 
+   Operations that rename or remove inodes hold meta_lock exclusively
+   and hence never race with holders of inode locks. fsync holds 
+   meta_lock exclusively too, so the memory that gets synchronized 
+   with the backup-file never contains half-done operations, just as
+   in global mode.
+*/
+static int __myfs_init_locks(struct __myfs_environment_struct_t *env) {
+  int i, j;
+
+  if (pthread_mutex_init(&(env->env_lock), NULL) != 0) {
+    perror("Cannot setup mutex");
+    return 0;
+  }
+  if (env->locking != MYFS_LOCKING_RWLOCK) return 1;
+  if (pthread_rwlock_init(&(env->meta_lock), NULL) != 0) {
+    perror("Cannot setup rwlock");
+    pthread_mutex_destroy(&(env->env_lock));
+    return 0;
+  }
+  for (i=0;i<MYFS_INODE_LOCK_STRIPES;i++) {
+    if (pthread_rwlock_init(&(env->inode_locks[i]), NULL) != 0) {
+      perror("Cannot setup rwlock");
+      for (j=0;j<i;j++) {
+        pthread_rwlock_destroy(&(env->inode_locks[j]));
+      }
+      pthread_rwlock_destroy(&(env->meta_lock));
+      pthread_mutex_destroy(&(env->env_lock));
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void __myfs_destroy_locks(struct __myfs_environment_struct_t *env) {
+  int i;
+
+  if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
+    perror("Cannot destroy mutex");
+  }
+  if (env->locking != MYFS_LOCKING_RWLOCK) return;
+  if (pthread_rwlock_destroy(&(env->meta_lock)) != 0) {
+    perror("Cannot destroy rwlock");
+  }
+  for (i=0;i<MYFS_INODE_LOCK_STRIPES;i++) {
+    if (pthread_rwlock_destroy(&(env->inode_locks[i])) != 0) {
+      perror("Cannot destroy rwlock");
+    }
+  }
+}
+
+static void __myfs_lock(struct __myfs_environment_struct_t *env, int exclusive) {
+  if (env->locking != MYFS_LOCKING_RWLOCK) {
+    pthread_mutex_lock(&(env->env_lock));
+    return;
+  }
+  if (exclusive) {
+    pthread_rwlock_wrlock(&(env->meta_lock));
+  } else {
+    pthread_rwlock_rdlock(&(env->meta_lock));
+  }
+}
+
+static void __myfs_unlock(struct __myfs_environment_struct_t *env) {
+  if (env->locking != MYFS_LOCKING_RWLOCK) {
+    pthread_mutex_unlock(&(env->env_lock));
+    return;
+  }
+  pthread_rwlock_unlock(&(env->meta_lock));
+}
+
+static pthread_rwlock_t *__myfs_inode_lock(struct __myfs_environment_struct_t *env, const char *path) {
+  unsigned int hash;
+  const char *c;
+
+  hash = 2166136261u;
+  for (c=path;*c!='\0';c++) {
+    hash = (hash ^ ((unsigned char) *c)) * 16777619u;
+  }
+  return &(env->inode_locks[hash % MYFS_INODE_LOCK_STRIPES]);
+}
+
+/* Must be called with meta_lock held; a no-op in global mode */
+static void __myfs_lock_inode(struct __myfs_environment_struct_t *env, const char *path, int exclusive) {
+  if (env->locking != MYFS_LOCKING_RWLOCK) return;
+  if (exclusive) {
+    pthread_rwlock_wrlock(__myfs_inode_lock(env, path));
+  } else {
+    pthread_rwlock_rdlock(__myfs_inode_lock(env, path));
+  }
+}
+
+static void __myfs_unlock_inode(struct __myfs_environment_struct_t *env, const char *path) {
+  if (env->locking != MYFS_LOCKING_RWLOCK) return;
+  pthread_rwlock_unlock(__myfs_inode_lock(env, path));
+}
+
 static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, struct __myfs_options_struct_t *opts) {
   int size_specified, using_backup;
   size_t size;
@@ -135,9 +281,40 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     size = MYFS_MIN_SIZE;
   }
 
-  /* Setup lock for the threads */
-  if (pthread_mutex_init(&(env->env_lock), NULL) != 0) {
-    perror("Cannot setup mutex");
+  /* Handle locking mode */
+  if ((opts->locking == NULL) || (strcmp(opts->locking, "global") == 0)) {
+    env->locking = MYFS_LOCKING_GLOBAL;
+  } else if (strcmp(opts->locking, "rwlock") == 0) {
+    env->locking = MYFS_LOCKING_RWLOCK;
+  } else {
+    fprintf(stderr, "Unknown locking mode \"%s\"\n", opts->locking);
+    return 0;
+  }
+
+  /* Handle write-back options */
+  env->flush_interval = 0u;
+  if (opts->flushinterval != NULL) {
+    if ((!__myfs_parse_size(&len, opts->flushinterval)) || (len > ((size_t) 86400))) {
+      fprintf(stderr, "Cannot parse flush interval indication\n");
+      return 0;
+    }
+    env->flush_interval = (unsigned int) len;
+  }
+  env->sync_stats = opts->syncstats;
+  env->journaling = (opts->journal && (opts->filename != NULL));
+  env->private_mapping = env->journaling;
+  env->zero_copy = (opts->zerocopy && (opts->filename != NULL) && (!(env->private_mapping)));
+  env->sync_all = 0;
+  env->synced_bytes = (size_t) 0;
+  env->flusher_running = 0;
+  env->flusher_stop = 0;
+  env->page_size = (size_t) sysconf(_SC_PAGESIZE);
+  if ((env->page_size == ((size_t) 0)) || ((env->page_size & (env->page_size - ((size_t) 1))) != ((size_t) 0))) {
+    env->page_size = (size_t) 4096;
+  }
+
+  /* Setup locks for the threads */
+  if (!__myfs_init_locks(env)) {
     return 0;    
   }
   
@@ -147,17 +324,13 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     fd = open(opts->filename, O_CREAT | O_RDWR, 00644);
     if (fd < 0) {
       perror("Cannot open backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
+      __myfs_destroy_locks(env);
       return 0;
     }
     off = lseek(fd, 0, SEEK_END);
     if (off < ((off_t) 0)) {
       perror("Cannot seek in backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
+      __myfs_destroy_locks(env);
       return 0;
     }
     len = (size_t) off;
@@ -165,9 +338,7 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     off = lseek(fd, 0, SEEK_SET);
     if (off < ((off_t) 0)) {
       perror("Cannot seek in backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
+      __myfs_destroy_locks(env);
       return 0;
     }
     if (size_specified) {
@@ -184,9 +355,7 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     }
     if (ftruncate(fd, size) != 0) {
       perror("Cannot seek in backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
+      __myfs_destroy_locks(env);
       return 0;
     }
   } else {
@@ -197,24 +366,22 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
 
   /* Do the mmap */
   if (using_backup) {
-    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    /* With journaling, nothing may reach the backup-file behind the
+       journal's back, so all writing to it is done explicitly */
+    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, (env->private_mapping ? MAP_PRIVATE : MAP_SHARED), fd, 0);
     if (memory == MAP_FAILED) {
       perror("Cannot map backup-file into memory");
       if (close(fd) != 0) {
         perror("Cannot close backup-file");
       }
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
+      __myfs_destroy_locks(env);
       return 0;
     }
   } else {
     memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (memory == MAP_FAILED) {
       perror("Cannot map in memory");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
-      }
+      __myfs_destroy_locks(env);
       return 0;
     }
   }
@@ -241,11 +408,325 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
   return 1;
 }
 
+/* Write-back
+
+   Instead of synchronizing the whole mapping with the backup-file, 
+   only the parts the implementation marked dirty get written back, 
+   rounded out to page boundaries. If writing back ever fails, the 
+   dirty marks are gone, so the next write-back covers everything. 
+
+   With journaling (--journal), the backup-file is mapped privately 
+   and written explicitly: after every operation that changed 
+   metadata, the blocks it allocated for large metadata get written 
+   in place and synchronized, then the new journal records get 
+   appended and synchronized; everything else only gets written at
+   checkpoints, which happen on fsync, unmount, in the flusher and 
+   when the journal is half full. 
+   During a checkpoint, the page holding the handle is written last,
+   as it switches the image over to the new journal generation. 
+   File contents written since the last checkpoint may be lost in a 
+   crash; the structure of the filesystem is not.
+*/
+int __myfs_dirty_range_implem(void *, size_t, int *, size_t, size_t *, size_t *);
+int __myfs_journal_open_implem(void *, size_t, int *, int);
+int __myfs_journal_commit_implem(void *, size_t, int *, int (*)(void *, size_t, size_t), void *, size_t *, size_t *);
+int __myfs_journal_checkpoint_implem(void *, size_t, int *);
+
+/* Writes len bytes of the memory at offset start to the backup-file */
+static int __myfs_persist(struct __myfs_environment_struct_t *env, size_t start, size_t len) {
+  ssize_t res;
+
+  if (!(env->private_mapping)) {
+    return msync(env->memory + start, len, MS_SYNC);
+  }
+  while (len > ((size_t) 0)) {
+    res = pwrite(env->backup_fd, env->memory + start, len, (off_t) start);
+    if (res < ((ssize_t) 0)) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    start += (size_t) res;
+    len -= (size_t) res;
+  }
+  return 0;
+}
+
+/* Takes the dirty ranges of the filesystem, merged on page boundaries.
+   Must be called with the lock held in some mode. Returns the number
+   of ranges put into *ranges, which needs to be freed. */
+static size_t __myfs_collect_dirty(struct __myfs_environment_struct_t *env, struct __myfs_range_struct_t **ranges) {
+  struct __myfs_range_struct_t *r, *t;
+  size_t n, cap, from, start, len, end;
+  int all, __myfs_errno;
+
+  r = NULL;
+  n = (size_t) 0;
+  cap = (size_t) 0;
+  all = __atomic_load_n(&(env->sync_all), __ATOMIC_SEQ_CST);
+  for (from=(size_t) 0;
+       __myfs_dirty_range_implem(env->memory, env->size, &__myfs_errno, from, &start, &len) > 0;
+       from=start+len) {
+    if (all) continue;
+    end = (start + len + env->page_size - ((size_t) 1)) & ~(env->page_size - ((size_t) 1));
+    if (end > env->size) end = env->size;
+    start &= ~(env->page_size - ((size_t) 1));
+    if ((n > ((size_t) 0)) && (start <= r[n-1].start + r[n-1].len)) {
+      r[n-1].len = end - r[n-1].start;
+      continue;
+    }
+    if (n == cap) {
+      cap = (cap == ((size_t) 0)) ? ((size_t) 16) : (cap << 1);
+      t = (struct __myfs_range_struct_t *) realloc(r, cap * sizeof(struct __myfs_range_struct_t));
+      if (t == NULL) {
+        all = 1;
+        continue;
+      }
+      r = t;
+    }
+    r[n].start = start;
+    r[n].len = end - start;
+    n++;
+  }
+  if (all) {
+    free(r);
+    r = (struct __myfs_range_struct_t *) malloc(sizeof(struct __myfs_range_struct_t));
+    if (r == NULL) {
+      __atomic_store_n(&(env->sync_all), 1, __ATOMIC_SEQ_CST);
+      *ranges = NULL;
+      return (size_t) 0;
+    }
+    r[0].start = (size_t) 0;
+    r[0].len = env->size;
+    n = (size_t) 1;
+    __atomic_store_n(&(env->sync_all), 0, __ATOMIC_SEQ_CST);
+  }
+  *ranges = r;
+  return n;
+}
+
+/* Writes back the given ranges. Returns 0 on success, -1 otherwise. */
+static int __myfs_write_back(struct __myfs_environment_struct_t *env, struct __myfs_range_struct_t *ranges, size_t n) {
+  size_t i, bytes, start, len, first;
+  int res;
+
+  res = 0;
+  bytes = (size_t) 0;
+  first = (size_t) 0;
+  for (i=0;i<n;i++) {
+    start = ranges[i].start;
+    len = ranges[i].len;
+    if (env->private_mapping && (start == ((size_t) 0))) {
+      /* Keep the page holding the handle for the end */
+      first = (len < env->page_size) ? len : env->page_size;
+      start += first;
+      len -= first;
+    }
+    if ((len > ((size_t) 0)) && (__myfs_persist(env, start, len) != 0)) {
+      res = -1;
+      continue;
+    }
+    bytes += len;
+  }
+  if (env->private_mapping && (res == 0)) {
+    if (fdatasync(env->backup_fd) != 0) res = -1;
+    if ((res == 0) && (first > ((size_t) 0))) {
+      if ((__myfs_persist(env, (size_t) 0, first) != 0) || (fdatasync(env->backup_fd) != 0)) {
+        res = -1;
+      } else {
+        bytes += first;
+      }
+    }
+    /* The backup-file now has it all, so the private copies of whole
+       pages can go */
+    for (i=0;(res == 0) && (i<n);i++) {
+      start = (ranges[i].start + env->page_size - ((size_t) 1)) & ~(env->page_size - ((size_t) 1));
+      len = (ranges[i].start + ranges[i].len) & ~(env->page_size - ((size_t) 1));
+      if (len > start) {
+        madvise(env->memory + start, len - start, MADV_DONTNEED);
+      }
+    }
+  }
+  if (res != 0) {
+    __atomic_store_n(&(env->sync_all), 1, __ATOMIC_SEQ_CST);
+  }
+  __atomic_fetch_add(&(env->synced_bytes), bytes, __ATOMIC_RELAXED);
+  if (env->sync_stats) {
+    fprintf(stderr, "myfs: wrote back %zu bytes in %zu ranges\n", bytes, n);
+  }
+  return res;
+}
+
+/* Writes back all dirty ranges; with journaling, this is a 
+   checkpoint. Must be called with the lock held exclusively when
+   the mapping is private. */
+static int __myfs_write_back_dirty(struct __myfs_environment_struct_t *env) {
+  struct __myfs_range_struct_t *ranges;
+  size_t n;
+  int res, __myfs_errno;
+
+  if (env->journaling) {
+    if (__myfs_journal_checkpoint_implem(env->memory, env->size, &__myfs_errno) != 0) return -1;
+  }
+  n = __myfs_collect_dirty(env, &ranges);
+  if ((n == ((size_t) 0)) && __atomic_load_n(&(env->sync_all), __ATOMIC_SEQ_CST)) return -1;
+  res = __myfs_write_back(env, ranges, n);
+  free(ranges);
+  return res;
+}
+
+/* Blocks written in place by a commit */
+struct __myfs_commit_state_struct_t {
+  struct __myfs_environment_struct_t *env;
+  int                                written;
+};
+
+static int __myfs_commit_persist(void *data, size_t start, size_t len) {
+  struct __myfs_commit_state_struct_t *state;
+
+  state = (struct __myfs_commit_state_struct_t *) data;
+  state->written = 1;
+  return __myfs_persist(state->env, start, len);
+}
+
+/* Commits the metadata changes made so far, as many commits as it 
+   takes to also give back all freed memory. Must be called with the 
+   lock held exclusively. Returns 0 on success. On failure, -1 is 
+   returned and *errnoptr is set; errors other than ENOSPC, meaning 
+   that the changes do not fit into the journal, have been reported. */
+static int __myfs_try_commit(struct __myfs_environment_struct_t *env, int *errnoptr) {
+  struct __myfs_commit_state_struct_t state;
+  size_t start, len;
+  int res;
+
+  state.env = env;
+  for (;;) {
+    state.written = 0;
+    res = __myfs_journal_commit_implem(env->memory, env->size, errnoptr, 
+                                       __myfs_commit_persist, &state, &start, &len);
+    if (res == 0) return 0;
+    if (res < 0) {
+      if (*errnoptr == EIO) {
+        perror("Cannot write blocks to backup-file");
+      } else if (*errnoptr != ENOSPC) {
+        fprintf(stderr, "Cannot commit to journal: %s\n", strerror(*errnoptr));
+      }
+      return -1;
+    }
+    /* The blocks written in place must be there before the commit 
+       record */
+    if ((state.written && (fdatasync(env->backup_fd) != 0)) ||
+        (__myfs_persist(env, start, len) != 0) || (fdatasync(env->backup_fd) != 0)) {
+      perror("Cannot write journal to backup-file");
+      *errnoptr = EIO;
+      return -1;
+    }
+    if ((res > 1) && (__myfs_write_back_dirty(env) != 0)) {
+      perror("Cannot checkpoint backup-file");
+      *errnoptr = EIO;
+      return -1;
+    }
+  }
+}
+
+/* Makes the metadata changes of the operation that just ran durable.
+   Must be called with the lock held exclusively. */
+static void __myfs_commit(struct __myfs_environment_struct_t *env) {
+  int __myfs_errno;
+
+  if (!(env->journaling)) return;
+  if (__myfs_try_commit(env, &__myfs_errno) == 0) return;
+  if (__myfs_errno != ENOSPC) return;
+  /* Operations stop early rather than outgrow the journal, so this 
+     should not happen. Should it anyway, make everything durable 
+     instead, which unlike a checkpoint after a commit is not 
+     crash-safe. */
+  fprintf(stderr, "The journal ran full, writing back without it\n");
+  if (__myfs_write_back_dirty(env) != 0) {
+    perror("Cannot checkpoint backup-file");
+  }
+}
+
+/* Background flusher, writing back the dirty ranges every 
+   flush_interval seconds. Only the collection of the ranges happens
+   under the lock, unless the mapping is private; the changes made 
+   meanwhile get marked again and are picked up by the next round or 
+   fsync. */
+static void *__myfs_flusher(void *arg) {
+  struct __myfs_environment_struct_t *env;
+  struct __myfs_range_struct_t *ranges;
+  struct timespec deadline;
+  size_t n;
+
+  env = (struct __myfs_environment_struct_t *) arg;
+  pthread_mutex_lock(&(env->flusher_lock));
+  while (!(env->flusher_stop)) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (time_t) env->flush_interval;
+    while ((!(env->flusher_stop)) &&
+           (pthread_cond_timedwait(&(env->flusher_cond), &(env->flusher_lock), &deadline) == 0));
+    if (env->flusher_stop) break;
+    pthread_mutex_unlock(&(env->flusher_lock));
+
+    if (env->private_mapping) {
+      /* Data is copied out of the memory here, so it must not change */
+      __myfs_lock(env, 1);
+      __myfs_write_back_dirty(env);
+      __myfs_unlock(env);
+    } else {
+      __myfs_lock(env, 0);
+      n = __myfs_collect_dirty(env, &ranges);
+      __myfs_unlock(env);
+      __myfs_write_back(env, ranges, n);
+      free(ranges);
+    }
+
+    pthread_mutex_lock(&(env->flusher_lock));
+  }
+  pthread_mutex_unlock(&(env->flusher_lock));
+  return NULL;
+}
+
+static void __myfs_start_flusher(struct __myfs_environment_struct_t *env) {
+  if ((!(env->using_backup)) || (env->flush_interval == 0u)) return;
+  if (pthread_mutex_init(&(env->flusher_lock), NULL) != 0) {
+    perror("Cannot setup mutex");
+    return;
+  }
+  if (pthread_cond_init(&(env->flusher_cond), NULL) != 0) {
+    perror("Cannot setup condition variable");
+    pthread_mutex_destroy(&(env->flusher_lock));
+    return;
+  }
+  if (pthread_create(&(env->flusher), NULL, __myfs_flusher, env) != 0) {
+    perror("Cannot start flusher thread");
+    pthread_cond_destroy(&(env->flusher_cond));
+    pthread_mutex_destroy(&(env->flusher_lock));
+    return;
+  }
+  env->flusher_running = 1;
+}
+
+static void __myfs_stop_flusher(struct __myfs_environment_struct_t *env) {
+  if (!(env->flusher_running)) return;
+  pthread_mutex_lock(&(env->flusher_lock));
+  env->flusher_stop = 1;
+  pthread_cond_signal(&(env->flusher_cond));
+  pthread_mutex_unlock(&(env->flusher_lock));
+  pthread_join(env->flusher, NULL);
+  pthread_cond_destroy(&(env->flusher_cond));
+  pthread_mutex_destroy(&(env->flusher_lock));
+  env->flusher_running = 0;
+}
+
 static void __myfs_clear_environment(struct __myfs_environment_struct_t *env) {
+  __myfs_stop_flusher(env);
   if (env->using_backup) {
-    if (msync(env->memory, env->size, MS_SYNC) != 0) {
+    if (__myfs_write_back_dirty(env) != 0) {
       perror("Cannot synchronize memory map with backup-file");
     }
+    if (env->sync_stats) {
+      fprintf(stderr, "myfs: wrote back %zu bytes in total\n", env->synced_bytes);
+    }
   }
   if (munmap(env->memory, env->size) != 0) {
     perror("Cannot unmap memory");
@@ -255,15 +736,13 @@ static void __myfs_clear_environment(struct __myfs_environment_struct_t *env) {
       perror("Cannot close backup-file");
     }
   }
-  if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-    perror("Cannot destroy mutex");
-  }
+  __myfs_destroy_locks(env);
 }
 
 static int __myfs_sync_environment(struct __myfs_environment_struct_t *env) {
   if (env == NULL) return -1;
   if (!(env->using_backup)) return 0;
-  if (msync(env->memory, env->size, MS_SYNC) != 0) return -1;
+  if (__myfs_write_back_dirty(env) != 0) return -1;
   if (fsync(env->backup_fd) != 0) return -1;
   return 0;
 }
@@ -272,6 +751,8 @@ static int __myfs_sync_environment(struct __myfs_environment_struct_t *env) {
 
 int __myfs_getattr_implem(void *, size_t, int *, uid_t, gid_t, const char *, struct stat *);
 int __myfs_readdir_implem(void *, size_t, int *, const char *, char ***);
+int __myfs_readdir_cursor_implem(void *, size_t, int *, const char *, off_t,
+                                 int (*)(void *, const char *, const struct stat *, off_t), void *);
 int __myfs_mknod_implem(void *, size_t, int *, const char *);
 int __myfs_unlink_implem(void *, size_t, int *, const char *);
 int __myfs_mkdir_implem(void *, size_t, int *, const char *);
@@ -281,11 +762,83 @@ int __myfs_truncate_implem(void *, size_t, int *, const char *, off_t);
 int __myfs_open_implem(void *, size_t, int *, const char *);
 int __myfs_read_implem(void *, size_t, int *, const char *, char *, size_t, off_t);
 int __myfs_write_implem(void *, size_t, int *, const char *, const char *, size_t, off_t);
+int __myfs_overwrite_implem(void *, size_t, int *, const char *, const char *, size_t, off_t);
+int __myfs_map_implem(void *, size_t, int *, const char *, size_t, off_t, int,
+                      int (*)(void *, size_t, size_t), void *);
 int __myfs_statfs_implem(void *, size_t, int *, struct statvfs*);
+int __myfs_check_implem(void *, size_t, int *);
 int __myfs_utimens_implem(void *, size_t, int *, const char *, const struct timespec [2]);
 
 /* End of declarations */
 
+/* Checks the image before any FUSE operation touches it. Returns 0 if
+   it cannot be used, in which case it is left as it is. */
+static int __myfs_check_environment(struct __myfs_environment_struct_t *env) {
+  int __myfs_errno;
+
+  if (__myfs_check_implem(env->memory, env->size, &__myfs_errno) != 0) {
+    if (__myfs_errno == EPROTO) {
+      fprintf(stderr, "Cannot use the filesystem image: it has the layout of an older version, which cannot be migrated; it has been left untouched\n");
+    } else if (__myfs_errno == ENOTSUP) {
+      fprintf(stderr, "Cannot use the filesystem image: it is from a newer version; it has been left untouched\n");
+    } else {
+      fprintf(stderr, "Cannot use the filesystem image: %s\n", strerror(__myfs_errno));
+    }
+    return 0;
+  }
+  return 1;
+}
+
+/* Formats (or checks) the filesystem once before any FUSE thread 
+   runs, so that no operation done under a shared lock ever has to
+   initialize the memory. Returns 0 if the image cannot be used, in
+   which case it is left as it is. */
+static int __myfs_prime_environment(struct __myfs_environment_struct_t *env) {
+  struct stat st;
+  int __myfs_errno, res;
+
+  /* Replay what a crash may have left in the journal */
+  res = __myfs_journal_open_implem(env->memory, env->size, &__myfs_errno, env->journaling);
+  if (res < 0) {
+    if (!(env->journaling && (__myfs_errno == ENOSPC))) {
+      fprintf(stderr, "Cannot open journal: %s; the filesystem image has been left untouched\n", strerror(__myfs_errno));
+      return 0;
+    }
+    fprintf(stderr, "The filesystem is too small for a journal, journaling is off\n");
+    env->journaling = 0;
+  } else if (res > 0) {
+    fprintf(stderr, "Replayed %d journal commits\n", res);
+    /* Leave all of the journal to the migration */
+    if (env->journaling && (__myfs_write_back_dirty(env) != 0)) {
+      perror("Cannot checkpoint backup-file");
+      return 0;
+    }
+  }
+
+  /* Formats or migrates the image; the migration gets committed as a 
+     whole */
+  if (__myfs_getattr_implem(env->memory, env->size, &__myfs_errno,
+                            env->uid, env->gid, "/", &st) != 0) {
+    fprintf(stderr, "Cannot use the filesystem image: it is too full to be migrated; it has been left untouched\n");
+    return 0;
+  }
+  if (env->journaling && (__myfs_try_commit(env, &__myfs_errno) != 0)) {
+    if (__myfs_errno == ENOSPC) {
+      fprintf(stderr, "Cannot use the filesystem image: migrating it takes more than the journal holds; "
+              "it has not been changed, mount it once without --journal\n");
+    }
+    return 0;
+  }
+
+  /* Start out from a clean checkpoint */
+  if (env->private_mapping) {
+    if (__myfs_write_back_dirty(env) != 0) {
+      perror("Cannot checkpoint backup-file");
+    }
+  }
+  return 1;
+}
+
 /* FUSE operations part */
 
 static int __myfs_getattr(const char *path, struct stat *st) {
@@ -299,7 +852,8 @@ static int __myfs_getattr(const char *path, struct stat *st) {
   memset(st, 0, sizeof(struct stat));
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 0);
+  __myfs_lock_inode(env, path, 0);
   res = __myfs_getattr_implem(env->memory,
                               env->size,
                               &__myfs_errno,
@@ -307,54 +861,64 @@ static int __myfs_getattr(const char *path, struct stat *st) {
                               env->gid,
                               path,
                               st);
-  pthread_mutex_unlock(&(env->env_lock));  
+  __myfs_unlock_inode(env, path);
+  __myfs_unlock(env);  
   if (res >= 0)
     return res;
   return -__myfs_errno;
 }
 
+/* Passes the entries of a listing on to FUSE. Offsets 1 and 2 belong
+   to . and .., the offsets of the children are their cursors shifted
+   by 2. */
+struct __myfs_readdir_state_struct_t {
+  void            *buf;
+  fuse_fill_dir_t filler;
+};
+
+static int __myfs_readdir_fill(void *data, const char *name, const struct stat *st, off_t next) {
+  struct __myfs_readdir_state_struct_t *state;
+
+  state = (struct __myfs_readdir_state_struct_t *) data;
+  return state->filler(state->buf, name, st, next + ((off_t) 2));
+}
+
+/* Fills one buffer's worth of entries starting at offset, then drops
+   the lock; FUSE calls again with the offset of the last entry that 
+   fit. */
 static int __myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                           off_t offset, struct fuse_file_info *fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
-  int __myfs_errno, res, i;
-  char **names;
+  struct __myfs_readdir_state_struct_t state;
+  int __myfs_errno, res;
   
-  (void) offset;
   (void) fi;
   
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
 
-  names = NULL;
-  __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_readdir_implem(env->memory,
-                              env->size,
-                              &__myfs_errno,
-                              path,
-                              &names);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0) {
-    if (res == 0) {
-      filler(buf, ".", NULL, 0);
-      filler(buf, "..", NULL, 0);
-      return 0;
-    } else {
-      if (names != NULL) {
-        filler(buf, ".", NULL, 0);
-        filler(buf, "..", NULL, 0);
-        for (i=0;i<res;i++) {
-          filler(buf, names[i], NULL, 0);
-          free(names[i]);
-        }
-        free(names);
-        return 0;
-      } else {
-        return -ENOENT;
-      }
-    }
+  if (offset < ((off_t) 1)) {
+    if (filler(buf, ".", NULL, (off_t) 1) != 0) return 0;
   }
+  if (offset < ((off_t) 2)) {
+    if (filler(buf, "..", NULL, (off_t) 2) != 0) return 0;
+  }
+  state.buf = buf;
+  state.filler = filler;
+
+  __myfs_errno = ENOENT;
+  __myfs_lock(env, 0);
+  res = __myfs_readdir_cursor_implem(env->memory,
+                                     env->size,
+                                     &__myfs_errno,
+                                     path,
+                                     (offset > ((off_t) 2)) ? (offset - ((off_t) 2)) : ((off_t) 0),
+                                     __myfs_readdir_fill,
+                                     &state);
+  __myfs_unlock(env);
+  if (res >= 0)
+    return 0;
   return -__myfs_errno;
 }
 
@@ -371,12 +935,13 @@ static int __myfs_mknod(const char* path, mode_t mode, dev_t dev) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 1);
   res = __myfs_mknod_implem(env->memory,
                             env->size,
                             &__myfs_errno,
                             path);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_commit(env);
+  __myfs_unlock(env);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -391,12 +956,13 @@ static int __myfs_unlink(const char* path) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 1);
   res = __myfs_unlink_implem(env->memory,
                              env->size,
                              &__myfs_errno,
                              path);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_commit(env);
+  __myfs_unlock(env);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -411,12 +977,13 @@ static int __myfs_mkdir(const char* path, mode_t mode) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 1);
   res = __myfs_mkdir_implem(env->memory,
                             env->size,
                             &__myfs_errno,
                             path);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_commit(env);
+  __myfs_unlock(env);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -431,12 +998,13 @@ static int __myfs_rmdir(const char* path) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 1);
   res = __myfs_rmdir_implem(env->memory,
                             env->size,
                             &__myfs_errno,
                             path);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_commit(env);
+  __myfs_unlock(env);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -451,13 +1019,14 @@ static int __myfs_rename(const char* from, const char* to) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 1);
   res = __myfs_rename_implem(env->memory,
                              env->size,
                              &__myfs_errno,
                              from,
                              to);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_commit(env);
+  __myfs_unlock(env);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -472,13 +1041,14 @@ static int __myfs_truncate(const char* path, off_t size) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 1);
   res = __myfs_truncate_implem(env->memory,
                                env->size,
                                &__myfs_errno,
                                path,
                                size);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_commit(env);
+  __myfs_unlock(env);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -498,12 +1068,12 @@ static int __myfs_open(const char* path, struct fuse_file_info* fi) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 0);
   res = __myfs_open_implem(env->memory,
                            env->size,
                            &__myfs_errno,
                            path);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_unlock(env);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -520,7 +1090,8 @@ static int __myfs_read(const char* path, char *buf, size_t size, off_t offset, s
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 0);
+  __myfs_lock_inode(env, path, 0);
   res = __myfs_read_implem(env->memory,
                            env->size,
                            &__myfs_errno,
@@ -528,7 +1099,8 @@ static int __myfs_read(const char* path, char *buf, size_t size, off_t offset, s
                            buf,
                            size,
                            offset);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_unlock_inode(env, path);
+  __myfs_unlock(env);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -544,8 +1116,30 @@ static int __myfs_write(const char* path, const char *buf, size_t size, off_t of
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
+  /* In rwlock mode, try to overwrite in place with the filesystem
+     shared first; fall back to taking it exclusively when the file
+     needs to grow. */
+  if (env->locking == MYFS_LOCKING_RWLOCK) {
+    __myfs_errno = ENOENT;
+    __myfs_lock(env, 0);
+    __myfs_lock_inode(env, path, 1);
+    res = __myfs_overwrite_implem(env->memory,
+                                  env->size,
+                                  &__myfs_errno,
+                                  path,
+                                  buf,
+                                  size,
+                                  offset);
+    __myfs_unlock_inode(env, path);
+    __myfs_unlock(env);
+    if (res >= 0)
+      return res;
+    if (__myfs_errno != EAGAIN)
+      return -__myfs_errno;
+  }
+  
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 1);
   res = __myfs_write_implem(env->memory,
                             env->size,
                             &__myfs_errno,
@@ -553,12 +1147,207 @@ static int __myfs_write(const char* path, const char *buf, size_t size, off_t of
                             buf,
                             size,
                             offset);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_commit(env);
+  __myfs_unlock(env);
   if (res >= 0)
     return res;
   return -__myfs_errno;
 }
 
+/* Buffer vector being built by __myfs_read_buf. libfuse frees the 
+   memory of every buffer after replying, so holes get buffers of 
+   their own and the contents are only ever referenced by offset in 
+   the backup-file. */
+struct __myfs_read_buf_state_struct_t {
+  struct __myfs_environment_struct_t *env;
+  struct fuse_bufvec                 *vec;
+  size_t                             capacity;
+};
+
+static int __myfs_read_buf_add(void *data, size_t start, size_t len) {
+  struct __myfs_read_buf_state_struct_t *state;
+  struct fuse_bufvec *vec;
+  struct fuse_buf *last;
+  size_t capacity;
+
+  state = (struct __myfs_read_buf_state_struct_t *) data;
+  if (state->vec->count > ((size_t) 0)) {
+    last = &(state->vec->buf[state->vec->count - ((size_t) 1)]);
+    if ((start != ((size_t) 0)) && (last->flags & FUSE_BUF_IS_FD) && 
+        (((size_t) last->pos) + last->size == start)) {
+      last->size += len;
+      return 0;
+    }
+  }
+  if (state->vec->count == state->capacity) {
+    capacity = state->capacity << 1;
+    vec = (struct fuse_bufvec *) realloc(state->vec, sizeof(struct fuse_bufvec) + 
+                                         (capacity - ((size_t) 1)) * sizeof(struct fuse_buf));
+    if (vec == NULL) return -1;
+    state->vec = vec;
+    state->capacity = capacity;
+  }
+  last = &(state->vec->buf[state->vec->count]);
+  memset(last, 0, sizeof(struct fuse_buf));
+  last->size = len;
+  last->fd = -1;
+  if (start == ((size_t) 0)) {
+    last->mem = calloc(len, (size_t) 1);
+    if (last->mem == NULL) return -1;
+  } else {
+    last->flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    last->fd = state->env->backup_fd;
+    last->pos = (off_t) start;
+  }
+  state->vec->count++;
+  return 0;
+}
+
+static void __myfs_free_bufvec(struct fuse_bufvec *vec) {
+  size_t i;
+
+  for (i=0;i<vec->count;i++) {
+    free(vec->buf[i].mem);
+  }
+  free(vec);
+}
+
+/* With --zerocopy, reads get mapped onto the backup-file, which holds
+   the filesystem as the mapping is shared, and libfuse moves the 
+   bytes from there, splicing them when it can. Otherwise the contents
+   are copied once, into a buffer of their own. */
+static int __myfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  struct __myfs_read_buf_state_struct_t state;
+  struct fuse_bufvec *vec;
+  void *mem;
+  int __myfs_errno, res;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  if (!(env->zero_copy)) {
+    vec = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec));
+    mem = malloc((size > ((size_t) 0)) ? size : ((size_t) 1));
+    if ((vec == NULL) || (mem == NULL)) {
+      free(vec);
+      free(mem);
+      return -ENOMEM;
+    }
+    res = __myfs_read(path, (char *) mem, size, offset, fi);
+    if (res < 0) {
+      free(vec);
+      free(mem);
+      return res;
+    }
+    *vec = FUSE_BUFVEC_INIT((size_t) res);
+    vec->buf[0].mem = mem;
+    *bufp = vec;
+    return 0;
+  }
+
+  state.env = env;
+  state.capacity = (size_t) 4;
+  state.vec = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec) + 
+                                            (state.capacity - ((size_t) 1)) * sizeof(struct fuse_buf));
+  if (state.vec == NULL) return -ENOMEM;
+  memset(state.vec, 0, sizeof(struct fuse_bufvec));
+
+  __myfs_errno = ENOENT;
+  __myfs_lock(env, 0);
+  __myfs_lock_inode(env, path, 0);
+  res = __myfs_map_implem(env->memory,
+                          env->size,
+                          &__myfs_errno,
+                          path,
+                          size,
+                          offset,
+                          0,
+                          __myfs_read_buf_add,
+                          &state);
+  __myfs_unlock_inode(env, path);
+  __myfs_unlock(env);
+  if (res < 0) {
+    __myfs_free_bufvec(state.vec);
+    return (__myfs_errno == EIO) ? -ENOMEM : -__myfs_errno;
+  }
+  *bufp = state.vec;
+  return 0;
+}
+
+struct __myfs_write_buf_state_struct_t {
+  struct __myfs_environment_struct_t *env;
+  struct fuse_bufvec                 *src;
+};
+
+static int __myfs_write_buf_copy(void *data, size_t start, size_t len) {
+  struct __myfs_write_buf_state_struct_t *state;
+  struct fuse_bufvec dst;
+
+  state = (struct __myfs_write_buf_state_struct_t *) data;
+  dst = FUSE_BUFVEC_INIT(len);
+  dst.buf[0].mem = state->env->memory + start;
+  if (fuse_buf_copy(&dst, state->src, (enum fuse_buf_copy_flags) 0) != (ssize_t) len) return -1;
+  return 0;
+}
+
+/* Data in memory goes the usual way. Data that libfuse left in a
+   pipe or file is copied straight into the file when it is 
+   overwritten in place, and through a buffer otherwise. */
+static int __myfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  struct __myfs_write_buf_state_struct_t state;
+  struct fuse_bufvec tmp;
+  size_t size;
+  ssize_t copied;
+  int __myfs_errno, res;
+
+  size = fuse_buf_size(buf);
+  if ((buf->count == ((size_t) 1)) && (buf->idx == ((size_t) 0)) && (buf->off == ((size_t) 0)) &&
+      (!(buf->buf[0].flags & FUSE_BUF_IS_FD))) {
+    return __myfs_write(path, (const char *) buf->buf[0].mem, size, offset, fi);
+  }
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+  
+  state.env = env;
+  state.src = buf;
+  __myfs_errno = ENOENT;
+  __myfs_lock(env, 0);
+  __myfs_lock_inode(env, path, 1);
+  res = __myfs_map_implem(env->memory,
+                          env->size,
+                          &__myfs_errno,
+                          path,
+                          size,
+                          offset,
+                          1,
+                          __myfs_write_buf_copy,
+                          &state);
+  __myfs_unlock_inode(env, path);
+  __myfs_unlock(env);
+  if (res >= 0)
+    return res;
+  if (__myfs_errno != EAGAIN)
+    return -__myfs_errno;
+
+  tmp = FUSE_BUFVEC_INIT(size);
+  tmp.buf[0].mem = malloc((size > ((size_t) 0)) ? size : ((size_t) 1));
+  if (tmp.buf[0].mem == NULL)
+    return -ENOMEM;
+  copied = fuse_buf_copy(&tmp, buf, (enum fuse_buf_copy_flags) 0);
+  if (copied < ((ssize_t) 0)) {
+    free(tmp.buf[0].mem);
+    return (int) copied;
+  }
+  res = __myfs_write(path, (const char *) tmp.buf[0].mem, (size_t) copied, offset, fi);
+  free(tmp.buf[0].mem);
+  return res;
+}
+
 static int __myfs_statfs(const char* path, struct statvfs* stbuf) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
@@ -572,12 +1361,12 @@ static int __myfs_statfs(const char* path, struct statvfs* stbuf) {
   memset(stbuf, 0, sizeof(struct statvfs));
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 0);
   res = __myfs_statfs_implem(env->memory,
                              env->size,
                              &__myfs_errno,
                              stbuf);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_unlock(env);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -592,13 +1381,14 @@ static int __myfs_utimens(const char* path, const struct timespec ts[2]) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 1);
   res = __myfs_utimens_implem(env->memory,
                               env->size,
                               &__myfs_errno,
                               path,
                               ts);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_commit(env);
+  __myfs_unlock(env);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -617,14 +1407,30 @@ static int __myfs_fsync(const char *path, int datasync, struct fuse_file_info *f
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = EIO;
-  pthread_mutex_lock(&(env->env_lock));
+  __myfs_lock(env, 1);
   res = __myfs_sync_environment(env);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_unlock(env);
   if (res >= 0)
     return res;
   return -__myfs_errno;  
 }
 
+static void *__myfs_init(struct fuse_conn_info *conn) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+
+  (void) conn;
+  
+  /* The flusher can only be started here, once FUSE has gone into 
+     the background */
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+  if (env != NULL) {
+    __myfs_start_flusher(env);
+  }
+  return env;
+}
+
 static void __myfs_destroy(void *private_data) {
   struct __myfs_environment_struct_t *env;
   
@@ -645,9 +1451,12 @@ static struct fuse_operations __myfs_operations = {
   .open = __myfs_open,
   .read = __myfs_read,
   .write = __myfs_write,
+  .read_buf = __myfs_read_buf,
+  .write_buf = __myfs_write_buf,
   .statfs = __myfs_statfs,
   .utimens = __myfs_utimens,
   .fsync = __myfs_fsync,
+  .init = __myfs_init,
   .destroy = __myfs_destroy
 };
 
@@ -666,6 +1475,25 @@ static void __myfs_show_help(const char *name) {
                "                            backup-file and the size specified.\n"
                "                            The minimum size of a filesystem is 2kB. If a\n"
                "                            lesser size is used, it is increased to 2kB.\n"
+               "    --locking=<s>           Locking mode, global or rwlock\n"
+               "                            Default: global, one operation at a time.\n"
+               "                            rwlock lets reads, getattr and readdir run\n"
+               "                            in parallel and uses per-file locks for\n"
+               "                            file contents.\n"
+               "    --flushinterval=<n>     Write changes back to the backup-file every\n"
+               "                            n seconds in the background.\n"
+               "                            Default: 0, only on fsync and unmount.\n"
+               "    --syncstats             Report how many bytes every write-back to the\n"
+               "                            backup-file wrote on stderr.\n"
+               "    --journal               Keep a write-ahead journal for the metadata in\n"
+               "                            the backup-file, so that a crash cannot leave\n"
+               "                            it inconsistent. Changes are then only written\n"
+               "                            at checkpoints, through the journal otherwise.\n"
+               "    --zerocopy              Hand file contents read to FUSE as ranges of the\n"
+               "                            backup-file, to be spliced instead of copied.\n"
+               "                            A read racing with a truncate or unlink of the\n"
+               "                            same file may then see the bytes replacing its\n"
+               "                            contents. Not with --journal.\n"
                "\n");
 }
 
@@ -678,6 +1506,11 @@ int main(int argc, char *argv[]) {
   /* Initialize defaults */
   __myfs_options.filename = NULL;
   __myfs_options.size = NULL;
+  __myfs_options.locking = NULL;
+  __myfs_options.flushinterval = NULL;
+  __myfs_options.syncstats = 0;
+  __myfs_options.journal = 0;
+  __myfs_options.zerocopy = 0;
   __myfs_options.show_help = 0;
         
   /* Parse options */
@@ -691,6 +1524,10 @@ int main(int argc, char *argv[]) {
     env_ptr = &__myfs_environment;
     if (!__myfs_setup_environment(env_ptr, &__myfs_options))
       return 1;
+    if (!__myfs_check_environment(env_ptr))
+      return 1;
+    if (!__myfs_prime_environment(env_ptr))
+      return 1;
   } else {
     /* Handle displaying of help text */
     __myfs_show_help(argv[0]);
@@ -0,0 +1,104 @@
+/*
+
+  Test of the directory index of implementation.c
+
+  Includes the implementation, so that the index itself can be looked
+  at, not only the results of lookups. Build and run it with
+
+  gcc -O2 -Wall test_dir_index.c -o test_dir_index && ./test_dir_index
+
+  Creates directories full of entries with long names, which are
+  stored in blocks of their own, removes part of them with unlink,
+  rmdir and rename to another directory, and checks that every
+  directory still has its index and that every remaining entry is in
+  it. Prints what failed and exits with 1 on failure.
+
+*/
+
+#include <sys/mman.h>
+
+#include "implementation.c"
+
+#define TEST_SIZE    ((size_t) (64 << 20)) /* 64MB */
+#define TEST_ENTRIES ((size_t) 2000)
+
+static int __test_failures = 0;
+
+static void __test_check(int cond, const char *what) {
+  if (!cond) {
+    fprintf(stderr, "FAIL: %s\n", what);
+    __test_failures++;
+  }
+}
+
+/* Checks that dir has an index that knows all of its children */
+static void __test_check_index(void *memory, const char *path) {
+  __myfs_handle_t *handle;
+  __myfs_inode_t *dir;
+  size_t i, position;
+
+  handle = __myfs_get_handle(memory, TEST_SIZE);
+  dir = __myfs_path_resolve(handle, path);
+  __test_check(dir != NULL, path);
+  if (dir == NULL) return;
+  __test_check(dir->value.directory.index != (__myfs_offset_t) 0, "directory index still present");
+  if (dir->value.directory.index == (__myfs_offset_t) 0) return;
+  for (i = (size_t) 0; i < dir->value.directory.number_children; i++) {
+    if (__myfs_dir_index_slot(handle, dir, i) == dir->value.directory.index_size) {
+      __test_check(0, "remaining child found in the index");
+      return;
+    }
+    if (__myfs_dir_lookup(handle, dir, __myfs_inode_name(handle, __myfs_dir_child(handle, dir, i)),
+                          (size_t) __myfs_dir_child(handle, dir, i)->name_length, &position) == NULL) {
+      __test_check(0, "remaining child found by lookup");
+      return;
+    }
+  }
+}
+
+int main(void) {
+  void *memory;
+  char path[128], to[128];
+  size_t i;
+  int e;
+
+  memory = mmap(NULL, TEST_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    perror("Cannot map memory");
+    return 1;
+  }
+
+  __test_check(__myfs_mkdir_implem(memory, TEST_SIZE, &e, "/files") == 0, "mkdir /files");
+  __test_check(__myfs_mkdir_implem(memory, TEST_SIZE, &e, "/dirs") == 0, "mkdir /dirs");
+  __test_check(__myfs_mkdir_implem(memory, TEST_SIZE, &e, "/moved") == 0, "mkdir /moved");
+  for (i = 0; i < TEST_ENTRIES; i++) {
+    snprintf(path, sizeof(path), "/files/a-rather-long-file-name-%06zu", i);
+    __test_check(__myfs_mknod_implem(memory, TEST_SIZE, &e, path) == 0, "mknod");
+    snprintf(path, sizeof(path), "/dirs/a-rather-long-directory-name-%06zu", i);
+    __test_check(__myfs_mkdir_implem(memory, TEST_SIZE, &e, path) == 0, "mkdir");
+  }
+
+  /* unlink and rmdir every other entry, move every fourth elsewhere */
+  for (i = 0; i < TEST_ENTRIES; i += 2) {
+    snprintf(path, sizeof(path), "/files/a-rather-long-file-name-%06zu", i);
+    __test_check(__myfs_unlink_implem(memory, TEST_SIZE, &e, path) == 0, "unlink");
+    snprintf(path, sizeof(path), "/dirs/a-rather-long-directory-name-%06zu", i);
+    __test_check(__myfs_rmdir_implem(memory, TEST_SIZE, &e, path) == 0, "rmdir");
+  }
+  for (i = 1; i < TEST_ENTRIES; i += 4) {
+    snprintf(path, sizeof(path), "/files/a-rather-long-file-name-%06zu", i);
+    snprintf(to, sizeof(to), "/moved/another-long-file-name-%06zu", i);
+    __test_check(__myfs_rename_implem(memory, TEST_SIZE, &e, path, to) == 0, "rename");
+  }
+
+  __test_check_index(memory, "/files");
+  __test_check_index(memory, "/dirs");
+  __test_check_index(memory, "/moved");
+
+  if (__test_failures != 0) {
+    fprintf(stderr, "%d checks failed\n", __test_failures);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
@@ -1,11 +1,22 @@
 #include <stdio.h>
-#include <sys/type.h>
+#include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
-#include <sys/mman.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include "record_map.h"
+
+
+/*
+  Looks words up in a dictionary file of fixed-size entries sorted by
+  the spanish word, padded with '#'. The lookups are done by the
+  record_map functions of homework1:
+
+  gcc -Wall -O3 -I../../homework1 lookup.c ../../homework1/record_map.c -o lookup
+*/
 
 
 typedef struct {
@@ -17,156 +28,174 @@ typedef struct {
 
 
 void usage(){
-  fprintf(stderr, "lookup <filename> <word>\n");
+  fprintf(stderr, "lookup <filename> <word> [<word> ...]\n");
+  fprintf(stderr, "lookup <filename> -p <prefix>\n");
 }
 
 
 
-void print_trimmed(const char *str){  
+void print_trimmed(const char *str, size_t len){  
   const char *curr;
-  for (curr = str;(*curr != '\0') && (*curr != '#'); curr++){
+  for (curr = str;(curr < str + len) && (*curr != '\0') && (*curr != '#'); curr++){
     printf("%c", *curr);
   }
 }
 
 
 
-int compare_entries(const char *word_a, const char *word_b){
-  const char *a;
-  const char *b;
-
-  for (a = word_a, b = word_b;
-       ((*a != '\0') && (*a != '#') &&
-	(*b != '\0') && (*b != '#'));
-       a++, b++){
-    
-    if (*a < *b) return -1;
-    if (*a > *b) return 1;
+/* Compares two words of at most len characters, ended by '\0' or '#'.
+   Also compares the keys of entries to prefixes of len characters,
+   in the same order the entries are sorted in. */
+int compare_entries(const char *word_a, const char *word_b, size_t len){
+  size_t i;
+  int a_over, b_over;
+
+  for (i = (size_t) 0; i < len; i++){
+    a_over = (word_a[i] == '\0') || (word_a[i] == '#');
+    b_over = (word_b[i] == '\0') || (word_b[i] == '#');
+    if (a_over && b_over) return 0;
+    // a is over, b is not
+    if (a_over) return -1;
+    // a is not over, b is over
+    if (b_over) return 1;
+    if (word_a[i] < word_b[i]) return -1;
+    if (word_a[i] > word_b[i]) return 1;
   }
-  if (((*a == '\0') || (*a == '#')) &&
-      ((*b != '\0') && (*b != '#'))) {
-    // a is over  , b is not
-    return -1;
+  return 0;	   
+}
+
+
+
+/* Copies word into key, padded with '#' like the entries are */
+void make_key(char *key, size_t width, const char *word){
+  size_t i;
+
+  for (i = (size_t) 0; (i < width) && (word[i] != '\0'); i++){
+    key[i] = word[i];
   }
-  if (((*a != '\0') && (*a != '#')) &&
-      ((*b == '\0') || (*b == '#'))) {
-    // a is not over a , b is over 
-      return 1;
+  for (; i < width; i++){
+    key[i] = '#';
   }
-  return 0;	   
 }
 
 
 
-char *lookup_doit(entry_t dictionary[], ssize_t num_entries, const char *word){
-  // if its sorted do binary search
-  ssize_t l, r, m;
-  int cmp;
+void print_entry(const entry_t *entry){
+  print_trimmed(entry->spanish, sizeof(entry->spanish));
+  printf(" = ");
+  print_trimmed(entry->english, sizeof(entry->english));
+  printf("\n");
+}
 
-  l = (ssize_t) 0;
-  r = num_entries - ((ssize_t)1);
-  
-  while (l <= r){
-    m = (l + r) / ((ssize_t)2);
 
-    cmp = compare_entries(dictionary[m].spanish, word);
 
-    if(cmp == 0) return dictionary[m].english;
-    if(cmp < 0){
-      l = m + ((ssize_t)1); // incase mid is not even
-    }else{
-      r = m - ((ssize_t)1);
+int open_dictionary(record_map_t *map, const char *filename, int preload){
+  if (record_map_open(map, filename, sizeof(entry_t), offsetof(entry_t, spanish),
+                      sizeof(((entry_t *) NULL)->spanish), preload) < 0){
+    if (errno == EINVAL){
+      fprintf(stderr, "The file \"%s\" is not properly formatted \n", filename);
+    } else {
+      fprintf(stderr, "Error opening file \"%s\": %s \n", filename, strerror(errno));
     }
+    return 1;
   }
-  return NULL;
+  map->compare = compare_entries;
+  return 0;
 }
 
 
 
-int lookup(const char *filename, const char *word){
-
-  int fd;
-  off_t lseek_res;
-  void *ptr;
-  cahr *english;
-  
-  fd = open(filename, O_RDONLY);
-
-  if (fd < 0){
-    fprintf(stderr, "Error opening file \"%s\": %s \n", filename, stderror(errno));
+int close_dictionary(record_map_t *map, const char *filename){
+  if (record_map_close(map) < 0){
+    fprintf(stderr, "Error closing file \"%s\": %s\n", filename, strerror(errno));
     return 1;
   }
+  return 0;
+}
 
-  /* Return offset of bytes of file */
-  lseek_res = lseek(fd, (off_t) 0, SEEK_END);
 
-  if (lseek_res == ((off_t) -1)){
-    fprintf(stderr,"Error seeking in file \%s\":  %s\n", filename, stderror(errno));
-    
-    if(close(fd) < 0){
-      fprintf(stderr, "Error closing file \%s\": %s\n", filename, stderror(errno));
-    }
+
+/* Looks up all words at once, they get sorted by record_map_find_batch() */
+int lookup(const char *filename, char **words, size_t n){
+  record_map_t map;
+  char *keys;
+  const char **key_ptrs;
+  const char **entries;
+  size_t width, i;
+  int res;
+
+  if (open_dictionary(&map, filename, n > (size_t) 1)) return 1;
+
+  width = map.key_width;
+  keys = (char *) malloc(n * width);
+  key_ptrs = (const char **) malloc(n * sizeof(char *));
+  entries = (const char **) malloc(n * sizeof(char *));
+  if ((keys == NULL) || (key_ptrs == NULL) || (entries == NULL)){
+    fprintf(stderr, "Error allocating memory: %s\n", strerror(errno));
+    free(keys);
+    free(key_ptrs);
+    free(entries);
+    close_dictionary(&map, filename);
     return 1;
   }
 
-  
-  filesize = (size_t) lseek_res;
-  
-  if((filesize % sizeof(entry_t)) != ((size_t) 0)){ /* TODO */
-    fprintf(stderrr, "The file \"%s\" is not properly formatted \n", filename);
-    if(close(fd) < 0){
-      fprintf(stderr, "Error closing file \%s\": %s\n", filename, stderror(errno));
-    }
-    return 1;
+  for (i = (size_t) 0; i < n; i++){
+    make_key(&keys[i * width], width, words[i]);
+    key_ptrs[i] = &keys[i * width];
   }
 
-  
-  ptr = mmap(NULL, filesize, PROT_READ, MAP_SHARED, fd, (off_t) 0);
-  if (ptr == MAP_FAILED){
-    fprintf(stderr, "Error mapping file \%s\" in memory: %s\n", filename, stderror()errno);
-    if(close(fd) < 0){
-      fprintf(stderr, "Error closing file \%s\": %s\n", filename, stderror(errno));
+  res = 0;
+  if (record_map_find_batch(&map, key_ptrs, n, entries) < 0){
+    fprintf(stderr, "Error allocating memory: %s\n", strerror(errno));
+    res = 1;
+  } else {
+    for (i = (size_t) 0; i < n; i++){
+      /* A key only holds the first width characters of a word */
+      if ((entries[i] == NULL) || (strlen(words[i]) > width)){
+        fprintf(stderr, "The word \"%s\" has not been found in the dictionary.\n", words[i]);
+        res = 1;
+      } else {
+        print_entry((const entry_t *) entries[i]);
+      }
     }
-    return 1;
   }
 
-  
-  /*
-    Here we have a valid pointer to memory, at that pointer , we can read what is inside that file. 
-    (Valid pointer to memory)
-  */
-
-  english = lookup_doit((entry_t *) ptr, ((ssize_t) (filesize / sizeof(entry_t))), word);
-
-  if(english == NULL){
-    fprintf(stderror, "The word \%s\" has not been found in the dictionary.\n", word);
-  }else{
-    printf("%s = ");
-    print_trimmed(english);
-    printf("\n");
+  free(keys);
+  free(key_ptrs);
+  free(entries);
+  if (close_dictionary(&map, filename)) return 1;
+  return res;
+}
+
+
+
+/* Prints all entries whose spanish word starts with prefix */
+int lookup_prefix(const char *filename, const char *prefix){
+  record_map_t map;
+  size_t first, count, i;
+
+  if (open_dictionary(&map, filename, 0)) return 1;
+
+  first = (size_t) 0;
+  count = (size_t) 0;
+  if (strlen(prefix) <= map.key_width){
+    count = record_map_prefix(&map, prefix, strlen(prefix), &first);
   }
-  
-  if(munmap(ptr,filesize) < 0){
-    fprintf(stderr, "Error unmapping file \%s\": %s\n", filename, stderror(errno));
-    if(close(fd) < 0){
-      fprintf(stderr, "Error closing file \%s\": %s\n", filename, stderror(errno));
-    }
-    return 1;
+  if (count == (size_t) 0){
+    fprintf(stderr, "No word starting with \"%s\" is in the dictionary.\n", prefix);
   }
-       
-  
-  if(close(fd) < 0){
-    fprintf(stderr, "Error closing file \%s\": %s\n", filename, stderror(errno));
-    return 1;
+  for (i = first; i < first + count; i++){
+    print_entry((const entry_t *) record_map_record(&map, i));
   }
-  return 0;
+
+  if (close_dictionary(&map, filename)) return 1;
+  return (count == (size_t) 0 ? 1 : 0);
 }
 
 
 
 int main (int argc, char **argv){
   char *filename;
-  char *word;
   
   if (argc < 3){
     usage();
@@ -174,8 +203,15 @@ int main (int argc, char **argv){
   }
 
   filename = argv[1];
-  word = argv[2];
 
-  if (lookup(filename, word)) return 1;
+  if (strcmp(argv[2], "-p") == 0){
+    if (argc != 4){
+      usage();
+      return 1;
+    }
+    return lookup_prefix(filename, argv[3]);
+  }
+
+  if (lookup(filename, &argv[2], (size_t) (argc - 2))) return 1;
   return 0;
 }
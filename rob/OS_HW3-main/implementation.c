@@ -219,12 +219,14 @@ void add_allocation_space(void *fsptr, List *LL, AllocateFrom *alloc) {
   __myfs_off_t temp_off = LL->first_space;
   __myfs_off_t alloc_off = ptr_to_off(fsptr, alloc);
 
-  // New space address is less than the first_space in LL
-  if (temp_off > alloc_off) {
+  // New space address is less than the first_space in LL or the list is empty
+  // because all the memory is in use
+  if ((temp_off == ((__myfs_off_t)0)) || (temp_off > alloc_off)) {
     /* At this point we know that alloc comes before LL->first_space */
     LL->first_space = alloc_off;  // Update first space
     // Check if we can merge LL->first_space and alloc
-    if ((alloc_off + sizeof(size_t) + alloc->remaining) == temp_off) {
+    if ((temp_off != ((__myfs_off_t)0)) &&
+        ((alloc_off + sizeof(size_t) + alloc->remaining) == temp_off)) {
       // Get first pointer
       temp = off_to_ptr(fsptr, temp_off);
       // Combine the spaces available
@@ -304,8 +306,9 @@ void extend_pref_block(void *fsptr, AllocateFrom *before_pref,
     }
     // We can't make an AllocateFrom object
     else {
-      // Add everything that the prefer block have into the original one
-      org_pref->remaining += pref->remaining;
+      // Add everything that the prefer block have into the original one,
+      // including its header
+      org_pref->remaining += sizeof(size_t) + pref->remaining;
 
       // Update pointers so the one that was pointing to the prefer free block
       // is now pointing to the next free
@@ -316,50 +319,174 @@ void extend_pref_block(void *fsptr, AllocateFrom *before_pref,
   // We couldn't got everything from the prefer block so we get as much as we
   // can from it
   else {
-    // Add everything that the prefer block have into the original one
-    org_pref->remaining += pref->remaining;
+    // Add everything that the prefer block have into the original one,
+    // including its header
+    org_pref->remaining += sizeof(size_t) + pref->remaining;
 
     // Update pointers so the one that was pointing to the prefer free block is
     // now pointing to the next free
     before_pref->next_space = pref->next_space;
 
-    // Update size because we have gotten some space
-    *size -= pref->remaining;
+    // Update size because we have gotten some space, the header may have been
+    // just what was missing
+    if (sizeof(size_t) + pref->remaining >= *size) {
+      *size = ((size_t)0);
+    } else {
+      *size -= sizeof(size_t) + pref->remaining;
+    }
+  }
+}
+
+/* Return the placement policy of the file system, images made before the
+ * policies existed always place by largest block */
+uint32_t get_placement(void *fsptr) {
+  handler_t *handle = ((handler_t *)fsptr);
+
+  if (handle->magic == MYFS_MAGIC_V1) {
+    return PLACEMENT_LARGEST;
+  }
+  return handle->placement;
+}
+
+/* Find the free block that placement picks for size bytes and save the block
+ * before it in *before. Next fit and locality pick the first block that fits at
+ * or after start_off and otherwise wrap around to the start of the list. If no
+ * block can hold size bytes we fall back to the largest one.
+ */
+AllocateFrom *find_allocation_space(void *fsptr, List *LL, uint32_t placement,
+                                    __myfs_off_t start_off, size_t size,
+                                    AllocateFrom **before) {
+  // LL->first_space is where the next_space of an AllocateFrom would be, so
+  // the list itself works as the block before the first one
+  AllocateFrom *before_temp = ((void *)LL) - sizeof(size_t);
+  __myfs_off_t temp_off;
+  AllocateFrom *temp;
+
+  // Block picked by the policy
+  AllocateFrom *before_found = NULL;
+  AllocateFrom *found = NULL;
+
+  // First block that fits before start_off
+  AllocateFrom *before_wrapped = NULL;
+  AllocateFrom *wrapped = NULL;
+
+  // Largest block variables
+  AllocateFrom *before_largest = NULL;
+  AllocateFrom *largest = NULL;
+
+  for (temp_off = LL->first_space; temp_off != ((__myfs_off_t)0);
+       temp_off = temp->next_space) {
+    temp = off_to_ptr(fsptr, temp_off);
+
+    // Keep track of the largest block in case no block can hold size bytes
+    if ((largest == NULL) || (temp->remaining > largest->remaining)) {
+      before_largest = before_temp;
+      largest = temp;
+    }
+
+    if ((placement != PLACEMENT_LARGEST) && (temp->remaining >= size)) {
+      // Best fit has to see every block unless it finds an exact match
+      if (placement == PLACEMENT_BEST_FIT) {
+        if ((found == NULL) || (temp->remaining < found->remaining)) {
+          before_found = before_temp;
+          found = temp;
+          if (temp->remaining == size) {
+            break;
+          }
+        }
+      }
+      // The other policies take the first block that fits after start_off
+      else if ((placement == PLACEMENT_FIRST_FIT) || (temp_off >= start_off)) {
+        before_found = before_temp;
+        found = temp;
+        break;
+      }
+      // Remember the first one before start_off in case we have to wrap around
+      else if (wrapped == NULL) {
+        before_wrapped = before_temp;
+        wrapped = temp;
+      }
+    }
+
+    before_temp = temp;
+  }
+
+  if (found == NULL) {
+    before_found = before_wrapped;
+    found = wrapped;
   }
+  if (found == NULL) {
+    before_found = before_largest;
+    found = largest;
+  }
+
+  *before = before_found;
+  return found;
+}
+
+/* Take size bytes from alloc, which is the free block after before, and return
+ * a pointer to them. If alloc is too small we take all of it and leave in *size
+ * how many bytes are still missing.
+ */
+void *take_allocation_space(AllocateFrom *before, AllocateFrom *alloc,
+                            size_t *size) {
+  AllocateFrom *temp;
+
+  // Check if the block can give everything that we are missing
+  if (alloc->remaining >= *size) {
+    // Check if we can make an AllocateFrom object after getting size bytes
+    // from it
+    if (alloc->remaining > *size + sizeof(AllocateFrom)) {
+      // Make the new AllocateFrom object
+      temp = ((void *)alloc) + sizeof(size_t) + *size;
+      temp->remaining = alloc->remaining - *size - sizeof(size_t);
+      temp->next_space = alloc->next_space;
+
+      // before points to alloc, so we move it forward to temp
+      before->next_space += sizeof(size_t) + *size;
+
+      // Set alloc with the size that we took
+      alloc->remaining = *size;
+    }
+    // We can't make an AllocateFrom object so we take everything
+    else {
+      before->next_space = alloc->next_space;
+    }
+    *size = ((size_t)0);
+  }
+  // We couldn't get everything from the block so we take all of it
+  else {
+    before->next_space = alloc->next_space;
+    *size -= alloc->remaining;
+  }
+
+  return ((void *)alloc) + sizeof(size_t);
 }
 
 /* Check if the offset for pref_ptr is 0, if so we get any block for size,
  * otherwise we try to find the block after it and get as much from it as
- * possible and get the rest from the largest block
+ * possible and get the rest from the block that the placement policy picks
  */
 void *get_allocation(void *fsptr, List *LL, AllocateFrom *org_pref,
                      size_t *size) {
+  handler_t *handle = ((handler_t *)fsptr);
+  uint32_t placement = get_placement(fsptr);
+
   // There is no guarantee that its offset is not 0, if so, we don't consider it
   __myfs_off_t pref_off = ((__myfs_off_t)0);
 
-  // Before current space
-  __myfs_off_t before_temp_off;
-  AllocateFrom *before_temp;
+  // Where next fit and locality start looking for a block
+  __myfs_off_t start_off = ((__myfs_off_t)0);
 
-  // current space
+  // The list works as the block before the first one, see
+  // find_allocation_space()
+  AllocateFrom *before_temp = ((void *)LL) - sizeof(size_t);
   __myfs_off_t temp_off;
   AllocateFrom *temp;
 
-  // Largest block variables
-  AllocateFrom *before_largest = NULL;
-  __myfs_off_t largest_off;
-  AllocateFrom *largest;
-  size_t largest_size;
-
-  // Use this ptr if a new block needs to be return
-  AllocateFrom *ptr = NULL;
-
-  // Save first space
-  before_temp_off = LL->first_space;
-
-  // If before_temp have an offset of zero we have use all possible space in
-  // memory
-  if (!before_temp_off) {
+  // If the first space have an offset of zero we have use all possible space
+  // in memory
+  if (!LL->first_space) {
     return NULL;
   }
 
@@ -371,115 +498,49 @@ void *get_allocation(void *fsptr, List *LL, AllocateFrom *org_pref,
   if (((void *)org_pref) != fsptr) {
     pref_off =
         ptr_to_off(fsptr, org_pref) + sizeof(size_t) + org_pref->remaining;
-    // Check that the first block is the prefer one or not
-    if (pref_off == before_temp_off) {
-      extend_pref_block(fsptr, ((void *)LL) - sizeof(size_t), org_pref,
-                        pref_off, size);
+
+    // The list is in ascending order so the prefer block can only be before
+    // the first block past pref_off
+    temp_off = LL->first_space;
+    while ((temp_off != ((__myfs_off_t)0)) && (temp_off < pref_off)) {
+      before_temp = off_to_ptr(fsptr, temp_off);
+      temp_off = before_temp->next_space;
+    }
+
+    if (temp_off == pref_off) {
+      extend_pref_block(fsptr, before_temp, org_pref, pref_off, size);
       if (*size == ((size_t)0)) {
         return NULL;
       }
     }
-  }
-
-  // We currently have before_temp as our largest block
-  before_temp_off = LL->first_space;
-  before_temp = off_to_ptr(fsptr, before_temp_off);
-  largest_off = before_temp_off;
-  largest = before_temp;
-  largest_size = before_temp->remaining;
 
-  // Get next space
-  temp_off = before_temp->next_space;
+    // Locality keeps the rest of the file close to where it was going
+    start_off = pref_off;
 
-  // Iterate the list until the first block that can hold size and the block
-  // after pref_ptr is found (or pass because it is not there)
-  while (temp_off != ((__myfs_off_t)0)) {
-    // The offset is to get after the size_t so we readjust it
-    temp = off_to_ptr(fsptr, temp_off);
-    // Check if temp_off is the prefer block that we are looking for or if temp
-    // have more space available than the previous largest
-    if ((pref_off == temp_off) || (temp->remaining > largest_size)) {
-      // If temp_off is pref we would not like to update largest space so we
-      // have two places to get space from
-      if (pref_off == temp_off) {
-        // pref_found was successfully found
-        extend_pref_block(fsptr, before_temp, org_pref, pref_off, size);
-        if (size == ((__myfs_off_t)0)) {
-          break;
-        }
-      }
-      // Update largest space
-      else {
-        before_largest = before_temp;
-        largest_off = temp_off;
-        largest = temp;
-        largest_size = temp->remaining;
-      }
-    }
-    // Update pointers to next space
-    before_temp_off = temp_off;
-    before_temp = temp;
-    temp_off = temp->next_space;
-  }
-
-  // If size is still not 0 we get as much as we can from it or until size is 0
-  if ((*size != ((__myfs_off_t)0)) && (largest != NULL)) {
-    ptr = largest;
-    // Check if the largest block can give everything that we are missing
-    if (largest->remaining >= *size) {
-      // Check if we can make an AllocateFrom object after getting size bytes
-      // from it
-      if (largest->remaining > *size + sizeof(AllocateFrom)) {
-        // Make the new AllocateFrom object
-        temp = ((void *)largest) + sizeof(size_t) + *size;  //
-        temp->remaining = largest->remaining - *size - sizeof(size_t);
-        temp->next_space = largest->next_space;
-        // Update before_largest pointer, it may be the LL or a AllocateFrom
-        if (before_largest == NULL) {
-          // before_largest is the LL
-          LL->first_space = largest_off + *size + sizeof(size_t);
-        } else {
-          // Update pointers to add temp list of free blocks
-          before_largest->next_space = largest_off + *size + sizeof(size_t);
-        }
-        // Set original pref with final total size
-        ptr->remaining = *size;
-      }
-      // We can't make an AllocateFrom object so we get everything
-      else {
-        // Use everything that the largest block have
-        if (before_largest != NULL) {
-          before_largest->next_space = largest->next_space;
-        } else {
-          // Because largest is the first block and we use everything, it means
-          // that the system have no memory left
-          LL->first_space = ((__myfs_off_t)0);
-        }
-      }
-      *size = ((__myfs_off_t)0);
-    }
-    // We couldn't got everything from the largest block so we get as much as we
-    // can from it
-    else {
-      // Update pointers
-      if (before_largest == NULL) {
-        // We had use everything and we still didn't got enough size
-        return NULL;
-      } else {
-        before_largest->next_space = largest->next_space;
-        // Update size
-        *size -= largest->remaining;
-      }
+    // What is still missing may be less than what a block can hold
+    if (*size < sizeof(AllocateFrom)) {
+      *size = sizeof(AllocateFrom);
     }
   }
 
-  // We suppose to return the new block address if a new block outside the
-  // prefer one was needed
-  if (ptr == NULL) {
+  if (placement == PLACEMENT_NEXT_FIT) {
+    start_off = handle->next_fit;
+  }
+
+  temp = find_allocation_space(fsptr, LL, placement, start_off, *size,
+                               &before_temp);
+  if (temp == NULL) {
     return NULL;
   }
-  return ((void *)ptr) + sizeof(size_t);  // ptr was set to the largest which is
-                                          // at the size_t header so we resize
+
+  void *ptr = take_allocation_space(before_temp, temp, size);
+
+  // Next fit continues right after what we just took
+  if (placement == PLACEMENT_NEXT_FIT) {
+    handle->next_fit = ptr_to_off(fsptr, ptr) + temp->remaining;
+  }
+
+  return ptr;
 }
 
 /* If size is zero, return NULL. Otherwise, call get_allocation with size. */
@@ -616,10 +677,14 @@ void handler(void *fsptr, size_t fssize) {
   handler_t *handle = ((handler_t *)fsptr);
 
   // If we are mounting the file system for the first time
-  if (handle->magic != MYFS_MAGIC) {
+  if ((handle->magic != MYFS_MAGIC) && (handle->magic != MYFS_MAGIC_V2) &&
+      (handle->magic != MYFS_MAGIC_V1)) {
     // Set general stats
     handle->magic = MYFS_MAGIC;
     handle->size = fssize;
+    handle->placement = PLACEMENT_LARGEST;
+    handle->next_fit = ((__myfs_off_t)0);
+    handle->dentry_cache = ((__myfs_off_t)0);
 
     // Save space for root directory
     // root directory is a node_t variable that starts after the handler_t
@@ -661,10 +726,20 @@ void handler(void *fsptr, size_t fssize) {
     // sizeof(size_t)
     fb->remaining = fssize - handle->free_memory - sizeof(size_t);
     memset(((void *)fb) + sizeof(size_t), 0, fb->remaining);
+
+    // Big enough file systems get a dentry cache, all its entries are empty
+    // because the memory is 0 already
+    if (fssize >= DENTRY_CACHE_MIN_FS_SIZE) {
+      size_t ask_size = DENTRY_CACHE_SIZE * sizeof(dentry_t);
+      void *cache = __malloc_impl(fsptr, NULL, &ask_size);
+      handle->dentry_cache = ptr_to_off(fsptr, cache);
+    }
   }
 }
 
-char *get_last_token(const char *path, unsigned long *token_len) {
+/* Return where the last token of path starts and put its length in *token_len,
+ * the token is not copied because it already ends where path does */
+const char *get_last_token(const char *path, unsigned long *token_len) {
   unsigned long len = strlen(path);
   unsigned long index;
 
@@ -680,77 +755,113 @@ char *get_last_token(const char *path, unsigned long *token_len) {
   // Set the length of the last node
   *token_len = len - index;
 
-  // Make a copy of the last token
-  void *ptr = malloc((*token_len + 1) * sizeof(char));
+  return &path[index];
+}
 
-  // Check that malloc was successful
-  if (ptr == NULL) {
-    return NULL;
+/* Return where the token after the token character at path starts and put its
+ * length in *token_len. The token is not copied, so it ends at the next token
+ * character or at the end of path, which is where the next call starts */
+const char *next_token(const char token, const char *path,
+                       unsigned long *token_len) {
+  const char *start = path;
+
+  // Jump the token character in front of the token
+  if (*start == token) {
+    start++;
   }
 
-  char *copy = (char *)ptr;
-  strcpy(copy, &path[index]);  // strcpy(dst,src)
+  const char *end = start;
+  while ((*end != token) && (*end != '\0')) {
+    end++;
+  }
 
-  // Add null character to terminate the string
-  copy[*token_len] = '\0';
+  *token_len = ((unsigned long)(end - start));
 
-  return copy;
+  return start;
 }
 
-char **tokenize(const char token, const char *path, int skip_n_tokens) {
-  int n_tokens = 0;
-  for (const char *c = path; *c != '\0'; c++) {
-    if (*c == token) {
-      n_tokens++;
-    }
+/* FNV-1a hash of the len characters of name */
+size_t hash_name(const char *name, unsigned long len) {
+  size_t hash = ((size_t)14695981039346656037ULL);
+
+  for (unsigned long i = 0; i < len; i++) {
+    hash ^= ((size_t)((unsigned char)name[i]));
+    hash *= ((size_t)1099511628211ULL);
   }
-  // n_tokens value would be of at least 1 because of root directory
-  // Do not tokenize the last skip_n_tokens
-  n_tokens -= skip_n_tokens;
 
-  char **tokens = (char **)malloc(((u_int)(n_tokens + 1)) * sizeof(char *));
-  const char *start = &path[1];  // Jump the first character which is '\'
-  const char *end = start;
-  char *t;
+  return hash;
+}
 
-  // Populate tokens
-  for (int i = 0; i < n_tokens; i++) {
-    while ((*end != token) && (*end != '\0')) {
-      end++;
-    }
-    // Make space for the token
-    t = (char *)malloc((((u_int)(end - start)) + ((u_int)1)) * sizeof(char));
-    // Copy token
-    memcpy(t, start, ((size_t)(end - start)));
-    t[end - start] = '\0';
-    tokens[i] = t;
-    start = ++end;
-  }
-  // Make array null terminated
-  tokens[n_tokens] = NULL;
-
-  return tokens;
+/* Return the entry of the dentry cache where the name with the given hash in
+ * dict goes, or NULL if the file system has no cache */
+dentry_t *get_dentry(void *fsptr, directory_t *dict, size_t hash) {
+  handler_t *handle = ((handler_t *)fsptr);
+
+  // Old images have no room for the cache and small ones don't get it
+  if ((handle->magic != MYFS_MAGIC) ||
+      (handle->dentry_cache == ((__myfs_off_t)0))) {
+    return NULL;
+  }
+
+  dentry_t *cache = off_to_ptr(fsptr, handle->dentry_cache);
+
+  // Mix the directory in so the same name in different directories don't
+  // always fight for the same entry
+  return &cache[(hash ^ ptr_to_off(fsptr, dict)) % DENTRY_CACHE_SIZE];
 }
 
-void free_tokens(char **tokens) {
-  for (char **p = tokens; *p; p++) free(*p);
-  free(tokens);
+/* Remove node, which is in dict, from the dentry cache. Nodes never move, so
+ * this only has to be done when they are removed */
+void forget_node(void *fsptr, directory_t *dict, node_t *node) {
+  unsigned long len = strlen(node->name);
+  dentry_t *dentry = get_dentry(fsptr, dict, hash_name(node->name, len));
+
+  if ((dentry != NULL) && (dentry->node == ptr_to_off(fsptr, node))) {
+    dentry->node = ((__myfs_off_t)0);
+  }
 }
 
-node_t *get_node(void *fsptr, directory_t *dict, const char *child) {
+/* Find the child of dict with the len characters of child as its name, the
+ * dentry cache is checked before going over the children */
+node_t *get_node(void *fsptr, directory_t *dict, const char *child,
+                 unsigned long len) {
   size_t n_children = dict->number_children;
   __myfs_off_t *children = off_to_ptr(fsptr, dict->children);
+  __myfs_off_t dict_off = ptr_to_off(fsptr, dict);
   node_t *node = NULL;
 
   // Check if we need to go the parent directory
-  if (strcmp(child, "..") == 0) {
+  if ((len == 2) && (child[0] == '.') && (child[1] == '.')) {
     return ((node_t *)off_to_ptr(fsptr, children[0]));
   }
 
+  // No node can have a name that long
+  if (len > NAME_MAX_LEN) {
+    return NULL;
+  }
+
+  // The entry may be for another name that goes to the same place, so we still
+  // check the name of the node
+  size_t hash = hash_name(child, len);
+  dentry_t *dentry = get_dentry(fsptr, dict, hash);
+  if ((dentry != NULL) && (dentry->node != ((__myfs_off_t)0)) &&
+      (dentry->parent == dict_off) && (dentry->hash == hash)) {
+    node = ((node_t *)off_to_ptr(fsptr, dentry->node));
+    if ((node->name[len] == '\0') && (memcmp(node->name, child, len) == 0)) {
+      return node;
+    }
+  }
+
   // We start from the second children because the first one is ".." (parent)
   for (size_t i = ((size_t)1); i < n_children; i++) {
     node = ((node_t *)off_to_ptr(fsptr, children[i]));
-    if (strcmp(node->name, child) == 0) {
+    if ((node->name[len] == '\0') && (memcmp(node->name, child, len) == 0)) {
+      // Remember it for the next time
+      if (dentry != NULL) {
+        dentry->parent = dict_off;
+        dentry->node = children[i];
+        dentry->hash = hash;
+      }
       return node;
     }
   }
@@ -771,27 +882,38 @@ node_t *path_solver(void *fsptr, const char *path, int skip_n_tokens) {
     return node;
   }
 
-  // Break path into tokens
-  char **tokens = tokenize('/', path, skip_n_tokens);
+  // Every '/' starts a token, n_tokens value would be of at least 1 because of
+  // root directory. Do not follow the last skip_n_tokens
+  int n_tokens = 0;
+  for (const char *c = path; *c != '\0'; c++) {
+    if (*c == '/') {
+      n_tokens++;
+    }
+  }
+  n_tokens -= skip_n_tokens;
+
+  // Go over the tokens in place, so nothing gets allocated
+  const char *token = path;
+  unsigned long len;
+
+  for (; n_tokens > 0; n_tokens--) {
+    token = next_token('/', token, &len);
 
-  for (char **token = tokens; *token; token++) {
     // Files cannot have children
     if (node->is_file) {
-      free_tokens(tokens);
       return NULL;
     }
     // If token is "." we stay on the same directory
-    if (strcmp(*token, ".") != 0) {
-      node = get_node(fsptr, &node->type.directory, *token);
+    if ((len != 1) || (*token != '.')) {
+      node = get_node(fsptr, &node->type.directory, token, len);
       // Check that the child was successfully retrieved
       if (node == NULL) {
-        free_tokens(tokens);
         return NULL;
       }
     }
-  }
 
-  free_tokens(tokens);
+    token += len;
+  }
 
   return node;
 }
@@ -818,11 +940,11 @@ node_t *make_inode(void *fsptr, const char *path, int *errnoptr, int isfile) {
 
   // Get last token which have the filename
   unsigned long len;
-  char *new_node_name = get_last_token(path, &len);
+  const char *new_node_name = get_last_token(path, &len);
 
   // Check that the parent doesn't contain a node with the same name as the one
   // we are about to create
-  if (get_node(fsptr, dict, new_node_name) != NULL) {
+  if (get_node(fsptr, dict, new_node_name, len) != NULL) {
     *errnoptr = EEXIST;
     return NULL;
   }
@@ -944,7 +1066,8 @@ void remove_node(void *fsptr, directory_t *dict, node_t *node) {
     }
   }
 
-  // File must be at index
+  // File must be at index, it can't be found anymore
+  forget_node(fsptr, dict, node);
   __free_impl(fsptr, node);
 
   // Move the remaining nodes one to the left to cover the node remove
@@ -956,28 +1079,33 @@ void remove_node(void *fsptr, directory_t *dict, node_t *node) {
   children[index] = ((__myfs_off_t)0);
   dict->number_children--;
 
-  // See if we can free some memory by half while keeping at least 4 offsets
+  // See if we can free some memory by half while keeping at least 4 offsets.
+  // The size of the children array is in the size_t header before it
+  size_t *children_size = (((size_t *)children) - 1);
   size_t new_n_children =
-      (*((size_t *)children) - 1) /
+      (*children_size) /
       sizeof(__myfs_off_t);  // Get the maximum number of children offset
-  new_n_children <<= 1;      // Divide the maximum number by two
+  new_n_children >>= 1;      // Divide the maximum number by two
 
   // Check if the new number of children is greater or equal than the current
   // number, check that we always have 4 or more children spaces
   //  and that we can actually made an AllocateFrom object before making it
   if ((new_n_children >= dict->number_children) &&
-      (new_n_children * sizeof(__myfs_off_t) >= sizeof(AllocateFrom)) &&
+      (*children_size - new_n_children * sizeof(__myfs_off_t) >=
+       sizeof(AllocateFrom)) &&
       (new_n_children >= 4)) {
     // Every condition is meet, so we proceed to make an AlloacteFrom object and
     // sent it to be added into the linked list of free blocks
     AllocateFrom *temp = ((AllocateFrom *)&children[new_n_children]);
-    temp->remaining = new_n_children * sizeof(__myfs_off_t) - sizeof(size_t);
+    temp->remaining =
+        *children_size - new_n_children * sizeof(__myfs_off_t) - sizeof(size_t);
     temp->next_space = 0;
-    __free_impl(fsptr, temp);
 
     // Update the new size of the current directory children array of offsets
-    size_t *new_size = (((size_t *)children) - 1);
-    *new_size -= (temp->remaining - sizeof(size_t));
+    *children_size = new_n_children * sizeof(__myfs_off_t);
+
+    // __free_impl() expects the pointer after the header
+    __free_impl(fsptr, ((void *)temp) + sizeof(size_t));
   }
 }
 
@@ -1002,20 +1130,28 @@ void remove_data(void *fsptr, file_block_t *block, size_t size) {
   }
 
   // Free the data starting at the idx, first you need to set the header with
-  // block->allocated - idx - sizeof(size_t) Make the header, if possible, and
-  // free it
-  if ((idx + sizeof(AllocateFrom)) < block->allocated) {
+  // what the data block has after idx - sizeof(size_t). Make the header, if
+  // possible, and free it. The data block has to keep enough space to be freed
+  // later on
+  size_t *data_size = ((size_t *)off_to_ptr(fsptr, block->data)) - 1;
+  if ((idx >= sizeof(AllocateFrom)) &&
+      ((idx + sizeof(AllocateFrom)) <= *data_size)) {
     size_t *temp = (size_t *)&((char *)off_to_ptr(fsptr, block->data))[idx];
-    *temp = block->allocated - idx - sizeof(size_t);
+    *temp = *data_size - idx - sizeof(size_t);
+    // The data block now ends at idx
+    *data_size = idx;
+    block->size = idx;
     // Our offset to the beginning is 0
     __free_impl(fsptr, ((void *)temp) + sizeof(size_t));
   }
+  block->allocated = idx;
 
-  // Free all date and block after this one
-  block = off_to_ptr(fsptr, block->next_file_block);
-  file_block_t *temp;
+  // Free all date and block after this one, which is the last one now
+  file_block_t *temp = off_to_ptr(fsptr, block->next_file_block);
+  block->next_file_block = ((__myfs_off_t)0);
+  block = temp;
 
-  while (block != fsptr) {
+  while (((void *)block) != fsptr) {
     // Free the data block
     __free_impl(fsptr, off_to_ptr(fsptr, block->data));
 
@@ -1064,9 +1200,8 @@ int add_data(void *fsptr, file_t *file, size_t size, int *errnoptr) {
   }
   // Extend the last block by appending 0's
   else {
-    // Get the last block while keeping track of how many bytes are missing
+    // Get the last block, the size bytes go after it
     while (block->next_file_block != 0) {
-      size -= block->allocated;
       block = off_to_ptr(fsptr, block->next_file_block);
     }
 
@@ -1129,7 +1264,7 @@ int add_data(void *fsptr, file_t *file, size_t size, int *errnoptr) {
     size -= append_n_bytes;
 
     size_t temp_size;
-    temp_block = block;
+    prev_temp_block = block;
 
     // Start connecting and collecting blocks until we are done collecting bytes
     // or we fail to collect them all so we free them and fail
@@ -1137,9 +1272,19 @@ int add_data(void *fsptr, file_t *file, size_t size, int *errnoptr) {
       // Get the size of the block returned by __malloc_impl()
       new_data_block_size = *(((size_t *)new_data_block) - 1);
 
-      // Save temp_block
-      if (prev_temp_block != NULL) {
-        prev_temp_block->next_file_block = ptr_to_off(fsptr, temp_block);
+      // Get a file_block for the new data block
+      temp_size = sizeof(file_block_t);
+      temp_block = __malloc_impl(fsptr, NULL, &temp_size);
+      if ((temp_block == NULL) || (temp_size != 0)) {
+        __free_impl(fsptr, temp_block);
+        __free_impl(fsptr, new_data_block);
+
+        // Need to remove everything that got store, even the block extended
+        remove_data(fsptr, off_to_ptr(fsptr, file->first_file_block),
+                    initial_file_size);
+
+        *errnoptr = ENOSPC;
+        return -1;
       }
 
       // Set the temp_block information
@@ -1148,6 +1293,9 @@ int add_data(void *fsptr, file_t *file, size_t size, int *errnoptr) {
       temp_block->data = ptr_to_off(fsptr, new_data_block);
       temp_block->next_file_block = ((__myfs_off_t)0);
 
+      // Append it after the last block
+      prev_temp_block->next_file_block = ptr_to_off(fsptr, temp_block);
+
       memset(new_data_block, 0, temp_block->allocated);
       size -= temp_block->allocated;
 
@@ -1161,12 +1309,9 @@ int add_data(void *fsptr, file_t *file, size_t size, int *errnoptr) {
       // Call malloc to get another block of data
       ask_size = size;
       new_data_block = __malloc_impl(fsptr, NULL, &ask_size);
-      temp_size = sizeof(file_block_t);
-      temp_block = __malloc_impl(fsptr, NULL, &temp_size);
 
       // Make sure that we got something out of the call
-      if ((new_data_block == NULL) || (temp_block == NULL) ||
-          (temp_size != 0)) {
+      if (new_data_block == NULL) {
         // Need to remove everything that got store, even the block extended
         remove_data(fsptr, off_to_ptr(fsptr, file->first_file_block),
                     initial_file_size);
@@ -1391,11 +1536,11 @@ int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr,
 
   // Get last token which have the filename
   unsigned long len;
-  char *filename = get_last_token(path, &len);
+  const char *filename = get_last_token(path, &len);
 
   // Check that the parent don't contain a node with the same name as the one we
   // are about to create
-  node_t *file_node = get_node(fsptr, dict, filename);
+  node_t *file_node = get_node(fsptr, dict, filename, len);
 
   if (file_node == NULL) {
     *errnoptr = ENOENT;
@@ -1590,8 +1735,8 @@ int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
     // File would be access and modify
     update_time(node, 1);
 
-    // Add size bytes into the end of our block
-    if (add_data(fsptr, file, size, errnoptr) != 0) {
+    // Add the missing bytes into the end of our block
+    if (add_data(fsptr, file, size - file->total_size, errnoptr) != 0) {
       return -1;
     }
   }
@@ -1962,4 +2107,48 @@ int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr,
   return 0;
 }
 
+/* Sets the placement policy of the filesystem of size fssize pointed to by
+   fsptr. policy is one of "largest", "first", "best", "next" or "locality".
+
+   The policy is kept in the filesystem, so it stays in place when the
+   filesystem is mounted again without one.
+
+   On success, 0 is returned. On failure, -1 is returned and *errnoptr is set to
+   EINVAL if the policy is unknown or to ENOTSUP if the filesystem was made
+   before the placement policies existed.
+*/
+int __myfs_placement_implem(void *fsptr, size_t fssize, int *errnoptr,
+                            const char *policy) {
+  static const char *names[] = {"largest", "first", "best", "next",
+                                "locality"};
+  uint32_t placement;
+
+  handler(fsptr, fssize);
+
+  // Get the handler
+  handler_t *handle = ((handler_t *)fsptr);
+
+  for (placement = PLACEMENT_LARGEST; placement <= PLACEMENT_LOCALITY;
+       placement++) {
+    if (strcmp(policy, names[placement]) == 0) {
+      break;
+    }
+  }
+  if (placement > PLACEMENT_LOCALITY) {
+    *errnoptr = EINVAL;
+    return -1;
+  }
+
+  // Old images have no room for the policy
+  if (handle->magic == MYFS_MAGIC_V1) {
+    *errnoptr = ENOTSUP;
+    return -1;
+  }
+
+  handle->placement = placement;
+  handle->next_fit = ((__myfs_off_t)0);
+
+  return 0;
+}
+
 /* END of FUSE implementation */
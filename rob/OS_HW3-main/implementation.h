@@ -6,10 +6,27 @@
 
 /* Definitions and type declarations */
 
-#define MYFS_MAGIC ((uint32_t)0xCAFEBABE)
+#define MYFS_MAGIC ((uint32_t)0xCAFEBAC0)
+// Images from before the dentry cache, they have no room for it
+#define MYFS_MAGIC_V2 ((uint32_t)0xCAFEBABF)
+// Images from before the placement policies, they always place by largest
+#define MYFS_MAGIC_V1 ((uint32_t)0xCAFEBABE)
 #define NAME_MAX_LEN ((size_t)255)
 #define BLOCK_SIZE ((size_t)1024)
 
+// Placement policies, they choose the free block that __malloc_impl() takes
+// the bytes from once the preferred block can't be extended any further
+#define PLACEMENT_LARGEST ((uint32_t)0)    // Largest block (worst fit)
+#define PLACEMENT_FIRST_FIT ((uint32_t)1)  // Lowest block that fits
+#define PLACEMENT_BEST_FIT ((uint32_t)2)   // Smallest block that fits
+#define PLACEMENT_NEXT_FIT ((uint32_t)3)   // First fit after the last one
+#define PLACEMENT_LOCALITY ((uint32_t)4)   // First fit after preferred block
+
+// Entries of the dentry cache and the smallest file system that gets one, so
+// the cache never takes more than 1/256 of the memory
+#define DENTRY_CACHE_SIZE ((size_t)256)
+#define DENTRY_CACHE_MIN_FS_SIZE (DENTRY_CACHE_SIZE * sizeof(dentry_t) * 256)
+
 typedef unsigned int u_int;
 typedef size_t __myfs_off_t;
 
@@ -32,11 +49,21 @@ typedef struct s_List {
 
 typedef struct __handler_t {
   uint32_t magic;
+  uint32_t placement;  // One of the PLACEMENT_* policies
   __myfs_off_t root_dir;
   __myfs_off_t free_memory;
   size_t size;
+  __myfs_off_t next_fit;  // Where PLACEMENT_NEXT_FIT starts looking
+  __myfs_off_t dentry_cache;  // Offset to the dentry_t array, 0 if none
 } handler_t;
 
+// Remembers which node a name in a directory leads to
+typedef struct __dentry_t {
+  __myfs_off_t parent;  // Offset of the directory_t the name is in
+  __myfs_off_t node;    // Offset of the node_t, 0 if the entry is empty
+  size_t hash;          // Hash of the name
+} dentry_t;
+
 typedef struct __file_block_t {
   size_t size;
   size_t allocated;
@@ -79,6 +106,12 @@ void __free_impl(void *fsptr, void *ptr);
 void add_allocation_space(void *fspte, List *LL, AllocateFrom *alloc);
 void *get_allocation(void *fsptr, List *LL, AllocateFrom *org_pref,
                      size_t *size);
+uint32_t get_placement(void *fsptr);
+AllocateFrom *find_allocation_space(void *fsptr, List *LL, uint32_t placement,
+                                    __myfs_off_t start_off, size_t size,
+                                    AllocateFrom **before);
+void *take_allocation_space(AllocateFrom *before, AllocateFrom *alloc,
+                            size_t *size);
 
 // END memory allocation functions
 
@@ -89,10 +122,14 @@ __myfs_off_t ptr_to_off(void *reference, void *ptr);
 void update_time(node_t *node, int new_node);
 void *get_free_memory_ptr(void *fsptr);
 void handler(void *fsptr, size_t fssize);
-char *get_last_token(const char *path, unsigned long *token_len);
-char **tokenize(const char token, const char *path, int skip_n_tokens);
-void free_tokens(char **tokens);
-node_t *get_node(void *fsptr, directory_t *dict, const char *child);
+const char *get_last_token(const char *path, unsigned long *token_len);
+const char *next_token(const char token, const char *path,
+                       unsigned long *token_len);
+size_t hash_name(const char *name, unsigned long len);
+dentry_t *get_dentry(void *fsptr, directory_t *dict, size_t hash);
+void forget_node(void *fsptr, directory_t *dict, node_t *node);
+node_t *get_node(void *fsptr, directory_t *dict, const char *child,
+                 unsigned long len);
 node_t *path_solver(void *fsptr, const char *path, int skip_n_tokens);
 node_t *make_inode(void *fsptr, const char *path, int *errnoptr, int isfile);
 void free_file_info(void *fsptr, file_t *file);
@@ -131,6 +168,8 @@ int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr,
                           const char *path, const struct timespec ts[2]);
 int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr,
                          struct statvfs *stbuf);
+int __myfs_placement_implem(void *fsptr, size_t fssize, int *errnoptr,
+                            const char *policy);
 
 // END of fuse function declarations
 
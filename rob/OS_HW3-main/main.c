@@ -6,9 +6,19 @@
 
 #include "implementation.h"
 
-void print_tokens(char **tokens) {
-  for (; *tokens; tokens++) {
-    printf("%s\n", *tokens);
+void print_tokens(const char *path, int skip_n_tokens) {
+  int n_tokens = 0;
+  for (const char *c = path; *c != '\0'; c++) {
+    if (*c == '/') {
+      n_tokens++;
+    }
+  }
+
+  unsigned long len;
+  for (n_tokens -= skip_n_tokens; n_tokens > 0; n_tokens--) {
+    path = next_token('/', path, &len);
+    printf("%.*s\n", (int)len, path);
+    path += len;
   }
 }
 
@@ -19,22 +29,18 @@ int main(void) {
   printf("Full path: %s\n", path);
 
   // Tokenize all of them but eh last one and print them
-  char **tokens = tokenize('/', path, 1);
-  print_tokens(tokens);
+  print_tokens(path, 1);
 
   // Tokenize the last token and print it with its size
   unsigned long len;
-  char *last_token = get_last_token(path, &len);
+  const char *last_token = get_last_token(path, &len);
 
   printf("Last token: %s\n", last_token);
   printf("len: %lu =? strlen(last_token): %lu\n", len, strlen(last_token));
 
   const char path2[6] = "/file";
   printf("Full path: %s\n", path2);
-  tokens = tokenize('/', path2, 0);
-  for (char **token = tokens; *token; token++) {
-    printf("token = %s\n", *token);
-  }
+  print_tokens(path2, 0);
 
   printf("sizeof(handler_t) = %zx\n", sizeof(handler_t));
   printf("sizeof(node_t) = %zx\n", sizeof(node_t));
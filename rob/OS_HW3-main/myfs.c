@@ -56,6 +56,7 @@
 struct __myfs_options_struct_t {
   const char *filename;
   const char *size;
+  const char *placement;
   int show_help;
 };
 
@@ -64,7 +65,8 @@ struct __myfs_options_struct_t {
 
 static const struct fuse_opt __myfs_option_spec[] = {
     OPTION("--backupfile=%s", filename), OPTION("--size=%s", size),
-    OPTION("-h", show_help), OPTION("--help", show_help), FUSE_OPT_END};
+    OPTION("--placement=%s", placement), OPTION("-h", show_help),
+    OPTION("--help", show_help), FUSE_OPT_END};
 
 struct __memory_block_struct_t {
   size_t size;
@@ -282,6 +284,7 @@ int __myfs_read_implem(void *, size_t, int *, const char *, char *, size_t,
 int __myfs_write_implem(void *, size_t, int *, const char *, const char *,
                         size_t, off_t);
 int __myfs_statfs_implem(void *, size_t, int *, struct statvfs *);
+int __myfs_placement_implem(void *, size_t, int *, const char *);
 int __myfs_utimens_implem(void *, size_t, int *, const char *,
                           const struct timespec[2]);
 
@@ -610,6 +613,10 @@ static void __myfs_show_help(const char *name) {
       "                    backup-file and the size specified.\n"
       "                    The minimum size of a filesystem is 2kB. If a\n"
       "                    lesser size is used, it is increased to 2kB.\n"
+      "  --placement=<s>   Where new data of the files is placed:\n"
+      "                    largest, first, best, next or locality\n"
+      "                    Default: the policy the file-system was\n"
+      "                             last mounted with, largest otherwise.\n"
       "\n");
 }
 
@@ -622,6 +629,7 @@ int main(int argc, char *argv[]) {
   /* Initialize defaults */
   __myfs_options.filename = NULL;
   __myfs_options.size = NULL;
+  __myfs_options.placement = NULL;
   __myfs_options.show_help = 0;
 
   /* Parse options */
@@ -634,6 +642,14 @@ int main(int argc, char *argv[]) {
   if (!__myfs_options.show_help) {
     env_ptr = &__myfs_environment;
     if (!__myfs_setup_environment(env_ptr, &__myfs_options)) return 1;
+    if (__myfs_options.placement != NULL) {
+      if (__myfs_placement_implem(env_ptr->memory, env_ptr->size, &errno,
+                                  __myfs_options.placement) != 0) {
+        perror("Cannot set placement policy");
+        __myfs_clear_environment(env_ptr);
+        return 1;
+      }
+    }
   } else {
     /* Handle displaying of help text */
     __myfs_show_help(argv[0]);